@@ -3,57 +3,297 @@
 #include "TextureLoader.h"
 #include "lodepng/lodepng.h"
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
+#include <vector>
 
 #define LOG_TAG "Drawable"
 
+/// RGBA8888 pixels collected from the rows of a streamed PNG
+struct PngImage {
+    uint8_t *data;
+    unsigned int width;
+    unsigned int height;
+};
+
+static unsigned int OnPngHeader(void *user, unsigned int w, unsigned int h) {
+    PngImage *image = static_cast<PngImage *>(user);
+    image->data = static_cast<uint8_t *>(malloc(static_cast<size_t>(w) * h * 4));
+    image->width = w;
+    image->height = h;
+    return image->data ? 0 : 83; // lodepng's "memory allocation failed"
+}
+
+static void OnPngRow(void *user, const unsigned char *pixels, unsigned int count,
+                     unsigned int x, unsigned int dx, unsigned int y) {
+    PngImage *image = static_cast<PngImage *>(user);
+    uint8_t *out = image->data + (static_cast<size_t>(y) * image->width + x) * 4;
+    if (dx == 1) {
+        memcpy(out, pixels, static_cast<size_t>(count) * 4);
+        return;
+    }
+    // a row of an Adam7 reduced image
+    for (unsigned int i = 0; i < count; ++i) {
+        memcpy(out + static_cast<size_t>(i) * dx * 4, pixels + static_cast<size_t>(i) * 4, 4);
+    }
+}
+
+/// open asset/imageFilename, or log that it's missing
+static AAsset *OpenPngAsset(AAssetManager *manager, const char *imageFilename, int mode) {
+    AAsset *asset = AAssetManager_open(manager, imageFilename, mode);
+    if (!asset) {
+        LOGE("failed to open asset/%s", imageFilename);
+    }
+    return asset;
+}
+
+/// load the RGBA8888 pixels decoded from asset/imageFilename to OpenGL, or log why decoding failed
+static GLuint UploadPngImage(const char *imageFilename, const char *failure, const uint8_t *pixels,
+                             unsigned int width, unsigned int height) {
+    if (failure) {
+        LOGE("failed to load asset/%s: %s", imageFilename, failure);
+        return 0;
+    }
+    return LoadTextureBufferRgba8888(pixels, width, height);
+}
+
 static GLuint LoadPngFromAsset(AAssetManager *manager, const char *imageFilename) {
 
     const unsigned int bitDepth = 8;
 
-    GLuint texture_id = 0;
-    AAsset *asset = AAssetManager_open(manager, imageFilename, AASSET_MODE_BUFFER);
-    const void *assetBuffer = AAsset_getBuffer(asset);
-    off_t assetLength = AAsset_getLength(asset);
-    uint8_t *out = nullptr;
-    unsigned int w = 0;
-    unsigned int h = 0;
-    if (lodepng_decode_memory(
-            &out,
-            &w, &h,
-            reinterpret_cast<const uint8_t *>(assetBuffer),
-            static_cast<size_t>(assetLength),
-            LodePNGColorType::LCT_RGBA,
-            bitDepth)) {
-        LOGE("failed to load asset/tsukuba.png");
-        return texture_id;
+    AAsset *asset = OpenPngAsset(manager, imageFilename, AASSET_MODE_STREAMING);
+    if (!asset) {
+        return 0;
+    }
+
+    // decode while reading, so neither the whole file nor the unfiltered image is held in memory
+    PngImage image = {nullptr, 0, 0};
+    LodePNGStreamDecoder decoder;
+    lodepng_stream_decoder_init(&decoder);
+    decoder.state.info_raw.colortype = LodePNGColorType::LCT_RGBA;
+    decoder.state.info_raw.bitdepth = bitDepth;
+    decoder.header = OnPngHeader;
+    decoder.row = OnPngRow;
+    decoder.user = &image;
+
+    uint8_t buffer[16384];
+    unsigned int error = 0;
+    int bytesRead = 0;
+    while (!error && (bytesRead = AAsset_read(asset, buffer, sizeof(buffer))) > 0) {
+        error = lodepng_stream_decoder_write(&decoder, buffer, static_cast<size_t>(bytesRead));
+    }
+    if (!error && bytesRead == 0) {
+        error = lodepng_stream_decoder_finish(&decoder);
     }
+    lodepng_stream_decoder_cleanup(&decoder);
+    AAsset_close(asset);
+    asset = nullptr;
 
-    // load to OpenGL
-    texture_id = LoadTextureBufferRgba8888(out, w, h);
+    const char *failure = error ? lodepng_error_text(error) : bytesRead < 0 ? "read error" : nullptr;
+    GLuint texture_id = UploadPngImage(imageFilename, failure, image.data, image.width, image.height);
 
     // release resource
-    free(out);
+    free(image.data);
+
+    return texture_id;
+}
+
+/// load a lower mip level of a PNG: 1/2, 1/4 or 1/8 of its size. At full size, use LoadPngFromAsset
+static GLuint LoadPngLevelFromAsset(AAssetManager *manager, const char *imageFilename,
+                                    unsigned int downscale) {
+
+    AAsset *asset = OpenPngAsset(manager, imageFilename, AASSET_MODE_BUFFER);
+    if (!asset) {
+        return 0;
+    }
+    const unsigned char *png = static_cast<const unsigned char *>(AAsset_getBuffer(asset));
+    const size_t pngSize = static_cast<size_t>(AAsset_getLength(asset));
+
+    // the decoder box filters while it decodes, and skips the Adam7 passes it doesn't need
+    lodepng::State state;
+    state.info_raw.colortype = LodePNGColorType::LCT_RGBA;
+    state.info_raw.bitdepth = 8;
+    state.decoder.downscale = downscale;
+    std::vector<unsigned char> image;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int error = png ? lodepng::decode(image, width, height, state, png, pngSize) : 0;
     AAsset_close(asset);
     asset = nullptr;
 
-    return texture_id;
+    const char *failure = error ? lodepng_error_text(error) : !png ? "read error" : nullptr;
+    if (!failure) {
+        LOGI("loaded asset/%s at 1/%u size, %ux%u", imageFilename, downscale, width, height);
+    }
+    return UploadPngImage(imageFilename, failure, image.data(), width, height);
 }
 
-TexturedPlane::TexturedPlane(AAssetManager *manager):
+/// read the size of a PNG and whether it's interlaced, from its header
+static bool InspectPngAsset(AAssetManager *manager, const char *imageFilename,
+                            unsigned int *width, unsigned int *height, bool *interlaced) {
+    AAsset *asset = OpenPngAsset(manager, imageFilename, AASSET_MODE_STREAMING);
+    if (!asset) {
+        return false;
+    }
+    // the signature and the IHDR chunk
+    unsigned char header[33];
+    const int bytesRead = AAsset_read(asset, header, sizeof(header));
+    AAsset_close(asset);
+    lodepng::State state;
+    if (bytesRead != sizeof(header) ||
+        lodepng_inspect(width, height, &state, header, sizeof(header)) != 0) {
+        LOGE("asset/%s is not a valid PNG", imageFilename);
+        return false;
+    }
+    *interlaced = state.info_png.interlace_method == 1;
+    return true;
+}
+
+ProgressivePngTexture::ProgressivePngTexture(AAssetManager *manager, const std::string &imageFilename):
+    m_thread(),
+    m_stop(false),
+    m_decoder(nullptr),
+    m_rows(),
+    m_mutex(),
+    m_image(),
+    m_width(0),
+    m_height(0),
+    m_pending(false),
+    m_finished(false),
+    m_failed(false),
+    m_upload(),
     m_texture_id(0) {
-    LoadModel(manager);
+    m_thread = std::thread([this, manager, imageFilename]() { this->Decode(manager, imageFilename); });
+}
+
+ProgressivePngTexture::~ProgressivePngTexture() {
+    m_stop = true;
+    m_thread.join();
+}
+
+GLuint ProgressivePngTexture::Update() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_pending) {
+            return m_texture_id;
+        }
+        // the decoding thread goes on with the other buffer while this one is uploaded
+        m_upload.swap(m_image);
+        m_pending = false;
+    }
+    if (!m_texture_id) {
+        m_texture_id = LoadTextureBufferRgba8888(m_upload.data(), m_width, m_height);
+    } else {
+        UpdateTextureBufferRgba8888(m_texture_id, m_upload.data(), m_width, m_height);
+    }
+    return m_texture_id;
+}
+
+bool ProgressivePngTexture::Done() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed || (m_finished && !m_pending);
+}
+
+bool ProgressivePngTexture::Failed() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed;
+}
+
+unsigned int ProgressivePngTexture::OnHeader(void *user, unsigned int w, unsigned int h) {
+    ProgressivePngTexture *texture = static_cast<ProgressivePngTexture *>(user);
+    std::lock_guard<std::mutex> lock(texture->m_mutex);
+    texture->m_width = w;
+    texture->m_height = h;
+    return 0;
+}
+
+void ProgressivePngTexture::OnRow(void *user, const unsigned char *pixels, unsigned int count,
+                                  unsigned int x, unsigned int dx, unsigned int y) {
+    ProgressivePngTexture *texture = static_cast<ProgressivePngTexture *>(user);
+    if (texture->m_decoder->state.info_png.interlace_method != 0) {
+        // the previews have the rows of the Adam7 passes
+        return;
+    }
+    assert(x == 0 && dx == 1);
+    std::vector<uint8_t> &rows = texture->m_rows;
+    rows.resize(static_cast<size_t>(texture->m_width) * texture->m_height * 4);
+    memcpy(&rows[(static_cast<size_t>(y) * texture->m_width + x) * 4], pixels, static_cast<size_t>(count) * 4);
+}
+
+void ProgressivePngTexture::OnPreview(void *user, const unsigned char *image, unsigned int w, unsigned int h,
+                                      unsigned int pass) {
+    ProgressivePngTexture *texture = static_cast<ProgressivePngTexture *>(user);
+    std::lock_guard<std::mutex> lock(texture->m_mutex);
+    texture->m_image.assign(image, image + static_cast<size_t>(w) * h * 4);
+    texture->m_pending = true;
+    LOGI("preview after Adam7 pass %u", pass);
+}
+
+void ProgressivePngTexture::Decode(AAssetManager *manager, const std::string &imageFilename) {
+    AAsset *asset = AAssetManager_open(manager, imageFilename.c_str(), AASSET_MODE_STREAMING);
+    if (!asset) {
+        LOGE("failed to open asset/%s", imageFilename.c_str());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_failed = true;
+        return;
+    }
+
+    LodePNGStreamDecoder decoder;
+    lodepng_stream_decoder_init(&decoder);
+    decoder.state.info_raw.colortype = LodePNGColorType::LCT_RGBA;
+    decoder.state.info_raw.bitdepth = 8;
+    decoder.header = OnHeader;
+    decoder.row = OnRow;
+    decoder.preview = OnPreview;
+    decoder.user = this;
+    m_decoder = &decoder;
+
+    uint8_t buffer[16384];
+    unsigned int error = 0;
+    int bytesRead = 0;
+    while (!error && !m_stop && (bytesRead = AAsset_read(asset, buffer, sizeof(buffer))) > 0) {
+        error = lodepng_stream_decoder_write(&decoder, buffer, static_cast<size_t>(bytesRead));
+    }
+    if (!error && !m_stop && bytesRead == 0) {
+        error = lodepng_stream_decoder_finish(&decoder);
+    }
+    lodepng_stream_decoder_cleanup(&decoder);
+    m_decoder = nullptr;
+    AAsset_close(asset);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_stop) {
+        return;
+    }
+    if (error || bytesRead < 0) {
+        LOGE("failed to load asset/%s: %s", imageFilename.c_str(),
+             error ? lodepng_error_text(error) : "read error");
+        m_failed = true;
+        return;
+    }
+    if (!m_rows.empty()) {
+        // without interlacing there were no previews
+        m_image.swap(m_rows);
+        m_pending = true;
+    }
+    m_finished = true;
+}
+
+TexturedPlane::TexturedPlane(AAssetManager *manager, GLint viewHeight):
+    m_texture_id(0) {
+    LoadModel(manager, viewHeight);
 }
 
 TexturedPlane::~TexturedPlane() {
-    if (Initialized()) {
+    m_loader.reset();
+    if (m_texture_id != 0) {
         glDeleteTextures(1, &m_texture_id);
         m_texture_id = 0;
     }
 }
 
 bool TexturedPlane::Initialized() const {
-    return (m_texture_id != 0);
+    return (m_texture_id != 0) || m_loader;
 }
 
 bool TexturedPlane::Draw() {
@@ -62,6 +302,20 @@ bool TexturedPlane::Draw() {
         return false;
     }
 
+    if (m_loader) {
+        m_texture_id = m_loader->Update();
+        if (m_loader->Failed()) {
+            LOGE("TexturedPlane texture failed to load");
+        }
+        if (m_loader->Done()) {
+            m_loader.reset();
+        }
+        if (m_texture_id == 0) {
+            // nothing to show yet
+            return m_loader != nullptr;
+        }
+    }
+
     glFrontFace(GL_CCW);
     glEnable(GL_CULL_FACE);
     glCullFace(GL_BACK);
@@ -87,7 +341,7 @@ bool TexturedPlane::Draw() {
     return true;
 }
 
-void TexturedPlane::LoadModel(AAssetManager *manager) {
+void TexturedPlane::LoadModel(AAssetManager *manager, GLint viewHeight) {
 
     // XYZ, ST
     m_vertices[0] = {-0.5f,  -0.5f,  0.0f,   0.0f,  1.0f};
@@ -101,8 +355,30 @@ void TexturedPlane::LoadModel(AAssetManager *manager) {
 
 
     // load PNG texture
+    // the plane is 1 unit high and comes as close as 1.25 to the eye, while the view is 2 units high at
+    // distance 1: texture rows beyond the screen rows it covers would only be minified away
     const char *imageFilename = "tsukuba.png";
-    m_texture_id = LoadPngFromAsset(manager, imageFilename);
+    const unsigned int screenRows = static_cast<unsigned int>(viewHeight / 2.5f);
+    unsigned int width = 0;
+    unsigned int height = 0;
+    bool interlaced = false;
+    if (!InspectPngAsset(manager, imageFilename, &width, &height, &interlaced)) {
+        return;
+    }
+    // the smallest mip level, down to 1/8, that still has screenRows rows
+    unsigned int downscale = 1;
+    while (downscale < 8 && height / (downscale * 2) >= screenRows) {
+        downscale *= 2;
+    }
+    if (downscale > 1) {
+        m_texture_id = LoadPngLevelFromAsset(manager, imageFilename, downscale);
+    } else if (interlaced) {
+        // needed at full size: draw the Adam7 passes as they're decoded
+        m_loader.reset(new ProgressivePngTexture(manager, imageFilename));
+    } else {
+        // needed at full size: stream it, without holding the whole file or the unfiltered image
+        m_texture_id = LoadPngFromAsset(manager, imageFilename);
+    }
 }
 
 Text::Text(AAssetManager *manager):
@@ -4,7 +4,11 @@
 
 #include <android/asset_manager.h>
 #include <GLES/gl.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #pragma pack(push, 1)
@@ -22,6 +26,44 @@ struct Triangle {
 };
 #pragma pack(pop)
 
+/// decodes a PNG asset to a texture on a background thread. An Adam7 interlaced PNG can be drawn after its
+/// third pass, blocky at first and sharper with each later pass; others once they're decoded.
+class ProgressivePngTexture {
+public:
+    ProgressivePngTexture(AAssetManager *manager, const std::string &imageFilename);
+    ~ProgressivePngTexture();
+    /// call on the GL thread: uploads the newest image, returns the texture or 0 while there's none yet.
+    /// The texture belongs to the caller.
+    GLuint Update();
+    /// the final image is uploaded, or decoding failed
+    bool Done();
+    bool Failed();
+private:
+    void Decode(AAssetManager *manager, const std::string &imageFilename);
+    static unsigned int OnHeader(void *user, unsigned int w, unsigned int h);
+    static void OnRow(void *user, const unsigned char *pixels, unsigned int count,
+                      unsigned int x, unsigned int dx, unsigned int y);
+    static void OnPreview(void *user, const unsigned char *image, unsigned int w, unsigned int h,
+                          unsigned int pass);
+
+    std::thread m_thread;
+    std::atomic<bool> m_stop;
+    // decoding thread only: the decoder, and the rows of a PNG without interlacing
+    struct LodePNGStreamDecoder *m_decoder;
+    std::vector<uint8_t> m_rows;
+    // guarded by m_mutex: the newest image for the GL thread
+    std::mutex m_mutex;
+    std::vector<uint8_t> m_image;
+    unsigned int m_width;
+    unsigned int m_height;
+    bool m_pending;
+    bool m_finished;
+    bool m_failed;
+    // GL thread only
+    std::vector<uint8_t> m_upload;
+    GLuint m_texture_id;
+};
+
 // interface
 class Drawable {
 public:
@@ -32,13 +74,16 @@ public:
 
 class TexturedPlane: public Drawable {
 public:
-    explicit TexturedPlane(AAssetManager *manager);
+    /// the texture is loaded at a lower mip level if the view has too few rows for all of it
+    TexturedPlane(AAssetManager *manager, GLint viewHeight);
     virtual ~TexturedPlane();
     virtual bool Initialized() const override;
     virtual bool Draw() override;
 private:
-    void LoadModel(AAssetManager *manager);
+    void LoadModel(AAssetManager *manager, GLint viewHeight);
     GLuint m_texture_id;
+    // while a full size interlaced texture is still arriving
+    std::unique_ptr<ProgressivePngTexture> m_loader;
     Vertex m_vertices[4];
     Triangle m_triangles[2];
 };
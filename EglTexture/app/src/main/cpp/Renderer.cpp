@@ -202,7 +202,7 @@ bool Renderer::initialize() {
     glFrustumf(-ratio, ratio, -1, 1, 1, 10);
 
     // initialize drawables
-    TexturedPlane *tp = new TexturedPlane(m_asset_manager);
+    TexturedPlane *tp = new TexturedPlane(m_asset_manager, height);
     if (!tp->Initialized()) {
         LOGE("failed to load TexturedPlane");
         delete tp;
@@ -160,4 +160,21 @@ GLuint LoadTextureBufferRgba8888(const uint8_t *data,
                                  size_t width,
                                  size_t height) {
     return LoadTextureBuffer(data, width, height, GL_RGBA, GL_UNSIGNED_BYTE);
-}
\ No newline at end of file
+}
+
+/// replace the pixels of a texture, RBGA8888
+void UpdateTextureBufferRgba8888(GLuint textureID,
+                                 const uint8_t *data,
+                                 size_t width,
+                                 size_t height) {
+    glBindTexture(GL_TEXTURE_2D, textureID);
+    glTexSubImage2D(GL_TEXTURE_2D, // target
+                    0, // level of the mipmap
+                    0, // x offset
+                    0, // y offset
+                    width,
+                    height,
+                    GL_RGBA,
+                    GL_UNSIGNED_BYTE,
+                    data);
+}
@@ -16,4 +16,10 @@ GLuint LoadTextureBufferRgba8888(const uint8_t *data,
                                  size_t width,
                                  size_t height);
 
+/// replace the pixels of a texture from LoadTextureBufferRgba8888 with ones of the same size, RBGA8888
+void UpdateTextureBufferRgba8888(GLuint textureID,
+                                 const uint8_t *data,
+                                 size_t width,
+                                 size_t height);
+
 #endif //EGLTEXTURE_TEXTURELOADER_H
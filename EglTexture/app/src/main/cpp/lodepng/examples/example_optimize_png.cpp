@@ -28,6 +28,9 @@ This example saves the PNG with the best compression LodePNG can do, and with
 unnecessary chunks removed. It tries out several combinations of settings and
 keeps the smallest one.
 
+With a third argument, the colors are lossily reduced to a palette of at most that
+many, e.g. 256, which makes photos and gradients much smaller.
+
 NOTE: This is not as good as a true PNG optimizer like optipng or pngcrush.
 */
 
@@ -35,6 +38,7 @@ NOTE: This is not as good as a true PNG optimizer like optipng or pngcrush.
 
 #include "lodepng.h"
 
+#include <cstdlib>
 #include <iostream>
 
 int main(int argc, char *argv[])
@@ -47,7 +51,7 @@ int main(int argc, char *argv[])
   //check if user gave a filename
   if(argc < 3)
   {
-    std::cout << "please provide in and out filename" << std::endl;
+    std::cout << "please provide in and out filename, and optionally the number of palette colors" << std::endl;
     return 0;
   }
   
@@ -73,6 +77,7 @@ int main(int argc, char *argv[])
   state.encoder.zlibsettings.nicematch = 258; //Set this to the max possible, otherwise it can hurt compression
   state.encoder.zlibsettings.lazymatching = 1; //Definitely use lazy matching for better compression
   state.encoder.zlibsettings.windowsize = 32768; //Use maximum possible window size for best compression
+  if(argc > 3) state.encoder.quantize = std::atoi(argv[3]); //Lossy: at most this many colors in a palette
 
   size_t bestsize = 0;
   bool inited = false;
@@ -123,10 +128,25 @@ int main(int argc, char *argv[])
     }
   }
   
+  //Finally, encode once more with the best settings and optimal parsing, which is slow but compresses most
+  state.encoder.filter_strategy = strategies[beststrategy];
+  state.encoder.zlibsettings.btype = bestblocktype;
+  state.encoder.auto_convert = autoconverts[bestautoconvert];
+  state.encoder.zlibsettings.optimal_iterations = 15;
+  std::vector<unsigned char> temp;
+  error = lodepng::encode(temp, image, w, h, state);
+  if(!error && temp.size() < bestsize)
+  {
+    std::cout << "Optimal parsing saved " << (bestsize - temp.size()) << " bytes" << std::endl;
+    bestsize = temp.size();
+    temp.swap(buffer);
+  }
+
   std::cout << "Chosen filter strategy: " << strategynames[beststrategy] << std::endl;
   std::cout << "Chosen min match: " << bestminmatch << std::endl;
   std::cout << "Chosen block type: " << bestblocktype << std::endl;
   std::cout << "Chosen auto convert: " << autoconvertnames[bestautoconvert] << std::endl;
+  if(state.encoder.quantize) std::cout << "Quantized to " << state.encoder.quantize << " colors" << std::endl;
   
   lodepng::save_file(buffer, argv[2]);
   std::cout << "New size: " << buffer.size() << " (" << (buffer.size() / 1024) << "K)" << std::endl;
@@ -28,12 +28,68 @@ The manual and changelog are in the header file "lodepng.h"
 Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for C.
 */
 
+/*strict C90 and C++98 modes don't declare the POSIX functions of lodepng_map_file without this*/
+#if defined(__unix__) && defined(__STRICT_ANSI__) && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "lodepng.h"
 
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef LODEPNG_COMPILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /*LODEPNG_COMPILE_MMAP*/
+
+#ifdef LODEPNG_COMPILE_SIMD
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+/*x86 SIMD code is compiled for its instruction set per function, and only called if the CPU has it*/
+#define LODEPNG_SIMD_X86
+#define LODEPNG_TARGET(instructionset) __attribute__((target(instructionset)))
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+/*NEON code is only compiled if the target has NEON (always the case for arm64)*/
+#define LODEPNG_SIMD_NEON
+#include <arm_neon.h>
+#if defined(__aarch64__) && defined(__GNUC__) && (defined(__linux__) || defined(__APPLE__))
+/*the CRC32 instructions are optional in ARMv8.0, so like x86 SIMD they're compiled per function*/
+#define LODEPNG_CRC32_ARM
+#if defined(__clang__)
+#define LODEPNG_CRC32_TARGET __attribute__((target("crc")))
+#define LODEPNG_CRC32_8BYTES(crc, word) __builtin_arm_crc32d(crc, word)
+#define LODEPNG_CRC32_1BYTE(crc, byte) __builtin_arm_crc32b(crc, byte)
+#else /*__clang__*/
+#define LODEPNG_CRC32_TARGET __attribute__((target("+crc")))
+#define LODEPNG_CRC32_8BYTES(crc, word) __builtin_aarch64_crc32x(crc, word)
+#define LODEPNG_CRC32_1BYTE(crc, byte) __builtin_aarch64_crc32b(crc, byte)
+#endif /*__clang__*/
+#if defined(__linux__) && !defined(__ARM_FEATURE_CRC32)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif /*HWCAP_CRC32*/
+#endif /*__linux__*/
+#endif /*__aarch64__*/
+#endif /*__ARM_NEON*/
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+#ifdef LODEPNG_COMPILE_THREADS
+#include <atomic>
+#include <thread>
+#include <vector>
+#if defined(LODEPNG_COMPILE_CPP) && defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#endif /*LODEPNG_COMPILE_CPP && LODEPNG_COMPILE_PNG && LODEPNG_COMPILE_DECODER*/
+#endif /*LODEPNG_COMPILE_THREADS*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -60,24 +116,235 @@ lodepng source code. Don't forget to remove "static" if you copypaste them
 from here.*/
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
+/*
+The allocator of the current call to lodepng, per thread. Null outside of lodepng; inside, an allocator
+without functions stands for malloc. Threads that lodepng starts itself therefore use malloc.
+*/
+#if defined(LODEPNG_COMPILE_CPP) && __cplusplus >= 201103L
+static thread_local const LodePNGAllocator* lodepng_current_allocator = 0;
+#elif defined(__GNUC__) || defined(__clang__)
+static __thread const LodePNGAllocator* lodepng_current_allocator = 0;
+#elif defined(_MSC_VER)
+static __declspec(thread) const LodePNGAllocator* lodepng_current_allocator = 0;
+#else
+static const LodePNGAllocator* lodepng_current_allocator = 0;
+#endif
+
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+static const LodePNGAllocator lodepng_heap_allocator = {0, 0, 0, 0};
+
+/*
+Called at the start of the public functions: uses allocator (null for malloc) until lodepng_restore_allocator,
+unless this is a call from within lodepng, which keeps using the allocator of the outer call.
+*/
+static const LodePNGAllocator* lodepng_use_allocator(const LodePNGAllocator* allocator)
+{
+  const LodePNGAllocator* previous = lodepng_current_allocator;
+  if(!previous) lodepng_current_allocator = allocator ? allocator : &lodepng_heap_allocator;
+  return previous;
+}
+
+static void lodepng_restore_allocator(const LodePNGAllocator* previous)
+{
+  lodepng_current_allocator = previous;
+}
+
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_ENCODER)
+/*uses malloc until lodepng_restore_allocator, also within a call, for memory that passes between threads*/
+static const LodePNGAllocator* lodepng_use_heap(void)
+{
+  const LodePNGAllocator* previous = lodepng_current_allocator;
+  lodepng_current_allocator = &lodepng_heap_allocator;
+  return previous;
+}
+#endif /*LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_ZLIB && LODEPNG_COMPILE_ENCODER*/
+
+/*header of an allocation of an arena, which in the block only uses size*/
+typedef struct ArenaBlock
+{
+  struct ArenaBlock* prev; /*heap allocations of the arena, as doubly linked list*/
+  struct ArenaBlock* next;
+  size_t size; /*requested size in bytes*/
+} ArenaBlock;
+
+#define ARENA_ALIGN 16 /*enough for any type lodepng allocates, and for SIMD loads*/
+#define ARENA_ROUND(size) (((size) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(ArenaBlock))
+#define ARENA_MAX_SIZE ((size_t)(-1) - ARENA_HEADER - ARENA_ALIGN)
+
+static unsigned char* arenaHeapAllocate(LodePNGArena* arena, size_t size)
+{
+  ArenaBlock* block = size > ARENA_MAX_SIZE ? 0 : (ArenaBlock*)malloc(ARENA_HEADER + size);
+  if(!block) return 0;
+  block->prev = 0;
+  block->next = (ArenaBlock*)arena->heap;
+  block->size = size;
+  if(block->next) block->next->prev = block;
+  arena->heap = block;
+  ++arena->numheap;
+  return (unsigned char*)block + ARENA_HEADER;
+}
+
+static void* arenaAllocate(void* user, size_t size)
+{
+  LodePNGArena* arena = (LodePNGArena*)user;
+  ++arena->numallocs;
+  if(size <= ARENA_MAX_SIZE && arena->size - arena->used >= ARENA_HEADER + ARENA_ROUND(size))
+  {
+    unsigned char* result = &arena->data[arena->used];
+    ((ArenaBlock*)result)->size = size;
+    arena->last = arena->used;
+    arena->used += ARENA_HEADER + ARENA_ROUND(size);
+    return result + ARENA_HEADER;
+  }
+  return arenaHeapAllocate(arena, size);
+}
+
+/*whether ptr was allocated in the block*/
+static unsigned arenaOwns(const LodePNGArena* arena, const unsigned char* ptr)
+{
+  return arena->size != 0 && ptr >= arena->data && ptr < &arena->data[arena->size];
+}
+
+/*the header of ptr if it's one of the heap allocations of the arena, NULL if it was allocated with malloc*/
+static ArenaBlock* arenaHeapBlock(const LodePNGArena* arena, const unsigned char* ptr)
+{
+  ArenaBlock* block;
+  for(block = (ArenaBlock*)arena->heap; block; block = block->next)
+  {
+    if((unsigned char*)block + ARENA_HEADER == ptr) return block;
+  }
+  return 0;
+}
+
+static void arenaDeallocate(void* user, void* ptr)
+{
+  LodePNGArena* arena = (LodePNGArena*)user;
+  unsigned char* p = (unsigned char*)ptr;
+  ArenaBlock* block;
+  if(!p) return;
+  if(arenaOwns(arena, p))
+  {
+    /*only the most recent allocation gives its memory back*/
+    if(arena->last != arena->used && p == &arena->data[arena->last + ARENA_HEADER]) arena->used = arena->last;
+    return;
+  }
+  block = arenaHeapBlock(arena, p);
+  if(!block)
+  {
+    free(ptr); /*memory that was given to lodepng, such as a palette set before decoding*/
+    return;
+  }
+  if(block->prev) block->prev->next = block->next;
+  else arena->heap = block->next;
+  if(block->next) block->next->prev = block->prev;
+  free(block);
+}
+
+static void* arenaReallocate(void* user, void* ptr, size_t size)
+{
+  LodePNGArena* arena = (LodePNGArena*)user;
+  unsigned char* p = (unsigned char*)ptr;
+  ArenaBlock* block;
+  if(!p) return arenaAllocate(user, size);
+  if(arenaOwns(arena, p))
+  {
+    unsigned char* result;
+    size_t oldsize = ((ArenaBlock*)(p - ARENA_HEADER))->size;
+    if(arena->last != arena->used && p == &arena->data[arena->last + ARENA_HEADER])
+    {
+      /*the most recent allocation grows or shrinks in place if it fits*/
+      if(size <= ARENA_MAX_SIZE && arena->size - arena->last >= ARENA_HEADER + ARENA_ROUND(size))
+      {
+        ++arena->numallocs;
+        ((ArenaBlock*)(p - ARENA_HEADER))->size = size;
+        arena->used = arena->last + ARENA_HEADER + ARENA_ROUND(size);
+        return ptr;
+      }
+    }
+    else if(size <= oldsize) return ptr;
+    result = (unsigned char*)arenaAllocate(user, size);
+    if(!result) return 0;
+    memcpy(result, p, size < oldsize ? size : oldsize);
+    arenaDeallocate(user, ptr);
+    return result;
+  }
+  block = arenaHeapBlock(arena, p);
+  if(!block) return realloc(ptr, size);
+  ++arena->numallocs;
+  block = size > ARENA_MAX_SIZE ? 0 : (ArenaBlock*)realloc(block, ARENA_HEADER + size);
+  if(!block) return 0;
+  block->size = size;
+  if(block->prev) block->prev->next = block;
+  else arena->heap = block;
+  if(block->next) block->next->prev = block;
+  return (unsigned char*)block + ARENA_HEADER;
+}
+
+unsigned lodepng_arena_init(LodePNGArena* arena, size_t size)
+{
+  arena->allocator.allocate = arenaAllocate;
+  arena->allocator.reallocate = arenaReallocate;
+  arena->allocator.deallocate = arenaDeallocate;
+  arena->allocator.user = arena;
+  arena->data = size ? (unsigned char*)malloc(size) : 0;
+  arena->size = arena->data ? size : 0;
+  arena->heap = 0;
+  lodepng_arena_reset(arena);
+  return (size && !arena->data) ? 83 : 0; /*alloc fail*/
+}
+
+void lodepng_arena_reset(LodePNGArena* arena)
+{
+  while(arena->heap)
+  {
+    ArenaBlock* block = (ArenaBlock*)arena->heap;
+    arena->heap = block->next;
+    free(block);
+  }
+  arena->used = 0;
+  arena->last = 0;
+  arena->numallocs = 0;
+  arena->numheap = 0;
+}
+
+void lodepng_arena_cleanup(LodePNGArena* arena)
+{
+  lodepng_arena_reset(arena);
+  free(arena->data);
+  arena->data = 0;
+  arena->size = 0;
+}
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
+
 static void* lodepng_malloc(size_t size)
 {
+  const LodePNGAllocator* allocator = lodepng_current_allocator;
+  if(allocator && allocator->allocate) return allocator->allocate(allocator->user, size);
   return malloc(size);
 }
 
 static void* lodepng_realloc(void* ptr, size_t new_size)
 {
+  const LodePNGAllocator* allocator = lodepng_current_allocator;
+  if(allocator && allocator->reallocate) return allocator->reallocate(allocator->user, ptr, new_size);
   return realloc(ptr, new_size);
 }
 
 static void lodepng_free(void* ptr)
 {
-  free(ptr);
+  const LodePNGAllocator* allocator = lodepng_current_allocator;
+  if(allocator && allocator->deallocate) allocator->deallocate(allocator->user, ptr);
+  else free(ptr);
 }
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
 void* lodepng_malloc(size_t size);
 void* lodepng_realloc(void* ptr, size_t new_size);
 void lodepng_free(void* ptr);
+/*without the allocators here, the allocator fields of the settings and the state aren't used*/
+#define lodepng_use_allocator(allocator) ((void)(allocator), (const LodePNGAllocator*)0)
+#define lodepng_restore_allocator(previous) ((void)(previous))
+#define lodepng_use_heap() ((const LodePNGAllocator*)0)
 #endif /*LODEPNG_COMPILE_ALLOCATORS*/
 
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -234,7 +501,8 @@ static unsigned ucvector_resize(ucvector* p, size_t size)
   return 1; /*success*/
 }
 
-#ifdef LODEPNG_COMPILE_PNG
+#if defined(LODEPNG_COMPILE_PNG) \
+    || (defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_ENCODER))
 
 static void ucvector_cleanup(void* p)
 {
@@ -248,7 +516,7 @@ static void ucvector_init(ucvector* p)
   p->data = NULL;
   p->size = p->allocsize = 0;
 }
-#endif /*LODEPNG_COMPILE_PNG*/
+#endif /*LODEPNG_COMPILE_PNG || (LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_ZLIB && LODEPNG_COMPILE_ENCODER)*/
 
 #ifdef LODEPNG_COMPILE_ZLIB
 /*you can both convert from vector to buffer&size and vica versa. If you use
@@ -396,19 +664,164 @@ unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* fil
   return lodepng_buffer_file(*out, (size_t)size, filename);
 }
 
+unsigned lodepng_map_file(LodePNGMappedFile* file, const char* filename)
+{
+  unsigned char* buffer = 0;
+  unsigned error;
+#ifdef LODEPNG_COMPILE_MMAP
+  int fd = open(filename, O_RDONLY);
+  if(fd >= 0)
+  {
+    struct stat st;
+    void* data = MAP_FAILED;
+    /*empty files can't be mapped, the size must also fit in size_t*/
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (off_t)(size_t)st.st_size == st.st_size)
+    {
+      data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd); /*the mapping remains valid*/
+    if(data != MAP_FAILED)
+    {
+      /*decoding reads the chunks from start to end, so the OS can read ahead*/
+      posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+      file->data = (const unsigned char*)data;
+      file->size = (size_t)st.st_size;
+      file->mapped = 1;
+      return 0;
+    }
+  }
+#endif /*LODEPNG_COMPILE_MMAP*/
+  file->size = 0;
+  file->mapped = 0;
+  error = lodepng_load_file(&buffer, &file->size, filename);
+  file->data = buffer;
+  return error;
+}
+
+void lodepng_unmap_file(LodePNGMappedFile* file)
+{
+  if(!file->mapped) lodepng_free((void*)file->data);
+#ifdef LODEPNG_COMPILE_MMAP
+  else munmap((void*)file->data, file->size);
+#endif /*LODEPNG_COMPILE_MMAP*/
+  file->data = 0;
+  file->size = 0;
+  file->mapped = 0;
+}
+
 /*write given buffer to the file, overwriting the file, it doesn't append to it.*/
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename)
 {
   FILE* file;
   file = fopen(filename, "wb" );
   if(!file) return 79;
-  fwrite((char*)buffer , 1 , buffersize, file);
+  if(buffersize) fwrite((char*)buffer , 1 , buffersize, file); /*an empty buffer may be NULL*/
   fclose(file);
   return 0;
 }
 
 #endif /*LODEPNG_COMPILE_DISK*/
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / CPU features                                                           / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#ifdef LODEPNG_COMPILE_SIMD
+
+static unsigned lodepng_cpu_features_mask = ~0u; /*set with lodepng_set_cpu_features*/
+
+static unsigned detectCPUFeatures(void)
+{
+  unsigned features = 0;
+#if defined(LODEPNG_SIMD_X86)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2")) features |= LODEPNG_CPU_SSE2;
+  if(__builtin_cpu_supports("ssse3")) features |= LODEPNG_CPU_SSSE3;
+  /*this also checks that the OS saves the AVX registers*/
+  if(__builtin_cpu_supports("avx2")) features |= LODEPNG_CPU_AVX2;
+  if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2")) features |= LODEPNG_CPU_PCLMUL;
+#elif defined(LODEPNG_SIMD_NEON)
+  features |= LODEPNG_CPU_NEON;
+#if defined(__ARM_FEATURE_CRC32) || defined(__APPLE__)
+  features |= LODEPNG_CPU_ARM_CRC32; /*the target always has them*/
+#elif defined(LODEPNG_CRC32_ARM)
+  if(getauxval(AT_HWCAP) & HWCAP_CRC32) features |= LODEPNG_CPU_ARM_CRC32;
+#endif /*__ARM_FEATURE_CRC32*/
+#endif
+  return features;
+}
+
+unsigned lodepng_get_cpu_features(void)
+{
+#if (defined(__cplusplus) && __cplusplus >= 201103L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+  /*C++11 runs this once, threads that call it meanwhile wait for it*/
+  static const unsigned features = detectCPUFeatures();
+#elif defined(__GNUC__) || defined(__clang__)
+  /*the high bit marks the features as detected. Threads that detect them at the same time store the same value*/
+  static unsigned detected = 0;
+  unsigned features = __atomic_load_n(&detected, __ATOMIC_ACQUIRE);
+  if(!features)
+  {
+    features = detectCPUFeatures() | 0x80000000u;
+    __atomic_store_n(&detected, features, __ATOMIC_RELEASE);
+  }
+  features &= 0x7fffffffu;
+#else /*no threads to race with in lodepng itself, and no portable atomics in C90*/
+  static unsigned detected = 0;
+  static unsigned features = 0;
+  if(!detected)
+  {
+    features = detectCPUFeatures();
+    detected = 1;
+  }
+#endif
+  return features & lodepng_cpu_features_mask;
+}
+
+void lodepng_set_cpu_features(unsigned features)
+{
+  lodepng_cpu_features_mask = features;
+}
+
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Thread pool                                                            / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*used by the decoder of PNGs with a restart index, by deflate and by the filters of the PNG encoder*/
+#if defined(LODEPNG_COMPILE_THREADS) \
+    && ((defined(LODEPNG_COMPILE_ZLIB) && defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)) \
+    || (defined(LODEPNG_COMPILE_ENCODER) && (defined(LODEPNG_COMPILE_ZLIB) || defined(LODEPNG_COMPILE_PNG))))
+
+/*
+Calls job(data, i) for each i from 0 to count - 1 on up to numthreads threads, 0 for one per processor core.
+The calling thread is one of them and the others take the next i as soon as they're done with one, so jobs
+of different sizes even out. Returns when all jobs are done. If threads can't be started, fewer do the work.
+*/
+static void lodepng_parallel_for(size_t count, unsigned numthreads, void (*job)(void* data, size_t i), void* data)
+{
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  auto work = [&]()
+  {
+    size_t i;
+    while((i = next++) < count) job(data, i);
+  };
+
+  if(numthreads == 0) numthreads = std::thread::hardware_concurrency();
+  if(numthreads > count) numthreads = (unsigned)count;
+  try
+  {
+    while(threads.size() + 1 < numthreads) threads.emplace_back(work);
+  }
+  catch(...) {} /*run with the threads that did start*/
+  work();
+  for(size_t t = 0; t != threads.size(); ++t) threads[t].join();
+}
+
+#endif /*LODEPNG_COMPILE_THREADS && ((ZLIB && PNG && DECODER) || (ENCODER && (ZLIB || PNG)))*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* ////////////////////////////////////////////////////////////////////////// */
 /* // End of common code and tools. Begin of Zlib related code.            // */
@@ -427,38 +840,143 @@ unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const
   ++(*bitpointer);\
 }
 
+/*the same as nbits times addBitToStream, but a byte at a time. nbits must be at most 24.*/
 static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  size_t oldsize = bitstream->size, newsize = (*bitpointer + nbits + 7) / 8;
+  unsigned shift = (unsigned)(*bitpointer & 7);
+  unsigned char* p;
+  if(nbits == 0) return;
+  value = (value & ((1u << nbits) - 1u)) << shift;
+  if(newsize > oldsize)
+  {
+    if(!ucvector_resize(bitstream, newsize)) return; /*alloc fail*/
+    /*the new bytes start at zero, a partially filled last byte gets its upper bits ORed in*/
+    memset(&bitstream->data[oldsize], 0, newsize - oldsize);
+  }
+  p = &bitstream->data[*bitpointer / 8];
+  *bitpointer += nbits;
+  p[0] |= (unsigned char)value;
+  for(nbits += shift; nbits > 8; nbits -= 8)
+  {
+    value >>= 8;
+    *++p = (unsigned char)value;
+  }
+}
+
+/*reverses the bits of value, which has nbits (at most 16) bits*/
+static unsigned reverseCode(unsigned value, size_t nbits)
+{
+  value = ((value & 0x5555u) << 1u) | ((value >> 1u) & 0x5555u);
+  value = ((value & 0x3333u) << 2u) | ((value >> 2u) & 0x3333u);
+  value = ((value & 0x0F0Fu) << 4u) | ((value >> 4u) & 0x0F0Fu);
+  value = ((value & 0x00FFu) << 8u) | ((value >> 8u) & 0x00FFu);
+  return (value & 0xFFFFu) >> (16u - nbits);
 }
 
 static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  addBitsToStream(bitpointer, bitstream, reverseCode(value, nbits), nbits);
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Reads the deflate bit stream (LSB first) through a buffer of up to sizeof(size_t) bytes, so 64 bits
+on 64-bit targets. The buffer is refilled with whole bytes only when a read needs more bits than it
+has left, which is also the only place where the end of the input is checked. Bytes past the end read
+as 0, use LodePNGBitReader_overrun to find out whether such bits were actually consumed.
+*/
+typedef struct LodePNGBitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t pos; /*byte position of the next byte to load into buffer, can go past size*/
+  size_t buffer; /*loaded bits that are not consumed yet, the next bit of the stream is the LSB*/
+  unsigned bits; /*amount of valid bits in buffer*/
+} LodePNGBitReader;
+
+static void LodePNGBitReader_init(LodePNGBitReader* reader, const unsigned char* data, size_t size)
+{
+  reader->data = data;
+  reader->size = size;
+  reader->pos = 0;
+  reader->buffer = 0;
+  reader->bits = 0;
+}
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+/*position in bits of the next bit that will be read*/
+static size_t LodePNGBitReader_position(const LodePNGBitReader* reader)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  ++(*bitpointer);
-  return result;
+  return reader->pos * 8u - reader->bits;
+}
+
+/*whether bits past the end of the input have been consumed*/
+static unsigned LodePNGBitReader_overrun(const LodePNGBitReader* reader)
+{
+  return reader->pos > reader->size && LodePNGBitReader_position(reader) > reader->size * 8u;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*discards the loaded bits and continues reading at the given byte position*/
+static void LodePNGBitReader_seek(LodePNGBitReader* reader, size_t bytepos)
 {
-  unsigned result = 0, i;
-  for(i = 0; i != nbits; ++i)
+  reader->pos = bytepos;
+  reader->buffer = 0;
+  reader->bits = 0;
+}
+
+/*loads whole bytes until fewer than 8 bits of the buffer are free*/
+static void refillBits(LodePNGBitReader* reader)
+{
+  const unsigned maxbits = (unsigned)(sizeof(size_t) * 8u) - 8u;
+  if(reader->pos + sizeof(size_t) <= reader->size)
+  {
+    /*fast path: no more than sizeof(size_t) bytes are loaded, they are all in range*/
+    const unsigned char* data = &reader->data[reader->pos];
+    while(reader->bits <= maxbits)
+    {
+      reader->buffer |= (size_t)(*data++) << reader->bits;
+      reader->bits += 8u;
+    }
+    reader->pos = (size_t)(data - reader->data);
+  }
+  else
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    ++(*bitpointer);
+    while(reader->bits <= maxbits)
+    {
+      if(reader->pos < reader->size) reader->buffer |= (size_t)reader->data[reader->pos] << reader->bits;
+      reader->bits += 8u;
+      ++reader->pos;
+    }
   }
+}
+
+/*makes sure at least nbits (at most sizeof(size_t) * 8 - 7) are loaded*/
+static void ensureBits(LodePNGBitReader* reader, unsigned nbits)
+{
+  if(reader->bits < nbits) refillBits(reader);
+}
+
+/*returns the next nbits bits without consuming them, they must have been ensured*/
+static unsigned peekBits(const LodePNGBitReader* reader, unsigned nbits)
+{
+  return (unsigned)(reader->buffer & (((size_t)1u << nbits) - 1u));
+}
+
+static void advanceBits(LodePNGBitReader* reader, unsigned nbits)
+{
+  reader->buffer >>= nbits;
+  reader->bits -= nbits;
+}
+
+/*reads nbits (at most 25) bits*/
+static unsigned readBits(LodePNGBitReader* reader, unsigned nbits)
+{
+  unsigned result;
+  ensureBits(reader, nbits);
+  result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -508,11 +1026,14 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*for the decoder: lookup table indexed by the next FIRSTBITS bits of the stream (LSB first), with
+  second level subtables for longer codes. See HuffmanTree_makeTable.*/
+  unsigned char* table_len; /*length of the code, or of the subtable if > FIRSTBITS in the first level*/
+  unsigned short* table_value; /*the symbol, or the subtable start index if > FIRSTBITS in the first level*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -530,77 +1051,18 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
-}
-
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
-{
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
-
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
-
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffman tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; ++n)
-  {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
-  }
-
-  for(n = 0; n < tree->numcodes; ++n) /*the codes*/
-  {
-    for(i = 0; i != tree->lengths[n]; ++i) /*the bits for this code*/
-    {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      /*oversubscribed, see comment in lodepng_error_text*/
-      if(treepos > 2147483647 || treepos + 2 > tree->numcodes) return 55;
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
-      {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          ++nodefilled;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
-      }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
-    }
-  }
-
-  for(n = 0; n < tree->numcodes * 2; ++n)
-  {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
-  }
-
-  return 0;
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
 }
 
 /*
@@ -644,9 +1106,130 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
-  else return error;
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
+/*number of bits the first level of the decoding table is indexed with. Codes up to this length are
+decoded with a single lookup, longer ones (up to 15 bits) need one extra lookup in a subtable*/
+#define FIRSTBITS 9u
+/*table value for bit patterns that do not correspond to any code of an incomplete tree*/
+#define INVALIDSYMBOL 65535u
+/*table length that marks an entry as not yet filled in while building the table*/
+#define UNFILLEDLEN 16u
+
+/*reverses the order of the lowest num bits, huffman codes are stored MSB first in the stream*/
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i != num; ++i) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
+}
+
+/*
+the representation used by the decoder: a table indexed by the next FIRSTBITS bits of the stream,
+as read LSB first. For codes of at most FIRSTBITS bits, every index starting with the (reversed) code
+contains its symbol and length. For longer codes, the first level entry of their FIRSTBITS bits prefix
+contains the start index of a subtable and the maximum code length with that prefix, and the subtable
+is indexed by the remaining bits. tree1d and lengths must already be filled in. return value is error.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, size, pointer;
+  unsigned* maxlens = (unsigned*)lodepng_malloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
+
+  /*compute the maximum code length for each FIRSTBITS prefix, to know the size of the subtables*/
+  for(i = 0; i != headsize; ++i) maxlens[i] = 0;
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(l > maxlens[index]) maxlens[index] = l;
+  }
+  size = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(*tree->table_len));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(*tree->table_value));
+  if(!tree->table_len || !tree->table_value)
+  {
+    lodepng_free(maxlens);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i != size; ++i) tree->table_len[i] = UNFILLEDLEN;
+
+  /*point the first level entries of long codes to their subtable*/
+  pointer = headsize;
+  for(i = 0; i != headsize; ++i)
+  {
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += (size_t)1u << (l - FIRSTBITS);
+  }
+  lodepng_free(maxlens);
+
+  /*fill in the symbols. Two codes claiming the same entry means the tree is oversubscribed*/
+  for(i = 0; i != tree->numcodes; ++i)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
+    {
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != UNFILLEDLEN) return 55; /*oversubscribed*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index];
+      /*a shorter code already took this prefix entry, so the tree is oversubscribed*/
+      if(maxlen < l) return 55;
+      num = 1u << (maxlen - l);
+      for(j = 0; j != num; ++j)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        if(tree->table_len[index2] != UNFILLEDLEN) return 55; /*oversubscribed*/
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
+      }
+    }
+  }
+
+  /*An incomplete tree (e.g. one with a single code, or none at all if no distance codes are used)
+  leaves entries unfilled. Decoding such bit pattern is an error, but only when it actually occurs.
+  The length makes the decoder consume at least one bit in the first level or FIRSTBITS + 1 in a
+  subtable, which is all it has peeked there.*/
+  for(i = 0; i != size; ++i)
+  {
+    if(tree->table_len[i] == UNFILLEDLEN)
+    {
+      tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+      tree->table_value[i] = INVALIDSYMBOL;
+    }
+  }
+
+  return 0;
 }
+#endif /*LODEPNG_COMPILE_DECODER*/
 
 /*
 given the code lengths (as stored in the PNG file), generate the tree as defined
@@ -657,12 +1240,17 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
                                             size_t numcodes, unsigned maxbitlen)
 {
   unsigned i;
+  unsigned error;
   tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
   if(!tree->lengths) return 83; /*alloc fail*/
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
-  return HuffmanTree_makeFromLengths2(tree);
+  error = HuffmanTree_makeFromLengths2(tree);
+#ifdef LODEPNG_COMPILE_DECODER
+  if(!error) error = HuffmanTree_makeTable(tree);
+#endif /*LODEPNG_COMPILE_DECODER*/
+  return error;
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -941,27 +1529,28 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code, or (unsigned)(-1) if error happened. Use LodePNGBitReader_overrun to distinguish
+running out of input from a bit pattern that isn't a code of the tree.
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
-{
-  unsigned treepos = 0, ct;
-  for(;;)
-  {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    ++(*bp);
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
-  }
+static unsigned huffmanDecodeSymbol(LodePNGBitReader* reader, const HuffmanTree* codetree)
+{
+  unsigned code, index, l, value;
+  ensureBits(reader, 15); /*the longest deflate code*/
+  code = peekBits(reader, 15);
+  index = code & ((1u << FIRSTBITS) - 1u);
+  l = codetree->table_len[index];
+  value = codetree->table_value[index];
+  if(l > FIRSTBITS)
+  {
+    /*long code, look up the remaining bits in the subtable*/
+    index = value + ((code >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u));
+    l = codetree->table_len[index];
+    value = codetree->table_value[index];
+  }
+  advanceBits(reader, l);
+  if(LodePNGBitReader_overrun(reader)) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
+  if(value == INVALIDSYMBOL) return (unsigned)(-1); /*error: code not in the (incomplete) tree*/
+  return value;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -980,13 +1569,12 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, LodePNGBitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
+  size_t inbitlength = reader->size * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -995,16 +1583,18 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
+  /*error: the bit pointer is or will go past the memory*/
+  if(LodePNGBitReader_position(reader) + 14 > inbitlength) return 49;
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
-  if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
+  /*error: the bit pointer is or will go past the memory*/
+  if(LodePNGBitReader_position(reader) + HCLEN * 3 > inbitlength) return 50;
 
   HuffmanTree_init(&tree_cl);
 
@@ -1017,7 +1607,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
@@ -1035,7 +1625,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code = huffmanDecodeSymbol(reader, &tree_cl);
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1049,8 +1639,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
         if(i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        if((*bp + 2) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 2);
+        replength += readBits(reader, 2);
+        if(LodePNGBitReader_overrun(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1066,8 +1656,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if((*bp + 3) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 3);
+        replength += readBits(reader, 3);
+        if(LodePNGBitReader_overrun(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1082,8 +1672,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if((*bp + 7) > inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
-        replength += readBitsFromStream(bp, in, 7);
+        replength += readBits(reader, 7);
+        if(LodePNGBitReader_overrun(reader)) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; ++n)
@@ -1101,7 +1691,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         {
           /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
+          error = LodePNGBitReader_overrun(reader) ? 10 : 11;
         }
         else error = 16; /*unexisting code, this can never happen*/
         break;
@@ -1127,55 +1717,98 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+/*
+copies a back reference of length bytes that starts distance bytes before out to out. The source may
+overlap the destination, then the last distance bytes repeat. out must have room for 15 bytes more
+than length: whole chunks are copied and the last one may end past the run, the caller overwrites
+those bytes later.
+*/
+static void copyBackReference(unsigned char* out, size_t distance, size_t length)
 {
-  unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
-
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
-
-  while(!error) /*decode all symbols until end reached, breaks at end code*/
+  const unsigned char* end = out + length;
+  const unsigned char* in = out - distance;
+  if(distance >= 16)
   {
-    /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
-    if(code_ll <= 255) /*literal symbol*/
-    {
-      /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
-      if(!ucvector_resize(out, (*pos) + 1)) ERROR_BREAK(83 /*alloc fail*/);
-      out->data[*pos] = (unsigned char)code_ll;
-      ++(*pos);
-    }
-    else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
+    /*chunks never overlap, the bytes a chunk reads are written before it*/
+    do { memcpy(out, in, 16); out += 16; in += 16; } while(out < end);
+  }
+  else if(distance >= 8)
+  {
+    do { memcpy(out, in, 8); out += 8; in += 8; } while(out < end);
+  }
+  else if(distance == 1)
+  {
+    memset(out, in[0], length); /*run of a single byte, e.g. a row of equal grey or palette pixels*/
+  }
+  else
+  {
+    /*short repeating pattern, e.g. a 3 or 4 byte RGB or RGBA pixel. Write the pattern until it can be
+    read back from a multiple of its period that is at least 8 bytes away, then copy 8-byte chunks
+    from there*/
+    size_t period = distance * ((8 + distance - 1) / distance);
+    size_t i, prefix = period - distance;
+    if(prefix > length) prefix = length;
+    for(i = 0; i != prefix; ++i) out[i] = in[i];
+    out += prefix;
+    in = out - period;
+    while(out < end) { memcpy(out, in, 8); out += 8; in += 8; }
+  }
+}
+
+/*
+decodes the symbols of a Huffman block to out until the end code, then sets *end to 1. Also returns early,
+with *end 0, once out has outlimit bytes or when the reader is past bit position inlimit, so that a
+symbol that starts before inlimit never reads past it by more than 48 bits. Pass (size_t)(-1) for no limit.
+*/
+static unsigned inflateHuffmanSymbols(ucvector* out, LodePNGBitReader* reader, size_t* pos,
+                                      const HuffmanTree* tree_ll, const HuffmanTree* tree_d,
+                                      size_t inlimit, size_t outlimit, unsigned* end)
+{
+  unsigned error = 0;
+  size_t p = *pos;
+  unsigned char* data = out->data;
+
+  *end = 0;
+  while(!error) /*decode all symbols until end reached, breaks at end code*/
+  {
+    unsigned code_ll;
+    if(p >= outlimit || LodePNGBitReader_position(reader) > inlimit) break;
+    /*out->size is only updated at the end of the block, here capacity for the longest length (258) plus
+    the bytes copyBackReference may write past the end of it is reserved once per symbol*/
+    if(out->allocsize - p < 258 + 15)
+    {
+      if(!ucvector_reserve(out, p + 258 + 15)) ERROR_BREAK(83 /*alloc fail*/);
+      data = out->data;
+    }
+    /*code_ll is literal, length or end code*/
+    code_ll = huffmanDecodeSymbol(reader, tree_ll);
+    if(code_ll <= 255) /*literal symbol*/
+    {
+      data[p++] = (unsigned char)code_ll;
+    }
+    else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
       unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      size_t length;
 
       /*part 1: get length base*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
       /*part 2: get extra bits and add the value of that to length*/
       numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if((*bp + numextrabits_l) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += readBits(reader, numextrabits_l);
+      if(LodePNGBitReader_overrun(reader)) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(reader, tree_d);
       if(code_d > 29)
       {
         if(code_d == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
         {
           /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
+          error = LodePNGBitReader_overrun(reader) ? 10 : 11;
         }
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
@@ -1184,37 +1817,47 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
       /*part 4: get extra bits from distance*/
       numextrabits_d = DISTANCEEXTRA[code_d];
-      if((*bp + numextrabits_d) > inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      distance += readBits(reader, numextrabits_d);
+      if(LodePNGBitReader_overrun(reader)) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-
-      if(!ucvector_resize(out, (*pos) + length)) ERROR_BREAK(83 /*alloc fail*/);
-      if (distance < length) {
-        for(forward = 0; forward < length; ++forward)
-        {
-          out->data[(*pos)++] = out->data[backward++];
-        }
-      } else {
-        memcpy(out->data + *pos, out->data + backward, length);
-        *pos += length;
-      }
+      if(distance > p) ERROR_BREAK(52); /*too long backward distance*/
+      copyBackReference(&data[p], distance, length);
+      p += length;
     }
     else if(code_ll == 256)
     {
+      *end = 1;
       break; /*end code, break the loop*/
     }
     else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
     {
       /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
       (10=no endcode, 11=wrong jump outside of tree)*/
-      error = ((*bp) > inlength * 8) ? 10 : 11;
+      error = LodePNGBitReader_overrun(reader) ? 10 : 11;
       break;
     }
   }
+  out->size = *pos = p;
+
+  return error;
+}
+
+/*inflate a block with dynamic of fixed Huffman tree*/
+static unsigned inflateHuffmanBlock(ucvector* out, LodePNGBitReader* reader, size_t* pos, unsigned btype,
+                                    size_t stop)
+{
+  unsigned error = 0, end;
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+
+  HuffmanTree_init(&tree_ll);
+  HuffmanTree_init(&tree_d);
+
+  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+
+  if(!error) error = inflateHuffmanSymbols(out, reader, pos, &tree_ll, &tree_d, (size_t)(-1), stop, &end);
 
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
@@ -1222,17 +1865,18 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, LodePNGBitReader* reader, size_t* pos)
 {
   size_t p;
   unsigned LEN, NLEN, n, error = 0;
+  const unsigned char* in = reader->data;
+  size_t inlength = reader->size;
 
-  /*go to first boundary of byte*/
-  while(((*bp) & 0x7) != 0) ++(*bp);
-  p = (*bp) / 8; /*byte position*/
+  /*go to first boundary of byte, the bits still in the buffer of the reader are given back*/
+  p = (LodePNGBitReader_position(reader) + 7) / 8; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
+  if(p + 4 > inlength) return 52; /*error, bit pointer will jump past memory*/
   LEN = in[p] + 256u * in[p + 1]; p += 2;
   NLEN = in[p] + 256u * in[p + 1]; p += 2;
 
@@ -1245,34 +1889,36 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
   for(n = 0; n < LEN; ++n) out->data[(*pos)++] = in[p++];
 
-  (*bp) = p * 8;
+  LodePNGBitReader_seek(reader, p);
 
   return error;
 }
 
-static unsigned lodepng_inflatev(ucvector* out,
-                                 const unsigned char* in, size_t insize,
-                                 const LodePNGDecompressSettings* settings)
+/*inflates the blocks up to the final one. With flushed set, in may also end right after a block that ends
+at a byte boundary, as with a full flush, which is how a part of a bigger deflate stream ends. Stops early,
+possibly in the middle of a block, once there are at least stop bytes of output.*/
+static unsigned inflateBlocks(ucvector* out, const unsigned char* in, size_t insize, unsigned flushed,
+                              size_t stop)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  LodePNGBitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
 
-  (void)settings;
+  LodePNGBitReader_init(&reader, in, insize);
 
-  while(!BFINAL)
+  while(!BFINAL && pos < stop)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1u * readBitFromStream(&bp, in);
-    BTYPE += 2u * readBitFromStream(&bp, in);
+    if(flushed && LodePNGBitReader_position(&reader) == insize * 8) break; /*end of the part*/
+    /*error, bit pointer will jump past memory*/
+    if(LodePNGBitReader_position(&reader) + 2 >= insize * 8) return 52;
+    BFINAL = readBits(&reader, 1);
+    BTYPE = readBits(&reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE, stop); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
@@ -1280,30 +1926,43 @@ static unsigned lodepng_inflatev(ucvector* out,
   return error;
 }
 
+static unsigned lodepng_inflatev(ucvector* out,
+                                 const unsigned char* in, size_t insize,
+                                 const LodePNGDecompressSettings* settings)
+{
+  (void)settings;
+  return inflateBlocks(out, in, insize, 0, (size_t)(-1));
+}
+
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGDecompressSettings* settings)
 {
   unsigned error;
   ucvector v;
+  const LodePNGAllocator* previous = lodepng_use_allocator(settings->allocator);
   ucvector_init_buffer(&v, *out, *outsize);
   error = lodepng_inflatev(&v, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
+  lodepng_restore_allocator(previous);
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
+/*inflates to the start of out, keeping its allocated memory*/
+static unsigned inflatev(ucvector* out,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_inflate)
   {
-    return settings->custom_inflate(out, outsize, in, insize, settings);
+    unsigned error = settings->custom_inflate(&out->data, &out->size, in, insize, settings);
+    out->allocsize = out->size; /*all that is known about the memory it returns*/
+    return error;
   }
   else
   {
-    return lodepng_inflate(out, outsize, in, insize, settings);
+    return lodepng_inflatev(out, in, insize, settings);
   }
 }
 
@@ -1366,6 +2025,11 @@ static const unsigned HASH_BIT_MASK = 65535; /*HASH_NUM_VALUES - 1, but C90 does
 
 typedef struct Hash
 {
+  /*for compression levels 1-3 only this is used: per hash of 4 bytes, the most recent positions + 1 (0 for
+  none), fastways of them and the newest first*/
+  unsigned* fast;
+  unsigned fastways;
+
   int* head; /*hash value to head circular pos - can be outdated if went around window*/
   /*circular pos to prev circular pos*/
   unsigned short* chain;
@@ -1378,9 +2042,24 @@ typedef struct Hash
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+#define FAST_HASH_BITS 14
+#define FAST_HASH_NUM_VALUES (1u << FAST_HASH_BITS)
+
+static unsigned hash_init(Hash* hash, unsigned windowsize, unsigned fastways)
 {
   unsigned i;
+  hash->fastways = fastways;
+  if(fastways)
+  {
+    hash->head = hash->val = 0;
+    hash->chain = hash->zeros = hash->chainz = 0;
+    hash->headz = 0;
+    hash->fast = (unsigned*)lodepng_malloc(sizeof(unsigned) * FAST_HASH_NUM_VALUES * fastways);
+    if(!hash->fast) return 83; /*alloc fail*/
+    for(i = 0; i != FAST_HASH_NUM_VALUES * fastways; ++i) hash->fast[i] = 0;
+    return 0;
+  }
+  hash->fast = 0;
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1407,6 +2086,7 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
 
 static void hash_cleanup(Hash* hash)
 {
+  lodepng_free(hash->fast);
   lodepng_free(hash->head);
   lodepng_free(hash->val);
   lodepng_free(hash->chain);
@@ -1462,6 +2142,156 @@ static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned
   hash->headz[numzeros] = (unsigned)wpos;
 }
 
+/*
+The match finder of each compression level, like zlib's. Levels 1-3 match greedily with a hash table that has
+room for fastways positions per hash, and only level 2 and 3 hash the positions inside a match. Levels 4-9
+use the hash chains with lazy matching: they give up on a chain after maxchain positions, or a quarter of that
+if the previous position already has a match of goodlength, and lazy match up to a length of maxlazy.
+*/
+typedef struct LZ77Level
+{
+  unsigned fastways, insertmatches;
+  unsigned goodlength, maxlazy, nicematch, maxchain;
+} LZ77Level;
+
+static const LZ77Level LZ77_LEVELS[10] = {
+  {0, 0, 0, 0, 0, 0}, /*level 0 takes the settings as they are*/
+  {1, 0, 0, 0, 0, 0},
+  {2, 1, 0, 0, 0, 0},
+  {4, 1, 0, 0, 0, 0},
+  {0, 0, 4, 4, 16, 16},
+  {0, 0, 8, 16, 32, 32},
+  {0, 0, 8, 16, 128, 128},
+  {0, 0, 8, 32, 128, 256},
+  {0, 0, 32, 128, 258, 1024},
+  {0, 0, 32, 258, 258, 4096}
+};
+
+static unsigned lz77WindowSize(const LodePNGCompressSettings* settings)
+{
+  return (settings->level || settings->optimal_iterations) ? 32768 : settings->windowsize;
+}
+
+/*hash of the 4 bytes at p, for the fast match finder*/
+static unsigned fastHash(const unsigned char* p)
+{
+  unsigned v = (unsigned)p[0] | ((unsigned)p[1] << 8u) | ((unsigned)p[2] << 16u) | ((unsigned)p[3] << 24u);
+  return ((v * 2654435761u) & 0xffffffffu) >> (32u - FAST_HASH_BITS);
+}
+
+/*number of equal bytes at a and b, at most max, comparing a word at a time*/
+static unsigned matchLength(const unsigned char* a, const unsigned char* b, unsigned max)
+{
+  unsigned length = 0;
+  while(length + sizeof(size_t) <= max)
+  {
+    size_t x, y;
+    memcpy(&x, &a[length], sizeof(x));
+    memcpy(&y, &b[length], sizeof(y));
+    if(x != y) break;
+    length += sizeof(size_t);
+  }
+  while(length < max && a[length] == b[length]) ++length;
+  return length;
+}
+
+static void fastInsert(Hash* hash, const unsigned char* in, size_t pos)
+{
+  unsigned* bucket = &hash->fast[fastHash(&in[pos]) * hash->fastways];
+  unsigned w;
+  for(w = hash->fastways - 1; w != 0; --w) bucket[w] = bucket[w - 1];
+  bucket[0] = (unsigned)(pos + 1);
+}
+
+/*
+Adds the positions from start to end to the hash as if they had been encoded, so that the data there can be
+referred back to: the dictionary of a part of the data that is deflated separately. insize is where the data
+that is encoded next ends.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start, size_t end, size_t insize,
+                       unsigned windowsize)
+{
+  size_t pos;
+  unsigned hashval, numzeros = 0;
+  for(pos = start; pos < end; ++pos)
+  {
+    if(hash->fastways)
+    {
+      if(insize - pos >= 4) fastInsert(hash, in, pos);
+      continue;
+    }
+    hashval = getHash(in, insize, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else numzeros = 0;
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
+/*
+LZ77-encode greedily with the fast hash table: each position takes the longest match of the few most recent
+ones with the same hash, which may be up to 32768 bytes back. The positions are stored truncated to 32 bits,
+so a candidate is checked to be in range and its bytes are compared before use.
+*/
+static unsigned encodeLZ77Fast(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                               unsigned insertmatches)
+{
+  size_t pos = inpos;
+  unsigned i;
+  unsigned* codes;
+  /*a match of at least 4 bytes takes 4 codes, so there's at most one code per byte*/
+  if(!uivector_reserve(out, (out->size + insize - inpos) * sizeof(unsigned))) return 83; /*alloc fail*/
+  codes = &out->data[out->size];
+  while(pos < insize)
+  {
+    unsigned length = 0, offset = 0;
+    if(insize - pos >= 4)
+    {
+      const unsigned* bucket = &hash->fast[fastHash(&in[pos]) * hash->fastways];
+      unsigned max = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? (unsigned)(insize - pos)
+                                                                 : MAX_SUPPORTED_DEFLATE_LENGTH;
+      unsigned w;
+      for(w = 0; w != hash->fastways; ++w)
+      {
+        unsigned distance = (unsigned)(pos + 1) - bucket[w];
+        unsigned current;
+        /*the ways are ordered by position, so the next ones are even further back*/
+        if(bucket[w] == 0 || distance == 0 || distance > 32768 || distance > pos) break;
+        current = matchLength(&in[pos], &in[pos - distance], max);
+        if(current > length)
+        {
+          length = current;
+          offset = distance;
+          if(length == max) break;
+        }
+      }
+      fastInsert(hash, in, pos);
+    }
+
+    if(length >= 4)
+    {
+      /*the same as addLengthDistance*/
+      unsigned length_code = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
+      unsigned dist_code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, offset);
+      *codes++ = length_code + FIRST_LENGTH_CODE_INDEX;
+      *codes++ = length - LENGTHBASE[length_code];
+      *codes++ = dist_code;
+      *codes++ = offset - DISTANCEBASE[dist_code];
+      if(insertmatches)
+      {
+        for(i = 1; i < length && insize - (pos + i) >= 4; ++i) fastInsert(hash, in, pos + i);
+      }
+      pos += length;
+    }
+    else *codes++ = in[pos++];
+  }
+  out->size = (size_t)(codes - out->data);
+  return 0;
+}
+
 /*
 LZ77-encode the data. Return value is error code. The input are raw bytes, the output
 is in the form of unsigned integers with codes representing for example literal bytes, or
@@ -1472,14 +2302,20 @@ the "dictionary". A brute force search through all possible distances would be s
 this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings)
 {
   size_t pos;
   unsigned i, error = 0;
+  const LZ77Level* level = &LZ77_LEVELS[settings->level];
+  unsigned windowsize = lz77WindowSize(settings);
+  unsigned minmatch = settings->level ? 3 : settings->minmatch;
+  unsigned nicematch = settings->level ? level->nicematch : settings->nicematch;
+  unsigned lazymatching = settings->level ? 1 : settings->lazymatching;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
-  unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
+  unsigned maxchainlength = settings->level ? level->maxchain : windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxlazymatch = settings->level ? level->maxlazy : windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
+  unsigned goodlength = settings->level ? level->goodlength : MAX_SUPPORTED_DEFLATE_LENGTH + 1;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
   unsigned numzeros = 0;
@@ -1498,11 +2334,14 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
 
   if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+  if(hash->fastways) return encodeLZ77Fast(out, hash, in, inpos, insize, level->insertmatches);
 
   for(pos = inpos; pos < insize; ++pos)
   {
     size_t wpos = pos & (windowsize - 1); /*position for in 'circular' hash buffers*/
     unsigned chainlength = 0;
+    /*search less when the match of the previous position, that may still be taken, is good already*/
+    unsigned chainlimit = (lazy && lazylength >= goodlength) ? maxchainlength / 4 : maxchainlength;
 
     hashval = getHash(in, insize, pos);
 
@@ -1530,7 +2369,7 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
     prev_offset = 0;
     for(;;)
     {
-      if(chainlength++ >= maxchainlength) break;
+      if(chainlength++ >= chainlimit) break;
       current_offset = (unsigned)(hashpos <= wpos ? wpos - hashpos : wpos - hashpos + windowsize);
 
       if(current_offset < prev_offset) break; /*stop when went completely around the circular buffer*/
@@ -1648,21 +2487,276 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
   return error;
 }
 
+/*
+Optimal parsing, like the squeeze of zopfli. The matches of each position of the block are found once, then
+every iteration takes the cheapest path through the block: from position i, a literal goes to i + 1 and every
+length a match at i allows goes to i + length. The first iteration costs the symbols by the fixed tree, the
+next ones by the code lengths of the Huffman trees of the previous parse, and the parse that takes the fewest
+bits is kept.
+*/
+#define OPTIMAL_MATCHES 8 /*matches kept per position*/
+#define OPTIMAL_MAX_CHAIN 8192 /*hash chain positions to look at per position*/
+#define OPTIMAL_UNUSED_COST 15 /*the cost in bits of a symbol the previous parse didn't use*/
+
+/*
+Finds the matches at pos, whose hash chain entry must be added already: the longest match, and each nearer one
+that is longer than all nearer still. Up to OPTIMAL_MATCHES of the longest of these go to lengths and dists by
+increasing length, ended by a length 0 if there are less. A length shorter than that of a match can always use
+its distance as well, so every length from 3 up to the longest one can be chosen.
+*/
+static void findMatches(unsigned short* lengths, unsigned short* dists, const Hash* hash,
+                        const unsigned char* in, size_t pos, size_t insize, unsigned hashval, unsigned numzeros)
+{
+  unsigned short ringlengths[OPTIMAL_MATCHES], ringdists[OPTIMAL_MATCHES];
+  unsigned num = 0, length = 2, i, first;
+  unsigned chainlength = 0, prev_offset = 0;
+  unsigned max = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? (unsigned)(insize - pos)
+                                                             : MAX_SUPPORTED_DEFLATE_LENGTH;
+  size_t wpos = pos & 32767;
+  unsigned hashpos = hash->chain[wpos];
+
+  for(;;)
+  {
+    unsigned offset = (unsigned)(hashpos <= wpos ? wpos - hashpos : wpos - hashpos + 32768);
+    if(chainlength++ >= OPTIMAL_MAX_CHAIN || offset < prev_offset) break;
+    prev_offset = offset;
+    if(offset > 0)
+    {
+      /*the zeros at both positions are known to be equal, as in encodeLZ77*/
+      unsigned skip = numzeros >= 3 ? hash->zeros[hashpos] : 0;
+      unsigned current;
+      if(skip > numzeros) skip = numzeros;
+      current = skip + matchLength(&in[pos + skip], &in[pos + skip - offset], max - skip);
+      if(current > length)
+      {
+        ringlengths[num % OPTIMAL_MATCHES] = (unsigned short)current;
+        ringdists[num % OPTIMAL_MATCHES] = (unsigned short)offset;
+        ++num;
+        length = current;
+        if(length == max) break;
+      }
+    }
+
+    if(hashpos == hash->chain[hashpos]) break;
+
+    if(numzeros >= 3 && length > numzeros)
+    {
+      hashpos = hash->chainz[hashpos];
+      if(hash->zeros[hashpos] != numzeros) break;
+    }
+    else
+    {
+      hashpos = hash->chain[hashpos];
+      if(hash->val[hashpos] != (int)hashval) break;
+    }
+  }
+
+  first = num > OPTIMAL_MATCHES ? num - OPTIMAL_MATCHES : 0;
+  for(i = first; i != num; ++i)
+  {
+    lengths[i - first] = ringlengths[i % OPTIMAL_MATCHES];
+    dists[i - first] = ringdists[i % OPTIMAL_MATCHES];
+  }
+  if(num - first < OPTIMAL_MATCHES) lengths[num - first] = 0;
+}
+
+/*
+Parses n bytes from in with the matches that findMatches gave for each of them, into LZ77 codes at the end of
+out, taking the cheapest path by the costs in bits of the lit/len symbols in costll and the dist symbols in
+costd. costs, pathlength and pathdist are room for n + 1 values.
+*/
+static unsigned optimalParse(uivector* out, const unsigned char* in, size_t n,
+                             const unsigned short* lengths, const unsigned short* dists,
+                             const unsigned* costll, const unsigned* costd,
+                             unsigned* costs, unsigned short* pathlength, unsigned short* pathdist)
+{
+  unsigned lengthcost[259];
+  size_t i, end;
+  unsigned l, k;
+
+  for(l = 3; l <= MAX_SUPPORTED_DEFLATE_LENGTH; ++l)
+  {
+    unsigned code = (unsigned)searchCodeIndex(LENGTHBASE, 29, l);
+    lengthcost[l] = costll[code + FIRST_LENGTH_CODE_INDEX] + LENGTHEXTRA[code];
+  }
+
+  costs[0] = 0;
+  for(i = 1; i <= n; ++i) costs[i] = ~0u;
+  for(i = 0; i != n; ++i)
+  {
+    const unsigned short* matchlengths = &lengths[i * OPTIMAL_MATCHES];
+    const unsigned short* matchdists = &dists[i * OPTIMAL_MATCHES];
+    unsigned cost = costs[i] + costll[in[i]];
+    if(cost < costs[i + 1])
+    {
+      costs[i + 1] = cost;
+      pathlength[i + 1] = 1;
+    }
+    l = 3;
+    for(k = 0; k != OPTIMAL_MATCHES && matchlengths[k] != 0; ++k)
+    {
+      unsigned max = n - i < matchlengths[k] ? (unsigned)(n - i) : matchlengths[k];
+      unsigned code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, matchdists[k]);
+      unsigned distcost = costs[i] + costd[code] + DISTANCEEXTRA[code];
+      for(; l <= max; ++l)
+      {
+        cost = distcost + lengthcost[l];
+        if(cost < costs[i + l])
+        {
+          costs[i + l] = cost;
+          pathlength[i + l] = (unsigned short)l;
+          pathdist[i + l] = matchdists[k];
+        }
+      }
+    }
+  }
+
+  /*walk the path back from the end, storing in costs where each step of it ends*/
+  for(end = n; end != 0; end -= pathlength[end]) costs[end - pathlength[end]] = (unsigned)end;
+  for(i = 0; i != n; i = end)
+  {
+    end = costs[i];
+    if(pathlength[end] == 1)
+    {
+      if(!uivector_push_back(out, in[i])) return 83; /*alloc fail*/
+    }
+    else addLengthDistance(out, pathlength[end], pathdist[end]);
+  }
+  return 0;
+}
+
+/*
+Gives the code lengths of the Huffman trees for the LZ77 codes as the costs of the next parse, and the size in
+bits the codes take with them, without the trees themselves.
+*/
+static unsigned optimalCosts(unsigned* costll, unsigned* costd, size_t* bits, const uivector* codes)
+{
+  unsigned frequencies_ll[286], frequencies_d[30];
+  unsigned error;
+  size_t i;
+
+  for(i = 0; i != 286; ++i) frequencies_ll[i] = 0;
+  for(i = 0; i != 30; ++i) frequencies_d[i] = 0;
+  for(i = 0; i != codes->size; ++i)
+  {
+    ++frequencies_ll[codes->data[i]];
+    if(codes->data[i] > 256)
+    {
+      ++frequencies_d[codes->data[i + 2]];
+      i += 3;
+    }
+  }
+  frequencies_ll[256] = 1; /*the end code*/
+
+  error = lodepng_huffman_code_lengths(costll, frequencies_ll, 286, 15);
+  if(!error) error = lodepng_huffman_code_lengths(costd, frequencies_d, 30, 15);
+  if(error) return error;
+
+  *bits = costll[256];
+  for(i = 0; i != 286; ++i)
+  {
+    *bits += (size_t)frequencies_ll[i] * costll[i];
+    if(i > 256) *bits += (size_t)frequencies_ll[i] * LENGTHEXTRA[i - FIRST_LENGTH_CODE_INDEX];
+  }
+  for(i = 0; i != 30; ++i) *bits += (size_t)frequencies_d[i] * (costd[i] + DISTANCEEXTRA[i]);
+
+  for(i = 0; i != 286; ++i) if(costll[i] == 0) costll[i] = OPTIMAL_UNUSED_COST;
+  for(i = 0; i != 30; ++i) if(costd[i] == 0) costd[i] = OPTIMAL_UNUSED_COST;
+  return 0;
+}
+
+/*
+LZ77-encodes from inpos to insize with optimal parsing, in at most iterations parses. The hash must have a
+window of 32768. With iterations 1 it's the best parse for the fixed tree.
+*/
+static unsigned encodeLZ77Optimal(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                                  unsigned iterations)
+{
+  size_t n = insize - inpos, i, bits, bestbits = 0;
+  unsigned costll[286], costd[30], nextll[286], nextd[30];
+  unsigned hashval, numzeros = 0, iteration, error = 0;
+  uivector codes, best;
+  unsigned short* lengths = (unsigned short*)lodepng_malloc((n + 1) * OPTIMAL_MATCHES * sizeof(unsigned short));
+  unsigned short* dists = (unsigned short*)lodepng_malloc((n + 1) * OPTIMAL_MATCHES * sizeof(unsigned short));
+  unsigned* costs = (unsigned*)lodepng_malloc((n + 1) * sizeof(unsigned));
+  unsigned short* pathlength = (unsigned short*)lodepng_malloc((n + 1) * sizeof(unsigned short));
+  unsigned short* pathdist = (unsigned short*)lodepng_malloc((n + 1) * sizeof(unsigned short));
+
+  uivector_init(&codes);
+  uivector_init(&best);
+  if(!lengths || !dists || !costs || !pathlength || !pathdist) error = 83; /*alloc fail*/
+
+  for(i = 0; i != n && !error; ++i)
+  {
+    size_t pos = inpos + i;
+    hashval = getHash(in, insize, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, insize, pos);
+      else if(pos + numzeros > insize || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else numzeros = 0;
+    updateHashChain(hash, pos & 32767, hashval, numzeros);
+    findMatches(&lengths[i * OPTIMAL_MATCHES], &dists[i * OPTIMAL_MATCHES], hash, in, pos, insize,
+                hashval, numzeros);
+  }
+
+  /*the code lengths of the fixed trees*/
+  for(i = 0; i != 286; ++i) costll[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  for(i = 0; i != 30; ++i) costd[i] = 5;
+
+  for(iteration = 0; iteration != iterations && !error; ++iteration)
+  {
+    codes.size = 0;
+    error = optimalParse(&codes, &in[inpos], n, lengths, dists, costll, costd, costs, pathlength, pathdist);
+    if(!error) error = optimalCosts(nextll, nextd, &bits, &codes);
+    if(error) break;
+
+    if(iteration == 0 || bits < bestbits)
+    {
+      uivector temp = best;
+      best = codes;
+      codes = temp;
+      bestbits = bits;
+    }
+    /*the same costs would give the same parse again*/
+    if(memcmp(costll, nextll, sizeof(costll)) == 0 && memcmp(costd, nextd, sizeof(costd)) == 0) break;
+    memcpy(costll, nextll, sizeof(costll));
+    memcpy(costd, nextd, sizeof(costd));
+  }
+
+  if(!error)
+  {
+    if(!uivector_resize(out, out->size + best.size)) error = 83; /*alloc fail*/
+    else if(best.size) memcpy(&out->data[out->size - best.size], best.data, best.size * sizeof(unsigned));
+  }
+
+  uivector_cleanup(&codes);
+  uivector_cleanup(&best);
+  lodepng_free(lengths);
+  lodepng_free(dists);
+  lodepng_free(costs);
+  lodepng_free(pathlength);
+  lodepng_free(pathdist);
+  return error;
+}
+
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
 {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
   size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
   unsigned datapos = 0;
+  if(numdeflateblocks == 0) numdeflateblocks = 1; /*empty data still needs a (final) block*/
   for(i = 0; i != numdeflateblocks; ++i)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1782,8 +2876,11 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      if(settings->optimal_iterations)
+      {
+        error = encodeLZ77Optimal(&lz77_encoded, hash, data, datapos, dataend, settings->optimal_iterations);
+      }
+      else error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
     else
@@ -1992,8 +3089,9 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   {
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    /*with the fixed tree, the first parse of optimal parsing is the best one already*/
+    if(settings->optimal_iterations) error = encodeLZ77Optimal(&lz77_encoded, hash, data, datapos, dataend, 1);
+    else error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -2014,86 +3112,384 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+Deflates in from inpos to insize as blocks that continue out at bit pointer bp. Unless final, the last block
+isn't marked as the final one and a full flush follows: an empty stored block, which ends the blocks at a byte
+boundary. There must be data to deflate then. Back references go at most as far as the window before inpos,
+so with inpos 0, what follows a full flush can be inflated on its own.
+*/
+static unsigned deflateBlocks(ucvector* out, size_t* bp, const unsigned char* in, size_t inpos, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
-  size_t bp = 0; /*the bit pointer*/
+  unsigned windowsize = lz77WindowSize(settings);
   Hash hash;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
-  else /*if(settings->btype == 2)*/
+  else if(settings->level > 9) return 96;
+  else if(settings->btype == 0)
   {
-    /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
-    blocksize = insize / 8 + 8;
-    if(blocksize < 65536) blocksize = 65536;
-    if(blocksize > 262144) blocksize = 262144;
+    /*stored blocks are byte aligned already*/
+    error = deflateNoCompression(out, &in[inpos], insize - inpos, final);
+    *bp = out->size * 8;
   }
+  else
+  {
+    if(settings->btype == 1) blocksize = insize - inpos;
+    else /*if(settings->btype == 2)*/
+    {
+      /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
+      blocksize = (insize - inpos) / 8 + 8;
+      if(blocksize < 65536) blocksize = 65536;
+      if(blocksize > 262144) blocksize = 262144;
+    }
 
-  numdeflateblocks = (insize + blocksize - 1) / blocksize;
-  if(numdeflateblocks == 0) numdeflateblocks = 1;
+    numdeflateblocks = (insize - inpos + blocksize - 1) / blocksize;
+    if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
-  if(error) return error;
+    error = hash_init(&hash, windowsize, settings->optimal_iterations ? 0 : LZ77_LEVELS[settings->level].fastways);
+    if(error) return error;
+    /*encodeLZ77 gives the error for a window size that isn't a power of two up to 32768*/
+    if(inpos != 0 && settings->use_lz77 && windowsize - 1 < 32768 && (windowsize & (windowsize - 1)) == 0)
+    {
+      hash_prime(&hash, in, inpos < windowsize ? 0 : inpos - windowsize, inpos, insize, windowsize);
+    }
 
-  for(i = 0; i != numdeflateblocks && !error; ++i)
-  {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
-    size_t end = start + blocksize;
-    if(end > insize) end = insize;
+    for(i = 0; i != numdeflateblocks && !error; ++i)
+    {
+      unsigned BFINAL = final && (i == numdeflateblocks - 1);
+      size_t start = inpos + i * blocksize;
+      size_t end = start + blocksize;
+      if(end > insize) end = insize;
+
+      if(settings->btype == 1) error = deflateFixed(out, bp, &hash, in, start, end, settings, BFINAL);
+      else if(settings->btype == 2) error = deflateDynamic(out, bp, &hash, in, start, end, settings, BFINAL);
+    }
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    hash_cleanup(&hash);
   }
 
-  hash_cleanup(&hash);
+  if(!error && !final)
+  {
+    /*BFINAL 0 and BTYPE 00, then jump to the next byte for LEN 0 and NLEN 65535*/
+    addBitsToStream(bp, out, 0, 3);
+    *bp = (*bp + 7) / 8 * 8;
+    if(!ucvector_resize(out, out->size + 4)) return 83; /*alloc fail*/
+    out->data[out->size - 4] = out->data[out->size - 3] = 0;
+    out->data[out->size - 2] = out->data[out->size - 1] = 255;
+    *bp += 32;
+  }
 
   return error;
 }
 
-unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
-                         const unsigned char* in, size_t insize,
-                         const LodePNGCompressSettings* settings)
+/*deflates part i of in, which has parts of partsize bytes, at the end of out. See deflateParts.*/
+static unsigned deflatePart(ucvector* out, const unsigned char* in, size_t insize, size_t partsize, size_t i,
+                            unsigned dictionary, const LodePNGCompressSettings* settings)
 {
-  unsigned error;
-  ucvector v;
-  ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
-  *out = v.data;
-  *outsize = v.size;
-  return error;
+  size_t start = i * partsize;
+  size_t end = insize - start < partsize ? insize : start + partsize;
+  size_t bp = out->size * 8;
+  if(dictionary) return deflateBlocks(out, &bp, in, start, end, settings, end == insize);
+  return deflateBlocks(out, &bp, &in[start], 0, end - start, settings, end == insize);
 }
 
-static unsigned deflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGCompressSettings* settings)
+#ifdef LODEPNG_COMPILE_THREADS
+/*what the threads of deflateParts share*/
+typedef struct PartsEncoder
 {
-  if(settings->custom_deflate)
-  {
-    return settings->custom_deflate(out, outsize, in, insize, settings);
-  }
-  else
-  {
-    return lodepng_deflate(out, outsize, in, insize, settings);
-  }
-}
-
-#endif /*LODEPNG_COMPILE_DECODER*/
-
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / Adler32                                                                  */
-/* ////////////////////////////////////////////////////////////////////////// */
+  const unsigned char* in;
+  size_t insize, partsize;
+  unsigned dictionary;
+  const LodePNGCompressSettings* settings;
+  ucvector* parts; /*per part, its deflate data*/
+  unsigned* errors; /*per part, error code*/
+} PartsEncoder;
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+static void encodePart(void* data, size_t i)
 {
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
+  const PartsEncoder* e = (const PartsEncoder*)data;
+  /*the parts are freed by the calling thread, which may have another allocator*/
+  const LodePNGAllocator* previous = lodepng_use_heap();
+  e->errors[i] = deflatePart(&e->parts[i], e->in, e->insize, e->partsize, i, e->dictionary, e->settings);
+  lodepng_restore_allocator(previous);
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
 
-  while(len > 0)
+/*
+Deflates in as parts of partsize bytes, the last one may be smaller, that each start at a byte, at the end of
+out, which must end at a byte. positions[i], unless positions is null, is set to the byte position of part i
+in out. With dictionary, a part may refer back to the window before it, else a part can be inflated on its
+own. The parts are compressed on settings->num_threads threads, as far as there are.
+*/
+static unsigned deflateParts(ucvector* out, size_t* positions, const unsigned char* in, size_t insize,
+                             size_t partsize, unsigned dictionary, const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, numparts = (insize + partsize - 1) / partsize;
+
+#ifdef LODEPNG_COMPILE_THREADS
+  if(settings->num_threads != 1 && numparts > 1)
+  {
+    PartsEncoder e;
+    const LodePNGAllocator* previous;
+    e.in = in;
+    e.insize = insize;
+    e.partsize = partsize;
+    e.dictionary = dictionary;
+    e.settings = settings;
+    e.parts = (ucvector*)lodepng_malloc(numparts * sizeof(ucvector));
+    e.errors = (unsigned*)lodepng_malloc(numparts * sizeof(unsigned));
+    if(!e.parts || !e.errors) error = 83; /*alloc fail*/
+    else
+    {
+      for(i = 0; i != numparts; ++i) ucvector_init(&e.parts[i]);
+      lodepng_parallel_for(numparts, settings->num_threads, encodePart, &e);
+      for(i = 0; i != numparts && !error; ++i)
+      {
+        size_t size = e.parts[i].size;
+        if(positions) positions[i] = out->size;
+        error = e.errors[i];
+        if(!error && !ucvector_resize(out, out->size + size)) error = 83; /*alloc fail*/
+        if(!error && size) memcpy(&out->data[out->size - size], e.parts[i].data, size);
+      }
+      previous = lodepng_use_heap();
+      for(i = 0; i != numparts; ++i) ucvector_cleanup(&e.parts[i]);
+      lodepng_restore_allocator(previous);
+    }
+    lodepng_free(e.parts);
+    lodepng_free(e.errors);
+    return error;
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  for(i = 0; i != numparts && !error; ++i)
+  {
+    if(positions) positions[i] = out->size;
+    error = deflatePart(out, in, insize, partsize, i, dictionary, settings);
+  }
+  return error;
+}
+
+/*the size of the parts that deflate with num_threads other than 1 compresses separately*/
+#define DEFLATE_PART_SIZE 131072
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  size_t bp = 0; /*the bit pointer*/
+  if(settings->num_threads != 1 && insize > DEFLATE_PART_SIZE)
+  {
+    return deflateParts(out, 0, in, insize, DEFLATE_PART_SIZE, 1, settings);
+  }
+  return deflateBlocks(out, &bp, in, 0, insize, settings, 1);
+}
+
+unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGCompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  const LodePNGAllocator* previous = lodepng_use_allocator(settings->allocator);
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_deflatev(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
+static unsigned deflate(unsigned char** out, size_t* outsize,
+                        const unsigned char* in, size_t insize,
+                        const LodePNGCompressSettings* settings)
+{
+  if(settings->custom_deflate)
+  {
+    return settings->custom_deflate(out, outsize, in, insize, settings);
+  }
+  else
+  {
+    return lodepng_deflate(out, outsize, in, insize, settings);
+  }
+}
+
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Adler32                                                                  */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+The SIMD versions handle blocks of 32 or 64 bytes: s1 grows by the sum of the bytes of a block, and s2
+by 32 or 64 times s1 before the block plus the bytes weighted by 32..1 or 64..1. At most 5552 bytes
+(ADLER32_NMAX) are summed before the modulo, which is the most for which the sums can't overflow.
+*/
+#define ADLER32_NMAX 5552
+
+#if defined(LODEPNG_SIMD_X86)
+/*horizontal sum of the 4 32-bit lanes*/
+LODEPNG_TARGET("sse2") static unsigned sum32_sse2(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+  return (unsigned)_mm_cvtsi128_si32(v);
+}
+
+/*updates the adler32 with blocks * 32 bytes*/
+LODEPNG_TARGET("ssse3") static unsigned update_adler32_ssse3(unsigned adler, const unsigned char* data,
+                                                            unsigned blocks)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_NMAX / 32 ? ADLER32_NMAX / 32 : blocks;
+    /*v_ps sums s1 before each block, the initial s1 counts for all n blocks*/
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+    __m128i v_s1 = zero;
+    __m128i v_s2 = _mm_cvtsi32_si128((int)s2);
+    blocks -= n;
+    do
+    {
+      __m128i bytes1 = _mm_loadu_si128((const __m128i*)data);
+      __m128i bytes2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_add_epi32(_mm_sad_epu8(bytes1, zero), _mm_sad_epu8(bytes2, zero)));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      data += 32;
+    } while(--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+    s1 = (s1 + sum32_sse2(v_s1)) % 65521;
+    s2 = sum32_sse2(v_s2) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+
+/*updates the adler32 with blocks * 64 bytes*/
+LODEPNG_TARGET("avx2") static unsigned update_adler32_avx2(unsigned adler, const unsigned char* data,
+                                                          unsigned blocks)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                        48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+  const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_NMAX / 64 ? ADLER32_NMAX / 64 : blocks;
+    __m256i v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s1 = zero;
+    __m256i v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    blocks -= n;
+    do
+    {
+      __m256i bytes1 = _mm256_loadu_si256((const __m256i*)data);
+      __m256i bytes2 = _mm256_loadu_si256((const __m256i*)(data + 32));
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_add_epi32(_mm256_sad_epu8(bytes1, zero), _mm256_sad_epu8(bytes2, zero)));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes1, tap1), ones));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes2, tap2), ones));
+      data += 64;
+    } while(--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 6));
+    s1 = (s1 + sum32_sse2(_mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1)))) % 65521;
+    s2 = sum32_sse2(_mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1))) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*updates the adler32 with blocks * 32 bytes*/
+static unsigned update_adler32_neon(unsigned adler, const unsigned char* data, unsigned blocks)
+{
+  static const unsigned short taps[32] = {32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                          16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  while(blocks > 0)
+  {
+    unsigned n = blocks > ADLER32_NMAX / 32 ? ADLER32_NMAX / 32 : blocks;
+    uint32x4_t v_ps = vsetq_lane_u32(s1 * n, vdupq_n_u32(0), 0);
+    uint32x4_t v_s1 = vdupq_n_u32(0);
+    uint32x4_t v_s2;
+    uint32x2_t sum;
+    /*sums of the bytes at each of the 32 positions in a block, at most 173 * 255 so they fit in 16 bits*/
+    uint16x8_t column1 = vdupq_n_u16(0), column2 = vdupq_n_u16(0);
+    uint16x8_t column3 = vdupq_n_u16(0), column4 = vdupq_n_u16(0);
+    blocks -= n;
+    do
+    {
+      uint8x16_t bytes1 = vld1q_u8(data);
+      uint8x16_t bytes2 = vld1q_u8(data + 16);
+      v_ps = vaddq_u32(v_ps, v_s1);
+      v_s1 = vpadalq_u16(v_s1, vpadalq_u8(vpaddlq_u8(bytes1), bytes2));
+      column1 = vaddw_u8(column1, vget_low_u8(bytes1));
+      column2 = vaddw_u8(column2, vget_high_u8(bytes1));
+      column3 = vaddw_u8(column3, vget_low_u8(bytes2));
+      column4 = vaddw_u8(column4, vget_high_u8(bytes2));
+      data += 32;
+    } while(--n);
+    v_s2 = vshlq_n_u32(v_ps, 5);
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(column1), vld1_u16(&taps[0]));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(column1), vld1_u16(&taps[4]));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(column2), vld1_u16(&taps[8]));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(column2), vld1_u16(&taps[12]));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(column3), vld1_u16(&taps[16]));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(column3), vld1_u16(&taps[20]));
+    v_s2 = vmlal_u16(v_s2, vget_low_u16(column4), vld1_u16(&taps[24]));
+    v_s2 = vmlal_u16(v_s2, vget_high_u16(column4), vld1_u16(&taps[28]));
+    sum = vpadd_u32(vget_low_u32(v_s1), vget_high_u32(v_s1));
+    s1 = (s1 + vget_lane_u32(sum, 0) + vget_lane_u32(sum, 1)) % 65521;
+    sum = vpadd_u32(vget_low_u32(v_s2), vget_high_u32(v_s2));
+    s2 = (s2 + vget_lane_u32(sum, 0) + vget_lane_u32(sum, 1)) % 65521;
+  }
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+{
+  unsigned s1;
+  unsigned s2;
+
+#if defined(LODEPNG_SIMD_X86)
+  unsigned features = lodepng_get_cpu_features();
+  if(len >= 64 && (features & LODEPNG_CPU_AVX2))
+  {
+    adler = update_adler32_avx2(adler, data, len / 64);
+    data += len & ~63u;
+    len &= 63u;
+  }
+  if(len >= 32 && (features & LODEPNG_CPU_SSSE3))
+  {
+    adler = update_adler32_ssse3(adler, data, len / 32);
+    data += len & ~31u;
+    len &= 31u;
+  }
+#elif defined(LODEPNG_SIMD_NEON)
+  if(len >= 32 && (lodepng_get_cpu_features() & LODEPNG_CPU_NEON))
+  {
+    adler = update_adler32_neon(adler, data, len / 32);
+    data += len & ~31u;
+    len &= 31u;
+  }
+#endif /*LODEPNG_SIMD_X86*/
+
+  s1 = adler & 0xffff;
+  s2 = (adler >> 16) & 0xffff;
+
+  while(len > 0)
   {
     /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
     unsigned amount = len > 5550 ? 5550 : len;
@@ -2123,13 +3519,11 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*checks the 2-byte zlib header, returns error code*/
+static unsigned checkZlibHeader(const unsigned char* in)
 {
-  unsigned error = 0;
   unsigned CM, CINFO, FDICT;
 
-  if(insize < 2) return 53; /*error, size of zlib data too small*/
   /*read information from zlib header*/
   if((in[0] * 256 + in[1]) % 31 != 0)
   {
@@ -2155,29 +3549,58 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  return 0;
+}
+
+static unsigned lodepng_zlib_decompressv(ucvector* out, const unsigned char* in,
+                                         size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = 0;
+
+  if(insize < 2) return 53; /*error, size of zlib data too small*/
+  error = checkZlibHeader(in);
+  if(error) return error;
+
+  error = inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned checksum = adler32(out->data, (unsigned)(out->size));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
   return 0; /*no error*/
 }
 
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  const LodePNGAllocator* previous = lodepng_use_allocator(settings->allocator);
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_zlib_decompressv(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
+/*decompresses to the start of out, keeping its allocated memory, e.g. reserved for the expected size*/
+static unsigned zlib_decompress(ucvector* out, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
   if(settings->custom_zlib)
   {
-    return settings->custom_zlib(out, outsize, in, insize, settings);
+    unsigned error = settings->custom_zlib(&out->data, &out->size, in, insize, settings);
+    out->allocsize = out->size; /*all that is known about the memory it returns*/
+    return error;
   }
   else
   {
-    return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+    return lodepng_zlib_decompressv(out, in, insize, settings);
   }
 }
 
@@ -2185,6 +3608,20 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+static void addZlibHeader(ucvector* out)
+{
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG >> 8));
+  ucvector_push_back(out, (unsigned char)(CMFFLG & 255));
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings)
 {
@@ -2195,36 +3632,51 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned error;
   unsigned char* deflatedata = 0;
   size_t deflatesize = 0;
-
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-  unsigned FLEVEL = 0;
-  unsigned FDICT = 0;
-  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-  unsigned FCHECK = 31 - CMFFLG % 31;
-  CMFFLG += FCHECK;
+  const LodePNGAllocator* previous = lodepng_use_allocator(settings->allocator);
 
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
+  addZlibHeader(&outv);
 
   error = deflate(&deflatedata, &deflatesize, in, insize, settings);
 
   if(!error)
   {
     unsigned ADLER32 = adler32(in, (unsigned)insize);
-    for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
+    size_t oldsize = outv.size;
+    if(ucvector_resize(&outv, oldsize + deflatesize))
+    {
+      for(i = 0; i != deflatesize; ++i) outv.data[oldsize + i] = deflatedata[i];
+      lodepng_add32bitInt(&outv, ADLER32);
+    }
+    else error = 83; /*alloc fail*/
     lodepng_free(deflatedata);
-    lodepng_add32bitInt(&outv, ADLER32);
   }
 
   *out = outv.data;
   *outsize = outv.size;
+  lodepng_restore_allocator(previous);
+
+  return error;
+}
 
+#ifdef LODEPNG_COMPILE_PNG
+/*
+Zlib compresses in as parts of partsize bytes, the last one may be smaller, that can be inflated independently:
+each part starts at a byte and none refers back to an earlier one. positions[i] is set to the byte position of
+part i in out, which must have room for all parts. Always uses the built-in deflate.
+*/
+static unsigned zlib_compress_parts(ucvector* out, size_t* positions, const unsigned char* in, size_t insize,
+                                    size_t partsize, const LodePNGCompressSettings* settings)
+{
+  unsigned error;
+  addZlibHeader(out);
+  error = deflateParts(out, positions, in, insize, partsize, 0, settings);
+  if(!error) lodepng_add32bitInt(out, adler32(in, (unsigned)insize));
   return error;
 }
+#endif /*LODEPNG_COMPILE_PNG*/
 
 /* compress using the default or custom zlib function */
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
@@ -2245,11 +3697,14 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
 #else /*no LODEPNG_COMPILE_ZLIB*/
 
 #ifdef LODEPNG_COMPILE_DECODER
-static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+static unsigned zlib_decompress(ucvector* out, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
+  unsigned error;
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
-  return settings->custom_zlib(out, outsize, in, insize, settings);
+  error = settings->custom_zlib(&out->data, &out->size, in, insize, settings);
+  out->allocsize = out->size; /*all that is known about the memory it returns*/
+  return error;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -2279,13 +3734,17 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->level = 0;
+  settings->num_threads = 1;
+  settings->optimal_iterations = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
+  settings->allocator = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 1, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2299,9 +3758,10 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+  settings->allocator = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2319,53 +3779,410 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 
 
 #ifndef LODEPNG_NO_COMPILE_CRC
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/*
+CRC polynomial: 0xedb88320. lodepng_crc32_table[0] is the usual byte-wise table, lodepng_crc32_table[k]
+gives the CRC of a byte followed by k zero bytes, which allows handling 8 bytes at once ("slicing-by-8")
+*/
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+             0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+     249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+     498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+     325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+     997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+     901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+     651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+     671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+    1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+    2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+    1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+    1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+    1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+    1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+    1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+    1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+    3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+    3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+    4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+    4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+    3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+    3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+    3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+    3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+    2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+    2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+    2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+    2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+    2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+    2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+    3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+    3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+             0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+    3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+    1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+    2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+    2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+    1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+    3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+     396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+    4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+     950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+    3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+    1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+    1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+    2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+     792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+    3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+     998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+    4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+    1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+    3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+    2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+    1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+    3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+     740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+    3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+      52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+    2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+    1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+    1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+    2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+     347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+    3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+             0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+     236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+     472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+     305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+     944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+     912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+     611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+     712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+    1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+    2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+    1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+    1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+    1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+    1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+    1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+    1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+    3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+    4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+    4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+    4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+    3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+    3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+    3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+    3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+    2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+    2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+    2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+    2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+    2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+    2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+    3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+    3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+             0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+    3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+    1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+    2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+    2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+    1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+    4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+     899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+    2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+    1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+    3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+     247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+     992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+    4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+    1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+    2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+    3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+     686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+    3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+    2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+    1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+    2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+     494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+    3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+    1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+    3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+     643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+    3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+    3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+     332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+    2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+    1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+             0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+     812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+    1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+    1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+    3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+    4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+    2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+    2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+    1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+    1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+     940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+     140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+    2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+    2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+    4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+    3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+    2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+    2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+    3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+    3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+    1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+    1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+     281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+     548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+    3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+    3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+    2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+    3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+     685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+     413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+    1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+    2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+             0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+    3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+      64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+    4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+     128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+    3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+      75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+    3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+     257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+    3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+     210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+    3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+     150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+    3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+     186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+    3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+     514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+    4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+     493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+    4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+     421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+    4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+     449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+    4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+     300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+    4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+     306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+    4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+     373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+    4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+     361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+    4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+             0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+     871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+    1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+    1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+    3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+    4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+    2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+    2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+    1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+    2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+     601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+     272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+    2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+    3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+    3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+    3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+    2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+    3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+    4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+    3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+    1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+    1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+     544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+     328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+    3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+    4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+    2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+    2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+      60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+     810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+    1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+    1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+             0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+    3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+    2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+    2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+    4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+     714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+    2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+    1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+     698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+    4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+    1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+    2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+    3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+      51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+    2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+    2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+    1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+    2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+     796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+    4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+    2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+    2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+    3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+      85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+    2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+    2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+     102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+    3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+    2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+    1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+    4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+     747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
-/*Return the CRC of the bytes buf[0..len-1].*/
-unsigned lodepng_crc32(const unsigned char* data, size_t length)
+#if defined(LODEPNG_SIMD_X86)
+/*
+Carry-less multiplication folding of 16-byte blocks, as in Intel's "Fast CRC Computation for Generic
+Polynomials Using PCLMULQDQ Instruction". Works on the CRC register (not inverted), length must be at
+least 64 and a multiple of 16.
+*/
+LODEPNG_TARGET("pclmul,sse2") static unsigned crc32_pclmul(unsigned r, const unsigned char* data, size_t length)
+{
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  const __m128i k1k2 = _mm_set_epi32(1, (int)0xc6e41596u, 1, 0x54442bd4);
+  const __m128i k3k4 = _mm_set_epi32(0, (int)0xccaa009eu, 1, 0x751997d0);
+  const __m128i k5k0 = _mm_set_epi32(0, 0, 1, 0x63cd6124);
+  const __m128i poly = _mm_set_epi32(1, (int)0xf7011641u, 1, (int)0xdb710641u);
+  const __m128i mask32 = _mm_set_epi32(0, -1, 0, -1);
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128((int)r));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  data += 64;
+  length -= 64;
+
+  /*fold 4 blocks of 128 bits at once*/
+  while(length >= 64)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)data));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the 4 blocks into one*/
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+  /*fold the remaining single blocks of 128 bits*/
+  while(length >= 16)
+  {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11),
+                                     _mm_loadu_si128((const __m128i*)data)), x5);
+    data += 16;
+    length -= 16;
+  }
+
+  /*fold 128 bits to 64 bits*/
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5k0, 0x00), x2);
+
+  /*Barrett reduction to 32 bits*/
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_srli_si128(x1, 4);
+  return (unsigned)_mm_cvtsi128_si32(x0);
+}
+#elif defined(LODEPNG_CRC32_ARM)
+/*the ARMv8 CRC32 instructions use the same polynomial as PNG, on the CRC register (not inverted)*/
+LODEPNG_CRC32_TARGET static unsigned crc32_arm(unsigned r, const unsigned char* data, size_t length)
 {
-  unsigned r = 0xffffffffu;
   size_t i;
-  for(i = 0; i < length; ++i)
+  for(i = 0; i + 8 <= length; i += 8)
+  {
+    const unsigned char* p = &data[i];
+    unsigned long word = (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16)
+                       | ((unsigned long)p[3] << 24) | ((unsigned long)p[4] << 32) | ((unsigned long)p[5] << 40)
+                       | ((unsigned long)p[6] << 48) | ((unsigned long)p[7] << 56);
+    r = LODEPNG_CRC32_8BYTES(r, word);
+  }
+  for(; i < length; ++i) r = LODEPNG_CRC32_1BYTE(r, data[i]);
+  return r;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+/*continues the CRC of previous bytes with data[0..length-1], start with 0 for the first bytes*/
+static unsigned lodepng_crc32_update(unsigned crc, const unsigned char* data, size_t length)
+{
+  unsigned r = crc ^ 0xffffffffu;
+  size_t i = 0;
+#if defined(LODEPNG_SIMD_X86)
+  /*chunk headers and small chunks aren't worth the setup of the folding*/
+  if(length >= 64 && (lodepng_get_cpu_features() & LODEPNG_CPU_PCLMUL))
+  {
+    i = length & ~(size_t)15;
+    r = crc32_pclmul(r, data, i);
+  }
+#elif defined(LODEPNG_CRC32_ARM)
+  if(lodepng_get_cpu_features() & LODEPNG_CPU_ARM_CRC32) return crc32_arm(r, data, length) ^ 0xffffffffu;
+#endif /*LODEPNG_SIMD_X86*/
+  for(; i + 8 <= length; i += 8)
   {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
+    const unsigned char* p = &data[i];
+    r = lodepng_crc32_table[7][(p[0] ^ r) & 0xff] ^ lodepng_crc32_table[6][(p[1] ^ (r >> 8)) & 0xff]
+      ^ lodepng_crc32_table[5][(p[2] ^ (r >> 16)) & 0xff] ^ lodepng_crc32_table[4][(p[3] ^ (r >> 24)) & 0xff]
+      ^ lodepng_crc32_table[3][p[4]] ^ lodepng_crc32_table[2][p[5]]
+      ^ lodepng_crc32_table[1][p[6]] ^ lodepng_crc32_table[0][p[7]];
+  }
+  for(; i < length; ++i)
+  {
+    r = lodepng_crc32_table[0][(r ^ data[i]) & 0xff] ^ (r >> 8);
   }
   return r ^ 0xffffffffu;
 }
+
+/*Return the CRC of the bytes buf[0..len-1].*/
+unsigned lodepng_crc32(const unsigned char* data, size_t length)
+{
+  return lodepng_crc32_update(0, data, length);
+}
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
 #endif /* !LODEPNG_NO_COMPILE_CRC */
@@ -2984,82 +4801,69 @@ static void addColorBits(unsigned char* out, size_t index, unsigned bits, unsign
   else out[index * bits / 8] |= in;
 }
 
-typedef struct ColorTree ColorTree;
+/*
+The colors of a ColorTable: twice as many slots as the up to 257 colors that lodepng_get_color_profile counts
+or the up to 256 of a palette, so that it is at most about half full and lookups stop after a few slots.
+*/
+#define COLOR_TABLE_SIZE 512
+
+typedef struct ColorTable ColorTable;
 
 /*
-One node of a color tree
-This is the data structure used to count the number of unique colors and to get a palette
-index for a color. It's like an octree, but because the alpha channel is used too, each
-node has 16 instead of 8 children.
+A set of RGBA colors with a palette index each, used to count the number of unique colors and to get a palette
+index for a color. It's a hash table with open addressing, of the colors packed in 32 bits, in one array.
 */
-struct ColorTree
+struct ColorTable
 {
-  ColorTree* children[16]; /*up to 16 pointers to ColorTree of next level*/
-  int index; /*the payload. Only has a meaningful value if this is in the last level*/
+  unsigned colors[COLOR_TABLE_SIZE]; /*RGBA packed with R in the high byte*/
+  int indices[COLOR_TABLE_SIZE]; /*the payload, or -1 for an empty slot*/
 };
 
-static void color_tree_init(ColorTree* tree)
+static void color_table_init(ColorTable* table)
 {
   int i;
-  for(i = 0; i != 16; ++i) tree->children[i] = 0;
-  tree->index = -1;
+  for(i = 0; i != COLOR_TABLE_SIZE; ++i) table->indices[i] = -1;
 }
 
-static void color_tree_cleanup(ColorTree* tree)
+/*the slot with the color, or the empty slot where it goes*/
+static unsigned color_table_slot(const ColorTable* table,
+                                 unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  int i;
-  for(i = 0; i != 16; ++i)
-  {
-    if(tree->children[i])
-    {
-      color_tree_cleanup(tree->children[i]);
-      lodepng_free(tree->children[i]);
-    }
-  }
+  unsigned color = ((unsigned)r << 24u) | ((unsigned)g << 16u) | ((unsigned)b << 8u) | (unsigned)a;
+  unsigned slot = ((color * 2654435761u) >> 16u) & (COLOR_TABLE_SIZE - 1);
+  while(table->indices[slot] >= 0 && table->colors[slot] != color) slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+  return slot;
 }
 
 /*returns -1 if color not present, its index otherwise*/
-static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+static int color_table_get(const ColorTable* table,
+                           unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  int bit = 0;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i]) return -1;
-    else tree = tree->children[i];
-  }
-  return tree ? tree->index : -1;
+  return table->indices[color_table_slot(table, r, g, b, a)];
 }
 
 #ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+static int color_table_has(const ColorTable* table,
+                           unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  return color_tree_get(tree, r, g, b, a) >= 0;
+  return color_table_get(table, r, g, b, a) >= 0;
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
-static void color_tree_add(ColorTree* tree,
-                           unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
+/*At most 257 colors can be added. If the color is already there, its index is replaced, so with duplicate colors
+in a palette the last one is found. Index should be >= 0 (it's signed to be compatible with using -1 for
+"doesn't exist")*/
+static void color_table_add(ColorTable* table,
+                            unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
 {
-  int bit;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i])
-    {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
+  unsigned slot = color_table_slot(table, r, g, b, a);
+  table->colors[slot] = ((unsigned)r << 24u) | ((unsigned)g << 16u) | ((unsigned)b << 8u) | (unsigned)a;
+  table->indices[slot] = (int)index;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
   if(mode->colortype == LCT_GREY)
@@ -3091,7 +4895,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
   }
   else if(mode->colortype == LCT_PALETTE)
   {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_table_get(table, r, g, b, a);
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -3451,84 +5255,370 @@ static void getPixelColorRGBA16(unsigned short* r, unsigned short* g, unsigned s
   }
 }
 
-unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
-                         const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
-                         unsigned w, unsigned h)
+#ifdef LODEPNG_COMPILE_SIMD
+#ifdef LODEPNG_SIMD_X86
+/*
+SIMD versions of the conversions of convertFast. Each converts the pixels from the start as far as whole
+vectors go and returns how many it did. highBytes takes the high byte of each 16-bit value and counts bytes.
+*/
+LODEPNG_TARGET("ssse3") static size_t rgbToRgba_ssse3(unsigned char* out, const unsigned char* in, size_t n)
 {
+  const __m128i alpha = _mm_set1_epi32(~0xffffff);
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  /*the last 4 pixels are loaded 4 bytes earlier, to not read past the 48 bytes of 16 pixels*/
+  const __m128i shuffle4 = _mm_setr_epi8(4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
   size_t i;
-  ColorTree tree;
-  size_t numpixels = w * h;
-  unsigned error = 0;
-
-  if(lodepng_color_mode_equal(mode_out, mode_in))
+  for(i = 0; i + 16 <= n; i += 16)
   {
-    size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
-    for(i = 0; i != numbytes; ++i) out[i] = in[i];
-    return 0;
+    const unsigned char* p = &in[i * 3];
+    __m128i* o = (__m128i*)&out[i * 4];
+    _mm_storeu_si128(o + 0, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), shuffle), alpha));
+    _mm_storeu_si128(o + 1, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shuffle),
+                                         alpha));
+    _mm_storeu_si128(o + 2, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 24)), shuffle),
+                                         alpha));
+    _mm_storeu_si128(o + 3, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), shuffle4),
+                                         alpha));
   }
+  return i;
+}
 
-  if(mode_out->colortype == LCT_PALETTE)
+LODEPNG_TARGET("ssse3") static size_t rgbaToRgb_ssse3(unsigned char* out, const unsigned char* in, size_t n)
+{
+  /*4 pixels become 12 bytes at the bottom of the vector, 4 such go in 3 vectors*/
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
   {
-    size_t palettesize = mode_out->palettesize;
-    const unsigned char* palette = mode_out->palette;
-    size_t palsize = (size_t)1u << mode_out->bitdepth;
-    /*if the user specified output palette but did not give the values, assume
-    they want the values of the input color type (assuming that one is palette).
-    Note that we never create a new palette ourselves.*/
-    if(palettesize == 0)
-    {
-      palettesize = mode_in->palettesize;
-      palette = mode_in->palette;
-      /*if the input was also palette with same bitdepth, then the color types are also
-      equal, so copy literally. This to preserve the exact indices that were in the PNG
-      even in case there are duplicate colors in the palette.*/
-      if (mode_in->colortype == LCT_PALETTE && mode_in->bitdepth == mode_out->bitdepth)
-      {
-        size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
-        for(i = 0; i != numbytes; ++i) out[i] = in[i];
-        return 0;
-      }
-    }
-    if(palettesize < palsize) palsize = palettesize;
-    color_tree_init(&tree);
-    for(i = 0; i != palsize; ++i)
-    {
-      const unsigned char* p = &palette[i * 4];
-      color_tree_add(&tree, p[0], p[1], p[2], p[3], (unsigned)i);
-    }
+    const __m128i* p = (const __m128i*)&in[i * 4];
+    __m128i* o = (__m128i*)&out[i * 3];
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(p + 0), shuffle);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), shuffle);
+    __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), shuffle);
+    __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), shuffle);
+    _mm_storeu_si128(o + 0, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+    _mm_storeu_si128(o + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+    _mm_storeu_si128(o + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
   }
+  return i;
+}
 
-  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
+LODEPNG_TARGET("ssse3") static size_t greyToRgba_ssse3(unsigned char* out, const unsigned char* in, size_t n)
+{
+  const __m128i alpha = _mm_set1_epi32(~0xffffff);
+  const __m128i shuffle0 = _mm_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1);
+  const __m128i shuffle1 = _mm_setr_epi8(4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1);
+  const __m128i shuffle2 = _mm_setr_epi8(8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1);
+  const __m128i shuffle3 = _mm_setr_epi8(12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
   {
-    for(i = 0; i != numpixels; ++i)
-    {
-      unsigned short r = 0, g = 0, b = 0, a = 0;
-      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
-      rgba16ToPixel(out, i, mode_out, r, g, b, a);
-    }
+    __m128i v = _mm_loadu_si128((const __m128i*)&in[i]);
+    __m128i* o = (__m128i*)&out[i * 4];
+    _mm_storeu_si128(o + 0, _mm_or_si128(_mm_shuffle_epi8(v, shuffle0), alpha));
+    _mm_storeu_si128(o + 1, _mm_or_si128(_mm_shuffle_epi8(v, shuffle1), alpha));
+    _mm_storeu_si128(o + 2, _mm_or_si128(_mm_shuffle_epi8(v, shuffle2), alpha));
+    _mm_storeu_si128(o + 3, _mm_or_si128(_mm_shuffle_epi8(v, shuffle3), alpha));
   }
-  else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA)
+  return i;
+}
+
+LODEPNG_TARGET("ssse3") static size_t greyAlphaToRgba_ssse3(unsigned char* out, const unsigned char* in, size_t n)
+{
+  const __m128i low = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+  const __m128i high = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13, 14, 14, 14, 15);
+  size_t i;
+  for(i = 0; i + 8 <= n; i += 8)
   {
-    getPixelColorsRGBA8(out, numpixels, 1, in, mode_in);
+    __m128i v = _mm_loadu_si128((const __m128i*)&in[i * 2]);
+    _mm_storeu_si128((__m128i*)&out[i * 4], _mm_shuffle_epi8(v, low));
+    _mm_storeu_si128((__m128i*)&out[i * 4 + 16], _mm_shuffle_epi8(v, high));
   }
-  else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB)
+  return i;
+}
+
+LODEPNG_TARGET("sse2") static size_t highBytes_sse2(unsigned char* out, const unsigned char* in, size_t n)
+{
+  /*the values are big endian, so the high byte is the low one of each little endian 16-bit lane*/
+  const __m128i mask = _mm_set1_epi16(255);
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
   {
-    getPixelColorsRGBA8(out, numpixels, 0, in, mode_in);
+    __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[i * 2]), mask);
+    __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)&in[i * 2 + 16]), mask);
+    _mm_storeu_si128((__m128i*)&out[i], _mm_packus_epi16(a, b));
   }
-  else
+  return i;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*NEON versions of the conversions of convertFast, see the x86 ones*/
+static size_t rgbToRgba_neon(unsigned char* out, const unsigned char* in, size_t n)
+{
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
   {
-    unsigned char r = 0, g = 0, b = 0, a = 0;
-    for(i = 0; i != numpixels; ++i)
-    {
-      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-      error = rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
-      if (error) break;
-    }
+    uint8x16x3_t v = vld3q_u8(&in[i * 3]);
+    uint8x16x4_t o;
+    o.val[0] = v.val[0];
+    o.val[1] = v.val[1];
+    o.val[2] = v.val[2];
+    o.val[3] = vdupq_n_u8(255);
+    vst4q_u8(&out[i * 4], o);
   }
+  return i;
+}
 
-  if(mode_out->colortype == LCT_PALETTE)
+static size_t rgbaToRgb_neon(unsigned char* out, const unsigned char* in, size_t n)
+{
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
   {
-    color_tree_cleanup(&tree);
+    uint8x16x4_t v = vld4q_u8(&in[i * 4]);
+    uint8x16x3_t o;
+    o.val[0] = v.val[0];
+    o.val[1] = v.val[1];
+    o.val[2] = v.val[2];
+    vst3q_u8(&out[i * 3], o);
+  }
+  return i;
+}
+
+static size_t greyToRgba_neon(unsigned char* out, const unsigned char* in, size_t n)
+{
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
+  {
+    uint8x16x4_t o;
+    o.val[0] = o.val[1] = o.val[2] = vld1q_u8(&in[i]);
+    o.val[3] = vdupq_n_u8(255);
+    vst4q_u8(&out[i * 4], o);
+  }
+  return i;
+}
+
+static size_t greyAlphaToRgba_neon(unsigned char* out, const unsigned char* in, size_t n)
+{
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16)
+  {
+    uint8x16x2_t v = vld2q_u8(&in[i * 2]);
+    uint8x16x4_t o;
+    o.val[0] = o.val[1] = o.val[2] = v.val[0];
+    o.val[3] = v.val[1];
+    vst4q_u8(&out[i * 4], o);
+  }
+  return i;
+}
+
+static size_t highBytes_neon(unsigned char* out, const unsigned char* in, size_t n)
+{
+  size_t i;
+  for(i = 0; i + 16 <= n; i += 16) vst1q_u8(&out[i], vld2q_u8(&in[i * 2]).val[0]);
+  return i;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*how many pixels, or bytes for 16 to 8 bit, of a conversion of convertFast were done with SIMD*/
+static size_t convertSIMD(unsigned char* out, const unsigned char* in, LodePNGColorType type_in,
+                          unsigned bitdepth_in, size_t n)
+{
+  unsigned features = lodepng_get_cpu_features();
+#if defined(LODEPNG_SIMD_X86)
+  if(bitdepth_in == 16) return (features & LODEPNG_CPU_SSE2) ? highBytes_sse2(out, in, n) : 0;
+  if(!(features & LODEPNG_CPU_SSSE3)) return 0;
+  if(type_in == LCT_RGB) return rgbToRgba_ssse3(out, in, n);
+  if(type_in == LCT_RGBA) return rgbaToRgb_ssse3(out, in, n);
+  if(type_in == LCT_GREY) return greyToRgba_ssse3(out, in, n);
+  if(type_in == LCT_GREY_ALPHA) return greyAlphaToRgba_ssse3(out, in, n);
+  return 0;
+#elif defined(LODEPNG_SIMD_NEON)
+  if(!(features & LODEPNG_CPU_NEON)) return 0;
+  if(bitdepth_in == 16) return highBytes_neon(out, in, n);
+  if(type_in == LCT_RGB) return rgbToRgba_neon(out, in, n);
+  if(type_in == LCT_RGBA) return rgbaToRgb_neon(out, in, n);
+  if(type_in == LCT_GREY) return greyToRgba_neon(out, in, n);
+  if(type_in == LCT_GREY_ALPHA) return greyAlphaToRgba_neon(out, in, n);
+  return 0;
+#else /*no SIMD code for this target*/
+  (void)out; (void)in; (void)type_in; (void)bitdepth_in; (void)n; (void)features;
+  return 0;
+#endif
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+/*
+The common conversions of whole images, chosen once rather than per pixel: 8-bit RGB, grey and grey with
+alpha to RGBA, RGBA to RGB, palette to RGBA through a table of its colors, and 16 to 8 bit of the same color
+type. Returns 0 for any other conversion, or if a color key of the input would give transparent pixels.
+*/
+static unsigned convertFast(unsigned char* out, const unsigned char* in,
+                            const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in, size_t numpixels)
+{
+  LodePNGColorType type_in = mode_in->colortype, type_out = mode_out->colortype;
+  size_t i = 0;
+
+  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 8 && type_in == type_out)
+  {
+    size_t numbytes = numpixels * (lodepng_get_bpp(mode_out) / 8);
+#ifdef LODEPNG_COMPILE_SIMD
+    i = convertSIMD(out, in, type_in, 16, numbytes);
+#endif /*LODEPNG_COMPILE_SIMD*/
+    for(; i < numbytes; ++i) out[i] = in[i * 2];
+    return 1;
+  }
+  if(mode_out->bitdepth != 8) return 0;
+
+  if(type_in == LCT_PALETTE && type_out == LCT_RGBA)
+  {
+    /*like getPixelColorsRGBA8, indices past the palette are black*/
+    unsigned char colors[1024];
+    unsigned bits = mode_in->bitdepth, mask = (1u << bits) - 1u;
+    for(i = 0; i != 256; ++i)
+    {
+      if(i < mode_in->palettesize) memcpy(&colors[i * 4], &mode_in->palette[i * 4], 4);
+      else
+      {
+        colors[i * 4 + 0] = colors[i * 4 + 1] = colors[i * 4 + 2] = 0;
+        colors[i * 4 + 3] = 255;
+      }
+    }
+    if(bits == 8) for(i = 0; i != numpixels; ++i) memcpy(&out[i * 4], &colors[in[i] * 4], 4);
+    else
+    {
+      for(i = 0; i != numpixels; ++i)
+      {
+        size_t bit = i * bits;
+        unsigned index = (in[bit >> 3] >> (8 - bits - (bit & 7))) & mask;
+        memcpy(&out[i * 4], &colors[index * 4], 4);
+      }
+    }
+    return 1;
+  }
+
+  if(mode_in->bitdepth != 8) return 0;
+  if(mode_in->key_defined && (type_in == LCT_GREY || type_in == LCT_RGB)) return 0;
+  if(!(type_out == LCT_RGBA && (type_in == LCT_RGB || type_in == LCT_GREY || type_in == LCT_GREY_ALPHA))
+     && !(type_out == LCT_RGB && type_in == LCT_RGBA)) return 0;
+
+#ifdef LODEPNG_COMPILE_SIMD
+  i = convertSIMD(out, in, type_in, 8, numpixels);
+#endif /*LODEPNG_COMPILE_SIMD*/
+  /*one loop per conversion, chosen once rather than for each pixel*/
+  if(type_in == LCT_RGB)
+  {
+    for(; i < numpixels; ++i)
+    {
+      out[i * 4 + 0] = in[i * 3 + 0];
+      out[i * 4 + 1] = in[i * 3 + 1];
+      out[i * 4 + 2] = in[i * 3 + 2];
+      out[i * 4 + 3] = 255;
+    }
+  }
+  else if(type_in == LCT_RGBA)
+  {
+    for(; i < numpixels; ++i)
+    {
+      out[i * 3 + 0] = in[i * 4 + 0];
+      out[i * 3 + 1] = in[i * 4 + 1];
+      out[i * 3 + 2] = in[i * 4 + 2];
+    }
+  }
+  else if(type_in == LCT_GREY)
+  {
+    for(; i < numpixels; ++i)
+    {
+      out[i * 4 + 0] = out[i * 4 + 1] = out[i * 4 + 2] = in[i];
+      out[i * 4 + 3] = 255;
+    }
+  }
+  else
+  {
+    for(; i < numpixels; ++i)
+    {
+      out[i * 4 + 0] = out[i * 4 + 1] = out[i * 4 + 2] = in[i * 2 + 0];
+      out[i * 4 + 3] = in[i * 2 + 1];
+    }
+  }
+  return 1;
+}
+
+unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
+                         const LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                         unsigned w, unsigned h)
+{
+  size_t i;
+  ColorTable table;
+  size_t numpixels = w * h;
+  unsigned error = 0;
+
+  if(lodepng_color_mode_equal(mode_out, mode_in))
+  {
+    size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
+    for(i = 0; i != numbytes; ++i) out[i] = in[i];
+    return 0;
+  }
+
+  if(convertFast(out, in, mode_out, mode_in, numpixels)) return 0;
+
+  if(mode_out->colortype == LCT_PALETTE)
+  {
+    size_t palettesize = mode_out->palettesize;
+    const unsigned char* palette = mode_out->palette;
+    size_t palsize = (size_t)1u << mode_out->bitdepth;
+    /*if the user specified output palette but did not give the values, assume
+    they want the values of the input color type (assuming that one is palette).
+    Note that we never create a new palette ourselves.*/
+    if(palettesize == 0)
+    {
+      palettesize = mode_in->palettesize;
+      palette = mode_in->palette;
+      /*if the input was also palette with same bitdepth, then the color types are also
+      equal, so copy literally. This to preserve the exact indices that were in the PNG
+      even in case there are duplicate colors in the palette.*/
+      if (mode_in->colortype == LCT_PALETTE && mode_in->bitdepth == mode_out->bitdepth)
+      {
+        size_t numbytes = lodepng_get_raw_size(w, h, mode_in);
+        for(i = 0; i != numbytes; ++i) out[i] = in[i];
+        return 0;
+      }
+    }
+    if(palettesize < palsize) palsize = palettesize;
+    color_table_init(&table);
+    for(i = 0; i != palsize; ++i)
+    {
+      const unsigned char* p = &palette[i * 4];
+      color_table_add(&table, p[0], p[1], p[2], p[3], (unsigned)i);
+    }
+  }
+
+  if(mode_in->bitdepth == 16 && mode_out->bitdepth == 16)
+  {
+    for(i = 0; i != numpixels; ++i)
+    {
+      unsigned short r = 0, g = 0, b = 0, a = 0;
+      getPixelColorRGBA16(&r, &g, &b, &a, in, i, mode_in);
+      rgba16ToPixel(out, i, mode_out, r, g, b, a);
+    }
+  }
+  else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGBA)
+  {
+    getPixelColorsRGBA8(out, numpixels, 1, in, mode_in);
+  }
+  else if(mode_out->bitdepth == 8 && mode_out->colortype == LCT_RGB)
+  {
+    getPixelColorsRGBA8(out, numpixels, 0, in, mode_in);
+  }
+  else
+  {
+    unsigned char r = 0, g = 0, b = 0, a = 0;
+    for(i = 0; i != numpixels; ++i)
+    {
+      getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
+      error = rgba8ToPixel(out, i, mode_out, &table, r, g, b, a);
+      if (error) break;
+    }
   }
 
   return error;
@@ -3568,6 +5658,121 @@ static unsigned getValueRequiredBits(unsigned char value)
   return 8;
 }
 
+#define PROFILE_COLORED 1u /*a pixel with R, G and B not all equal*/
+#define PROFILE_ALPHA 2u /*a pixel with alpha other than 255*/
+#define PROFILE_BITS 4u /*a pixel with R, the grey value, needing more bits than given*/
+
+/*lodepng_get_color_profile first looks at about this many pixels spread over images with over 16 times more*/
+#define PROFILE_SAMPLES 4096
+
+#ifdef LODEPNG_COMPILE_SIMD
+#ifdef LODEPNG_SIMD_X86
+/*the movemask bits of the bytes of the given channel in the 16-byte chunk of a block of 16 pixels*/
+static unsigned profileChannelMask(unsigned channels, unsigned chunk, unsigned channel)
+{
+  static const unsigned masks3[3] = {0x9249u, 0x2492u, 0x4924u}; /*the bytes j with j % 3 == 0, 1, 2*/
+  if(channels == 3) return masks3[(channel + 3 - chunk) % 3]; /*chunk k starts at byte 16 * k, 16 % 3 == 1*/
+  return channels == 1 ? 0xffffu : (channels == 2 ? 0x5555u : 0x1111u) << channel;
+}
+
+/*
+The PROFILE_ flags of 16 pixels of 8 bits per channel. The bytes are compared with the next ones for the grey
+test, and rotated by the bit depth for the bits test: a value needs no more than 1, 2 or 4 bits if it's that
+many bits repeated. Reads one byte past the pixels.
+*/
+LODEPNG_TARGET("sse2") static unsigned profileBlock_sse2(const unsigned char* in, unsigned channels, unsigned bits)
+{
+  const __m128i ones = _mm_set1_epi8(-1);
+  const __m128i count = _mm_cvtsi32_si128((int)bits), count2 = _mm_cvtsi32_si128(8 - (int)bits);
+  const __m128i high = _mm_set1_epi8((char)(255u << bits)), low = _mm_set1_epi8((char)(255u >> (8 - bits)));
+  unsigned found = 0, k;
+  for(k = 0; k != channels; ++k)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&in[k * 16]);
+    if(channels >= 3)
+    {
+      unsigned equal = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i*)&in[k * 16 + 1])));
+      unsigned mask = profileChannelMask(channels, k, 0) | profileChannelMask(channels, k, 1);
+      if((equal & mask) != mask) found |= PROFILE_COLORED;
+    }
+    if(channels == 2 || channels == 4)
+    {
+      unsigned opaque = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones));
+      unsigned mask = profileChannelMask(channels, k, channels - 1);
+      if((opaque & mask) != mask) found |= PROFILE_ALPHA;
+    }
+    if(bits < 8)
+    {
+      __m128i rotated = _mm_or_si128(_mm_and_si128(_mm_sll_epi16(v, count), high),
+                                     _mm_and_si128(_mm_srl_epi16(v, count2), low));
+      unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, rotated));
+      unsigned mask = profileChannelMask(channels, k, 0);
+      if((same & mask) != mask) found |= PROFILE_BITS;
+    }
+  }
+  return found;
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static unsigned anyNonZero_neon(uint8x16_t v)
+{
+  uint8x8_t m = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+  return vget_lane_u64(vreinterpret_u64_u8(m), 0) != 0;
+}
+
+/*NEON version of profileBlock_sse2, with the channels loaded apart*/
+static unsigned profileBlock_neon(const unsigned char* in, unsigned channels, unsigned bits)
+{
+  uint8x16_t r, g, b, a;
+  unsigned found = 0;
+  if(channels == 4)
+  {
+    uint8x16x4_t v = vld4q_u8(in);
+    r = v.val[0]; g = v.val[1]; b = v.val[2]; a = v.val[3];
+  }
+  else if(channels == 3)
+  {
+    uint8x16x3_t v = vld3q_u8(in);
+    r = v.val[0]; g = v.val[1]; b = v.val[2]; a = vdupq_n_u8(255);
+  }
+  else if(channels == 2)
+  {
+    uint8x16x2_t v = vld2q_u8(in);
+    r = g = b = v.val[0]; a = v.val[1];
+  }
+  else
+  {
+    r = g = b = vld1q_u8(in);
+    a = vdupq_n_u8(255);
+  }
+  if(anyNonZero_neon(vorrq_u8(veorq_u8(r, g), veorq_u8(r, b)))) found |= PROFILE_COLORED;
+  if(anyNonZero_neon(vmvnq_u8(a))) found |= PROFILE_ALPHA;
+  if(bits < 8)
+  {
+    uint8x16_t rotated = vorrq_u8(vshlq_u8(r, vdupq_n_s8((signed char)bits)),
+                                  vshlq_u8(r, vdupq_n_s8((signed char)((int)bits - 8))));
+    if(anyNonZero_neon(veorq_u8(r, rotated))) found |= PROFILE_BITS;
+  }
+  return found;
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*The PROFILE_ flags of 16 pixels of 8 bits per channel, or all flags if there's no SIMD code for this CPU.
+Bits is what the grey values are tested against, 8 to not test them. Can read one byte past the pixels.*/
+static unsigned profileBlockSIMD(const unsigned char* in, unsigned channels, unsigned bits)
+{
+  unsigned features = lodepng_get_cpu_features();
+#if defined(LODEPNG_SIMD_X86)
+  if(features & LODEPNG_CPU_SSE2) return profileBlock_sse2(in, channels, bits);
+#elif defined(LODEPNG_SIMD_NEON)
+  if(features & LODEPNG_CPU_NEON) return profileBlock_neon(in, channels, bits);
+#endif
+  (void)in; (void)channels; (void)bits; (void)features;
+  return PROFILE_COLORED | PROFILE_ALPHA | PROFILE_BITS;
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 /*profile must already have been inited with mode.
 It's ok to set some parameters of profile to done already.*/
 unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
@@ -3576,7 +5781,7 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 {
   unsigned error = 0;
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = w * h;
 
   unsigned colored_done = lodepng_is_greyscale_type(mode) ? 1 : 0;
@@ -3588,7 +5793,7 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
   unsigned sixteen = 0;
   if(bpp <= 8) maxnumcolors = bpp == 1 ? 2 : (bpp == 2 ? 4 : (bpp == 4 ? 16 : 256));
 
-  color_tree_init(&tree);
+  color_table_init(&table);
 
   /*Check if the 16-bit input is truly 16-bit*/
   if(mode->bitdepth == 16)
@@ -3667,8 +5872,73 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
   else /* < 16-bit */
   {
     unsigned char r = 0, g = 0, b = 0, a = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+    /*pixels of 8 bits per channel can be checked 16 at a time once the colors are counted*/
+    unsigned blocks = mode->bitdepth == 8 && mode->colortype != LCT_PALETTE;
+    unsigned channels = lodepng_get_channels(mode);
+    size_t nextblock = 0;
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+    /*
+    On large images, first look at a sample of pixels spread over the image: it often already finds that the
+    image is colored, translucent or has more than 256 colors, so that the full pass below has less to check
+    and can skip blocks of pixels. Only what a single pixel decides on its own is taken from the sample, so
+    the profile is the same as without it. The palette and color key depend on the order of the pixels, so
+    the colors are only counted to know there are too many for a palette.
+    */
+    if(numpixels >= (size_t)PROFILE_SAMPLES * 16)
+    {
+      size_t step = numpixels / PROFILE_SAMPLES;
+      unsigned numsamplecolors = 0;
+      for(i = step / 2; i < numpixels; i += step)
+      {
+        getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode);
+        if(profile->bits < 8)
+        {
+          unsigned bits = getValueRequiredBits(r);
+          if(bits > profile->bits) profile->bits = bits;
+        }
+        if(!colored_done && (r != g || r != b))
+        {
+          profile->colored = 1;
+          colored_done = 1;
+          if(profile->bits < 8) profile->bits = 8; /*PNG has no colored modes with less than 8-bit per channel*/
+        }
+        if(!alpha_done && a != 255 && a != 0)
+        {
+          profile->alpha = 1;
+          profile->key = 0;
+          alpha_done = 1;
+          if(profile->bits < 8) profile->bits = 8; /*PNG has no alphachannel modes with less than 8-bit per channel*/
+        }
+        if(maxnumcolors == 257 && !numcolors_done && !color_table_has(&table, r, g, b, a))
+        {
+          color_table_add(&table, r, g, b, a, numsamplecolors);
+          numcolors_done = ++numsamplecolors == maxnumcolors;
+        }
+      }
+      if(numcolors_done && profile->numcolors < maxnumcolors) profile->numcolors = maxnumcolors;
+      else color_table_init(&table); /*the full pass counts the colors in order*/
+    }
+
     for(i = 0; i != numpixels; ++i)
     {
+#ifdef LODEPNG_COMPILE_SIMD
+      if(blocks && numcolors_done && i >= nextblock && i + 16 < numpixels)
+      {
+        nextblock = i + 16;
+        if(alpha_done || (!profile->key && !mode->key_defined))
+        {
+          unsigned needed = (colored_done ? 0 : PROFILE_COLORED) | (alpha_done ? 0 : PROFILE_ALPHA)
+                          | (bits_done ? 0 : PROFILE_BITS);
+          if(!(profileBlockSIMD(&in[i * channels], channels, bits_done ? 8 : profile->bits) & needed))
+          {
+            i += 15; /*nothing in these pixels changes the profile*/
+            continue;
+          }
+        }
+      }
+#endif /*LODEPNG_COMPILE_SIMD*/
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode);
 
       if(!bits_done && profile->bits < 8)
@@ -3677,7 +5947,8 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
         unsigned bits = getValueRequiredBits(r);
         if(bits > profile->bits) profile->bits = bits;
       }
-      bits_done = (profile->bits >= bpp);
+      /*the profile can't go above 8 bits here, once there the bits are done*/
+      bits_done = (profile->bits >= bpp || profile->bits >= 8);
 
       if(!colored_done && (r != g || r != b))
       {
@@ -3715,9 +5986,9 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
       if(!numcolors_done)
       {
-        if(!color_tree_has(&tree, r, g, b, a))
+        if(!color_table_has(&table, r, g, b, a))
         {
-          color_tree_add(&tree, r, g, b, a, profile->numcolors);
+          color_table_add(&table, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3757,7 +6028,6 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
     profile->key_b += (profile->key_b << 8);
   }
 
-  color_tree_cleanup(&tree);
   return error;
 }
 
@@ -3831,83 +6101,470 @@ unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
   return error;
 }
 
-#endif /* #ifdef LODEPNG_COMPILE_ENCODER */
+/*the pixels that the median cut and k-means of quantizeImage look at, spread over the image*/
+#define QUANTIZE_SAMPLES 65536
+/*how many times k-means moves the colors to the mean of the samples nearest to them*/
+#define QUANTIZE_ITERATIONS 4
+/*size of the cache of the palette index of recently mapped colors*/
+#define QUANTIZE_CACHE 4096
 
 /*
-Paeth predicter, used by PNG filter type 4
-The parameters are of type short, but should come from unsigned chars, the shorts
-are only needed to make the paeth calculation correct.
+The palette colors as searched by nearestColor: R with G and B with A as pairs of 16-bit values, so that the
+SIMD code can square and sum them with one multiply-add. The colors are padded to a multiple of 4 with copies
+of the last one, which never win over it.
 */
-static unsigned char paethPredictor(short a, short b, short c)
+typedef struct QuantizePalette
 {
-  short pa = abs(b - c);
-  short pb = abs(a - c);
-  short pc = abs(a + b - c - c);
-
-  if(pc < pa && pc < pb) return (unsigned char)c;
-  else if(pb < pa) return (unsigned char)b;
-  else return (unsigned char)a;
-}
-
-/*shared values used by multiple Adam7 related functions*/
-
-static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
-static const unsigned ADAM7_IY[7] = { 0, 0, 4, 0, 2, 0, 1 }; /*y start values*/
-static const unsigned ADAM7_DX[7] = { 8, 8, 4, 4, 2, 2, 1 }; /*x delta values*/
-static const unsigned ADAM7_DY[7] = { 8, 8, 8, 4, 4, 2, 2 }; /*y delta values*/
+  short rg[512];
+  short ba[512];
+  unsigned size; /*number of colors, without the padding*/
+} QuantizePalette;
 
-/*
-Outputs various dimensions and positions in the image related to the Adam7 reduced images.
-passw: output containing the width of the 7 passes
-passh: output containing the height of the 7 passes
-filter_passstart: output containing the index of the start and end of each
- reduced image with filter bytes
-padded_passstart output containing the index of the start and end of each
- reduced image when without filter bytes but with padded scanlines
-passstart: output containing the index of the start and end of each reduced
- image without padding between scanlines, but still padding between the images
-w, h: width and height of non-interlaced image
-bpp: bits per pixel
-"padded" is only relevant if bpp is less than 8 and a scanline or image does not
- end at a full byte
-*/
-static void Adam7_getpassvalues(unsigned passw[7], unsigned passh[7], size_t filter_passstart[8],
-                                size_t padded_passstart[8], size_t passstart[8], unsigned w, unsigned h, unsigned bpp)
+static void quantize_palette_set(QuantizePalette* palette, const unsigned char* colors, unsigned size)
 {
-  /*the passstart values have 8 values: the 8th one indicates the byte after the end of the 7th (= last) pass*/
   unsigned i;
-
-  /*calculate width and height in pixels of each pass*/
-  for(i = 0; i != 7; ++i)
+  for(i = 0; i != (size + 3u) / 4u * 4u; ++i)
   {
-    passw[i] = (w + ADAM7_DX[i] - ADAM7_IX[i] - 1) / ADAM7_DX[i];
-    passh[i] = (h + ADAM7_DY[i] - ADAM7_IY[i] - 1) / ADAM7_DY[i];
-    if(passw[i] == 0) passh[i] = 0;
-    if(passh[i] == 0) passw[i] = 0;
+    const unsigned char* c = &colors[(i < size ? i : size - 1) * 4];
+    palette->rg[i * 2 + 0] = c[0];
+    palette->rg[i * 2 + 1] = c[1];
+    palette->ba[i * 2 + 0] = c[2];
+    palette->ba[i * 2 + 1] = c[3];
   }
+  palette->size = size;
+}
 
-  filter_passstart[0] = padded_passstart[0] = passstart[0] = 0;
-  for(i = 0; i != 7; ++i)
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+/*the SIMD versions of nearestColor compare 4 colors at a time, this picks the best of the 4 lanes*/
+static unsigned nearestLane(const int* distances, const unsigned* indices)
+{
+  unsigned i, best = 0;
+  for(i = 1; i != 4; ++i)
   {
-    /*if passw[i] is 0, it's 0 bytes, not 1 (no filtertype-byte)*/
-    filter_passstart[i + 1] = filter_passstart[i]
-                            + ((passw[i] && passh[i]) ? passh[i] * (1 + (passw[i] * bpp + 7) / 8) : 0);
-    /*bits padded if needed to fill full byte at end of each scanline*/
-    padded_passstart[i + 1] = padded_passstart[i] + passh[i] * ((passw[i] * bpp + 7) / 8);
-    /*only padded at end of reduced image*/
-    passstart[i + 1] = passstart[i] + (passh[i] * passw[i] * bpp + 7) / 8;
+    if(distances[i] < distances[best] || (distances[i] == distances[best] && indices[i] < indices[best])) best = i;
   }
+  return indices[best];
 }
+#endif /*LODEPNG_SIMD_X86 || LODEPNG_SIMD_NEON*/
 
-#ifdef LODEPNG_COMPILE_DECODER
+#ifdef LODEPNG_SIMD_X86
+LODEPNG_TARGET("sse2") static unsigned nearestColor_sse2(const QuantizePalette* palette,
+                                                         int r, int g, int b, int a)
+{
+  const __m128i prg = _mm_set1_epi32(r | (g << 16)), pba = _mm_set1_epi32(b | (a << 16));
+  const __m128i four = _mm_set1_epi32(4);
+  __m128i best = _mm_set1_epi32(0x7fffffff), bestindex = _mm_setzero_si128(), index = _mm_setr_epi32(0, 1, 2, 3);
+  int distances[4];
+  unsigned indices[4], i;
+  for(i = 0; i < palette->size; i += 4)
+  {
+    __m128i drg = _mm_sub_epi16(prg, _mm_loadu_si128((const __m128i*)&palette->rg[i * 2]));
+    __m128i dba = _mm_sub_epi16(pba, _mm_loadu_si128((const __m128i*)&palette->ba[i * 2]));
+    __m128i d = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(dba, dba));
+    __m128i less = _mm_cmplt_epi32(d, best);
+    best = _mm_or_si128(_mm_and_si128(less, d), _mm_andnot_si128(less, best));
+    bestindex = _mm_or_si128(_mm_and_si128(less, index), _mm_andnot_si128(less, bestindex));
+    index = _mm_add_epi32(index, four);
+  }
+  _mm_storeu_si128((__m128i*)distances, best);
+  _mm_storeu_si128((__m128i*)indices, bestindex);
+  return nearestLane(distances, indices);
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static unsigned nearestColor_neon(const QuantizePalette* palette, int r, int g, int b, int a)
+{
+  const int16x4_t pr = vdup_n_s16((short)r), pg = vdup_n_s16((short)g);
+  const int16x4_t pb = vdup_n_s16((short)b), pa = vdup_n_s16((short)a);
+  int32x4_t best = vdupq_n_s32(0x7fffffff);
+  uint32x4_t bestindex = vdupq_n_u32(0);
+  static const unsigned start[4] = {0, 1, 2, 3};
+  uint32x4_t index = vld1q_u32(start);
+  int distances[4];
+  unsigned indices[4], i;
+  for(i = 0; i < palette->size; i += 4)
+  {
+    int16x4x2_t rg = vld2_s16(&palette->rg[i * 2]), ba = vld2_s16(&palette->ba[i * 2]);
+    int16x4_t dr = vsub_s16(pr, rg.val[0]), dg = vsub_s16(pg, rg.val[1]);
+    int16x4_t db = vsub_s16(pb, ba.val[0]), da = vsub_s16(pa, ba.val[1]);
+    int32x4_t d = vmlal_s16(vmlal_s16(vmlal_s16(vmull_s16(dr, dr), dg, dg), db, db), da, da);
+    uint32x4_t less = vcltq_s32(d, best);
+    best = vbslq_s32(less, d, best);
+    bestindex = vbslq_u32(less, index, bestindex);
+    index = vaddq_u32(index, vdupq_n_u32(4));
+  }
+  vst1q_s32(distances, best);
+  vst1q_u32(indices, bestindex);
+  return nearestLane(distances, indices);
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*index of the palette color with the smallest squared distance to the color, the first of equally near ones*/
+static unsigned nearestColor(const QuantizePalette* palette, int r, int g, int b, int a)
+{
+  unsigned i, best = 0;
+  int bestdistance = 0x7fffffff;
+  for(i = 0; i != palette->size; ++i)
+  {
+    int dr = r - palette->rg[i * 2 + 0], dg = g - palette->rg[i * 2 + 1];
+    int db = b - palette->ba[i * 2 + 0], da = a - palette->ba[i * 2 + 1];
+    int d = dr * dr + dg * dg + db * db + da * da;
+    if(d < bestdistance)
+    {
+      bestdistance = d;
+      best = i;
+    }
+  }
+  return best;
+}
+
+typedef unsigned (*NearestColorFunction)(const QuantizePalette* palette, int r, int g, int b, int a);
+
+/*the version of nearestColor for this CPU, chosen once per image as it's called for every sample and pixel*/
+static NearestColorFunction chooseNearestColor(void)
+{
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned features = lodepng_get_cpu_features();
+#if defined(LODEPNG_SIMD_X86)
+  if(features & LODEPNG_CPU_SSE2) return nearestColor_sse2;
+#elif defined(LODEPNG_SIMD_NEON)
+  if(features & LODEPNG_CPU_NEON) return nearestColor_neon;
+#endif
+  (void)features;
+#endif /*LODEPNG_COMPILE_SIMD*/
+  return nearestColor;
+}
+
+/*the widest channel (0-3 for R-A, as bytes 3-0 of the packed colors) of samples[start, end) and its range*/
+static unsigned quantize_widest(unsigned* channel, const unsigned* samples, size_t start, size_t end)
+{
+  unsigned c, lo[4] = {255, 255, 255, 255}, hi[4] = {0, 0, 0, 0}, best = 0;
+  size_t i;
+  for(i = start; i != end; ++i)
+  {
+    for(c = 0; c != 4; ++c)
+    {
+      unsigned v = (samples[i] >> (24 - c * 8)) & 255u;
+      if(v < lo[c]) lo[c] = v;
+      if(v > hi[c]) hi[c] = v;
+    }
+  }
+  *channel = 0;
+  for(c = 0; c != 4; ++c)
+  {
+    if(hi[c] >= lo[c] && hi[c] - lo[c] > best)
+    {
+      best = hi[c] - lo[c];
+      *channel = c;
+    }
+  }
+  return best;
+}
+
+/*a hash of the grid cell (x, y) of quantizeImage, which picks the pixel of the cell that is sampled*/
+static unsigned quantize_cellHash(size_t x, size_t y)
+{
+  unsigned v = (unsigned)((x * 73856093u) ^ (y * 19349663u)) & 0xffffffffu;
+  v ^= v >> 15u;
+  v = (v * 2654435761u) & 0xffffffffu;
+  return v ^ (v >> 13u);
+}
+
+/*
+Chooses a palette of at most maxcolors colors for the RGBA8 image, and writes for each pixel the index of its
+color in out. Median cut splits the box of samples with the largest range times count at the median of its
+widest channel until there are maxcolors boxes, their means are the first palette, and k-means refines it.
+*/
+static unsigned quantizeImage(unsigned char* out, unsigned char* palette, unsigned* palettesize,
+                              const unsigned char* image, unsigned w, unsigned h,
+                              unsigned maxcolors, unsigned dither)
+{
+  size_t numpixels = (size_t)w * h, numsamples, step, i, boxstart[257], x, y;
+  unsigned numboxes = 1, boxrange[256], boxchannel[256], b, c, iteration;
+  unsigned* samples; /*the sampled colors packed as RGBA with R in the high byte, then the same for sorting*/
+  unsigned* cachecolor;
+  short* cacheindex;
+  int* errors; /*the dithering errors of the current and the next row, times 16*/
+  size_t sums[256 * 4], counts[256];
+  QuantizePalette search;
+  NearestColorFunction nearest = chooseNearestColor();
+
+  if(maxcolors > 256) maxcolors = 256;
+  if(maxcolors == 0 || numpixels == 0) return 0;
+  /*one sample in each step x step cell of the image, at a place in the cell that a hash of the cell chooses.
+  Samples at the same place in each cell, or at a fixed distance in memory order, would keep hitting or missing
+  the same columns and rows of a pattern whose period divides step*/
+  step = 1;
+  while((step + 1) * (step + 1) * QUANTIZE_SAMPLES <= numpixels) ++step;
+  while(((w + step - 1) / step) * ((h + step - 1) / step) > QUANTIZE_SAMPLES) ++step;
+  numsamples = ((w + step - 1) / step) * ((h + step - 1) / step);
+  samples = (unsigned*)lodepng_malloc(numsamples * 2 * sizeof(unsigned) + QUANTIZE_CACHE * sizeof(unsigned)
+                                      + QUANTIZE_CACHE * sizeof(short) + ((size_t)w + 2) * 8 * sizeof(int));
+  if(!samples) return 83; /*alloc fail*/
+  cachecolor = samples + numsamples * 2;
+  errors = (int*)(cachecolor + QUANTIZE_CACHE);
+  cacheindex = (short*)(errors + ((size_t)w + 2) * 8);
+
+  i = 0;
+  for(y = 0; y < h; y += step)
+  {
+    for(x = 0; x < w; x += step)
+    {
+      size_t cellw = w - x < step ? w - x : step, cellh = h - y < step ? h - y : step;
+      unsigned v = quantize_cellHash(x / step, y / step);
+      const unsigned char* p = &image[((y + (v >> 16u) % cellh) * w + x + (v & 0xffffu) % cellw) * 4];
+      samples[i++] = ((unsigned)p[0] << 24u) | ((unsigned)p[1] << 16u) | ((unsigned)p[2] << 8u) | (unsigned)p[3];
+    }
+  }
+
+  /*median cut*/
+  boxstart[0] = 0;
+  boxstart[1] = numsamples;
+  boxrange[0] = quantize_widest(&boxchannel[0], samples, 0, numsamples);
+  while(numboxes < maxcolors)
+  {
+    size_t bestscore = 0, start, end, count[256], total = 0, split = 0, splitdistance = 0;
+    unsigned best = 0, shift, v;
+    unsigned* sorted = samples + numsamples;
+    for(b = 0; b != numboxes; ++b)
+    {
+      size_t score = boxrange[b] * (boxstart[b + 1] - boxstart[b]);
+      if(score > bestscore)
+      {
+        bestscore = score;
+        best = b;
+      }
+    }
+    if(bestscore == 0) break; /*every box has one color*/
+
+    /*sort the box on its widest channel by counting*/
+    start = boxstart[best];
+    end = boxstart[best + 1];
+    shift = 24 - boxchannel[best] * 8;
+    for(v = 0; v != 256; ++v) count[v] = 0;
+    for(i = start; i != end; ++i) ++count[(samples[i] >> shift) & 255u];
+    for(v = 0; v != 256; ++v)
+    {
+      size_t n = count[v];
+      count[v] = total;
+      total += n;
+      /*split at the value boundary nearest to the middle, one that leaves samples on both sides*/
+      if(total > 0 && total < end - start)
+      {
+        size_t distance = total > (end - start) / 2 ? total - (end - start) / 2 : (end - start) / 2 - total;
+        if(split == 0 || distance < splitdistance)
+        {
+          split = total;
+          splitdistance = distance;
+        }
+      }
+    }
+    for(i = start; i != end; ++i) sorted[start + count[(samples[i] >> shift) & 255u]++] = samples[i];
+    for(i = start; i != end; ++i) samples[i] = sorted[i];
+
+    /*the new box goes after the split one*/
+    for(b = numboxes; b > best; --b)
+    {
+      boxstart[b + 1] = boxstart[b];
+      if(b > best + 1)
+      {
+        boxrange[b] = boxrange[b - 1];
+        boxchannel[b] = boxchannel[b - 1];
+      }
+    }
+    boxstart[best + 1] = start + split;
+    boxrange[best] = quantize_widest(&boxchannel[best], samples, start, start + split);
+    boxrange[best + 1] = quantize_widest(&boxchannel[best + 1], samples, start + split, end);
+    ++numboxes;
+  }
+
+  /*the means of the boxes, then k-means*/
+  for(iteration = 0; iteration <= QUANTIZE_ITERATIONS; ++iteration)
+  {
+    for(i = 0; i != numboxes * 4; ++i) sums[i] = 0;
+    for(i = 0; i != numboxes; ++i) counts[i] = 0;
+    for(b = 0; b != numboxes; ++b)
+    {
+      for(i = boxstart[b]; i != boxstart[b + 1]; ++i)
+      {
+        unsigned color = samples[i];
+        unsigned index = iteration == 0 ? b : nearest(&search, (int)(color >> 24), (int)((color >> 16) & 255u),
+                                                      (int)((color >> 8) & 255u), (int)(color & 255u));
+        for(c = 0; c != 4; ++c) sums[index * 4 + c] += (color >> (24 - c * 8)) & 255u;
+        ++counts[index];
+      }
+    }
+    for(b = 0; b != numboxes; ++b)
+    {
+      /*a color that no sample is nearest to anymore keeps its place*/
+      if(counts[b]) for(c = 0; c != 4; ++c) palette[b * 4 + c] = (unsigned char)((sums[b * 4 + c] * 2 + counts[b])
+                                                                                 / (counts[b] * 2));
+    }
+    quantize_palette_set(&search, palette, numboxes);
+  }
+  *palettesize = numboxes;
+
+  /*map the pixels, remembering the index of recent colors as dithering makes many similar ones*/
+  for(i = 0; i != QUANTIZE_CACHE; ++i) cacheindex[i] = -1;
+  for(i = 0; i != ((size_t)w + 2) * 8; ++i) errors[i] = 0;
+  for(i = 0; i != numpixels; ++i)
+  {
+    size_t x = i % w;
+    int* current = &errors[((i / w) & 1u) * ((size_t)w + 2) * 4];
+    int* next = &errors[(((i / w) & 1u) ^ 1u) * ((size_t)w + 2) * 4];
+    int v[4];
+    unsigned color, slot, index;
+    for(c = 0; c != 4; ++c)
+    {
+      v[c] = image[i * 4 + c];
+      if(dither)
+      {
+        v[c] += current[(x + 1) * 4 + c] / 16;
+        v[c] = v[c] < 0 ? 0 : (v[c] > 255 ? 255 : v[c]);
+      }
+    }
+    color = ((unsigned)v[0] << 24u) | ((unsigned)v[1] << 16u) | ((unsigned)v[2] << 8u) | (unsigned)v[3];
+    slot = ((color * 2654435761u) >> 20u) & (QUANTIZE_CACHE - 1);
+    if(cacheindex[slot] < 0 || cachecolor[slot] != color)
+    {
+      cachecolor[slot] = color;
+      cacheindex[slot] = (short)nearest(&search, v[0], v[1], v[2], v[3]);
+    }
+    index = (unsigned)cacheindex[slot];
+    out[i] = (unsigned char)index;
+    if(dither)
+    {
+      if(x == 0) for(c = 0; c != ((unsigned)w + 2) * 4; ++c) next[c] = 0; /*the next row starts over*/
+      for(c = 0; c != 4; ++c)
+      {
+        int e = v[c] - palette[index * 4 + c];
+        current[(x + 2) * 4 + c] += e * 7;
+        next[x * 4 + c] += e * 3;
+        next[(x + 1) * 4 + c] += e * 5;
+        next[(x + 2) * 4 + c] += e;
+      }
+    }
+  }
+
+  lodepng_free(samples);
+  return 0;
+}
+
+#endif /* #ifdef LODEPNG_COMPILE_ENCODER */
+
+/*
+Paeth predicter, used by PNG filter type 4
+The parameters are of type short, but should come from unsigned chars, the shorts
+are only needed to make the paeth calculation correct.
+*/
+static unsigned char paethPredictor(short a, short b, short c)
+{
+  short pa = abs(b - c);
+  short pb = abs(a - c);
+  short pc = abs(a + b - c - c);
+
+  if(pc < pa && pc < pb) return (unsigned char)c;
+  else if(pb < pa) return (unsigned char)b;
+  else return (unsigned char)a;
+}
+
+#ifdef LODEPNG_COMPILE_SIMD
+/*the SIMD versions of paethPredictor, for the SIMD filter and unfilter functions*/
+#ifdef LODEPNG_SIMD_X86
+/*mask ? a : b, per bit*/
+LODEPNG_TARGET("sse2") static __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/*paethPredictor on 16-bit lanes, given pa = |b - c|, pb = |a - c| and pc = |a + b - 2c|. Ties prefer a, then b*/
+LODEPNG_TARGET("sse2") static __m128i paethSelect_sse2(__m128i a, __m128i b, __m128i c,
+                                                       __m128i pa, __m128i pb, __m128i pc)
+{
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  return select_sse2(_mm_cmpeq_epi16(smallest, pa), a, select_sse2(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+
+LODEPNG_TARGET("sse2") static __m128i abs16_sse2(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*paethPredictor on all channels. Ties prefer a, then b*/
+static uint8x8_t paeth_neon(uint8x8_t a, uint8x8_t b, uint8x8_t c)
+{
+  uint16x8_t pa = vabdl_u8(b, c); /*|p - a| with p = a + b - c*/
+  uint16x8_t pb = vabdl_u8(a, c); /*|p - b|*/
+  uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c)); /*|p - c|*/
+  uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+  uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+  return vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+}
+#endif /*LODEPNG_SIMD_NEON*/
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+/*shared values used by multiple Adam7 related functions*/
+
+static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
+static const unsigned ADAM7_IY[7] = { 0, 0, 4, 0, 2, 0, 1 }; /*y start values*/
+static const unsigned ADAM7_DX[7] = { 8, 8, 4, 4, 2, 2, 1 }; /*x delta values*/
+static const unsigned ADAM7_DY[7] = { 8, 8, 8, 4, 4, 2, 2 }; /*y delta values*/
+
+/*
+Outputs various dimensions and positions in the image related to the Adam7 reduced images.
+passw: output containing the width of the 7 passes
+passh: output containing the height of the 7 passes
+filter_passstart: output containing the index of the start and end of each
+ reduced image with filter bytes
+padded_passstart output containing the index of the start and end of each
+ reduced image when without filter bytes but with padded scanlines
+passstart: output containing the index of the start and end of each reduced
+ image without padding between scanlines, but still padding between the images
+w, h: width and height of non-interlaced image
+bpp: bits per pixel
+"padded" is only relevant if bpp is less than 8 and a scanline or image does not
+ end at a full byte
+*/
+static void Adam7_getpassvalues(unsigned passw[7], unsigned passh[7], size_t filter_passstart[8],
+                                size_t padded_passstart[8], size_t passstart[8], unsigned w, unsigned h, unsigned bpp)
+{
+  /*the passstart values have 8 values: the 8th one indicates the byte after the end of the 7th (= last) pass*/
+  unsigned i;
+
+  /*calculate width and height in pixels of each pass*/
+  for(i = 0; i != 7; ++i)
+  {
+    passw[i] = (w + ADAM7_DX[i] - ADAM7_IX[i] - 1) / ADAM7_DX[i];
+    passh[i] = (h + ADAM7_DY[i] - ADAM7_IY[i] - 1) / ADAM7_DY[i];
+    if(passw[i] == 0) passh[i] = 0;
+    if(passh[i] == 0) passw[i] = 0;
+  }
+
+  filter_passstart[0] = padded_passstart[0] = passstart[0] = 0;
+  for(i = 0; i != 7; ++i)
+  {
+    /*if passw[i] is 0, it's 0 bytes, not 1 (no filtertype-byte)*/
+    filter_passstart[i + 1] = filter_passstart[i]
+                            + ((passw[i] && passh[i]) ? passh[i] * (1 + (passw[i] * bpp + 7) / 8) : 0);
+    /*bits padded if needed to fill full byte at end of each scanline*/
+    padded_passstart[i + 1] = padded_passstart[i] + passh[i] * ((passw[i] * bpp + 7) / 8);
+    /*only padded at end of reduced image*/
+    passstart[i + 1] = passstart[i] + (passh[i] * passw[i] * bpp + 7) / 8;
+  }
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
 
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / PNG Decoder                                                            / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
 /*read the information from the header and store it in the LodePNGInfo. return value is error*/
-unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
-                         const unsigned char* in, size_t insize)
+static unsigned inspect(unsigned* w, unsigned* h, LodePNGState* state,
+                        const unsigned char* in, size_t insize)
 {
   LodePNGInfo* info = &state->info_png;
   if(insize == 0 || in == 0)
@@ -3972,100 +6629,459 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length)
+unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
+                         const unsigned char* in, size_t insize)
 {
-  /*
-  For PNG filter method 0
-  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
-  the filter works byte per byte (bytewidth = 1)
-  precon is the previous unfiltered scanline, recon the result, scanline the current one
-  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
-  recon and scanline MAY be the same memory address! precon must be disjoint.
-  */
-
-  size_t i;
-  switch(filterType)
-  {
-    case 0:
-      for(i = 0; i != length; ++i) recon[i] = scanline[i];
-      break;
-    case 1:
-      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
-      break;
-    case 2:
-      if(precon)
-      {
-        for(i = 0; i != length; ++i) recon[i] = scanline[i] + precon[i];
-      }
-      else
-      {
-        for(i = 0; i != length; ++i) recon[i] = scanline[i];
-      }
-      break;
-    case 3:
-      if(precon)
-      {
-        for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i] + (precon[i] >> 1);
-        for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) >> 1);
-      }
-      else
-      {
-        for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
-        for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + (recon[i - bytewidth] >> 1);
-      }
-      break;
-    case 4:
-      if(precon)
-      {
-        for(i = 0; i != bytewidth; ++i)
-        {
-          recon[i] = (scanline[i] + precon[i]); /*paethPredictor(0, precon[i], 0) is always precon[i]*/
-        }
-        for(i = bytewidth; i < length; ++i)
-        {
-          recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
-        }
-      }
-      else
-      {
-        for(i = 0; i != bytewidth; ++i)
-        {
-          recon[i] = scanline[i];
-        }
-        for(i = bytewidth; i < length; ++i)
-        {
-          /*paethPredictor(recon[i - bytewidth], 0, 0) is always recon[i - bytewidth]*/
-          recon[i] = (scanline[i] + recon[i - bytewidth]);
-        }
-      }
-      break;
-    default: return 36; /*error: unexisting filter type given*/
-  }
-  return 0;
+  const LodePNGAllocator* previous = lodepng_use_allocator(state->allocator);
+  unsigned error = inspect(w, h, state, in, insize);
+  lodepng_restore_allocator(previous);
+  return error;
 }
 
-static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
+unsigned lodepng_inspect_metadata(LodePNGMetadata* metadata, LodePNGState* state,
+                                  const unsigned char* in, size_t insize)
 {
-  /*
-  For PNG filter method 0
-  this function unfilters a single image (e.g. without interlacing this is called once, with Adam7 seven times)
-  out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
-  w and h are image dimensions or dimensions of reduced image, bpp is bits per pixel
-  in and out are allowed to be the same memory address (but aren't the same size since in has the extra filter bytes)
-  */
-
-  unsigned y;
-  unsigned char* prevline = 0;
+  unsigned w, h;
+  const unsigned char* chunk;
+  unsigned error = lodepng_inspect(&w, &h, state, in, insize);
+  if(error) return error;
 
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  size_t linebytes = (w * bpp + 7) / 8;
+  metadata->width = w;
+  metadata->height = h;
+  metadata->colortype = state->info_png.color.colortype;
+  metadata->bitdepth = state->info_png.color.bitdepth;
+  metadata->interlace_method = state->info_png.interlace_method;
+  metadata->raw_size = lodepng_get_raw_size(w, h, &state->info_png.color);
+  metadata->palette = 0;
+  metadata->palettesize = 0;
+  metadata->trns = 0;
+  metadata->trnssize = 0;
+  metadata->phys_defined = 0;
+  metadata->phys_x = metadata->phys_y = metadata->phys_unit = 0;
+  metadata->text_chunks = metadata->text_size = 0;
+  metadata->idat_chunks = metadata->idat_size = 0;
+  metadata->num_chunks = 1; /*IHDR*/
 
-  for(y = 0; y < h; ++y)
+  chunk = &in[33]; /*first byte of the first chunk after the header*/
+  for(;;)
   {
-    size_t outindex = linebytes * y;
+    unsigned chunkLength;
+    const unsigned char* data;
+    unsigned check = 0; /*whether the contents are read, then the CRC is checked*/
+
+    /*the same checks as when decoding*/
+    if((size_t)((chunk - in) + 12) > insize || chunk < in)
+    {
+      if(state->decoder.ignore_end) break;
+      CERROR_RETURN_ERROR(state->error, 30);
+    }
+    chunkLength = lodepng_chunk_length(chunk);
+    if(chunkLength > 2147483647)
+    {
+      if(state->decoder.ignore_end) break;
+      CERROR_RETURN_ERROR(state->error, 63);
+    }
+    if((size_t)((chunk - in) + chunkLength + 12) > insize || (chunk + chunkLength + 12) < in)
+    {
+      CERROR_RETURN_ERROR(state->error, 64);
+    }
+
+    data = lodepng_chunk_data_const(chunk);
+    ++metadata->num_chunks;
+    if(lodepng_chunk_type_equals(chunk, "IDAT"))
+    {
+      ++metadata->idat_chunks;
+      metadata->idat_size += chunkLength;
+    }
+    else if(lodepng_chunk_type_equals(chunk, "IEND"))
+    {
+      break;
+    }
+    else if(lodepng_chunk_type_equals(chunk, "PLTE"))
+    {
+      if(chunkLength % 3 != 0 || chunkLength > 3 * 256) CERROR_RETURN_ERROR(state->error, 38);
+      metadata->palette = data;
+      metadata->palettesize = chunkLength / 3;
+      check = 1;
+    }
+    else if(lodepng_chunk_type_equals(chunk, "tRNS"))
+    {
+      metadata->trns = data;
+      metadata->trnssize = chunkLength;
+      check = 1;
+    }
+    else if(lodepng_chunk_type_equals(chunk, "pHYs"))
+    {
+      if(chunkLength != 9) CERROR_RETURN_ERROR(state->error, 74); /*invalid pHYs chunk size*/
+      metadata->phys_defined = 1;
+      metadata->phys_x = lodepng_read32bitInt(&data[0]);
+      metadata->phys_y = lodepng_read32bitInt(&data[4]);
+      metadata->phys_unit = data[8];
+      check = 1;
+    }
+    else if(lodepng_chunk_type_equals(chunk, "tEXt") || lodepng_chunk_type_equals(chunk, "zTXt")
+            || lodepng_chunk_type_equals(chunk, "iTXt"))
+    {
+      ++metadata->text_chunks;
+      metadata->text_size += chunkLength;
+    }
+
+    if(check && !state->decoder.ignore_crc && lodepng_chunk_check_crc(chunk))
+    {
+      CERROR_RETURN_ERROR(state->error, 57); /*invalid CRC*/
+    }
+    chunk = lodepng_chunk_next_const(chunk);
+  }
+
+  state->error = 0;
+  return 0;
+}
+
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+SIMD versions of unfilterScanline. Up works on whole vectors, Sub, Average and Paeth depend on the
+reconstructed pixel to the left so they work one pixel (of 3, 4, 6 or 8 bytes) at a time, but on all
+its channels at once and without branches. They must give exactly the same result as unfilterScanline.
+*/
+#ifdef LODEPNG_SIMD_X86
+/*loads a pixel of 3, 4, 6 or 8 bytes in the low bytes of the register, the other bytes are zero*/
+LODEPNG_TARGET("sse2") static __m128i loadPixel_sse2(const unsigned char* p, size_t bytewidth)
+{
+  unsigned lo = 0, hi = 0;
+  switch(bytewidth)
+  {
+    case 3: memcpy(&lo, p, 3); break;
+    case 4: memcpy(&lo, p, 4); break;
+    case 6: memcpy(&lo, p, 4); memcpy(&hi, p + 4, 2); break;
+    default: memcpy(&lo, p, 4); memcpy(&hi, p + 4, 4); break;
+  }
+  return _mm_unpacklo_epi32(_mm_cvtsi32_si128((int)lo), _mm_cvtsi32_si128((int)hi));
+}
+
+/*stores exactly bytewidth bytes, recon may be followed by scanline bytes that were not read yet*/
+LODEPNG_TARGET("sse2") static void storePixel_sse2(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  unsigned lo = (unsigned)_mm_cvtsi128_si32(v);
+  unsigned hi = (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+  switch(bytewidth)
+  {
+    case 3: memcpy(p, &lo, 3); break;
+    case 4: memcpy(p, &lo, 4); break;
+    case 6: memcpy(p, &lo, 4); memcpy(p + 4, &hi, 2); break;
+    default: memcpy(p, &lo, 4); memcpy(p + 4, &hi, 4); break;
+  }
+}
+
+LODEPNG_TARGET("sse2") static void unfilterUp_sse2(unsigned char* recon, const unsigned char* scanline,
+                                                   const unsigned char* precon, size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+LODEPNG_TARGET("avx2") static void unfilterUp_avx2(unsigned char* recon, const unsigned char* scanline,
+                                                   const unsigned char* precon, size_t length)
+{
+  size_t i = 0;
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i*)&precon[i]);
+    _mm256_storeu_si256((__m256i*)&recon[i], _mm256_add_epi8(x, b));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+LODEPNG_TARGET("sse2") static void unfilterSub_sse2(unsigned char* recon, const unsigned char* scanline,
+                                                    size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i a = _mm_setzero_si128(); /*the reconstructed pixel to the left*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    a = _mm_add_epi8(loadPixel_sse2(&scanline[i], bytewidth), a);
+    storePixel_sse2(&recon[i], a, bytewidth);
+  }
+}
+
+LODEPNG_TARGET("sse2") static void unfilterAverage_sse2(unsigned char* recon, const unsigned char* scanline,
+                                                        const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128(); /*the reconstructed pixel to the left*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = loadPixel_sse2(&precon[i], bytewidth);
+    /*_mm_avg_epu8 rounds up, subtract the lowest bit of a + b to get (a + b) >> 1*/
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(loadPixel_sse2(&scanline[i], bytewidth), average);
+    storePixel_sse2(&recon[i], a, bytewidth);
+  }
+}
+
+LODEPNG_TARGET("sse2") static void unfilterPaeth_sse2(unsigned char* recon, const unsigned char* scanline,
+                                                      const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*the pixels to the left and above left, with 16-bit channels*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel_sse2(&precon[i], bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    __m128i predictor = paethSelect_sse2(a, b, c, abs16_sse2(pa), abs16_sse2(pb), abs16_sse2(pc));
+    __m128i x = _mm_add_epi8(loadPixel_sse2(&scanline[i], bytewidth), _mm_packus_epi16(predictor, predictor));
+    storePixel_sse2(&recon[i], x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+/*same as unfilterPaeth_sse2, with the absolute value instruction of SSSE3*/
+LODEPNG_TARGET("ssse3") static void unfilterPaeth_ssse3(unsigned char* recon, const unsigned char* scanline,
+                                                        const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*the pixels to the left and above left, with 16-bit channels*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixel_sse2(&precon[i], bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    __m128i predictor = paethSelect_sse2(a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb), _mm_abs_epi16(pc));
+    __m128i x = _mm_add_epi8(loadPixel_sse2(&scanline[i], bytewidth), _mm_packus_epi16(predictor, predictor));
+    storePixel_sse2(&recon[i], x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+/*loads a pixel of 3, 4, 6 or 8 bytes in the low bytes of the register, the other bytes are zero*/
+static uint8x8_t loadPixel_neon(const unsigned char* p, size_t bytewidth)
+{
+  unsigned char buffer[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  switch(bytewidth)
+  {
+    case 3: memcpy(buffer, p, 3); break;
+    case 4: memcpy(buffer, p, 4); break;
+    case 6: memcpy(buffer, p, 6); break;
+    default: memcpy(buffer, p, 8); break;
+  }
+  return vld1_u8(buffer);
+}
+
+/*stores exactly bytewidth bytes, recon may be followed by scanline bytes that were not read yet*/
+static void storePixel_neon(unsigned char* p, uint8x8_t v, size_t bytewidth)
+{
+  unsigned char buffer[8];
+  vst1_u8(buffer, v);
+  switch(bytewidth)
+  {
+    case 3: memcpy(p, buffer, 3); break;
+    case 4: memcpy(p, buffer, 4); break;
+    case 6: memcpy(p, buffer, 6); break;
+    default: memcpy(p, buffer, 8); break;
+  }
+}
+
+static void unfilterUp_neon(unsigned char* recon, const unsigned char* scanline,
+                            const unsigned char* precon, size_t length)
+{
+  size_t i = 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    vst1q_u8(&recon[i], vaddq_u8(vld1q_u8(&scanline[i]), vld1q_u8(&precon[i])));
+  }
+  for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterSub_neon(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0); /*the reconstructed pixel to the left*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    a = vadd_u8(loadPixel_neon(&scanline[i], bytewidth), a);
+    storePixel_neon(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterAverage_neon(unsigned char* recon, const unsigned char* scanline,
+                                 const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0); /*the reconstructed pixel to the left*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    /*vhadd_u8 is (a + b) >> 1 without overflow*/
+    a = vadd_u8(loadPixel_neon(&scanline[i], bytewidth), vhadd_u8(a, loadPixel_neon(&precon[i], bytewidth)));
+    storePixel_neon(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterPaeth_neon(unsigned char* recon, const unsigned char* scanline,
+                               const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0); /*the pixels to the left and above left*/
+  for(i = 0; i != length; i += bytewidth)
+  {
+    uint8x8_t b = loadPixel_neon(&precon[i], bytewidth);
+    a = vadd_u8(loadPixel_neon(&scanline[i], bytewidth), paeth_neon(a, b, c));
+    storePixel_neon(&recon[i], a, bytewidth);
+    c = b;
+  }
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*returns 1 if the scanline was unfiltered by SIMD code, 0 if unfilterScanline has to do it*/
+static unsigned unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                     size_t bytewidth, unsigned char filterType, size_t length)
+{
+  unsigned features = lodepng_get_cpu_features();
+  unsigned pixels = bytewidth == 3 || bytewidth == 4 || bytewidth == 6 || bytewidth == 8;
+  /*without previous scanline, Paeth predicts the left pixel like Sub does*/
+  if(!precon && filterType == 4) filterType = 1;
+  else if(!precon) return 0;
+#if defined(LODEPNG_SIMD_X86)
+  if(filterType == 2 && (features & LODEPNG_CPU_AVX2)) unfilterUp_avx2(recon, scanline, precon, length);
+  else if(filterType == 2 && (features & LODEPNG_CPU_SSE2)) unfilterUp_sse2(recon, scanline, precon, length);
+  else if(!pixels || !(features & LODEPNG_CPU_SSE2)) return 0;
+  else if(filterType == 1) unfilterSub_sse2(recon, scanline, bytewidth, length);
+  else if(filterType == 3) unfilterAverage_sse2(recon, scanline, precon, bytewidth, length);
+  else if(filterType == 4 && (features & LODEPNG_CPU_SSSE3))
+  {
+    unfilterPaeth_ssse3(recon, scanline, precon, bytewidth, length);
+  }
+  else if(filterType == 4) unfilterPaeth_sse2(recon, scanline, precon, bytewidth, length);
+  else return 0;
+  return 1;
+#elif defined(LODEPNG_SIMD_NEON)
+  if(!(features & LODEPNG_CPU_NEON)) return 0;
+  else if(filterType == 2) unfilterUp_neon(recon, scanline, precon, length);
+  else if(!pixels) return 0;
+  else if(filterType == 1) unfilterSub_neon(recon, scanline, bytewidth, length);
+  else if(filterType == 3) unfilterAverage_neon(recon, scanline, precon, bytewidth, length);
+  else if(filterType == 4) unfilterPaeth_neon(recon, scanline, precon, bytewidth, length);
+  else return 0;
+  return 1;
+#else /*no SIMD code for this target*/
+  (void)recon; (void)scanline; (void)bytewidth; (void)length; (void)features; (void)pixels;
+  return 0;
+#endif
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+  /*
+  For PNG filter method 0
+  unfilter a PNG image scanline by scanline. when the pixels are smaller than 1 byte,
+  the filter works byte per byte (bytewidth = 1)
+  precon is the previous unfiltered scanline, recon the result, scanline the current one
+  the incoming scanlines do NOT include the filtertype byte, that one is given in the parameter filterType instead
+  recon and scanline MAY be the same memory address! precon must be disjoint.
+  */
+
+  size_t i;
+#ifdef LODEPNG_COMPILE_SIMD
+  if(unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif /*LODEPNG_COMPILE_SIMD*/
+  switch(filterType)
+  {
+    case 0:
+      for(i = 0; i != length; ++i) recon[i] = scanline[i];
+      break;
+    case 1:
+      for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
+      for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
+      break;
+    case 2:
+      if(precon)
+      {
+        for(i = 0; i != length; ++i) recon[i] = scanline[i] + precon[i];
+      }
+      else
+      {
+        for(i = 0; i != length; ++i) recon[i] = scanline[i];
+      }
+      break;
+    case 3:
+      if(precon)
+      {
+        for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i] + (precon[i] >> 1);
+        for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) >> 1);
+      }
+      else
+      {
+        for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
+        for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + (recon[i - bytewidth] >> 1);
+      }
+      break;
+    case 4:
+      if(precon)
+      {
+        for(i = 0; i != bytewidth; ++i)
+        {
+          recon[i] = (scanline[i] + precon[i]); /*paethPredictor(0, precon[i], 0) is always precon[i]*/
+        }
+        for(i = bytewidth; i < length; ++i)
+        {
+          recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
+        }
+      }
+      else
+      {
+        for(i = 0; i != bytewidth; ++i)
+        {
+          recon[i] = scanline[i];
+        }
+        for(i = bytewidth; i < length; ++i)
+        {
+          /*paethPredictor(recon[i - bytewidth], 0, 0) is always recon[i - bytewidth]*/
+          recon[i] = (scanline[i] + recon[i - bytewidth]);
+        }
+      }
+      break;
+    default: return 36; /*error: unexisting filter type given*/
+  }
+  return 0;
+}
+
+static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
+{
+  /*
+  For PNG filter method 0
+  this function unfilters a single image (e.g. without interlacing this is called once, with Adam7 seven times)
+  out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
+  w and h are image dimensions or dimensions of reduced image, bpp is bits per pixel
+  in and out are allowed to be the same memory address (but aren't the same size since in has the extra filter bytes)
+  */
+
+  unsigned y;
+  unsigned char* prevline = 0;
+
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t linebytes = (w * bpp + 7) / 8;
+
+  for(y = 0; y < h; ++y)
+  {
+    size_t outindex = linebytes * y;
     size_t inindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
     unsigned char filterType = in[inindex];
 
@@ -4218,29 +7234,106 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
   return 0;
 }
 
-static unsigned readChunk_PLTE(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength)
+/*Unfilters the decompressed data in and writes the image rows to out, stride bytes apart, in color mode
+mode_out: the same as info_png->color or, if convert is set, converted to it. in is overwritten with
+intermediate data. Only Adam7 with conversion uses row, which must fit one row of the image in mode_out.
+Returns error code.*/
+static unsigned writeScanlines(unsigned char* out, size_t stride, unsigned char* in, unsigned char* row,
+                               unsigned w, unsigned h, const LodePNGColorMode* mode_out,
+                               const LodePNGInfo* info_png, unsigned convert)
 {
-  unsigned pos = 0, i;
-  if(color->palette) lodepng_free(color->palette);
-  color->palettesize = chunkLength / 3;
-  color->palette = (unsigned char*)lodepng_malloc(4 * color->palettesize);
-  if(!color->palette && color->palettesize)
-  {
-    color->palettesize = 0;
-    return 83; /*alloc fail*/
-  }
-  if(color->palettesize > 256) return 38; /*error: palette too big*/
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned y;
+  if(bpp == 0) return 31; /*error: invalid colortype*/
 
-  for(i = 0; i != color->palettesize; ++i)
+  if(info_png->interlace_method == 0)
   {
-    color->palette[4 * i + 0] = data[pos++]; /*R*/
-    color->palette[4 * i + 1] = data[pos++]; /*G*/
-    color->palette[4 * i + 2] = data[pos++]; /*B*/
-    color->palette[4 * i + 3] = 255; /*alpha*/
+    size_t linebytes = (w * bpp + 7) / 8;
+    const unsigned char* prevline = 0;
+    for(y = 0; y < h; ++y)
+    {
+      /*unfilter in place and only write to the output, which may be slow to read back, such as mapped
+      texture memory*/
+      unsigned char* recon = &in[y * linebytes];
+      const unsigned char* scanline = &in[y * (linebytes + 1)];
+      CERROR_TRY_RETURN(unfilterScanline(recon, &scanline[1], prevline, bytewidth, scanline[0], linebytes));
+      if(!convert) memcpy(&out[y * stride], recon, linebytes);
+      else CERROR_TRY_RETURN(lodepng_convert(&out[y * stride], recon, mode_out, &info_png->color, w, 1));
+      prevline = recon;
+    }
   }
+  else /*interlace_method is 1 (Adam7): unfilter each reduced image in place, then scatter its pixels*/
+  {
+    unsigned passw[7], passh[7]; size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    unsigned i;
+    unsigned obpp = lodepng_get_bpp(mode_out);
 
-  return 0; /* OK */
-}
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+
+    for(i = 0; i != 7; ++i)
+    {
+      size_t linebytes = (passw[i] * bpp + 7) / 8;
+      CERROR_TRY_RETURN(unfilter(&in[padded_passstart[i]], &in[filter_passstart[i]], passw[i], passh[i], bpp));
+      for(y = 0; y < passh[i]; ++y)
+      {
+        const unsigned char* line = &in[padded_passstart[i] + y * linebytes];
+        unsigned char* dest = &out[(ADAM7_IY[i] + y * ADAM7_DY[i]) * stride];
+        unsigned x;
+        if(convert)
+        {
+          CERROR_TRY_RETURN(lodepng_convert(row, line, mode_out, &info_png->color, passw[i], 1));
+          line = row;
+        }
+        if(obpp >= 8)
+        {
+          size_t pixelbytes = obpp / 8, b;
+          for(x = 0; x < passw[i]; ++x)
+          {
+            unsigned char* pixel = &dest[(ADAM7_IX[i] + x * ADAM7_DX[i]) * pixelbytes];
+            for(b = 0; b < pixelbytes; ++b) pixel[b] = line[x * pixelbytes + b];
+          }
+        }
+        else /*the output is not cleared, so set each bit*/
+        {
+          size_t ibp = 0;
+          for(x = 0; x < passw[i]; ++x)
+          {
+            size_t obp = (ADAM7_IX[i] + x * ADAM7_DX[i]) * obpp;
+            unsigned b;
+            for(b = 0; b < obpp; ++b) setBitOfReversedStream(&obp, dest, readBitFromReversedStream(&ibp, line));
+          }
+        }
+      }
+    }
+  }
+
+  return 0;
+}
+
+static unsigned readChunk_PLTE(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength)
+{
+  unsigned pos = 0, i;
+  if(color->palette) lodepng_free(color->palette);
+  color->palettesize = chunkLength / 3;
+  color->palette = (unsigned char*)lodepng_malloc(4 * color->palettesize);
+  if(!color->palette && color->palettesize)
+  {
+    color->palettesize = 0;
+    return 83; /*alloc fail*/
+  }
+  if(color->palettesize > 256) return 38; /*error: palette too big*/
+
+  for(i = 0; i != color->palettesize; ++i)
+  {
+    color->palette[4 * i + 0] = data[pos++]; /*R*/
+    color->palette[4 * i + 1] = data[pos++]; /*G*/
+    color->palette[4 * i + 2] = data[pos++]; /*B*/
+    color->palette[4 * i + 3] = 255; /*alpha*/
+  }
+
+  return 0; /* OK */
+}
 
 static unsigned readChunk_tRNS(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength)
 {
@@ -4385,9 +7478,7 @@ static unsigned readChunk_zTXt(LodePNGInfo* info, const LodePNGDecompressSetting
 
     length = (unsigned)chunkLength - string2_begin;
     /*will fail if zlib error, e.g. if length is too small*/
-    error = zlib_decompress(&decoded.data, &decoded.size,
-                            (unsigned char*)(&data[string2_begin]),
-                            length, zlibsettings);
+    error = zlib_decompress(&decoded, (unsigned char*)(&data[string2_begin]), length, zlibsettings);
     if(error) break;
     ucvector_push_back(&decoded, 0);
 
@@ -4468,11 +7559,8 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const LodePNGDecompressSetting
     if(compressed)
     {
       /*will fail if zlib error, e.g. if length is too small*/
-      error = zlib_decompress(&decoded.data, &decoded.size,
-                              (unsigned char*)(&data[begin]),
-                              length, zlibsettings);
+      error = zlib_decompress(&decoded, (unsigned char*)(&data[begin]), length, zlibsettings);
       if(error) break;
-      if(decoded.allocsize < decoded.size) decoded.allocsize = decoded.size;
       ucvector_push_back(&decoded, 0);
     }
     else
@@ -4524,46 +7612,127 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
-                          LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+/*
+reads a chunk other than IHDR, IDAT or IEND into state->info_png. Unknown chunks are remembered at
+critical_pos (1 = after IHDR, 2 = after PLTE, 3 = after IDAT), which becomes 2 at the PLTE chunk, and
+set *unknown to 1. Returns error code.
+*/
+static unsigned readChunk(LodePNGState* state, const unsigned char* chunk, unsigned* critical_pos, unsigned* unknown)
+{
+  unsigned error = 0;
+  unsigned chunkLength = lodepng_chunk_length(chunk);
+  const unsigned char* data = lodepng_chunk_data_const(chunk);
+
+  /*palette chunk (PLTE)*/
+  if(lodepng_chunk_type_equals(chunk, "PLTE"))
+  {
+    error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
+    *critical_pos = 2;
+  }
+  /*palette transparency chunk (tRNS)*/
+  else if(lodepng_chunk_type_equals(chunk, "tRNS"))
+  {
+    error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*background color chunk (bKGD)*/
+  else if(lodepng_chunk_type_equals(chunk, "bKGD"))
+  {
+    error = readChunk_bKGD(&state->info_png, data, chunkLength);
+  }
+  /*text chunk (tEXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "tEXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      error = readChunk_tEXt(&state->info_png, data, chunkLength);
+    }
+  }
+  /*compressed text chunk (zTXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "zTXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      error = readChunk_zTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
+    }
+  }
+  /*international text chunk (iTXt)*/
+  else if(lodepng_chunk_type_equals(chunk, "iTXt"))
+  {
+    if(state->decoder.read_text_chunks)
+    {
+      error = readChunk_iTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
+    }
+  }
+  else if(lodepng_chunk_type_equals(chunk, "tIME"))
+  {
+    error = readChunk_tIME(&state->info_png, data, chunkLength);
+  }
+  else if(lodepng_chunk_type_equals(chunk, "pHYs"))
+  {
+    error = readChunk_pHYs(&state->info_png, data, chunkLength);
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  else /*it's not an implemented chunk type, so ignore it: skip over the data*/
+  {
+    /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+    if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk))
+    {
+      return 69;
+    }
+
+    *unknown = 1;
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+    if(state->decoder.remember_unknown_chunks)
+    {
+      error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[*critical_pos - 1],
+                                   &state->info_png.unknown_chunks_size[*critical_pos - 1], chunk);
+    }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  }
+
+  return error;
+}
+
+/*
+reads the header and all chunks, putting the rest in state->info_png. zdata and zsize are set to the zlib
+data: with a single IDAT chunk that is its contents in the input, which is used in place, otherwise the
+contents of all IDAT chunks are put after each other in idat. If restarts isn't NULL, it's set to the idRS
+chunk if there is one. Returns error code.
+*/
+static unsigned readChunks(unsigned* w, unsigned* h, LodePNGState* state,
+                           const unsigned char* in, size_t insize, ucvector* idat,
+                           const unsigned char** zdata, size_t* zsize, const unsigned char** restarts)
 {
+  unsigned error;
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
-  ucvector idat; /*the data from idat chunks*/
-  ucvector scanlines;
-  size_t predict;
   size_t numpixels;
-  size_t outsize = 0;
+  size_t numidat = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned critical_pos = 1; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-
-  state->error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
-  if(state->error) return;
+  *zdata = 0;
+  *zsize = 0;
+  error = lodepng_inspect(w, h, state, in, insize); /*reads header and resets other parameters in state->info_png*/
+  if(error) return error;
 
   numpixels = *w * *h;
 
   /*multiplication overflow*/
-  if(*h != 0 && numpixels / *h != *w) CERROR_RETURN(state->error, 92);
+  if(*h != 0 && numpixels / *h != *w) return 92;
   /*multiplication overflow possible further below. Allows up to 2^31-1 pixel
   bytes with 16-bit RGBA, the rest is room for filter bytes.*/
-  if(numpixels > 268435455) CERROR_RETURN(state->error, 92);
+  if(numpixels > 268435455) return 92;
 
-  ucvector_init(&idat);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
   IDAT data is put at the start of the in buffer*/
-  while(!IEND && !state->error)
+  while(!IEND && !error)
   {
     unsigned chunkLength;
     const unsigned char* data; /*the data in the chunk*/
@@ -4572,7 +7741,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if((size_t)((chunk - in) + 12) > insize || chunk < in)
     {
       if(state->decoder.ignore_end) break; /*other errors may still happen though*/
-      CERROR_BREAK(state->error, 30);
+      CERROR_BREAK(error, 30);
     }
 
     /*length of the data of the chunk, excluding the length bytes, chunk type and CRC bytes*/
@@ -4581,12 +7750,12 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(chunkLength > 2147483647)
     {
       if(state->decoder.ignore_end) break; /*other errors may still happen though*/
-      CERROR_BREAK(state->error, 63);
+      CERROR_BREAK(error, 63);
     }
 
     if((size_t)((chunk - in) + chunkLength + 12) > insize || (chunk + chunkLength + 12) < in)
     {
-      CERROR_BREAK(state->error, 64); /*error: size of the in buffer too small to contain next chunk*/
+      CERROR_BREAK(error, 64); /*error: size of the in buffer too small to contain next chunk*/
     }
 
     data = lodepng_chunk_data_const(chunk);
@@ -4594,244 +7763,1445 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i != chunkLength; ++i) idat.data[oldsize + i] = data[i];
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+      if(numidat == 0)
+      {
+        *zdata = data;
+        *zsize = chunkLength;
+      }
+      else
+      {
+        size_t oldsize;
+        if(numidat == 1)
+        {
+          /*from the second IDAT chunk on, the contents are copied after each other, starting with the first*/
+          if(!ucvector_resize(idat, *zsize)) CERROR_BREAK(error, 83 /*alloc fail*/);
+          for(i = 0; i != *zsize; ++i) idat->data[i] = (*zdata)[i];
+        }
+        oldsize = idat->size;
+        if(!ucvector_resize(idat, oldsize + chunkLength)) CERROR_BREAK(error, 83 /*alloc fail*/);
+        for(i = 0; i != chunkLength; ++i) idat->data[oldsize + i] = data[i];
+        *zdata = idat->data;
+        *zsize = idat->size;
+      }
+      ++numidat;
       critical_pos = 3;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     }
     /*IEND chunk*/
     else if(lodepng_chunk_type_equals(chunk, "IEND"))
     {
       IEND = 1;
     }
-    /*palette chunk (PLTE)*/
-    else if(lodepng_chunk_type_equals(chunk, "PLTE"))
-    {
-      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      critical_pos = 2;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    }
-    /*palette transparency chunk (tRNS)*/
-    else if(lodepng_chunk_type_equals(chunk, "tRNS"))
+    else
     {
-      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
-      if(state->error) break;
+      /*to everything but decodeParts the restart index is an unknown chunk*/
+      if(restarts && !*restarts && lodepng_chunk_type_equals(chunk, "idRS")) *restarts = chunk;
+      error = readChunk(state, chunk, &critical_pos, &unknown);
+      if(error) break;
     }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*background color chunk (bKGD)*/
-    else if(lodepng_chunk_type_equals(chunk, "bKGD"))
+
+    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/
     {
-      state->error = readChunk_bKGD(&state->info_png, data, chunkLength);
-      if(state->error) break;
+      if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(error, 57); /*invalid CRC*/
     }
-    /*text chunk (tEXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "tEXt"))
-    {
-      if(state->decoder.read_text_chunks)
+
+    if(!IEND) chunk = lodepng_chunk_next_const(chunk);
+  }
+
+  return error;
+}
+
+/*the size of the decompressed image data: the scanlines with their filter bytes, for Adam7 the seven
+reduced images after each other*/
+static size_t getScanlinesSize(unsigned w, unsigned h, const LodePNGInfo* info_png)
+{
+  const LodePNGColorMode* color = &info_png->color;
+  size_t predict = 0;
+  if(info_png->interlace_method == 0)
+  {
+    /*The extra h is added because this are the filter bytes every scanline starts with*/
+    predict = lodepng_get_raw_size_idat(w, h, color) + h;
+  }
+  else
+  {
+    /*Adam-7 interlaced: predicted size is the sum of the 7 sub-images sizes*/
+    predict += lodepng_get_raw_size_idat((w + 7) >> 3, (h + 7) >> 3, color) + ((h + 7) >> 3);
+    if(w > 4) predict += lodepng_get_raw_size_idat((w + 3) >> 3, (h + 7) >> 3, color) + ((h + 7) >> 3);
+    predict += lodepng_get_raw_size_idat((w + 3) >> 2, (h + 3) >> 3, color) + ((h + 3) >> 3);
+    if(w > 2) predict += lodepng_get_raw_size_idat((w + 1) >> 2, (h + 3) >> 2, color) + ((h + 3) >> 2);
+    predict += lodepng_get_raw_size_idat((w + 1) >> 1, (h + 1) >> 2, color) + ((h + 1) >> 2);
+    if(w > 1) predict += lodepng_get_raw_size_idat((w + 0) >> 1, (h + 1) >> 1, color) + ((h + 1) >> 1);
+    predict += lodepng_get_raw_size_idat((w + 0), (h + 0) >> 1, color) + ((h + 0) >> 1);
+  }
+  return predict;
+}
+
+/*decompresses the IDAT data to the start of scanlines, whose memory is reserved for the predicted size plus
+extra bytes. Returns error code, e.g. if the size doesn't match the prediction.*/
+static unsigned inflateScanlines(ucvector* scanlines, size_t extra, unsigned w, unsigned h,
+                                 const LodePNGState* state, const unsigned char* zdata, size_t zsize)
+{
+  unsigned error;
+  /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
+  If the decompressed size does not match the prediction, the image must be corrupt.*/
+  size_t predict = getScanlinesSize(w, h, &state->info_png);
+
+  if(!ucvector_reserve(scanlines, predict + extra)) return 83; /*alloc fail*/
+  scanlines->size = 0;
+  error = zlib_decompress(scanlines, zdata, zsize, &state->decoder.zlibsettings);
+  if(error) return error;
+  if(scanlines->size != predict) return 91; /*decompressed size doesn't match prediction*/
+  /*a custom zlib may have given other memory*/
+  if(!ucvector_reserve(scanlines, predict + extra)) return 83; /*alloc fail*/
+  return 0;
+}
+
+/*like inflateScanlines, but inflating stops once there are need bytes, for a crop rectangle that doesn't
+need the end of the image. The Adler-32 checksum, which is of all the data, can't be checked then.*/
+static unsigned inflateScanlinesPart(ucvector* scanlines, size_t need, unsigned w, unsigned h,
+                                     const LodePNGState* state, const unsigned char* zdata, size_t zsize)
+{
+#ifdef LODEPNG_COMPILE_ZLIB
+  const LodePNGDecompressSettings* settings = &state->decoder.zlibsettings;
+  if(need < getScanlinesSize(w, h, &state->info_png) && !settings->custom_zlib && !settings->custom_inflate)
+  {
+    unsigned error;
+    if(zsize < 2) return 53; /*error, size of zlib data too small*/
+    error = checkZlibHeader(zdata);
+    if(error) return error;
+    if(!ucvector_reserve(scanlines, need)) return 83; /*alloc fail*/
+    scanlines->size = 0;
+    error = inflateBlocks(scanlines, &zdata[2], zsize - 2, 0, need);
+    if(error) return error;
+    return scanlines->size < need ? 91 : 0; /*the data ended before the rows that are needed*/
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  (void)need;
+  return inflateScanlines(scanlines, 0, w, h, state, zdata, zsize);
+}
+
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ZLIB)
+
+/*the Adler-32 of two pieces of data after each other, from the Adler-32 of each and the size of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t size2)
+{
+  unsigned rem = (unsigned)(size2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 = (s1 + (adler2 & 0xffff) + 65521 - 1) % 65521;
+  s2 = (s2 + (adler1 >> 16) + (adler2 >> 16) + 65521 - rem) % 65521;
+  return (s2 << 16) | s1;
+}
+
+/*what the threads of decodeParts share*/
+typedef struct PartsDecoder
+{
+  unsigned char* out; /*the unfiltered scanlines, linebytes apart*/
+  const unsigned char* zdata; /*the zlib data*/
+  size_t zsize;
+  const unsigned char* index; /*the idRS chunk data: rows per part, then the position of each part*/
+  size_t numparts;
+  unsigned rows; /*rows per part*/
+  unsigned h, bpp;
+  size_t linebytes;
+  unsigned* adlers; /*per part, the Adler-32 of its scanlines*/
+  unsigned* errors; /*per part, error code*/
+} PartsDecoder;
+
+static void decodePart(void* data, size_t i)
+{
+  const PartsDecoder* d = (const PartsDecoder*)data;
+  size_t start = lodepng_read32bitInt(&d->index[4 + 4 * i]);
+  size_t end = i + 1 == d->numparts ? d->zsize - 4 : lodepng_read32bitInt(&d->index[8 + 4 * i]);
+  unsigned y0 = (unsigned)i * d->rows;
+  unsigned numrows = d->h - y0 < d->rows ? d->h - y0 : d->rows;
+  size_t bytewidth = (d->bpp + 7) / 8;
+  const unsigned char* prevline = 0;
+  ucvector scanlines;
+  unsigned error = 0, y;
+
+  ucvector_init(&scanlines);
+  if(!ucvector_reserve(&scanlines, numrows * (d->linebytes + 1))) error = 83; /*alloc fail*/
+  if(!error) error = inflateBlocks(&scanlines, &d->zdata[start], end - start, i + 1 != d->numparts,
+                                       (size_t)(-1));
+  if(!error && scanlines.size != numrows * (d->linebytes + 1)) error = 91;
+  /*only the rows of the first part may depend on the row above them*/
+  if(!error && i != 0 && scanlines.data[0] > 1) error = 36;
+  for(y = 0; y < numrows && !error; ++y)
+  {
+    unsigned char* recon = &d->out[(y0 + y) * d->linebytes];
+    const unsigned char* scanline = &scanlines.data[y * (d->linebytes + 1)];
+    error = unfilterScanline(recon, &scanline[1], prevline, bytewidth, scanline[0], d->linebytes);
+    prevline = recon;
+  }
+  if(!error) d->adlers[i] = adler32(scanlines.data, (unsigned)scanlines.size);
+  d->errors[i] = error;
+  ucvector_cleanup(&scanlines);
+}
+
+/*
+Decodes a non-interlaced PNG with a restart index (the idRS chunk, see restart_rows in the encoder settings)
+by inflating and unfiltering its parts on several threads. Returns 1 if it did and *out has the image in the
+color type of the PNG. Returns 0 if the index isn't usable or anything goes wrong. The PNG is then decoded the
+usual way, which also finds any error in it.
+*/
+static unsigned decodeParts(unsigned char** out, unsigned w, unsigned h,
+                            const LodePNGState* state, const unsigned char* zdata, size_t zsize,
+                            const unsigned char* chunk)
+{
+  PartsDecoder d;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  size_t i, chunkLength = lodepng_chunk_length(chunk);
+  unsigned adler, ok = 1;
+
+  if(state->info_png.interlace_method != 0 || state->decoder.num_threads == 1 || bpp == 0) return 0;
+  if(state->decoder.zlibsettings.custom_zlib || state->decoder.zlibsettings.custom_inflate) return 0;
+  if(!state->decoder.ignore_crc && lodepng_chunk_check_crc(chunk)) return 0;
+  if(chunkLength < 8 || zsize < 6 || checkZlibHeader(zdata)) return 0;
+
+  d.zdata = zdata;
+  d.zsize = zsize;
+  d.index = lodepng_chunk_data_const(chunk);
+  d.rows = lodepng_read32bitInt(d.index);
+  if(d.rows == 0) return 0;
+  d.numparts = h / d.rows + (h % d.rows != 0);
+  if(chunkLength != 4 + 4 * d.numparts) return 0;
+  /*the parts follow each other, from right after the zlib header up to the Adler-32 at the end*/
+  for(i = 0; i != d.numparts; ++i)
+  {
+    size_t start = lodepng_read32bitInt(&d.index[4 + 4 * i]);
+    size_t end = i + 1 == d.numparts ? zsize - 4 : lodepng_read32bitInt(&d.index[8 + 4 * i]);
+    if((i == 0 && start != 2) || end <= start || end > zsize - 4) return 0;
+  }
+  d.h = h;
+  d.bpp = bpp;
+  d.linebytes = (w * bpp + 7) / 8;
+
+  /*unfiltered scanlines may have padding bits, which are removed afterwards*/
+  *out = (unsigned char*)lodepng_malloc(d.linebytes * h);
+  d.out = *out;
+  d.adlers = (unsigned*)lodepng_malloc(d.numparts * 2 * sizeof(unsigned));
+  if(*out && d.adlers)
+  {
+    d.errors = &d.adlers[d.numparts];
+    lodepng_parallel_for(d.numparts, state->decoder.num_threads, decodePart, &d);
+
+    adler = d.adlers[0];
+    for(i = 0; i != d.numparts && ok; ++i)
+    {
+      if(d.errors[i]) ok = 0;
+      else if(i != 0)
       {
-        state->error = readChunk_tEXt(&state->info_png, data, chunkLength);
-        if(state->error) break;
+        size_t size = (h - i * d.rows < d.rows ? h - i * d.rows : d.rows) * (d.linebytes + 1);
+        adler = adler32_combine(adler, d.adlers[i], size);
       }
     }
-    /*compressed text chunk (zTXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "zTXt"))
+    if(ok && !state->decoder.zlibsettings.ignore_adler32 && adler != lodepng_read32bitInt(&zdata[zsize - 4]))
     {
-      if(state->decoder.read_text_chunks)
-      {
-        state->error = readChunk_zTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
-        if(state->error) break;
-      }
+      ok = 0;
     }
-    /*international text chunk (iTXt)*/
-    else if(lodepng_chunk_type_equals(chunk, "iTXt"))
+  }
+  else ok = 0;
+  lodepng_free(d.adlers);
+
+  if(!ok)
+  {
+    lodepng_free(*out);
+    *out = 0;
+    return 0;
+  }
+  if(bpp < 8 && w * bpp != d.linebytes * 8)
+  {
+    size_t bits = (size_t)w * h * bpp;
+    removePaddingBits(*out, *out, w * bpp, d.linebytes * 8, h);
+    /*as after postProcessScanlines, the bits after the last pixel are 0*/
+    if(bits % 8) (*out)[bits / 8] &= (unsigned char)(255u << (8 - bits % 8));
+  }
+  return 1;
+}
+
+#endif /*LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_ZLIB*/
+
+/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
+static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
+                          LodePNGState* state,
+                          const unsigned char* in, size_t insize)
+{
+  size_t i;
+  ucvector idat; /*the data from idat chunks, if there are several*/
+  const unsigned char* zdata;
+  size_t zsize;
+  ucvector scanlines;
+  size_t outsize = 0;
+  const unsigned char* restarts = 0; /*the idRS chunk*/
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+
+  ucvector_init(&idat);
+  ucvector_init(&scanlines);
+  state->error = readChunks(w, h, state, in, insize, &idat, &zdata, &zsize, &restarts);
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ZLIB)
+  if(!state->error && restarts && decodeParts(out, *w, *h, state, zdata, zsize, restarts))
+  {
+    ucvector_cleanup(&idat);
+    return;
+  }
+#endif /*LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_ZLIB*/
+  if(!state->error) state->error = inflateScanlines(&scanlines, 0, *w, *h, state, zdata, zsize);
+  ucvector_cleanup(&idat);
+
+  if(!state->error)
+  {
+    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+    *out = (unsigned char*)lodepng_malloc(outsize);
+    if(!*out) state->error = 83; /*alloc fail*/
+  }
+  if(!state->error)
+  {
+    for(i = 0; i < outsize; i++) (*out)[i] = 0;
+    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
+  }
+  ucvector_cleanup(&scanlines);
+}
+
+/*whether the settings ask for less than the whole image at full size*/
+static unsigned isRegionDecode(const LodePNGDecoderSettings* settings)
+{
+  return (settings->crop_w && settings->crop_h) || settings->downscale != 1;
+}
+
+/*unfilters rows y0 to y1 of the scanlines in place, each after its filter type byte. Row y0 must not depend on
+the row above it. Returns error code.*/
+static unsigned unfilterRows(unsigned char* in, size_t linebytes, size_t bytewidth, unsigned y0, unsigned y1)
+{
+  unsigned y;
+  const unsigned char* prevline = 0;
+  for(y = y0; y < y1; ++y)
+  {
+    unsigned char* line = &in[y * (linebytes + 1)];
+    CERROR_TRY_RETURN(unfilterScanline(&line[1], &line[1], prevline, bytewidth, line[0], linebytes));
+    prevline = &line[1];
+  }
+  return 0;
+}
+
+/*the bit position of pixel x, y of the image in scanlines unfiltered by unfilterRows*/
+static size_t regionBitPos(unsigned x, unsigned y, unsigned w, unsigned bpp, unsigned interlace_method,
+                           const unsigned passw[7], const size_t filter_passstart[8])
+{
+  unsigned i;
+  if(!interlace_method) return ((size_t)y * (1 + ((size_t)w * bpp + 7) / 8) + 1) * 8 + (size_t)x * bpp;
+  /*the passes have no pixels in common, and the last one has all that are left*/
+  for(i = 0; i != 6; ++i)
+  {
+    if(x % ADAM7_DX[i] == ADAM7_IX[i] && y % ADAM7_DY[i] == ADAM7_IY[i]) break;
+  }
+  return (filter_passstart[i] + (size_t)((y - ADAM7_IY[i]) / ADAM7_DY[i]) * (1 + ((size_t)passw[i] * bpp + 7) / 8)
+          + 1) * 8 + (size_t)((x - ADAM7_IX[i]) / ADAM7_DX[i]) * bpp;
+}
+
+/*makes the image of w * h pixels factor times smaller, each pixel the average of a square of pixels. The color
+mode has channels of 8 or 16 bits.*/
+static void downscaleBox(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned factor,
+                         const LodePNGColorMode* mode)
+{
+  size_t channels = lodepng_get_channels(mode);
+  size_t bytes = mode->bitdepth / 8;
+  size_t pixelbytes = channels * bytes;
+  unsigned ow = (w + factor - 1) / factor, oh = (h + factor - 1) / factor;
+  unsigned ox, oy, x, y;
+  size_t c;
+
+  for(oy = 0; oy != oh; ++oy)
+  {
+    unsigned y1 = oy * factor + factor < h ? oy * factor + factor : h;
+    for(ox = 0; ox != ow; ++ox)
     {
-      if(state->decoder.read_text_chunks)
+      unsigned x1 = ox * factor + factor < w ? ox * factor + factor : w;
+      unsigned count = (x1 - ox * factor) * (y1 - oy * factor);
+      unsigned sum[4] = {0, 0, 0, 0}; /*at most 64 values of 16 bits per channel*/
+      unsigned char* pixel = &out[((size_t)oy * ow + ox) * pixelbytes];
+      for(y = oy * factor; y != y1; ++y)
+      {
+        const unsigned char* p = &in[((size_t)y * w + ox * factor) * pixelbytes];
+        if(bytes == 1)
+        {
+          for(x = ox * factor; x != x1; ++x, p += pixelbytes)
+          {
+            for(c = 0; c != channels; ++c) sum[c] += p[c];
+          }
+        }
+        else
+        {
+          for(x = ox * factor; x != x1; ++x, p += pixelbytes)
+          {
+            for(c = 0; c != channels; ++c) sum[c] += 256u * p[2 * c] + p[2 * c + 1];
+          }
+        }
+      }
+      for(c = 0; c != channels; ++c)
       {
-        state->error = readChunk_iTXt(&state->info_png, &state->decoder.zlibsettings, data, chunkLength);
-        if(state->error) break;
+        unsigned value = (sum[c] + count / 2) / count;
+        if(bytes == 2)
+        {
+          pixel[2 * c] = (unsigned char)(value >> 8);
+          pixel[2 * c + 1] = (unsigned char)(value & 255);
+        }
+        else pixel[c] = (unsigned char)value;
       }
     }
-    else if(lodepng_chunk_type_equals(chunk, "tIME"))
+  }
+}
+
+/*decodes the crop rectangle of the decoder settings, downscaled, in the output color mode. Inflates and
+unfilters only the rows it needs, and of Adam7 images that are point sampled, only the first passes.*/
+static unsigned decodeRegion(unsigned char** out, unsigned* w, unsigned* h,
+                             LodePNGState* state,
+                             const unsigned char* in, size_t insize)
+{
+  const LodePNGDecoderSettings* settings = &state->decoder;
+  const LodePNGInfo* info = &state->info_png;
+  unsigned scale = settings->downscale, crop = settings->crop_w && settings->crop_h;
+  unsigned x0 = 0, y0 = 0, cw = 0, ch = 0, step, rw, rh, bpp, passes, i, x, y, before;
+  unsigned passw[7], passh[7], passrows[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  size_t need = 0, obp = 0, rawsize;
+  ucvector idat, scanlines;
+  const unsigned char* zdata;
+  size_t zsize;
+  unsigned char* region = 0;
+  unsigned char* data;
+  unsigned error;
+
+  *out = 0;
+  ucvector_init(&idat);
+  ucvector_init(&scanlines);
+
+  while(1) /*not really a while loop, only used to break on error*/
+  {
+    error = readChunks(w, h, state, in, insize, &idat, &zdata, &zsize, 0);
+    if(error) break;
+
+    if(scale != 1 && scale != 2 && scale != 4 && scale != 8) CERROR_BREAK(error, 99);
+    x0 = crop ? settings->crop_x : 0;
+    y0 = crop ? settings->crop_y : 0;
+    if(x0 >= *w || y0 >= *h) CERROR_BREAK(error, 99);
+    cw = crop && settings->crop_w < *w - x0 ? settings->crop_w : *w - x0;
+    ch = crop && settings->crop_h < *h - y0 ? settings->crop_h : *h - y0;
+
+    if(!settings->color_convert)
     {
-      state->error = readChunk_tIME(&state->info_png, data, chunkLength);
-      if(state->error) break;
+      error = lodepng_color_mode_copy(&state->info_raw, &info->color);
+      if(error) break;
     }
-    else if(lodepng_chunk_type_equals(chunk, "pHYs"))
+    else if(!lodepng_color_mode_equal(&state->info_raw, &info->color)
+            && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+            && !(state->info_raw.bitdepth == 8))
     {
-      state->error = readChunk_pHYs(&state->info_png, data, chunkLength);
+      CERROR_BREAK(error, 56); /*unsupported color mode conversion, as in decodeAndConvert*/
+    }
+    if(scale != 1 && (state->info_raw.colortype == LCT_PALETTE || state->info_raw.bitdepth < 8))
+    {
+      CERROR_BREAK(error, 100);
+    }
+
+    bpp = lodepng_get_bpp(&info->color);
+    /*the top left pixels of the squares of an Adam7 image are all in the first passes*/
+    step = info->interlace_method && scale != 1 && x0 % scale == 0 && y0 % scale == 0 ? scale : 1;
+    passes = step == 8 ? 1 : step == 4 ? 3 : step == 2 ? 5 : 7;
+    rw = (cw + step - 1) / step;
+    rh = (ch + step - 1) / step;
+
+    /*the scanlines up to the last row that's needed*/
+    if(!info->interlace_method) need = (size_t)(y0 + ch) * (1 + ((size_t)*w * bpp + 7) / 8);
+    else
+    {
+      Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, *w, *h, bpp);
+      for(i = 0; i != 7; ++i)
+      {
+        passrows[i] = 0;
+        if(i < passes && y0 + ch > ADAM7_IY[i])
+        {
+          passrows[i] = (y0 + ch - ADAM7_IY[i] + ADAM7_DY[i] - 1) / ADAM7_DY[i];
+        }
+        if(passrows[i] > passh[i]) passrows[i] = passh[i];
+        if(passrows[i]) need = filter_passstart[i] + passrows[i] * (1 + ((size_t)passw[i] * bpp + 7) / 8);
+      }
+    }
+    error = inflateScanlinesPart(&scanlines, need, *w, *h, state, zdata, zsize);
+    if(error) break;
+
+    if(!info->interlace_method)
+    {
+      size_t linebytes = ((size_t)*w * bpp + 7) / 8;
+      /*the rows above the first one are only needed back to one with filter type None or Sub*/
+      for(y = y0; y > 0 && scanlines.data[y * (linebytes + 1)] > 1; --y) {}
+      error = unfilterRows(scanlines.data, linebytes, (bpp + 7) / 8, y, y0 + ch);
+    }
+    else
+    {
+      for(i = 0; i != 7 && !error; ++i)
+      {
+        error = unfilterRows(&scanlines.data[filter_passstart[i]], ((size_t)passw[i] * bpp + 7) / 8,
+                             (bpp + 7) / 8, 0, passrows[i]);
+      }
+    }
+    if(error) break;
+
+    /*gather the pixels, still in the color mode of the PNG*/
+    rawsize = lodepng_get_raw_size(rw, rh, &info->color);
+    region = (unsigned char*)lodepng_malloc(rawsize);
+    if(!region) CERROR_BREAK(error, 83); /*alloc fail*/
+    if(bpp < 8) memset(region, 0, rawsize);
+    for(y = 0; y != rh; ++y)
+    {
+      if(!info->interlace_method && bpp >= 8)
+      {
+        /*the row is in one piece*/
+        size_t ibp = regionBitPos(x0, y0 + y, *w, bpp, 0, passw, filter_passstart);
+        memcpy(&region[obp / 8], &scanlines.data[ibp / 8], (size_t)rw * bpp / 8);
+        obp += (size_t)rw * bpp;
+        continue;
+      }
+      for(x = 0; x != rw; ++x)
+      {
+        size_t ibp = regionBitPos(x0 + x * step, y0 + y * step, *w, bpp, info->interlace_method,
+                                  passw, filter_passstart);
+        if(bpp >= 8)
+        {
+          memcpy(&region[obp / 8], &scanlines.data[ibp / 8], bpp / 8);
+          obp += bpp;
+        }
+        else
+        {
+          unsigned b;
+          for(b = 0; b != bpp; ++b)
+          {
+            setBitOfReversedStream0(&obp, region, readBitFromReversedStream(&ibp, scanlines.data));
+          }
+        }
+      }
+    }
+
+    /*averaging commutes with the conversion of channels of the same bit depth without color key, so then
+    only the smaller image is converted*/
+    before = scale != step && info->color.colortype != LCT_PALETTE && !info->color.key_defined
+          && info->color.bitdepth == state->info_raw.bitdepth;
+    for(i = 0; i != 2 && !error; ++i)
+    {
+      if(i == before && !lodepng_color_mode_equal(&state->info_raw, &info->color))
+      {
+        data = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(rw, rh, &state->info_raw));
+        if(!data) CERROR_BREAK(error, 83); /*alloc fail*/
+        error = lodepng_convert(data, region, &state->info_raw, &info->color, rw, rh);
+        lodepng_free(region);
+        region = data;
+      }
+      if(i != before && scale != step)
+      {
+        const LodePNGColorMode* mode = before ? &info->color : &state->info_raw;
+        data = (unsigned char*)lodepng_malloc(lodepng_get_raw_size((rw + scale - 1) / scale,
+                                                                   (rh + scale - 1) / scale, mode));
+        if(!data) CERROR_BREAK(error, 83); /*alloc fail*/
+        downscaleBox(data, region, rw, rh, scale, mode);
+        lodepng_free(region);
+        region = data;
+        rw = (rw + scale - 1) / scale;
+        rh = (rh + scale - 1) / scale;
+      }
+    }
+    if(error) break;
+
+    *out = region;
+    region = 0;
+    *w = (cw + scale - 1) / scale;
+    *h = (ch + scale - 1) / scale;
+    break;
+  }
+
+  lodepng_free(region);
+  ucvector_cleanup(&idat);
+  ucvector_cleanup(&scanlines);
+  state->error = error;
+  return error;
+}
+
+static unsigned decodeAndConvert(unsigned char** out, unsigned* w, unsigned* h,
+                                 LodePNGState* state,
+                                 const unsigned char* in, size_t insize)
+{
+  *out = 0;
+  if(isRegionDecode(&state->decoder)) return decodeRegion(out, w, h, state, in, insize);
+  decodeGeneric(out, w, h, state, in, insize);
+  if(state->error) return state->error;
+  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
+  {
+    /*same color type, no copying or converting of data needed*/
+    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
+    the raw image has to the end user*/
+    if(!state->decoder.color_convert)
+    {
+      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+      if(state->error) return state->error;
+    }
+  }
+  else
+  {
+    /*color conversion needed; sort of copy of the data*/
+    unsigned char* data = *out;
+    size_t outsize;
+
+    /*TODO: check if this works according to the statement in the documentation: "The converter can convert
+    from greyscale input color type, to 8-bit greyscale or greyscale with alpha"*/
+    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+       && !(state->info_raw.bitdepth == 8))
+    {
+      return 56; /*unsupported color mode conversion*/
+    }
+
+    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
+    *out = (unsigned char*)lodepng_malloc(outsize);
+    if(!(*out))
+    {
+      state->error = 83; /*alloc fail*/
+    }
+    else state->error = lodepng_convert(*out, data, &state->info_raw,
+                                        &state->info_png.color, *w, *h);
+    lodepng_free(data);
+  }
+  return state->error;
+}
+
+unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
+                        LodePNGState* state,
+                        const unsigned char* in, size_t insize)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(state->allocator);
+  unsigned error = decodeAndConvert(out, w, h, state, in, insize);
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
+unsigned lodepng_decode_into(unsigned char* out, size_t stride, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize,
+                             LodePNGDecodeScratch* scratch)
+{
+  LodePNGDecodeScratch temp;
+  ucvector idat, scanlines;
+  const unsigned char* zdata;
+  size_t zsize;
+  const LodePNGColorMode* mode_out = &state->info_raw;
+  unsigned convert = 0;
+  size_t linebytes;
+  const LodePNGAllocator* previous;
+
+  if(!scratch)
+  {
+    lodepng_decode_scratch_init(&temp);
+    scratch = &temp;
+  }
+  /*the scratch memory is reallocated with the allocator of the state, so it must come from there*/
+  if(scratch->allocator != state->allocator) lodepng_decode_scratch_cleanup(scratch);
+  scratch->allocator = state->allocator;
+  previous = lodepng_use_allocator(state->allocator);
+  /*take over the scratch memory, it goes back to the scratch afterwards however big it has grown*/
+  idat.data = scratch->idat;
+  idat.allocsize = scratch->idatsize;
+  idat.size = 0;
+  scanlines.data = scratch->scanlines;
+  scanlines.allocsize = scratch->scanlinessize;
+  scanlines.size = 0;
+
+  while(1) /*not really a while loop, only used to break on error*/
+  {
+    if(isRegionDecode(&state->decoder)) CERROR_BREAK(state->error, 101);
+    state->error = readChunks(w, h, state, in, insize, &idat, &zdata, &zsize, 0);
+    if(state->error) break;
+
+    if(!state->decoder.color_convert)
+    {
+      /*let info_raw reflect the color type of the output, as lodepng_decode does*/
+      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
       if(state->error) break;
     }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    else /*it's not an implemented chunk type, so ignore it: skip over the data*/
+    else if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
     {
-      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
-      if(!state->decoder.ignore_critical && !lodepng_chunk_ancillary(chunk))
+      /*the same conversions as lodepng_decode supports*/
+      if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+         && !(state->info_raw.bitdepth == 8))
       {
-        CERROR_BREAK(state->error, 69);
+        CERROR_BREAK(state->error, 56); /*unsupported color mode conversion*/
       }
+      convert = 1;
+    }
 
-      unknown = 1;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-      if(state->decoder.remember_unknown_chunks)
+    /*the last row doesn't need the whole stride, e.g. for a texture that is a region of a bigger buffer*/
+    linebytes = lodepng_get_raw_size(*w, 1, mode_out);
+    if(stride < linebytes || outsize < linebytes || (outsize - linebytes) / stride < *h - 1)
+    {
+      CERROR_BREAK(state->error, 95);
+    }
+
+    /*with Adam7 and conversion, a converted row of a reduced image is kept after the scanlines*/
+    state->error = inflateScanlines(&scanlines, (convert && state->info_png.interlace_method) ? linebytes : 0,
+                                    *w, *h, state, zdata, zsize);
+    if(state->error) break;
+
+    state->error = writeScanlines(out, stride, scanlines.data, &scanlines.data[scanlines.size], *w, *h,
+                                  mode_out, &state->info_png, convert);
+    break;
+  }
+
+  scratch->idat = idat.data;
+  scratch->idatsize = idat.allocsize;
+  scratch->scanlines = scanlines.data;
+  scratch->scanlinessize = scanlines.allocsize;
+  lodepng_restore_allocator(previous);
+  if(scratch == &temp) lodepng_decode_scratch_cleanup(&temp);
+  return state->error;
+}
+
+void lodepng_decode_scratch_init(LodePNGDecodeScratch* scratch)
+{
+  scratch->idat = 0;
+  scratch->idatsize = 0;
+  scratch->scanlines = 0;
+  scratch->scanlinessize = 0;
+  scratch->allocator = 0;
+}
+
+void lodepng_decode_scratch_cleanup(LodePNGDecodeScratch* scratch)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(scratch->allocator);
+  lodepng_free(scratch->idat);
+  lodepng_free(scratch->scanlines);
+  lodepng_restore_allocator(previous);
+  lodepng_decode_scratch_init(scratch);
+}
+
+unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
+                               size_t insize, LodePNGColorType colortype, unsigned bitdepth)
+{
+  unsigned error;
+  LodePNGState state;
+  lodepng_state_init(&state);
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  error = lodepng_decode(out, w, h, &state, in, insize);
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
+unsigned lodepng_decode32(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+{
+  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGBA, 8);
+}
+
+unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+{
+  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGB, 8);
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
+                             LodePNGColorType colortype, unsigned bitdepth)
+{
+  LodePNGMappedFile file;
+  unsigned error;
+  error = lodepng_map_file(&file, filename);
+  if(!error) error = lodepng_decode_memory(out, w, h, file.data, file.size, colortype, bitdepth);
+  lodepng_unmap_file(&file);
+  return error;
+}
+
+unsigned lodepng_decode32_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename)
+{
+  return lodepng_decode_file(out, w, h, filename, LCT_RGBA, 8);
+}
+
+unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename)
+{
+  return lodepng_decode_file(out, w, h, filename, LCT_RGB, 8);
+}
+#endif /*LODEPNG_COMPILE_DISK*/
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Stream Decoder                                                         / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+typedef enum StreamStage
+{
+  STREAM_HEADER, /*collecting the signature and the IHDR chunk*/
+  STREAM_CHUNK, /*collecting the length and type of the next chunk*/
+  STREAM_CHUNK_DATA, /*collecting the rest of a chunk other than IDAT*/
+  STREAM_IDAT, /*passing the data of an IDAT chunk on to the inflater*/
+  STREAM_IDAT_CRC, /*collecting the CRC of an IDAT chunk*/
+  STREAM_END /*the IEND chunk was read*/
+} StreamStage;
+
+typedef enum ZlibStage
+{
+  ZLIB_HEADER, /*the 2-byte zlib header*/
+  ZLIB_BLOCK, /*the header of a deflate block, including its dynamic trees*/
+  ZLIB_HUFFMAN, /*the symbols of a block with fixed or dynamic trees*/
+  ZLIB_STORED, /*the bytes of an uncompressed block*/
+  ZLIB_ADLER, /*the adler32 checksum after the last block*/
+  ZLIB_DONE
+} ZlibStage;
+
+/*the private part of LodePNGStreamDecoder*/
+typedef struct StreamDecoderState
+{
+  StreamStage stage;
+  ucvector input; /*the signature and IHDR, or the current chunk other than IDAT, collected so far*/
+  size_t needed; /*size input must reach before it is processed*/
+  size_t idat_length; /*data size of the current IDAT chunk*/
+  size_t idat_remaining; /*bytes of its data that are still to come*/
+  unsigned idat_crc; /*CRC of the current IDAT chunk so far*/
+  unsigned critical_pos; /*1 = after IHDR, 2 = after PLTE, 3 = after IDAT*/
+  unsigned unknown; /*an unknown chunk was seen, like in decodeGeneric no CRCs are checked after that*/
+
+  /*inflater: zdata holds the IDAT data that is not consumed yet, window the inflated bytes that are not
+  unfiltered yet plus 32K of history for the back references*/
+  ZlibStage zstage;
+  ucvector zdata;
+  size_t zbit; /*bit position in zdata*/
+  unsigned zfinal; /*all IDAT data is in zdata*/
+  unsigned bfinal; /*the current block is the last one*/
+  size_t stored_remaining; /*bytes of the current uncompressed block still to copy*/
+  HuffmanTree tree_ll, tree_d; /*trees of the current compressed block*/
+  unsigned adler;
+  ucvector window;
+  size_t rowpos; /*position in window of the next filtered scanline*/
+
+  /*scanlines: pass is the Adam7 pass (only pass 0 without interlacing), 7 when all rows are done*/
+  unsigned pass, y;
+  unsigned passw[7], passh[7];
+  unsigned char* line; /*the current unfiltered scanline*/
+  unsigned char* prevline; /*the previous one, in the same pass*/
+  unsigned char* converted; /*the scanline in the color type of info_raw, or 0 if no conversion is needed*/
+  unsigned char* image; /*for the preview function, the whole image in the color type of info_raw, or 0*/
+} StreamDecoderState;
+
+static void StreamDecoderState_init(StreamDecoderState* s)
+{
+  unsigned i;
+  s->stage = STREAM_HEADER;
+  ucvector_init(&s->input);
+  s->needed = 33; /*signature and IHDR chunk, as lodepng_inspect reads them*/
+  s->idat_length = s->idat_remaining = 0;
+  s->idat_crc = 0;
+  s->critical_pos = 1;
+  s->unknown = 0;
+  s->zstage = ZLIB_HEADER;
+  ucvector_init(&s->zdata);
+  s->zbit = 0;
+  s->zfinal = 0;
+  s->bfinal = 0;
+  s->stored_remaining = 0;
+  HuffmanTree_init(&s->tree_ll);
+  HuffmanTree_init(&s->tree_d);
+  s->adler = 1;
+  ucvector_init(&s->window);
+  s->rowpos = 0;
+  s->pass = s->y = 0;
+  /*no rows until streamImageStart, also if the image ends without any IDAT chunk*/
+  for(i = 0; i != 7; ++i) s->passw[i] = s->passh[i] = 0;
+  s->line = s->prevline = s->converted = s->image = 0;
+}
+
+static void StreamDecoderState_cleanup(StreamDecoderState* s)
+{
+  ucvector_cleanup(&s->input);
+  ucvector_cleanup(&s->zdata);
+  HuffmanTree_cleanup(&s->tree_ll);
+  HuffmanTree_cleanup(&s->tree_d);
+  ucvector_cleanup(&s->window);
+  lodepng_free(s->line);
+  lodepng_free(s->prevline);
+  lodepng_free(s->converted);
+  lodepng_free(s->image);
+}
+
+/*
+inflates a bit more of the IDAT data received so far. As long as not all IDAT data is there, it only starts
+on a part of the stream when zdata has enough bits to finish it, so running out of input is never an error
+then, *progress is 0 if it has to wait for more data.
+*/
+static unsigned inflateStream(StreamDecoderState* s, const LodePNGDecompressSettings* settings, unsigned* progress)
+{
+  unsigned error = 0;
+  size_t start = s->window.size;
+  size_t zbit = s->zbit;
+  size_t insize = s->zdata.size;
+  size_t available = insize * 8 - zbit; /*bits*/
+  ZlibStage zstage = s->zstage;
+  LodePNGBitReader reader;
+
+  LodePNGBitReader_init(&reader, s->zdata.data, insize);
+  LodePNGBitReader_seek(&reader, zbit / 8);
+  readBits(&reader, (unsigned)(zbit & 7));
+
+  switch(s->zstage)
+  {
+    case ZLIB_HEADER:
+      if(available < 16)
       {
-        state->error = lodepng_chunk_append(&state->info_png.unknown_chunks_data[critical_pos - 1],
-                                            &state->info_png.unknown_chunks_size[critical_pos - 1], chunk);
-        if(state->error) break;
+        if(s->zfinal) error = 53; /*error, size of zlib data too small*/
+        break;
       }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+      error = checkZlibHeader(&s->zdata.data[zbit / 8]);
+      readBits(&reader, 16);
+      s->zstage = ZLIB_BLOCK;
+      break;
+    case ZLIB_BLOCK:
+    {
+      unsigned BTYPE;
+      /*the longest block header: 3 bits, 14 bits of tree sizes, 19 * 3 bits of code length code lengths and
+      320 code lengths of at most 7 + 7 bits*/
+      if(!s->zfinal && available < 4554) break;
+      /*error, bit pointer will jump past memory*/
+      if(LodePNGBitReader_position(&reader) + 2 >= insize * 8) ERROR_BREAK(52);
+      s->bfinal = readBits(&reader, 1);
+      BTYPE = readBits(&reader, 2);
+      if(BTYPE == 3) ERROR_BREAK(20); /*error: invalid BTYPE*/
+      if(BTYPE == 0) /*no compression*/
+      {
+        unsigned LEN, NLEN;
+        const unsigned char* in = s->zdata.data;
+        /*go to first boundary of byte*/
+        size_t p = (LodePNGBitReader_position(&reader) + 7) / 8;
+        if(p + 4 >= insize) ERROR_BREAK(52); /*error, bit pointer will jump past memory*/
+        LEN = in[p] + 256u * in[p + 1];
+        NLEN = in[p + 2] + 256u * in[p + 3];
+        if(LEN + NLEN != 65535) ERROR_BREAK(21); /*error: NLEN is not one's complement of LEN*/
+        LodePNGBitReader_seek(&reader, p + 4);
+        s->stored_remaining = LEN;
+        s->zstage = ZLIB_STORED;
+      }
+      else
+      {
+        HuffmanTree_cleanup(&s->tree_ll);
+        HuffmanTree_cleanup(&s->tree_d);
+        HuffmanTree_init(&s->tree_ll);
+        HuffmanTree_init(&s->tree_d);
+        if(BTYPE == 1) getTreeInflateFixed(&s->tree_ll, &s->tree_d);
+        else error = getTreeInflateDynamic(&s->tree_ll, &s->tree_d, &reader);
+        s->zstage = ZLIB_HUFFMAN;
+      }
+      break;
+    }
+    case ZLIB_HUFFMAN:
+    {
+      unsigned end;
+      size_t pos = s->window.size;
+      if(!s->zfinal && available < 48) break;
+      /*outputs at most 64K at once, so the rows can be handed out before the window grows further*/
+      error = inflateHuffmanSymbols(&s->window, &reader, &pos, &s->tree_ll, &s->tree_d,
+                                    s->zfinal ? (size_t)(-1) : insize * 8 - 48, pos + 65536, &end);
+      if(!error && end) s->zstage = s->bfinal ? ZLIB_ADLER : ZLIB_BLOCK;
+      break;
+    }
+    case ZLIB_STORED:
+    {
+      size_t p = LodePNGBitReader_position(&reader) / 8; /*byte aligned*/
+      size_t n = s->stored_remaining;
+      if(n > insize - p) n = insize - p;
+      if(n > 65536) n = 65536;
+      if(n == 0 && s->stored_remaining)
+      {
+        if(s->zfinal) error = 23; /*error: reading outside of in buffer*/
+        break;
+      }
+      if(!ucvector_resize(&s->window, start + n)) ERROR_BREAK(83); /*alloc fail*/
+      memcpy(&s->window.data[start], &s->zdata.data[p], n);
+      LodePNGBitReader_seek(&reader, p + n);
+      s->stored_remaining -= n;
+      if(!s->stored_remaining) s->zstage = s->bfinal ? ZLIB_ADLER : ZLIB_BLOCK;
+      break;
+    }
+    case ZLIB_ADLER:
+    {
+      size_t p = (LodePNGBitReader_position(&reader) + 7) / 8;
+      if(!settings->ignore_adler32)
+      {
+        if(p + 4 > insize)
+        {
+          if(s->zfinal) error = 58; /*error, adler checksum not correct, data must be corrupted*/
+          break;
+        }
+        if(lodepng_read32bitInt(&s->zdata.data[p]) != s->adler) ERROR_BREAK(58);
+        p += 4;
+      }
+      LodePNGBitReader_seek(&reader, p);
+      s->zstage = ZLIB_DONE;
+      break;
+    }
+    case ZLIB_DONE:
+      break;
+  }
+
+  if(!error)
+  {
+    /*data after the zlib stream is ignored, like the non-streaming decoder does*/
+    s->zbit = s->zstage == ZLIB_DONE ? insize * 8 : LodePNGBitReader_position(&reader);
+    if(!settings->ignore_adler32)
+    {
+      s->adler = update_adler32(s->adler, &s->window.data[start], (unsigned)(s->window.size - start));
+    }
+  }
+  *progress = s->zstage != zstage || s->zbit != zbit;
+  return error;
+}
+
+/*puts the count pixels of a row of Adam7 pass (0-6) in the image, at their place in row y*/
+static void Adam7_placeRow(unsigned char* image, const unsigned char* pixels, unsigned count, unsigned w,
+                           unsigned y, unsigned bpp, unsigned pass)
+{
+  unsigned x;
+  if(bpp >= 8)
+  {
+    size_t bytewidth = bpp / 8;
+    unsigned char* dest = &image[((size_t)y * w + ADAM7_IX[pass]) * bytewidth];
+    for(x = 0; x != count; ++x, dest += ADAM7_DX[pass] * bytewidth) memcpy(dest, &pixels[x * bytewidth], bytewidth);
+  }
+  else
+  {
+    size_t ibp = 0;
+    for(x = 0; x != count; ++x)
+    {
+      size_t obp = ((size_t)y * w + ADAM7_IX[pass] + (size_t)x * ADAM7_DX[pass]) * bpp;
+      unsigned b;
+      for(b = 0; b != bpp; ++b) setBitOfReversedStream(&obp, image, readBitFromReversedStream(&ibp, pixels));
+    }
+  }
+}
+
+/*fills the pixels of the image that come in the Adam7 passes after pass (0-6) with a copy of the pixel at the
+top left of their block, which is in that pass or an earlier one*/
+static void Adam7_fillBlocks(unsigned char* image, unsigned w, unsigned h, unsigned bpp, unsigned pass)
+{
+  /*the block size after each pass: the distance between the pixels of that pass and the ones before it*/
+  static const unsigned BLOCKW[7] = {8, 4, 4, 2, 2, 1, 1}, BLOCKH[7] = {8, 8, 4, 4, 2, 2, 1};
+  unsigned bw = BLOCKW[pass], bh = BLOCKH[pass], x, y;
+  size_t bytewidth = bpp / 8;
+  for(y = 0; y != h; ++y)
+  {
+    if(y % bh)
+    {
+      /*the whole row is a copy of the one at the top of the blocks, which is filled already*/
+      if(bpp >= 8)
+      {
+        memcpy(&image[(size_t)y * w * bytewidth], &image[(size_t)(y - y % bh) * w * bytewidth], w * bytewidth);
+      }
+      else
+      {
+        size_t ibp = (size_t)(y - y % bh) * w * bpp, obp = (size_t)y * w * bpp, i;
+        for(i = 0; i != (size_t)w * bpp; ++i)
+        {
+          setBitOfReversedStream(&obp, image, readBitFromReversedStream(&ibp, image));
+        }
+      }
+    }
+    else if(bw != 1)
+    {
+      for(x = 0; x != w; ++x)
+      {
+        if(x % bw == 0) continue;
+        if(bpp >= 8)
+        {
+          memcpy(&image[((size_t)y * w + x) * bytewidth], &image[((size_t)y * w + x - x % bw) * bytewidth], bytewidth);
+        }
+        else
+        {
+          size_t ibp = ((size_t)y * w + x - x % bw) * bpp, obp = ((size_t)y * w + x) * bpp;
+          unsigned b;
+          for(b = 0; b != bpp; ++b) setBitOfReversedStream(&obp, image, readBitFromReversedStream(&ibp, image));
+        }
+      }
+    }
+  }
+}
+
+/*unfilters and hands out the rows that are complete in the window*/
+static unsigned streamRows(LodePNGStreamDecoder* decoder, StreamDecoderState* s)
+{
+  LodePNGState* state = &decoder->state;
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  size_t bytewidth = (bpp + 7) / 8;
+  unsigned interlaced = state->info_png.interlace_method == 1;
+
+  while(s->pass != 7)
+  {
+    unsigned w = s->passw[s->pass];
+    size_t linebytes = ((size_t)w * bpp + 7) / 8;
+    const unsigned char* scanline = &s->window.data[s->rowpos];
+    unsigned char* swap;
+    unsigned error;
+    if(s->window.size - s->rowpos < linebytes + 1) break;
+
+    error = unfilterScanline(s->line, &scanline[1], s->y ? s->prevline : 0, bytewidth, scanline[0], linebytes);
+    if(error) return error;
+    s->rowpos += linebytes + 1;
+
+    if(s->converted)
+    {
+      error = lodepng_convert(s->converted, s->line, &state->info_raw, &state->info_png.color, w, 1);
+      if(error) return error;
+    }
+    if(decoder->row)
+    {
+      if(interlaced)
+      {
+        decoder->row(decoder->user, s->converted ? s->converted : s->line, w, ADAM7_IX[s->pass], ADAM7_DX[s->pass],
+                     ADAM7_IY[s->pass] + s->y * ADAM7_DY[s->pass]);
+      }
+      else decoder->row(decoder->user, s->converted ? s->converted : s->line, w, 0, 1, s->y);
     }
+    if(s->image)
+    {
+      Adam7_placeRow(s->image, s->converted ? s->converted : s->line, w, decoder->width,
+                     ADAM7_IY[s->pass] + s->y * ADAM7_DY[s->pass], lodepng_get_bpp(&state->info_raw), s->pass);
+    }
+
+    swap = s->prevline;
+    s->prevline = s->line;
+    s->line = swap;
+    if(++s->y == s->passh[s->pass])
+    {
+      unsigned done = s->pass;
+      /*the next reduced image that isn't empty*/
+      s->y = 0;
+      do ++s->pass; while(s->pass != 7 && s->passh[s->pass] == 0);
+      /*from preview_pass on, and always after the last pass with pixels: small images, such as 1x1, have
+      empty passes at the end and are complete before preview_pass*/
+      if(s->image && (done + 1 >= decoder->preview_pass || s->pass == 7))
+      {
+        Adam7_fillBlocks(s->image, decoder->width, decoder->height, lodepng_get_bpp(&state->info_raw), done);
+        decoder->preview(decoder->user, s->image, decoder->width, decoder->height, done + 1);
+      }
+    }
+  }
+  /*more image data than the size of the image needs*/
+  if(s->pass == 7 && s->window.size != s->rowpos) return 91;
+  return 0;
+}
+
+/*inflates and hands out all the rows the IDAT data received so far allows*/
+static unsigned streamImageData(LodePNGStreamDecoder* decoder, StreamDecoderState* s)
+{
+  unsigned error = 0;
+  for(;;)
+  {
+    unsigned progress;
+    size_t start;
+    error = streamRows(decoder, s);
+    if(error || s->zstage == ZLIB_DONE) break;
 
-    if(!state->decoder.ignore_crc && !unknown) /*check CRC if wanted, only on known chunk types*/
+    /*drop window bytes that are unfiltered and too far back for the inflater*/
+    start = s->window.size > 32768 ? s->window.size - 32768 : 0;
+    if(start > s->rowpos) start = s->rowpos;
+    if(start >= 32768)
     {
-      if(lodepng_chunk_check_crc(chunk)) CERROR_BREAK(state->error, 57); /*invalid CRC*/
+      memmove(s->window.data, &s->window.data[start], s->window.size - start);
+      s->window.size -= start;
+      s->rowpos -= start;
     }
 
-    if(!IEND) chunk = lodepng_chunk_next_const(chunk);
+    error = inflateStream(s, &decoder->state.decoder.zlibsettings, &progress);
+    if(error || !progress) break;
   }
 
-  ucvector_init(&scanlines);
-  /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
-  If the decompressed size does not match the prediction, the image must be corrupt.*/
-  if(state->info_png.interlace_method == 0)
+  /*drop the consumed IDAT data*/
+  if(s->zbit / 8 >= 32768 || (s->zbit != 0 && s->zbit == s->zdata.size * 8))
   {
-    /*The extra *h is added because this are the filter bytes every scanline starts with*/
-    predict = lodepng_get_raw_size_idat(*w, *h, &state->info_png.color) + *h;
+    size_t consumed = s->zbit / 8;
+    memmove(s->zdata.data, &s->zdata.data[consumed], s->zdata.size - consumed);
+    s->zdata.size -= consumed;
+    s->zbit -= consumed * 8;
   }
-  else
-  {
-    /*Adam-7 interlaced: predicted size is the sum of the 7 sub-images sizes*/
-    const LodePNGColorMode* color = &state->info_png.color;
-    predict = 0;
-    predict += lodepng_get_raw_size_idat((*w + 7) >> 3, (*h + 7) >> 3, color) + ((*h + 7) >> 3);
-    if(*w > 4) predict += lodepng_get_raw_size_idat((*w + 3) >> 3, (*h + 7) >> 3, color) + ((*h + 7) >> 3);
-    predict += lodepng_get_raw_size_idat((*w + 3) >> 2, (*h + 3) >> 3, color) + ((*h + 3) >> 3);
-    if(*w > 2) predict += lodepng_get_raw_size_idat((*w + 1) >> 2, (*h + 3) >> 2, color) + ((*h + 3) >> 2);
-    predict += lodepng_get_raw_size_idat((*w + 1) >> 1, (*h + 1) >> 2, color) + ((*h + 1) >> 2);
-    if(*w > 1) predict += lodepng_get_raw_size_idat((*w + 0) >> 1, (*h + 1) >> 1, color) + ((*h + 1) >> 1);
-    predict += lodepng_get_raw_size_idat((*w + 0), (*h + 0) >> 1, color) + ((*h + 0) >> 1);
-  }
-  if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
-  if(!state->error)
+  return error;
+}
+
+/*prepares the scanline buffers at the first IDAT chunk, when all chunks the colors depend on are known*/
+static unsigned streamImageStart(LodePNGStreamDecoder* decoder, StreamDecoderState* s)
+{
+  LodePNGState* state = &decoder->state;
+  unsigned w = decoder->width, h = decoder->height;
+  size_t linebytes = lodepng_get_raw_size(w, 1, &state->info_png.color);
+  unsigned i;
+
+  if(!state->decoder.color_convert)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
-    if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
+    unsigned error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    if(error) return error;
   }
-  ucvector_cleanup(&idat);
-
-  if(!state->error)
+  else if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
   {
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!*out) state->error = 83; /*alloc fail*/
+    /*same restriction as lodepng_decode*/
+    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+       && !(state->info_raw.bitdepth == 8))
+    {
+      return 56; /*unsupported color mode conversion*/
+    }
+    s->converted = (unsigned char*)lodepng_malloc(lodepng_get_raw_size(w, 1, &state->info_raw));
+    if(!s->converted) return 83; /*alloc fail*/
   }
-  if(!state->error)
+
+  s->line = (unsigned char*)lodepng_malloc(linebytes);
+  s->prevline = (unsigned char*)lodepng_malloc(linebytes);
+  if(!s->line || !s->prevline) return 83; /*alloc fail*/
+  if(decoder->preview && state->info_png.interlace_method == 1)
   {
-    for(i = 0; i < outsize; i++) (*out)[i] = 0;
-    state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
+    /*cleared, so that the previews have no undefined padding bits after the last pixel*/
+    size_t size = lodepng_get_raw_size(w, h, &state->info_raw);
+    s->image = (unsigned char*)lodepng_malloc(size);
+    if(!s->image) return 83; /*alloc fail*/
+    memset(s->image, 0, size);
   }
-  ucvector_cleanup(&scanlines);
-}
 
-unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
-                        LodePNGState* state,
-                        const unsigned char* in, size_t insize)
-{
-  *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
-  if(state->error) return state->error;
-  if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
+  if(state->info_png.interlace_method == 0)
   {
-    /*same color type, no copying or converting of data needed*/
-    /*store the info_png color settings on the info_raw so that the info_raw still reflects what colortype
-    the raw image has to the end user*/
-    if(!state->decoder.color_convert)
-    {
-      state->error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
-      if(state->error) return state->error;
-    }
+    s->passw[0] = w;
+    s->passh[0] = h;
+    for(i = 1; i != 7; ++i) s->passw[i] = s->passh[i] = 0;
   }
   else
   {
-    /*color conversion needed; sort of copy of the data*/
-    unsigned char* data = *out;
-    size_t outsize;
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(s->passw, s->passh, filter_passstart, padded_passstart, passstart,
+                        w, h, lodepng_get_bpp(&state->info_png.color));
+  }
+  s->pass = 0;
+  while(s->pass != 7 && s->passh[s->pass] == 0) ++s->pass;
+  s->y = 0;
 
-    /*TODO: check if this works according to the statement in the documentation: "The converter can convert
-    from greyscale input color type, to 8-bit greyscale or greyscale with alpha"*/
-    if(!(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
-       && !(state->info_raw.bitdepth == 8))
+  return decoder->header ? decoder->header(decoder->user, w, h) : 0;
+}
+
+/*processes s->input once it has s->needed bytes*/
+static unsigned streamInput(LodePNGStreamDecoder* decoder, StreamDecoderState* s)
+{
+  LodePNGState* state = &decoder->state;
+  const unsigned char* chunk = s->input.data;
+  unsigned error = 0;
+
+  switch(s->stage)
+  {
+    case STREAM_HEADER:
     {
-      return 56; /*unsupported color mode conversion*/
+      unsigned w, h;
+      error = lodepng_inspect(&w, &h, state, s->input.data, s->input.size);
+      if(error) break;
+      /*multiplication overflow possible further below, same limit as decodeGeneric*/
+      if((size_t)w * h / h != w || (size_t)w * h > 268435455) ERROR_BREAK(92);
+      decoder->width = w;
+      decoder->height = h;
+      s->stage = STREAM_CHUNK;
+      s->needed = 8;
+      s->input.size = 0;
+      break;
     }
-
-    outsize = lodepng_get_raw_size(*w, *h, &state->info_raw);
-    *out = (unsigned char*)lodepng_malloc(outsize);
-    if(!(*out))
+    case STREAM_CHUNK:
     {
-      state->error = 83; /*alloc fail*/
+      unsigned chunkLength = lodepng_chunk_length(chunk);
+      /*error: chunk length larger than the max PNG chunk size*/
+      if(chunkLength > 2147483647)
+      {
+        if(!state->decoder.ignore_end) ERROR_BREAK(63);
+        s->stage = STREAM_END; /*other errors may still happen though*/
+        break;
+      }
+      if(lodepng_chunk_type_equals(chunk, "IDAT"))
+      {
+        if(!s->line)
+        {
+          error = streamImageStart(decoder, s);
+          if(error) break;
+        }
+        s->critical_pos = 3;
+#ifndef LODEPNG_NO_COMPILE_CRC
+        s->idat_crc = lodepng_crc32_update(0, &chunk[4], 4);
+#endif /*LODEPNG_NO_COMPILE_CRC*/
+        s->idat_length = s->idat_remaining = chunkLength;
+        s->stage = chunkLength ? STREAM_IDAT : STREAM_IDAT_CRC;
+        s->needed = 4;
+        s->input.size = 0;
+      }
+      else
+      {
+        s->stage = STREAM_CHUNK_DATA;
+        s->needed = 12 + (size_t)chunkLength;
+      }
+      break;
     }
-    else state->error = lodepng_convert(*out, data, &state->info_raw,
-                                        &state->info_png.color, *w, *h);
-    lodepng_free(data);
+    case STREAM_CHUNK_DATA:
+      if(lodepng_chunk_type_equals(chunk, "IEND"))
+      {
+        s->stage = STREAM_END;
+      }
+      else
+      {
+        error = readChunk(state, chunk, &s->critical_pos, &s->unknown);
+        if(error) break;
+        s->stage = STREAM_CHUNK;
+        s->needed = 8;
+      }
+      /*check CRC if wanted, only on known chunk types*/
+      if(!state->decoder.ignore_crc && !s->unknown && lodepng_chunk_check_crc(chunk)) ERROR_BREAK(57);
+      s->input.size = 0;
+      break;
+    case STREAM_IDAT_CRC:
+#ifndef LODEPNG_NO_COMPILE_CRC
+      /*with a custom lodepng_crc32 the CRC can't be computed piece by piece, then IDAT CRCs aren't checked*/
+      if(!state->decoder.ignore_crc && !s->unknown && lodepng_read32bitInt(chunk) != s->idat_crc) ERROR_BREAK(57);
+#endif /*LODEPNG_NO_COMPILE_CRC*/
+      s->stage = STREAM_CHUNK;
+      s->needed = 8;
+      s->input.size = 0;
+      break;
+    default: break;
   }
-  return state->error;
+  return error;
 }
 
-unsigned lodepng_decode_memory(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in,
-                               size_t insize, LodePNGColorType colortype, unsigned bitdepth)
+/*called at IEND or at the end of the input: inflates the rest and checks that the image is complete*/
+static unsigned streamImageEnd(LodePNGStreamDecoder* decoder, StreamDecoderState* s)
 {
   unsigned error;
-  LodePNGState state;
-  lodepng_state_init(&state);
-  state.info_raw.colortype = colortype;
-  state.info_raw.bitdepth = bitdepth;
-  error = lodepng_decode(out, w, h, &state, in, insize);
-  lodepng_state_cleanup(&state);
+  s->zfinal = 1;
+  error = streamImageData(decoder, s);
+  /*decompressed size doesn't match prediction*/
+  if(!error && (s->pass != 7 || s->window.size != s->rowpos)) error = 91;
   return error;
 }
 
-unsigned lodepng_decode32(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+void lodepng_stream_decoder_init(LodePNGStreamDecoder* decoder)
 {
-  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGBA, 8);
+  lodepng_state_init(&decoder->state);
+  decoder->state.error = 0; /*errors stick, so it must not start at "nothing done yet"*/
+  decoder->header = 0;
+  decoder->row = 0;
+  decoder->preview = 0;
+  decoder->preview_pass = 3;
+  decoder->user = 0;
+  decoder->width = decoder->height = 0;
+  decoder->internal = 0;
 }
 
-unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const unsigned char* in, size_t insize)
+void lodepng_stream_decoder_cleanup(LodePNGStreamDecoder* decoder)
 {
-  return lodepng_decode_memory(out, w, h, in, insize, LCT_RGB, 8);
+  if(decoder->internal)
+  {
+    const LodePNGAllocator* previous = lodepng_use_allocator(decoder->state.allocator);
+    StreamDecoderState_cleanup((StreamDecoderState*)decoder->internal);
+    lodepng_free(decoder->internal);
+    lodepng_restore_allocator(previous);
+    decoder->internal = 0;
+  }
+  lodepng_state_cleanup(&decoder->state);
 }
 
-#ifdef LODEPNG_COMPILE_DISK
-unsigned lodepng_decode_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename,
-                             LodePNGColorType colortype, unsigned bitdepth)
+static unsigned streamDecoderWrite(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize)
 {
-  unsigned char* buffer = 0;
-  size_t buffersize;
-  unsigned error;
-  error = lodepng_load_file(&buffer, &buffersize, filename);
-  if(!error) error = lodepng_decode_memory(out, w, h, buffer, buffersize, colortype, bitdepth);
-  lodepng_free(buffer);
+  LodePNGState* state = &decoder->state;
+  StreamDecoderState* s = (StreamDecoderState*)decoder->internal;
+  if(state->error) return state->error;
+  if(!s)
+  {
+    s = (StreamDecoderState*)lodepng_malloc(sizeof(StreamDecoderState));
+    if(!s) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+    StreamDecoderState_init(s);
+    decoder->internal = s;
+  }
+
+  while(insize != 0 && !state->error && s->stage != STREAM_END)
+  {
+    if(s->stage == STREAM_IDAT)
+    {
+      /*inflate at most 64K of new data at once, to keep zdata small when the input comes in big pieces*/
+      size_t n = insize < s->idat_remaining ? insize : s->idat_remaining;
+      size_t oldsize = s->zdata.size;
+      if(n > 65536) n = 65536;
+      if(!ucvector_resize(&s->zdata, oldsize + n)) CERROR_BREAK(state->error, 83); /*alloc fail*/
+      memcpy(&s->zdata.data[oldsize], in, n);
+#ifndef LODEPNG_NO_COMPILE_CRC
+      s->idat_crc = lodepng_crc32_update(s->idat_crc, in, n);
+#endif /*LODEPNG_NO_COMPILE_CRC*/
+      in += n;
+      insize -= n;
+      s->idat_remaining -= n;
+      if(!s->idat_remaining) s->stage = STREAM_IDAT_CRC;
+      state->error = streamImageData(decoder, s);
+    }
+    else
+    {
+      size_t n = s->needed - s->input.size;
+      size_t oldsize = s->input.size;
+      if(n > insize) n = insize;
+      if(!ucvector_resize(&s->input, oldsize + n)) CERROR_BREAK(state->error, 83); /*alloc fail*/
+      memcpy(&s->input.data[oldsize], in, n);
+      in += n;
+      insize -= n;
+      if(s->input.size == s->needed)
+      {
+        state->error = streamInput(decoder, s);
+        if(!state->error && s->stage == STREAM_END) state->error = streamImageEnd(decoder, s);
+      }
+    }
+  }
+  return state->error;
+}
+
+unsigned lodepng_stream_decoder_write(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(decoder->state.allocator);
+  unsigned error = streamDecoderWrite(decoder, in, insize);
+  lodepng_restore_allocator(previous);
   return error;
 }
 
-unsigned lodepng_decode32_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename)
+static unsigned streamDecoderFinish(LodePNGStreamDecoder* decoder)
 {
-  return lodepng_decode_file(out, w, h, filename, LCT_RGBA, 8);
+  LodePNGState* state = &decoder->state;
+  StreamDecoderState* s = (StreamDecoderState*)decoder->internal;
+  if(state->error) return state->error;
+  /*error: the given data is empty*/
+  if(!s || (s->stage == STREAM_HEADER && s->input.size == 0)) CERROR_RETURN_ERROR(state->error, 48);
+  /*error: the data length is smaller than the length of a PNG header*/
+  if(s->stage == STREAM_HEADER) CERROR_RETURN_ERROR(state->error, 27);
+  if(s->stage != STREAM_END)
+  {
+    /*bytes of the last chunk, that is cut off*/
+    size_t received = s->input.size;
+    if(s->stage == STREAM_IDAT || s->stage == STREAM_IDAT_CRC)
+    {
+      received += 8 + s->idat_length - s->idat_remaining;
+    }
+    /*like decodeGeneric, only a missing IEND or a chunk without complete length, type and CRC can be ignored*/
+    if(received >= 12) CERROR_RETURN_ERROR(state->error, 64);
+    if(!state->decoder.ignore_end) CERROR_RETURN_ERROR(state->error, 30);
+    state->error = streamImageEnd(decoder, s);
+  }
+  return state->error;
 }
 
-unsigned lodepng_decode24_file(unsigned char** out, unsigned* w, unsigned* h, const char* filename)
+unsigned lodepng_stream_decoder_finish(LodePNGStreamDecoder* decoder)
 {
-  return lodepng_decode_file(out, w, h, filename, LCT_RGB, 8);
+  const LodePNGAllocator* previous = lodepng_use_allocator(decoder->state.allocator);
+  unsigned error = streamDecoderFinish(decoder);
+  lodepng_restore_allocator(previous);
+  return error;
 }
-#endif /*LODEPNG_COMPILE_DISK*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
 
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
 {
   settings->color_convert = 1;
+  settings->num_threads = 0;
+  settings->crop_x = settings->crop_y = settings->crop_w = settings->crop_h = 0;
+  settings->downscale = 1;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->read_text_chunks = 1;
   settings->remember_unknown_chunks = 0;
@@ -4857,22 +9227,28 @@ void lodepng_state_init(LodePNGState* state)
   lodepng_color_mode_init(&state->info_raw);
   lodepng_info_init(&state->info_png);
   state->error = 1;
+  state->allocator = 0;
 }
 
 void lodepng_state_cleanup(LodePNGState* state)
 {
+  const LodePNGAllocator* previous = lodepng_use_allocator(state->allocator);
   lodepng_color_mode_cleanup(&state->info_raw);
   lodepng_info_cleanup(&state->info_png);
+  lodepng_restore_allocator(previous);
 }
 
 void lodepng_state_copy(LodePNGState* dest, const LodePNGState* source)
 {
+  const LodePNGAllocator* previous;
   lodepng_state_cleanup(dest);
   *dest = *source;
   lodepng_color_mode_init(&dest->info_raw);
   lodepng_info_init(&dest->info_png);
-  dest->error = lodepng_color_mode_copy(&dest->info_raw, &source->info_raw); if(dest->error) return;
-  dest->error = lodepng_info_copy(&dest->info_png, &source->info_png); if(dest->error) return;
+  previous = lodepng_use_allocator(dest->allocator);
+  dest->error = lodepng_color_mode_copy(&dest->info_raw, &source->info_raw);
+  if(!dest->error) dest->error = lodepng_info_copy(&dest->info_png, &source->info_png);
+  lodepng_restore_allocator(previous);
 }
 
 #endif /* defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER) */
@@ -5002,6 +9378,38 @@ static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t d
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+IDAT compressed in parts of restart_rows scanlines that can be inflated independently, followed by the idRS
+chunk: the rows per part and the position of each part in the zlib data, all as 4-byte big endian numbers.
+*/
+static unsigned addChunks_IDAT_idRS(ucvector* out, const unsigned char* data, size_t datasize, unsigned h,
+                                    unsigned restart_rows, LodePNGCompressSettings* zlibsettings)
+{
+  ucvector zlibdata, index;
+  size_t i, numparts = (h + restart_rows - 1) / restart_rows;
+  size_t* positions = (size_t*)lodepng_malloc(numparts * sizeof(size_t));
+  unsigned error = 0;
+
+  if(!positions) return 83; /*alloc fail*/
+  ucvector_init(&zlibdata);
+  ucvector_init(&index);
+  error = zlib_compress_parts(&zlibdata, positions, data, datasize, datasize / h * restart_rows, zlibsettings);
+  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
+  if(!error)
+  {
+    lodepng_add32bitInt(&index, restart_rows);
+    for(i = 0; i != numparts; ++i) lodepng_add32bitInt(&index, (unsigned)positions[i]);
+    error = addChunk(out, "idRS", index.data, index.size);
+  }
+  ucvector_cleanup(&zlibdata);
+  ucvector_cleanup(&index);
+  lodepng_free(positions);
+
+  return error;
+}
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 static unsigned addChunk_IEND(ucvector* out)
 {
   unsigned error = 0;
@@ -5176,95 +9584,436 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+      }
+      else
+      {
+        for(i = 0; i != length; ++i) out[i] = scanline[i];
+      }
+      break;
+    case 3: /*Average*/
+      if(prevline)
+      {
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
+        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+      }
+      else
+      {
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
+        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
+      }
+      break;
+    case 4: /*Paeth*/
+      if(prevline)
+      {
+        /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
+        for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
+        for(i = bytewidth; i < length; ++i)
+        {
+          out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
+        }
+      }
+      else
+      {
+        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
+        /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
+        for(i = bytewidth; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
+      }
+      break;
+    default: return; /*unexisting filter type given*/
+  }
+}
+
+/* log2 approximation. A slight bit faster than std::log. */
+static float flog2(float f)
+{
+  float result = 0;
+  while(f > 32) { result += 4; f /= 16; }
+  while(f > 2) { ++result; f /= 2; }
+  return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
+}
+
+#ifdef LODEPNG_COMPILE_SIMD
+/*the SIMD versions of filterSum and filterScanlineAll sum at most this many bytes at a time in vector lanes,
+so the sums fit in 32 bits*/
+#define FILTER_SUM_CHUNK 1048576
+
+/*
+SIMD versions of filterSum, for a length that's a multiple of the vector size. For the differences, a byte of
+128 or more becomes 255 minus it by inverting it, then the bytes are added up.
+*/
+#ifdef LODEPNG_SIMD_X86
+LODEPNG_TARGET("sse2") static size_t filterSum_sse2(const unsigned char* line, size_t length, unsigned differences)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  size_t i;
+  for(i = 0; i != length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&line[i]);
+    if(differences) v = _mm_xor_si128(v, _mm_cmpgt_epi8(zero, v));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(v, zero));
+  }
+  sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sum);
+}
+
+LODEPNG_TARGET("avx2") static size_t filterSum_avx2(const unsigned char* line, size_t length, unsigned differences)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i sum = zero;
+  __m128i sum128;
+  size_t i;
+  for(i = 0; i != length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)&line[i]);
+    if(differences) v = _mm256_xor_si256(v, _mm256_cmpgt_epi8(zero, v));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, zero));
+  }
+  sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  sum128 = _mm_add_epi64(sum128, _mm_unpackhi_epi64(sum128, sum128));
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sum128);
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static size_t filterSum_neon(const unsigned char* line, size_t length, unsigned differences)
+{
+  uint32x4_t sum = vdupq_n_u32(0);
+  uint64x2_t sum64;
+  size_t i;
+  for(i = 0; i != length; i += 16)
+  {
+    uint8x16_t v = vld1q_u8(&line[i]);
+    /*the arithmetic shift gives 255 for the bytes of 128 or more*/
+    if(differences) v = veorq_u8(v, vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7)));
+    sum = vpadalq_u16(sum, vpaddlq_u8(v));
+  }
+  sum64 = vpaddlq_u32(sum);
+  return (size_t)(vgetq_lane_u64(sum64, 0) + vgetq_lane_u64(sum64, 1));
+}
+#endif /*LODEPNG_SIMD_NEON*/
+
+/*
+SIMD versions of filterScanlineAll, which need a previous scanline and at least one vector of bytes after the
+first pixel. Those first bytewidth bytes are left to filterScanlineAll. The others are predicted a vector at a
+time, the last vector overlapping the one before it, with the overlapped bytes masked out of the sums.
+*/
+
+/*16 or 32 zeros then as many 255s, to load the mask of the last bytes of a vector from*/
+static const unsigned char FILTER_TAIL_MASK[64] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255};
+
+#ifdef LODEPNG_SIMD_X86
+/*sum of the two 64-bit lanes, which are known to fit in 32 bits*/
+LODEPNG_TARGET("sse2") static unsigned sum64_sse2(__m128i v)
+{
+  return (unsigned)_mm_cvtsi128_si32(_mm_add_epi64(v, _mm_unpackhi_epi64(v, v)));
+}
+
+/*the Paeth predictions of 16 bytes*/
+LODEPNG_TARGET("sse2") static __m128i paeth16_sse2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i result[2];
+  int half;
+  for(half = 0; half != 2; ++half)
+  {
+    __m128i a16 = half ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+    __m128i b16 = half ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+    __m128i c16 = half ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+    __m128i pa = _mm_sub_epi16(b16, c16);
+    __m128i pb = _mm_sub_epi16(a16, c16);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    result[half] = paethSelect_sse2(a16, b16, c16, abs16_sse2(pa), abs16_sse2(pb), abs16_sse2(pc));
+  }
+  return _mm_packus_epi16(result[0], result[1]);
+}
+
+LODEPNG_TARGET("sse2") static void filterScanlineAll_sse2(unsigned char* attempt[5], size_t sum[5],
+                                                          const unsigned char* scanline,
+                                                          const unsigned char* prevline,
+                                                          size_t length, size_t bytewidth)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i one = _mm_set1_epi8(1);
+  size_t i = bytewidth, chunkend, type;
+  while(i != length)
+  {
+    __m128i sums[5];
+    for(type = 0; type != 5; ++type) sums[type] = zero;
+    chunkend = length - i > FILTER_SUM_CHUNK ? i + FILTER_SUM_CHUNK : length;
+    while(i != chunkend)
+    {
+      __m128i mask = _mm_set1_epi8(-1);
+      __m128i x, a, b, c, r[5];
+      if(chunkend - i < 16)
+      {
+        mask = _mm_loadu_si128((const __m128i*)&FILTER_TAIL_MASK[16 + chunkend - i]);
+        i = chunkend - 16;
       }
-      else
+      x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+      a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      r[0] = x;
+      r[1] = _mm_sub_epi8(x, a);
+      r[2] = _mm_sub_epi8(x, b);
+      /*the average rounded down, avg_epu8 rounds up*/
+      r[3] = _mm_sub_epi8(x, _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one)));
+      r[4] = _mm_sub_epi8(x, paeth16_sse2(a, b, c));
+      for(type = 0; type != 5; ++type)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i];
+        __m128i v = type == 0 ? r[0] : _mm_xor_si128(r[type], _mm_cmpgt_epi8(zero, r[type]));
+        _mm_storeu_si128((__m128i*)&attempt[type][i], r[type]);
+        sums[type] = _mm_add_epi64(sums[type], _mm_sad_epu8(_mm_and_si128(v, mask), zero));
       }
-      break;
-    case 3: /*Average*/
-      if(prevline)
+      i += 16;
+    }
+    for(type = 0; type != 5; ++type) sum[type] += sum64_sse2(sums[type]);
+  }
+}
+
+LODEPNG_TARGET("avx2") static void filterScanlineAll_avx2(unsigned char* attempt[5], size_t sum[5],
+                                                          const unsigned char* scanline,
+                                                          const unsigned char* prevline,
+                                                          size_t length, size_t bytewidth)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i one = _mm256_set1_epi8(1);
+  size_t i = bytewidth, chunkend, type;
+  while(i != length)
+  {
+    __m256i sums[5];
+    for(type = 0; type != 5; ++type) sums[type] = zero;
+    chunkend = length - i > FILTER_SUM_CHUNK ? i + FILTER_SUM_CHUNK : length;
+    while(i != chunkend)
+    {
+      __m256i mask = _mm256_set1_epi8(-1);
+      __m256i x, a, b, c, r[5], predictor[2];
+      int half;
+      if(chunkend - i < 32)
       {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        mask = _mm256_loadu_si256((const __m256i*)&FILTER_TAIL_MASK[chunkend - i]);
+        i = chunkend - 32;
       }
-      else
+      x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+      a = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+      b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+      c = _mm256_loadu_si256((const __m256i*)&prevline[i - bytewidth]);
+      /*Paeth on 16-bit lanes, the unpacking and packing both work within each 128-bit half*/
+      for(half = 0; half != 2; ++half)
       {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - (scanline[i - bytewidth] >> 1);
+        __m256i a16 = half ? _mm256_unpackhi_epi8(a, zero) : _mm256_unpacklo_epi8(a, zero);
+        __m256i b16 = half ? _mm256_unpackhi_epi8(b, zero) : _mm256_unpacklo_epi8(b, zero);
+        __m256i c16 = half ? _mm256_unpackhi_epi8(c, zero) : _mm256_unpacklo_epi8(c, zero);
+        __m256i pa = _mm256_sub_epi16(b16, c16);
+        __m256i pb = _mm256_sub_epi16(a16, c16);
+        __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+        __m256i smallest;
+        pa = _mm256_abs_epi16(pa);
+        pb = _mm256_abs_epi16(pb);
+        smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+        /*ties prefer a, then b*/
+        predictor[half] = _mm256_blendv_epi8(_mm256_blendv_epi8(c16, b16, _mm256_cmpeq_epi16(smallest, pb)),
+                                             a16, _mm256_cmpeq_epi16(smallest, pa));
       }
-      break;
-    case 4: /*Paeth*/
-      if(prevline)
+      r[0] = x;
+      r[1] = _mm256_sub_epi8(x, a);
+      r[2] = _mm256_sub_epi8(x, b);
+      r[3] = _mm256_sub_epi8(x, _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                                                _mm256_and_si256(_mm256_xor_si256(a, b), one)));
+      r[4] = _mm256_sub_epi8(x, _mm256_packus_epi16(predictor[0], predictor[1]));
+      for(type = 0; type != 5; ++type)
       {
-        /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
-        for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
-        {
-          out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
-        }
+        __m256i v = type == 0 ? r[0] : _mm256_xor_si256(r[type], _mm256_cmpgt_epi8(zero, r[type]));
+        _mm256_storeu_si256((__m256i*)&attempt[type][i], r[type]);
+        sums[type] = _mm256_add_epi64(sums[type], _mm256_sad_epu8(_mm256_and_si256(v, mask), zero));
       }
-      else
+      i += 32;
+    }
+    for(type = 0; type != 5; ++type)
+    {
+      __m128i total = _mm_add_epi64(_mm256_castsi256_si128(sums[type]), _mm256_extracti128_si256(sums[type], 1));
+      sum[type] += sum64_sse2(total);
+    }
+  }
+}
+#endif /*LODEPNG_SIMD_X86*/
+
+#ifdef LODEPNG_SIMD_NEON
+static void filterScanlineAll_neon(unsigned char* attempt[5], size_t sum[5], const unsigned char* scanline,
+                                   const unsigned char* prevline, size_t length, size_t bytewidth)
+{
+  size_t i = bytewidth, chunkend, type;
+  while(i != length)
+  {
+    uint32x4_t sums[5];
+    for(type = 0; type != 5; ++type) sums[type] = vdupq_n_u32(0);
+    chunkend = length - i > FILTER_SUM_CHUNK ? i + FILTER_SUM_CHUNK : length;
+    while(i != chunkend)
+    {
+      uint8x16_t mask = vdupq_n_u8(255);
+      uint8x16_t x, a, b, c, r[5];
+      if(chunkend - i < 16)
       {
-        for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-        /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; ++i) out[i] = (scanline[i] - scanline[i - bytewidth]);
+        mask = vld1q_u8(&FILTER_TAIL_MASK[16 + chunkend - i]);
+        i = chunkend - 16;
       }
-      break;
-    default: return; /*unexisting filter type given*/
+      x = vld1q_u8(&scanline[i]);
+      a = vld1q_u8(&scanline[i - bytewidth]);
+      b = vld1q_u8(&prevline[i]);
+      c = vld1q_u8(&prevline[i - bytewidth]);
+      r[0] = x;
+      r[1] = vsubq_u8(x, a);
+      r[2] = vsubq_u8(x, b);
+      r[3] = vsubq_u8(x, vhaddq_u8(a, b)); /*the halving add rounds down*/
+      r[4] = vsubq_u8(x, vcombine_u8(paeth_neon(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c)),
+                                     paeth_neon(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c))));
+      for(type = 0; type != 5; ++type)
+      {
+        uint8x16_t v = r[type];
+        if(type != 0) v = veorq_u8(v, vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7)));
+        vst1q_u8(&attempt[type][i], r[type]);
+        sums[type] = vpadalq_u16(sums[type], vpaddlq_u8(vandq_u8(v, mask)));
+      }
+      i += 16;
+    }
+    for(type = 0; type != 5; ++type)
+    {
+      uint64x2_t total = vpaddlq_u32(sums[type]);
+      sum[type] += (size_t)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+    }
   }
 }
+#endif /*LODEPNG_SIMD_NEON*/
+#endif /*LODEPNG_COMPILE_SIMD*/
 
-/* log2 approximation. A slight bit faster than std::log. */
-static float flog2(float f)
+/*
+The minimum sum score of a filtered scanline: the sum of its bytes, which are differences that count as
+signed values unless the filter type is 0. A difference of 128 or more counts as 255 minus it.
+*/
+static size_t filterSum(const unsigned char* line, size_t length, unsigned char filterType)
 {
-  float result = 0;
-  while(f > 32) { result += 4; f /= 16; }
-  while(f > 2) { ++result; f /= 2; }
-  return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
+  size_t sum = 0, i = 0;
+  unsigned differences = filterType != 0;
+#if defined(LODEPNG_COMPILE_SIMD) && defined(LODEPNG_SIMD_X86)
+  unsigned features = lodepng_get_cpu_features();
+  size_t vectorsize = (features & LODEPNG_CPU_AVX2) ? 32 : (features & LODEPNG_CPU_SSE2) ? 16 : 0;
+  while(vectorsize && length - i >= vectorsize)
+  {
+    size_t n = (length - i < FILTER_SUM_CHUNK ? length - i : FILTER_SUM_CHUNK) & ~(vectorsize - 1);
+    if(vectorsize == 32) sum += filterSum_avx2(&line[i], n, differences);
+    else sum += filterSum_sse2(&line[i], n, differences);
+    i += n;
+  }
+#elif defined(LODEPNG_COMPILE_SIMD) && defined(LODEPNG_SIMD_NEON)
+  while(length - i >= 16 && (lodepng_get_cpu_features() & LODEPNG_CPU_NEON))
+  {
+    size_t n = (length - i < FILTER_SUM_CHUNK ? length - i : FILTER_SUM_CHUNK) & ~(size_t)15;
+    sum += filterSum_neon(&line[i], n, differences);
+    i += n;
+  }
+#endif /*LODEPNG_SIMD_X86*/
+  if(!differences)
+  {
+    for(; i != length; ++i) sum += line[i];
+  }
+  else
+  {
+    for(; i != length; ++i) sum += line[i] < 128 ? line[i] : (255U - line[i]);
+  }
+  return sum;
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*
+Counts how often each value occurs in the scanline. The bytes go round robin to four histograms that are
+added up at the end, so that runs of the same value don't wait on the previous increment of the same count.
+*/
+static void filterHistogram(unsigned* count, const unsigned char* line, size_t length)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+  unsigned counts[4][256];
+  size_t i;
+  for(i = 0; i != 256; ++i) counts[0][i] = counts[1][i] = counts[2][i] = counts[3][i] = 0;
+  for(i = 0; i + 4 <= length; i += 4)
+  {
+    ++counts[0][line[i + 0]];
+    ++counts[1][line[i + 1]];
+    ++counts[2][line[i + 2]];
+    ++counts[3][line[i + 3]];
+  }
+  for(; i != length; ++i) ++counts[0][line[i]];
+  for(i = 0; i != 256; ++i) count[i] = counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+}
 
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
+/*
+Filters the scanline with each of the five filter types into attempt[type], and sets sum[type] to its minimum
+sum score as filterSum gives it. With SIMD, this is one pass over the scanline for all filter types.
+*/
+static void filterScanlineAll(unsigned char* attempt[5], size_t sum[5], const unsigned char* scanline,
+                              const unsigned char* prevline, size_t length, size_t bytewidth)
+{
+  unsigned char type;
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned features = lodepng_get_cpu_features();
+  size_t i;
+#if defined(LODEPNG_SIMD_X86)
+  size_t vectorsize = (features & LODEPNG_CPU_AVX2) ? 32 : (features & LODEPNG_CPU_SSE2) ? 16 : 0;
+#elif defined(LODEPNG_SIMD_NEON)
+  size_t vectorsize = (features & LODEPNG_CPU_NEON) ? 16 : 0;
+#else /*no SIMD code for this target*/
+  size_t vectorsize = 0;
+  (void)features;
+#endif /*LODEPNG_SIMD_X86*/
+  if(prevline && vectorsize && length - bytewidth >= vectorsize)
+  {
+    /*the first pixel has no left neighbor, Average and Paeth then only use the pixel above*/
+    for(type = 0; type != 5; ++type) sum[type] = 0;
+    for(i = 0; i != bytewidth; ++i)
+    {
+      unsigned char x = scanline[i];
+      attempt[0][i] = attempt[1][i] = x;
+      attempt[2][i] = attempt[4][i] = (unsigned char)(x - prevline[i]);
+      attempt[3][i] = (unsigned char)(x - (prevline[i] >> 1));
+      for(type = 0; type != 5; ++type)
+      {
+        unsigned char r = attempt[type][i];
+        sum[type] += (type == 0 || r < 128) ? r : (255U - r);
+      }
+    }
+#if defined(LODEPNG_SIMD_X86)
+    if(vectorsize == 32) filterScanlineAll_avx2(attempt, sum, scanline, prevline, length, bytewidth);
+    else filterScanlineAll_sse2(attempt, sum, scanline, prevline, length, bytewidth);
+#elif defined(LODEPNG_SIMD_NEON)
+    filterScanlineAll_neon(attempt, sum, scanline, prevline, length, bytewidth);
+#endif /*LODEPNG_SIMD_X86*/
+    return;
+  }
+#endif /*LODEPNG_COMPILE_SIMD*/
+  for(type = 0; type != 5; ++type)
+  {
+    filterScanline(attempt[type], scanline, prevline, length, bytewidth, type);
+    sum[type] = filterSum(attempt[type], length, type);
+  }
+}
+
+/*
+Filters the scanlines from y0 to y1 with the strategy, see filter. The filter of a scanline only depends on
+the scanline and the one above it in the input, so any range of scanlines can be filtered on its own.
+*/
+static unsigned filterRows(unsigned char* out, const unsigned char* in, unsigned y0, unsigned y1,
+                           size_t linebytes, size_t bytewidth, LodePNGFilterStrategy strategy,
+                           const LodePNGEncoderSettings* settings)
+{
+  const unsigned char* prevline = y0 == 0 ? 0 : &in[(y0 - 1) * linebytes];
   unsigned x, y;
   unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
-
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
-
-  if(bpp == 0) return 31; /*error: invalid color type*/
 
   if(strategy == LFS_ZERO)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5284,36 +10033,20 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     for(type = 0; type != 5; ++type)
     {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
+      if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
     if(!error)
     {
-      for(y = 0; y != h; ++y)
+      for(y = y0; y != y1; ++y)
       {
-        /*try the 5 filter types*/
+        /*try the 5 filter types and calculate the sum of each result. For differences, each byte should be
+        treated as signed, values above 127 are negative (converted to signed char). Filtertype 0 isn't a
+        difference though, so use unsigned there. This means filtertype 0 is almost never chosen, but that
+        is justified.*/
+        filterScanlineAll(attempt, sum, &in[y * linebytes], prevline, linebytes, bytewidth);
         for(type = 0; type != 5; ++type)
         {
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
-          }
-          else
-          {
-            for(x = 0; x != linebytes; ++x)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
-
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum[type] < smallest)
           {
@@ -5343,17 +10076,16 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     for(type = 0; type != 5; ++type)
     {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
+      if(!attempt[type]) error = 83; /*alloc fail*/
     }
 
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1 && !error; ++y)
     {
       /*try the 5 filter types*/
       for(type = 0; type != 5; ++type)
       {
         filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x != 256; ++x) count[x] = 0;
-        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
+        filterHistogram(count, attempt[type], linebytes);
         ++count[type]; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
         for(x = 0; x != 256; ++x)
@@ -5380,7 +10112,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   }
   else if(strategy == LFS_PREDEFINED)
   {
-    for(y = 0; y != h; ++y)
+    for(y = y0; y != y1; ++y)
     {
       size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
       size_t inindex = linebytes * y;
@@ -5410,12 +10142,19 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     images only, so disable it*/
     zlibsettings.custom_zlib = 0;
     zlibsettings.custom_deflate = 0;
+    /*this may run on a thread of filter, which must use malloc rather than the allocator of the caller.
+    On the calling thread the allocator of the outer call is kept anyway. The rows are short enough for
+    deflate to not split them.*/
+    zlibsettings.allocator = 0;
+    zlibsettings.num_threads = 1;
+    /*the attempts only compare the filter types, optimal parsing would make them far slower*/
+    zlibsettings.optimal_iterations = 0;
     for(type = 0; type != 5; ++type)
     {
       attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
+      if(!attempt[type]) error = 83; /*alloc fail*/
     }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    for(y = y0; y != y1 && !error; ++y) /*try the 5 filter types*/
     {
       for(type = 0; type != 5; ++type)
       {
@@ -5445,6 +10184,98 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_THREADS
+/*what the threads of filter share*/
+typedef struct FilterBands
+{
+  unsigned char* out;
+  const unsigned char* in;
+  unsigned h;
+  unsigned rows; /*rows per band*/
+  size_t linebytes, bytewidth;
+  LodePNGFilterStrategy strategy;
+  const LodePNGEncoderSettings* settings;
+  unsigned* errors; /*per band, error code*/
+} FilterBands;
+
+static void filterBand(void* data, size_t i)
+{
+  const FilterBands* f = (const FilterBands*)data;
+  unsigned y0 = (unsigned)i * f->rows;
+  unsigned y1 = f->h - y0 < f->rows ? f->h : y0 + f->rows;
+  f->errors[i] = filterRows(f->out, f->in, y0, y1, f->linebytes, f->bytewidth, f->strategy, f->settings);
+}
+
+/*the scanlines that filter gives each thread at a time are about this many bytes*/
+#define FILTER_BAND_SIZE 65536
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(info);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = (w * bpp + 7) / 8;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  LodePNGFilterStrategy strategy = settings->filter_strategy;
+
+  /*
+  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+      use fixed filtering, with the filter None).
+   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+     all five filters and select the filter that produces the smallest sum of absolute values per row.
+  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+  heuristic is used.
+  */
+  if(settings->filter_palette_zero &&
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+#ifdef LODEPNG_COMPILE_THREADS
+  /*the strategies that try all filter types can choose them in bands of scanlines on several threads*/
+  if(settings->num_threads != 1 && linebytes != 0
+     && (strategy == LFS_MINSUM || strategy == LFS_ENTROPY || strategy == LFS_BRUTE_FORCE))
+  {
+    FilterBands f;
+    size_t numbands, i;
+    unsigned error = 0;
+    f.rows = linebytes >= FILTER_BAND_SIZE ? 1 : (unsigned)(FILTER_BAND_SIZE / linebytes);
+    numbands = h / f.rows + (h % f.rows != 0);
+    if(numbands > 1)
+    {
+      f.out = out;
+      f.in = in;
+      f.h = h;
+      f.linebytes = linebytes;
+      f.bytewidth = bytewidth;
+      f.strategy = strategy;
+      f.settings = settings;
+      f.errors = (unsigned*)lodepng_malloc(numbands * sizeof(unsigned));
+      if(!f.errors) return 83; /*alloc fail*/
+      lodepng_parallel_for(numbands, settings->num_threads, filterBand, &f);
+      for(i = 0; i != numbands && !error; ++i) error = f.errors[i];
+      lodepng_free(f.errors);
+      return error;
+    }
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  return filterRows(out, in, 0, h, linebytes, bytewidth, strategy, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -5527,6 +10358,41 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   }
 }
 
+/*the restart_rows setting, or 0 if the image can't or needn't be compressed in parts*/
+static unsigned getRestartRows(unsigned h, const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
+{
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(info_png->interlace_method != 0 || h <= settings->restart_rows) return 0;
+  if(settings->zlibsettings.custom_zlib || settings->zlibsettings.custom_deflate) return 0;
+  return settings->restart_rows;
+#else /*LODEPNG_COMPILE_ZLIB*/
+  (void)h;
+  (void)info_png;
+  (void)settings;
+  return 0; /*parts need the built-in deflate*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+}
+
+/*
+So that parts of restart_rows rows can be unfiltered independently, the first row of each part must not
+depend on the row above it: Up, Average and Paeth there are replaced by Sub, which still uses the pixel
+to the left. in is the image the filtered scanlines in out were made from.
+*/
+static void filterRestartRows(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                              unsigned bpp, unsigned restart_rows)
+{
+  size_t linebytes = (w * bpp + 7) / 8;
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t y;
+  for(y = restart_rows; y < h; y += restart_rows)
+  {
+    unsigned char* scanline = &out[(1 + linebytes) * y];
+    if(scanline[0] <= 1) continue;
+    scanline[0] = 1;
+    filterScanline(&scanline[1], &in[linebytes * y], 0, linebytes, bytewidth, 1);
+  }
+}
+
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
 static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
@@ -5539,6 +10405,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   *) if adam7: 1) Adam7_interlace 2) 7x add padding bits 3) 7x filter
   */
   unsigned bpp = lodepng_get_bpp(&info_png->color);
+  unsigned restart_rows = getRestartRows(h, info_png, settings);
   unsigned error = 0;
 
   if(info_png->interlace_method == 0)
@@ -5558,6 +10425,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
           error = filter(*out, padded, w, h, &info_png->color, settings);
+          if(!error && restart_rows) filterRestartRows(*out, padded, w, h, bpp, restart_rows);
         }
         lodepng_free(padded);
       }
@@ -5565,6 +10433,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
       {
         /*we can immediately filter into the out buffer, no other steps needed*/
         error = filter(*out, in, w, h, &info_png->color, settings);
+        if(!error && restart_rows) filterRestartRows(*out, in, w, h, bpp, restart_rows);
       }
     }
   }
@@ -5656,14 +10525,171 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+/*the signature and the chunks before the image data, of a PNG with the color type and interlacing of info*/
+static unsigned addChunksBeforeIDAT(ucvector* out, const LodePNGInfo* info, unsigned w, unsigned h,
+                                    const LodePNGEncoderSettings* settings)
+{
+  unsigned error = 0;
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*unknown chunks between IHDR and PLTE*/
+  if(info->unknown_chunks_data[0])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
+    if(error) return error;
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  /*bKGD (must come between PLTE and the IDAt chunks*/
+  if(info->background_defined) addChunk_bKGD(out, info);
+  /*pHYs (must come before the IDAT chunks)*/
+  if(info->phys_defined) addChunk_pHYs(out, info);
+
+  /*unknown chunks between PLTE and IDAT*/
+  if(info->unknown_chunks_data[1])
+  {
+    error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
+  }
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return error;
+}
+
+/*the chunks after the image data, up to and including IEND*/
+static unsigned addChunksAfterIDAT(ucvector* out, const LodePNGInfo* info, LodePNGEncoderSettings* settings)
+{
+#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
+  size_t i;
+  /*tIME*/
+  if(info->time_defined) addChunk_tIME(out, &info->time);
+  /*tEXt and/or zTXt*/
+  for(i = 0; i != info->text_num; ++i)
+  {
+    if(strlen(info->text_keys[i]) > 79) return 66; /*text chunk too large*/
+    if(strlen(info->text_keys[i]) < 1) return 67; /*text chunk too small*/
+    if(settings->text_compression)
+    {
+      addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &settings->zlibsettings);
+    }
+    else
+    {
+      addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
+    }
+  }
+  /*LodePNG version id in text chunk*/
+  if(settings->add_id)
+  {
+    unsigned alread_added_id_text = 0;
+    for(i = 0; i != info->text_num; ++i)
+    {
+      if(!strcmp(info->text_keys[i], "LodePNG"))
+      {
+        alread_added_id_text = 1;
+        break;
+      }
+    }
+    if(alread_added_id_text == 0)
+    {
+      addChunk_tEXt(out, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+    }
+  }
+  /*iTXt*/
+  for(i = 0; i != info->itext_num; ++i)
+  {
+    if(strlen(info->itext_keys[i]) > 79) return 66; /*text chunk too large*/
+    if(strlen(info->itext_keys[i]) < 1) return 67; /*text chunk too small*/
+    addChunk_iTXt(out, settings->text_compression,
+                  info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
+                  &settings->zlibsettings);
+  }
+
+  /*unknown chunks between IDAT and IEND*/
+  if(info->unknown_chunks_data[2])
+  {
+    unsigned error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
+    if(error) return error;
+  }
+#else /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  (void)info;
+  (void)settings;
+#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  return addChunk_IEND(out);
+}
+
+/*
+Quantizes the image for encoder.quantize: *quantized gets its palette indices at 8 bits, in sourcemode, and the
+PNG color mode becomes a palette of the same colors, with fewer bits if they fit.
+*/
+static unsigned quantizeAndChooseColor(unsigned char** quantized, LodePNGColorMode* mode_png,
+                                       LodePNGColorMode* sourcemode, const unsigned char* image,
+                                       unsigned w, unsigned h, const LodePNGState* state)
+{
+  unsigned error = 0, i, palettesize = 0;
+  unsigned char palette[1024];
+  unsigned char* rgba = 0;
+  size_t numpixels = (size_t)w * h;
+  LodePNGColorMode mode_rgba;
+
+  lodepng_color_mode_init(&mode_rgba); /*RGBA, 8-bit*/
+  *quantized = (unsigned char*)lodepng_malloc(numpixels ? numpixels : 1);
+  if(!*quantized) return 83; /*alloc fail*/
+  if(!lodepng_color_mode_equal(&state->info_raw, &mode_rgba))
+  {
+    rgba = (unsigned char*)lodepng_malloc(numpixels * 4);
+    if(!rgba && numpixels) return 83; /*alloc fail*/
+    error = lodepng_convert(rgba, image, &mode_rgba, &state->info_raw, w, h);
+    image = rgba;
+  }
+  if(!error) error = quantizeImage(*quantized, palette, &palettesize, image, w, h,
+                                   state->encoder.quantize, state->encoder.quantize_dither);
+  lodepng_free(rgba);
+
+  lodepng_palette_clear(sourcemode);
+  sourcemode->colortype = LCT_PALETTE;
+  sourcemode->bitdepth = 8;
+  for(i = 0; !error && i != palettesize; ++i)
+  {
+    error = lodepng_palette_add(sourcemode, palette[i * 4 + 0], palette[i * 4 + 1],
+                                palette[i * 4 + 2], palette[i * 4 + 3]);
+  }
+  if(!error)
+  {
+    error = lodepng_color_mode_copy(mode_png, sourcemode);
+    mode_png->bitdepth = palettesize <= 2 ? 1 : (palettesize <= 4 ? 2 : (palettesize <= 16 ? 4 : 8));
+  }
+  return error;
+}
+
+static unsigned encodeAndConvert(unsigned char** out, size_t* outsize,
+                                 const unsigned char* image, unsigned w, unsigned h,
+                                 LodePNGState* state)
 {
   LodePNGInfo info;
   ucvector outv;
   unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
   size_t datasize = 0;
+  const unsigned char* source = image; /*the pixels to encode, the input or its quantized version*/
+  LodePNGColorMode sourcemode;
+  unsigned char* quantized = 0;
 
   /*provide some proper output values if error will happen*/
   *out = 0;
@@ -5692,13 +10718,21 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   /* color convert and compute scanline filter types */
   lodepng_info_init(&info);
   lodepng_info_copy(&info, &state->info_png);
+  lodepng_color_mode_init(&sourcemode);
   if(state->encoder.auto_convert)
   {
     state->error = lodepng_auto_choose_color(&info.color, image, w, h, &state->info_raw);
   }
-  if (!state->error)
+  if(!state->error && state->encoder.quantize
+     && !(info.color.colortype == LCT_PALETTE && info.color.palettesize <= state->encoder.quantize))
+  {
+    state->error = quantizeAndChooseColor(&quantized, &info.color, &sourcemode, image, w, h, state);
+    if(!state->error) source = quantized;
+  }
+  if(!state->error && !quantized) state->error = lodepng_color_mode_copy(&sourcemode, &state->info_raw);
+  if(!state->error)
   {
-    if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+    if(!lodepng_color_mode_equal(&sourcemode, &info.color))
     {
       unsigned char* converted;
       size_t size = (w * h * (size_t)lodepng_get_bpp(&info.color) + 7) / 8;
@@ -5707,138 +10741,33 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       if(!converted && size) state->error = 83; /*alloc fail*/
       if(!state->error)
       {
-        state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
+        state->error = lodepng_convert(converted, source, &info.color, &sourcemode, w, h);
       }
       if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
       lodepng_free(converted);
     }
-    else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+    else preProcessScanlines(&data, &datasize, source, w, h, &info, &state->encoder);
   }
+  lodepng_free(quantized);
+  lodepng_color_mode_cleanup(&sourcemode);
 
   /* output all PNG chunks */
   ucvector_init(&outv);
-  while(!state->error) /*while only executed once, to break on error*/
+  if(!state->error) state->error = addChunksBeforeIDAT(&outv, &info, w, h, &state->encoder);
+  /*IDAT (multiple IDAT chunks must be consecutive)*/
+  if(!state->error)
   {
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    size_t i;
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
-    /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
-
-    /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
+#ifdef LODEPNG_COMPILE_ZLIB
+    if(getRestartRows(h, &info, &state->encoder))
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
-      if(state->error) break;
+      state->error = addChunks_IDAT_idRS(&outv, data, datasize, h, state->encoder.restart_rows,
+                                         &state->encoder.zlibsettings);
     }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    /*IDAT (multiple IDAT chunks must be consecutive)*/
+    else
+#endif /*LODEPNG_COMPILE_ZLIB*/
     state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
-    if(state->error) break;
-#ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
-    /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
-    /*tEXt and/or zTXt*/
-    for(i = 0; i != info.text_num; ++i)
-    {
-      if(strlen(info.text_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.text_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      if(state->encoder.text_compression)
-      {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
-      }
-      else
-      {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
-      }
-    }
-    /*LodePNG version id in text chunk*/
-    if(state->encoder.add_id)
-    {
-      unsigned alread_added_id_text = 0;
-      for(i = 0; i != info.text_num; ++i)
-      {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
-        {
-          alread_added_id_text = 1;
-          break;
-        }
-      }
-      if(alread_added_id_text == 0)
-      {
-        addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
-      }
-    }
-    /*iTXt*/
-    for(i = 0; i != info.itext_num; ++i)
-    {
-      if(strlen(info.itext_keys[i]) > 79)
-      {
-        state->error = 66; /*text chunk too large*/
-        break;
-      }
-      if(strlen(info.itext_keys[i]) < 1)
-      {
-        state->error = 67; /*text chunk too small*/
-        break;
-      }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
-                    &state->encoder.zlibsettings);
-    }
-
-    /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
-    {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
-      if(state->error) break;
-    }
-#endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
-
-    break; /*this isn't really a while loop; no error happened so break out now!*/
   }
+  if(!state->error) state->error = addChunksAfterIDAT(&outv, &info, &state->encoder);
 
   lodepng_info_cleanup(&info);
   lodepng_free(data);
@@ -5849,6 +10778,16 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   return state->error;
 }
 
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(state->allocator);
+  unsigned error = encodeAndConvert(out, outsize, image, w, h, state);
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -5898,6 +10837,236 @@ unsigned lodepng_encode24_file(const char* filename, const unsigned char* image,
 }
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_COMPILE_ZLIB
+/*the private part of LodePNGStreamEncoder*/
+typedef struct StreamEncoderState
+{
+  LodePNGEncoderSettings settings; /*those of the state, with predefined_filters moved along with the rows*/
+  LodePNGFilterStrategy strategy;
+  unsigned w, h, y; /*y: the rows pushed so far*/
+  size_t rawbytes, linebytes, bytewidth; /*bytes of a row in info_raw and in the PNG, and for filtering*/
+  unsigned char* lines; /*the previous and the current scanline, unfiltered*/
+  unsigned char* filtered; /*room for two filtered scanlines, as filterRows writes the second one after the first*/
+  /*the filtered data: window bytes of history, then what's not deflated yet*/
+  unsigned char* data;
+  size_t window, size;
+  unsigned adler;
+  unsigned started; /*the zlib header is written*/
+  ucvector out; /*the next piece of the file*/
+} StreamEncoderState;
+
+static void StreamEncoderState_cleanup(StreamEncoderState* s)
+{
+  lodepng_free(s->lines);
+  lodepng_free(s->filtered);
+  lodepng_free(s->data);
+  ucvector_cleanup(&s->out);
+}
+
+/*gives the PNG data in s->out to the write function and empties it*/
+static unsigned streamOutput(LodePNGStreamEncoder* encoder, StreamEncoderState* s)
+{
+  unsigned error = encoder->write(encoder->user, s->out.data, s->out.size);
+  s->out.size = 0;
+  return error;
+}
+
+/*
+Deflates the first count bytes that are waiting in s->data as an IDAT chunk, with the final block and the
+adler32 checksum if final. These are the same parts, with the same dictionary, as with zlib_compress and
+num_threads other than 1, so the image data is the same as lodepng_encode gives with those.
+*/
+static unsigned streamDeflate(LodePNGStreamEncoder* encoder, StreamEncoderState* s, size_t count, unsigned final)
+{
+  ucvector zlibdata;
+  size_t bp;
+  unsigned error;
+  size_t keep;
+
+  ucvector_init(&zlibdata);
+  if(!s->started) addZlibHeader(&zlibdata);
+  s->started = 1;
+  bp = zlibdata.size * 8;
+  error = deflateBlocks(&zlibdata, &bp, s->data, s->window, s->window + count, &s->settings.zlibsettings, final);
+  s->adler = update_adler32(s->adler, &s->data[s->window], (unsigned)count);
+  if(!error && final) lodepng_add32bitInt(&zlibdata, s->adler);
+  if(!error) error = addChunk(&s->out, "IDAT", zlibdata.data, zlibdata.size);
+  ucvector_cleanup(&zlibdata);
+  if(!error) error = streamOutput(encoder, s);
+
+  /*keep the 32K before what's not deflated yet*/
+  keep = s->window + count < 32768 ? s->window + count : 32768;
+  memmove(s->data, &s->data[s->window + count - keep], s->size - (s->window + count - keep));
+  s->size -= s->window + count - keep;
+  s->window = keep;
+  return error;
+}
+
+void lodepng_stream_encoder_init(LodePNGStreamEncoder* encoder)
+{
+  lodepng_state_init(&encoder->state);
+  encoder->state.error = 0; /*errors stick, so it must not start at "nothing done yet"*/
+  encoder->write = 0;
+  encoder->user = 0;
+  encoder->internal = 0;
+}
+
+void lodepng_stream_encoder_cleanup(LodePNGStreamEncoder* encoder)
+{
+  if(encoder->internal)
+  {
+    const LodePNGAllocator* previous = lodepng_use_allocator(encoder->state.allocator);
+    StreamEncoderState_cleanup((StreamEncoderState*)encoder->internal);
+    lodepng_free(encoder->internal);
+    lodepng_restore_allocator(previous);
+    encoder->internal = 0;
+  }
+  lodepng_state_cleanup(&encoder->state);
+}
+static unsigned streamEncoderStart(LodePNGStreamEncoder* encoder, unsigned w, unsigned h)
+{
+  LodePNGState* state = &encoder->state;
+  const LodePNGInfo* info = &state->info_png;
+  StreamEncoderState* s;
+  unsigned bpp = lodepng_get_bpp(&info->color);
+
+  if(state->error) return state->error;
+  if(encoder->internal) CERROR_RETURN_ERROR(state->error, 98); /*started twice*/
+  if(w == 0 || h == 0) CERROR_RETURN_ERROR(state->error, 93);
+  if((info->color.colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (info->color.palettesize == 0 || info->color.palettesize > 256))
+  {
+    CERROR_RETURN_ERROR(state->error, 68); /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  if(state->encoder.zlibsettings.btype > 2) CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
+  if(state->encoder.zlibsettings.level > 9) CERROR_RETURN_ERROR(state->error, 96);
+  if(info->interlace_method > 1) CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
+  if(info->interlace_method == 1) CERROR_RETURN_ERROR(state->error, 97); /*Adam7 needs the whole image*/
+  state->error = checkColorValidity(info->color.colortype, info->color.bitdepth);
+  if(state->error) return state->error; /*error: unexisting color type given*/
+  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+  if(state->error) return state->error; /*error: unexisting color type given*/
+
+  s = (StreamEncoderState*)lodepng_malloc(sizeof(StreamEncoderState));
+  if(!s) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+  encoder->internal = s;
+  s->settings = state->encoder;
+  s->strategy = state->encoder.filter_strategy;
+  /*like filter, including the palette and low bit depth heuristic*/
+  if(s->settings.filter_palette_zero && (info->color.colortype == LCT_PALETTE || info->color.bitdepth < 8))
+  {
+    s->strategy = LFS_ZERO;
+  }
+  s->w = w;
+  s->h = h;
+  s->y = 0;
+  s->rawbytes = ((size_t)w * lodepng_get_bpp(&state->info_raw) + 7) / 8;
+  s->linebytes = ((size_t)w * bpp + 7) / 8;
+  s->bytewidth = (bpp + 7) / 8;
+  s->window = s->size = 0;
+  s->adler = 1;
+  s->started = 0;
+  ucvector_init(&s->out);
+  s->lines = (unsigned char*)lodepng_malloc(s->linebytes * 2);
+  s->filtered = (unsigned char*)lodepng_malloc((s->linebytes + 1) * 2);
+  /*the history, a whole part and the row that goes past it*/
+  s->data = (unsigned char*)lodepng_malloc(32768 + DEFLATE_PART_SIZE + s->linebytes + 1);
+  if(!s->lines || !s->filtered || !s->data) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+
+  state->error = addChunksBeforeIDAT(&s->out, info, w, h, &state->encoder);
+  if(!state->error) state->error = streamOutput(encoder, s);
+  return state->error;
+}
+
+unsigned lodepng_stream_encoder_start(LodePNGStreamEncoder* encoder, unsigned w, unsigned h)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(encoder->state.allocator);
+  unsigned error = streamEncoderStart(encoder, w, h);
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
+static unsigned streamEncoderPush(LodePNGStreamEncoder* encoder, const unsigned char* rows, unsigned count,
+                                  size_t stride)
+{
+  LodePNGState* state = &encoder->state;
+  StreamEncoderState* s = (StreamEncoderState*)encoder->internal;
+  unsigned i;
+
+  if(state->error) return state->error;
+  if(!s || count > s->h - s->y) CERROR_RETURN_ERROR(state->error, 98); /*more rows than the height*/
+  if(stride == 0) stride = s->rawbytes;
+  if(stride < s->rawbytes) CERROR_RETURN_ERROR(state->error, 95);
+
+  for(i = 0; i != count && !state->error; ++i)
+  {
+    const unsigned char* row = &rows[i * stride];
+    unsigned char* line = &s->lines[s->linebytes];
+    unsigned char* filtered = &s->filtered[s->y == 0 ? 0 : s->linebytes + 1];
+
+    if(lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)) memcpy(line, row, s->linebytes);
+    else
+    {
+      line[s->linebytes - 1] = 0; /*padding bits of less than 8 bit pixels*/
+      state->error = lodepng_convert(line, row, &state->info_png.color, &state->info_raw, s->w, 1);
+      if(state->error) break;
+    }
+
+    /*filterRows filters row 1 of lines after row 0, or the first row of the image on its own*/
+    if(s->settings.predefined_filters)
+    {
+      s->settings.predefined_filters = &state->encoder.predefined_filters[s->y == 0 ? 0 : s->y - 1];
+    }
+    if(s->y == 0) state->error = filterRows(s->filtered, line, 0, 1, s->linebytes, s->bytewidth, s->strategy,
+                                            &s->settings);
+    else state->error = filterRows(s->filtered, s->lines, 1, 2, s->linebytes, s->bytewidth, s->strategy,
+                                   &s->settings);
+    if(state->error) break;
+    memcpy(&s->data[s->size], filtered, s->linebytes + 1);
+    s->size += s->linebytes + 1;
+    memcpy(s->lines, line, s->linebytes);
+    ++s->y;
+
+    /*a part is deflated once data follows it, the last one is final*/
+    while(!state->error && s->size - s->window > DEFLATE_PART_SIZE)
+    {
+      state->error = streamDeflate(encoder, s, DEFLATE_PART_SIZE, 0);
+    }
+  }
+  return state->error;
+}
+
+unsigned lodepng_stream_encoder_push(LodePNGStreamEncoder* encoder, const unsigned char* rows, unsigned count,
+                                     size_t stride)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(encoder->state.allocator);
+  unsigned error = streamEncoderPush(encoder, rows, count, stride);
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
+static unsigned streamEncoderFinish(LodePNGStreamEncoder* encoder)
+{
+  LodePNGState* state = &encoder->state;
+  StreamEncoderState* s = (StreamEncoderState*)encoder->internal;
+  if(state->error) return state->error;
+  if(!s || s->y != s->h) CERROR_RETURN_ERROR(state->error, 98); /*rows are missing*/
+  state->error = streamDeflate(encoder, s, s->size - s->window, 1);
+  if(!state->error) state->error = addChunksAfterIDAT(&s->out, &state->info_png, &state->encoder);
+  if(!state->error) state->error = streamOutput(encoder, s);
+  return state->error;
+}
+
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder)
+{
+  const LodePNGAllocator* previous = lodepng_use_allocator(encoder->state.allocator);
+  unsigned error = streamEncoderFinish(encoder);
+  lodepng_restore_allocator(previous);
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 {
   lodepng_compress_settings_init(&settings->zlibsettings);
@@ -5906,6 +11075,10 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->restart_rows = 0;
+  settings->num_threads = 1;
+  settings->quantize = 0;
+  settings->quantize_dither = 1;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -6017,6 +11190,16 @@ const char* lodepng_error_text(unsigned code)
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
     case 94: return "header chunk must have a size of 13 bytes";
+    case 95: return "buffer too small for the image rows with the given stride";
+    /*the compression level is 0 for the individual LZ77 settings, or 1 to 9*/
+    case 96: return "invalid compression level";
+    /*Adam7 passes need all rows of the image, so a PNG that's written as the rows arrive can't interlace*/
+    case 97: return "the streaming encoder does not support interlacing";
+    case 98: return "streaming encoder not started, or given more or fewer rows than the image height";
+    case 99: return "crop rectangle outside the image or downscale factor other than 1, 2, 4 or 8";
+    /*averaging pixels needs whole color values: no palette indices or greyscale packed in bits*/
+    case 100: return "downscaling needs an output color type without palette and a bit depth of 8 or 16";
+    case 101: return "lodepng_decode_into does not support crop and downscale";
   }
   return "unknown error code";
 }
@@ -6053,14 +11236,17 @@ unsigned save_file(const std::vector<unsigned char>& buffer, const std::string&
 unsigned decompress(std::vector<unsigned char>& out, const unsigned char* in, size_t insize,
                     const LodePNGDecompressSettings& settings)
 {
-  unsigned char* buffer = 0;
-  size_t buffersize = 0;
-  unsigned error = zlib_decompress(&buffer, &buffersize, in, insize, &settings);
-  if(buffer)
+  ucvector buffer;
+  unsigned error;
+  const LodePNGAllocator* previous = lodepng_use_allocator(settings.allocator);
+  ucvector_init_buffer(&buffer, 0, 0);
+  error = zlib_decompress(&buffer, in, insize, &settings);
+  if(buffer.data)
   {
-    out.insert(out.end(), &buffer[0], &buffer[buffersize]);
-    lodepng_free(buffer);
+    out.insert(out.end(), &buffer.data[0], &buffer.data[buffer.size]);
+    lodepng_free(buffer.data);
   }
+  lodepng_restore_allocator(previous);
   return error;
 }
 
@@ -6077,12 +11263,14 @@ unsigned compress(std::vector<unsigned char>& out, const unsigned char* in, size
 {
   unsigned char* buffer = 0;
   size_t buffersize = 0;
+  const LodePNGAllocator* previous = lodepng_use_allocator(settings.allocator);
   unsigned error = zlib_compress(&buffer, &buffersize, in, insize, &settings);
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
     lodepng_free(buffer);
   }
+  lodepng_restore_allocator(previous);
   return error;
 }
 
@@ -6149,6 +11337,7 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
                 const unsigned char* in, size_t insize)
 {
   unsigned char* buffer = NULL;
+  const LodePNGAllocator* previous = lodepng_use_allocator(state.allocator);
   unsigned error = lodepng_decode(&buffer, &w, &h, &state, in, insize);
   if(buffer && !error)
   {
@@ -6156,6 +11345,7 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
   }
   lodepng_free(buffer);
+  lodepng_restore_allocator(previous);
   return error;
 }
 
@@ -6170,14 +11360,277 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h, const std::string& filename,
                 LodePNGColorType colortype, unsigned bitdepth)
 {
-  std::vector<unsigned char> buffer;
-  unsigned error = load_file(buffer, filename);
-  if(error) return error;
-  return decode(out, w, h, buffer, colortype, bitdepth);
+  LodePNGMappedFile file;
+  unsigned error = lodepng_map_file(&file, filename.c_str());
+  if(!error) error = decode(out, w, h, file.data, file.size, colortype, bitdepth);
+  lodepng_unmap_file(&file);
+  return error;
 }
-#endif /* LODEPNG_COMPILE_DECODER */
 #endif /* LODEPNG_COMPILE_DISK */
 
+#ifdef LODEPNG_COMPILE_THREADS
+/*an image added to a BatchDecoder, until a thread has decoded it*/
+struct BatchJob
+{
+  size_t index;
+  bool isfile; /*decode the file filename rather than in*/
+  const unsigned char* in;
+  size_t insize;
+  std::string filename;
+  std::promise<BatchImage> promise;
+  std::shared_future<BatchImage> future;
+};
+
+/*the jobs handed to one thread. It takes them from the front, other threads steal from the back*/
+struct BatchQueue
+{
+  std::mutex mutex;
+  std::deque<BatchJob*> jobs;
+};
+
+struct BatchDecoder::Impl
+{
+  State state;
+  size_t budget;
+  std::vector<std::thread> threads;
+  std::unique_ptr<BatchQueue[]> queues; /*one per thread*/
+  size_t numqueues;
+
+  /*the rest is guarded by mutex*/
+  std::mutex mutex;
+  std::condition_variable work; /*a job was added, or stop was set*/
+  std::condition_variable admit; /*reserved memory was released, or the next ticket may start*/
+  std::condition_variable done; /*a job finished*/
+  size_t queued; /*jobs added but not taken yet. At least the number in the queues, never less*/
+  bool stop;
+  size_t reserved; /*bytes reserved by the running decodes*/
+  size_t tickets, serving; /*decodes start in the order of their ticket*/
+  size_t added, returned; /*jobs added, and returned by next*/
+  size_t nextqueue; /*the queue the next job goes to*/
+  std::deque<std::shared_future<BatchImage> > finished; /*not returned by next yet*/
+
+  /*takes the oldest job of queue t, or else steals the newest of another queue. Returns null if all are empty*/
+  BatchJob* take(size_t t)
+  {
+    for(size_t i = 0; i != numqueues; ++i)
+    {
+      BatchQueue& queue = queues[(t + i) % numqueues];
+      BatchJob* job = 0;
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.jobs.empty()) continue;
+        if(i == 0)
+        {
+          job = queue.jobs.front();
+          queue.jobs.pop_front();
+        }
+        else
+        {
+          job = queue.jobs.back();
+          queue.jobs.pop_back();
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      --queued;
+      return job;
+    }
+    return 0;
+  }
+
+  /*an estimate of the memory lodepng::decode needs for this PNG, 0 if the header can't be read*/
+  size_t estimate(const BatchJob& job) const
+  {
+    State inspected(state);
+    unsigned w = 0, h = 0;
+    size_t size = 0;
+    if(!job.isfile)
+    {
+      if(lodepng_inspect(&w, &h, &inspected, job.in, job.insize)) return 0;
+    }
+#ifdef LODEPNG_COMPILE_DISK
+    else
+    {
+      unsigned char header[33]; /*signature and IHDR chunk*/
+      long filesize = lodepng_filesize(job.filename.c_str());
+      if(filesize < 0 || lodepng_buffer_file(header, sizeof(header), job.filename.c_str())) return 0;
+      if(lodepng_inspect(&w, &h, &inspected, header, sizeof(header))) return 0;
+      size = (size_t)filesize; /*mapped, or loaded if it can't be*/
+    }
+#endif /*LODEPNG_COMPILE_DISK*/
+    size += lodepng_get_raw_size(w, h, &inspected.info_raw);
+    /*the scanlines with their filter type bytes, which the image is unfiltered in*/
+    size += lodepng_get_raw_size(w, h, &inspected.info_png.color) + h;
+    return size;
+  }
+
+  void run(BatchJob* job)
+  {
+    size_t cost = estimate(*job);
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t ticket = tickets++;
+    admit.wait(lock, [&]()
+    {
+      return ticket == serving && (budget == 0 || reserved == 0 || reserved + cost <= budget);
+    });
+    ++serving;
+    reserved += cost;
+    admit.notify_all(); /*the next ticket may fit as well*/
+    lock.unlock();
+
+    BatchImage result;
+    result.index = job->index;
+    result.w = result.h = 0;
+    try
+    {
+      State jobstate(state);
+      if(!job->isfile) result.error = decode(result.image, result.w, result.h, jobstate, job->in, job->insize);
+#ifdef LODEPNG_COMPILE_DISK
+      else
+      {
+        LodePNGMappedFile file;
+        result.error = lodepng_map_file(&file, job->filename.c_str());
+        if(!result.error) result.error = decode(result.image, result.w, result.h, jobstate, file.data, file.size);
+        lodepng_unmap_file(&file);
+      }
+#endif /*LODEPNG_COMPILE_DISK*/
+    }
+    catch(const std::bad_alloc&)
+    {
+      result.error = 83; /*alloc fail, of the std::vector*/
+    }
+    if(result.error) std::vector<unsigned char>().swap(result.image);
+    job->promise.set_value(std::move(result));
+
+    lock.lock();
+    reserved -= cost;
+    finished.push_back(job->future);
+    delete job;
+    admit.notify_all();
+    done.notify_all();
+  }
+
+  void worker(size_t t)
+  {
+    for(;;)
+    {
+      BatchJob* job = take(t);
+      if(job)
+      {
+        run(job);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex);
+      work.wait(lock, [&]() { return stop || queued != 0; });
+      if(queued == 0) return; /*stopped, and all jobs are taken*/
+    }
+  }
+
+  std::shared_future<BatchImage> add(BatchJob* job)
+  {
+    std::shared_future<BatchImage> future = job->future = job->promise.get_future().share();
+    size_t q = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job->index = added++;
+      if(!threads.empty())
+      {
+        q = nextqueue;
+        nextqueue = (nextqueue + 1) % numqueues;
+        ++queued;
+      }
+    }
+    if(threads.empty())
+    {
+      run(job); /*no thread could be started, decode it right here*/
+      return future;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queues[q].mutex);
+      queues[q].jobs.push_back(job);
+    }
+    work.notify_one();
+    return future;
+  }
+};
+
+BatchDecoder::BatchDecoder(const State& state, unsigned num_threads, size_t budget) : impl(new Impl)
+{
+  impl->state = state;
+  impl->state.decoder.num_threads = 1;
+  impl->budget = budget;
+  impl->queued = 0;
+  impl->stop = false;
+  impl->reserved = 0;
+  impl->tickets = impl->serving = 0;
+  impl->added = impl->returned = 0;
+  impl->nextqueue = 0;
+  if(num_threads == 0) num_threads = std::thread::hardware_concurrency();
+  if(num_threads == 0) num_threads = 1;
+  impl->numqueues = num_threads;
+  impl->queues.reset(new BatchQueue[num_threads]);
+  try
+  {
+    /*the queues of threads that don't start are emptied by the others*/
+    Impl* pool = impl;
+    while(impl->threads.size() < num_threads)
+    {
+      size_t t = impl->threads.size();
+      impl->threads.emplace_back([pool, t]() { pool->worker(t); });
+    }
+  }
+  catch(...) {} /*run with the threads that did start*/
+}
+
+BatchDecoder::~BatchDecoder()
+{
+  {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    impl->stop = true;
+  }
+  impl->work.notify_all();
+  for(size_t t = 0; t != impl->threads.size(); ++t) impl->threads[t].join();
+  delete impl;
+}
+
+std::shared_future<BatchImage> BatchDecoder::add(const unsigned char* in, size_t insize)
+{
+  BatchJob* job = new BatchJob;
+  job->isfile = false;
+  job->in = in;
+  job->insize = insize;
+  return impl->add(job);
+}
+
+std::shared_future<BatchImage> BatchDecoder::add(const std::vector<unsigned char>& in)
+{
+  return add(in.empty() ? 0 : &in[0], in.size());
+}
+
+#ifdef LODEPNG_COMPILE_DISK
+std::shared_future<BatchImage> BatchDecoder::add(const std::string& filename)
+{
+  BatchJob* job = new BatchJob;
+  job->isfile = true;
+  job->in = 0;
+  job->insize = 0;
+  job->filename = filename;
+  return impl->add(job);
+}
+#endif /*LODEPNG_COMPILE_DISK*/
+
+std::shared_future<BatchImage> BatchDecoder::next()
+{
+  std::unique_lock<std::mutex> lock(impl->mutex);
+  if(impl->returned == impl->added) return std::shared_future<BatchImage>();
+  impl->done.wait(lock, [this]() { return !impl->finished.empty(); });
+  std::shared_future<BatchImage> future = impl->finished.front();
+  impl->finished.pop_front();
+  ++impl->returned;
+  return future;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+#endif /* LODEPNG_COMPILE_DECODER */
+
 #ifdef LODEPNG_COMPILE_ENCODER
 unsigned encode(std::vector<unsigned char>& out, const unsigned char* in, unsigned w, unsigned h,
                 LodePNGColorType colortype, unsigned bitdepth)
@@ -6207,12 +11660,14 @@ unsigned encode(std::vector<unsigned char>& out,
 {
   unsigned char* buffer;
   size_t buffersize;
+  const LodePNGAllocator* previous = lodepng_use_allocator(state.allocator);
   unsigned error = lodepng_encode(&buffer, &buffersize, in, w, h, &state);
   if(buffer)
   {
     out.insert(out.end(), &buffer[0], &buffer[buffersize]);
     lodepng_free(buffer);
   }
+  lodepng_restore_allocator(previous);
   return error;
 }
 
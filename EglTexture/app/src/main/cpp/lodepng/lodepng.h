@@ -60,6 +60,12 @@ the custom_zlib field of the compress and decompress settings*/
 #ifndef LODEPNG_NO_COMPILE_DISK
 #define LODEPNG_COMPILE_DISK
 #endif
+/*memory map files with the POSIX mmap to decode them from disk, instead of reading them into a buffer*/
+#ifndef LODEPNG_NO_COMPILE_MMAP
+#if defined(LODEPNG_COMPILE_DISK) && (defined(__unix__) || defined(__APPLE__))
+#define LODEPNG_COMPILE_MMAP
+#endif
+#endif
 /*support for chunks other than IHDR, IDAT, PLTE, tRNS, IEND: ancillary and unknown chunks*/
 #ifndef LODEPNG_NO_COMPILE_ANCILLARY_CHUNKS
 #define LODEPNG_COMPILE_ANCILLARY_CHUNKS
@@ -70,10 +76,24 @@ the custom_zlib field of the compress and decompress settings*/
 #endif
 /*Compile the default allocators (C's free, malloc and realloc). If you disable this,
 you can define the functions lodepng_free, lodepng_malloc and lodepng_realloc in your
-source files with custom allocators.*/
+source files with custom allocators. With these, a LodePNGAllocator can be chosen at runtime
+instead, see the allocator field of LodePNGState.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*SIMD versions of the hottest loops (SSE2/SSSE3/AVX2 with gcc or clang on x86, NEON on ARM). They
+are picked at runtime depending on the CPU, the portable C code remains the fallback and reference.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
+/*decode PNGs that have a restart index, choose the filters of the encoder, and deflate with num_threads other
+than 1, on several threads. This needs the C++11 thread library, so it is only compiled as C++11 or newer.
+Without it that work is done on the calling thread.*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#if (defined(__cplusplus) && __cplusplus >= 201103L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+#define LODEPNG_COMPILE_THREADS
+#endif
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -84,6 +104,9 @@ source files with custom allocators.*/
 #ifdef LODEPNG_COMPILE_CPP
 #include <vector>
 #include <string>
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_PNG) && defined(LODEPNG_COMPILE_DECODER)
+#include <future> /*for lodepng::BatchDecoder*/
+#endif /*LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_PNG && LODEPNG_COMPILE_DECODER*/
 #endif /*LODEPNG_COMPILE_CPP*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -250,6 +273,50 @@ unsigned encode(const std::string& filename,
 const char* lodepng_error_text(unsigned code);
 #endif /*LODEPNG_COMPILE_ERROR_TEXT*/
 
+#if defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)
+/*
+Memory allocation functions to use instead of malloc, realloc and free, for the duration of one call to
+lodepng. user is passed on to the functions. See lodepng_arena_init for an allocator that hands out memory
+from one block and frees it all at once. Only used if LODEPNG_COMPILE_ALLOCATORS is defined.
+*/
+typedef struct LodePNGAllocator
+{
+  void* (*allocate)(void* user, size_t size);
+  void* (*reallocate)(void* user, void* ptr, size_t size); /*ptr may be NULL*/
+  void (*deallocate)(void* user, void* ptr); /*ptr may be NULL*/
+  void* user;
+} LodePNGAllocator;
+
+#ifdef LODEPNG_COMPILE_ALLOCATORS
+/*
+An allocator that hands out memory from one block by bumping a pointer, for decoding many images without
+going to the heap for each vector and huffman table. Freeing does nothing, except for the most recent
+allocation, which can also grow and shrink in place. Memory that doesn't fit in the block comes from malloc.
+lodepng_arena_reset frees everything at once, including the output images, which must not be freed with free.
+Use &arena.allocator as allocator of a LodePNGState or of the zlib settings, and reset the arena after
+lodepng_state_cleanup of the states that use it: a state that's used again must be initialized again. Not
+thread-safe: threads that a decoder starts itself use malloc.
+*/
+typedef struct LodePNGArena
+{
+  LodePNGAllocator allocator;
+  unsigned char* data; /*the block*/
+  size_t size; /*size of the block in bytes*/
+  size_t used; /*bytes of the block in use*/
+  size_t last; /*position of the most recent allocation in the block, equal to used once that's freed*/
+  void* heap; /*the allocations that didn't fit in the block*/
+  size_t numallocs; /*number of allocations and reallocations since the last reset*/
+  size_t numheap; /*how many of those went to the heap*/
+} LodePNGArena;
+
+/*creates an arena with a block of size bytes, returns error 83 if that can't be allocated*/
+unsigned lodepng_arena_init(LodePNGArena* arena, size_t size);
+/*frees all memory allocated from the arena since the last reset*/
+void lodepng_arena_reset(LodePNGArena* arena);
+void lodepng_arena_cleanup(LodePNGArena* arena);
+#endif /*LODEPNG_COMPILE_ALLOCATORS*/
+#endif /*defined(LODEPNG_COMPILE_DECODER) || defined(LODEPNG_COMPILE_ENCODER)*/
+
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
@@ -270,6 +337,10 @@ struct LodePNGDecompressSettings
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*allocator for lodepng_zlib_decompress and lodepng_inflate (default: null, for malloc). A PNG decoder
+  uses the allocator of its LodePNGState instead.*/
+  const LodePNGAllocator* allocator;
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -291,6 +362,19 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*zlib-style compression level: 1-3 find matches in a small hash table, fast but compressing less, 4-9 search
+  ever longer hash chains in a 32768 window. 0 uses windowsize, minmatch, nicematch and lazymatching. Default: 0*/
+  unsigned level;
+  /*threads to deflate on, 0 for one per processor core. With any value other than 1, the data is deflated in
+  parts of 128 KiB that end at a byte boundary, each using the 32 KiB before it as dictionary, so that the
+  parts can be compressed at the same time. The output then doesn't depend on the number of threads, and is
+  the same without LODEPNG_COMPILE_THREADS, which deflates the parts one after another. Default: 1*/
+  unsigned num_threads;
+  /*if not 0, LZ77 uses optimal parsing instead of the level or the four settings above: the matches are chosen
+  by the cheapest path through each block, with the costs of the symbols taken from the previous parse. This
+  repeats at most this many times and keeps the smallest. Much slower, meant for assets compressed once.
+  Default: 0*/
+  unsigned optimal_iterations;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -304,6 +388,10 @@ struct LodePNGCompressSettings /*deflate = compress*/
                              const LodePNGCompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*allocator for lodepng_zlib_compress and lodepng_deflate (default: null, for malloc). A PNG encoder
+  uses the allocator of its LodePNGState instead.*/
+  const LodePNGAllocator* allocator;
 };
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
@@ -528,6 +616,24 @@ typedef struct LodePNGDecoderSettings
 
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
 
+  /*threads to inflate and unfilter a PNG with a restart index (see restart_rows of the encoder settings)
+  with, 0 for one per processor core. Only used with LODEPNG_COMPILE_THREADS. Default: 0*/
+  unsigned num_threads;
+
+  /*decode only the rectangle of crop_w * crop_h pixels at crop_x, crop_y, clipped to the image. A crop_w or
+  crop_h of 0 means the whole image. The data is only inflated as far as the rectangle needs, and of the
+  rows above it only those that the filter of its first row depends on are unfiltered. Default: 0*/
+  unsigned crop_x, crop_y, crop_w, crop_h;
+  /*1, 2, 4 or 8: make the (cropped) image this many times smaller, each output pixel the average of a
+  square of pixels, fewer at the right and bottom edge. Needs an output color type without palette and
+  bit depth 8 or 16. Of an Adam7 image cropped at a multiple of it, each output pixel is the top left pixel
+  of its square instead, so only passes 1 to 1, 3 or 5 are decoded. Default: 1*/
+  unsigned downscale;
+  /*crop and downscale are used by lodepng_decode and the functions built on it, which return the width and
+  height of the result. lodepng_decode_into gives an error for them and LodePNGStreamDecoder ignores them.
+  Without a custom_zlib or custom_inflate, the Adler-32 checksum isn't checked when inflating stops before
+  the end of the data.*/
+
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
   /*store all bytes from unknown chunks in the LodePNGInfo (off by default, useful for a png editor)*/
@@ -609,6 +715,25 @@ typedef struct LodePNGEncoderSettings
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
   unsigned force_palette;
+
+  /*if not 0, the image data is compressed in parts of this many rows that can be inflated and unfiltered
+  independently of each other, and a private idRS chunk after the IDAT chunks gives where each part starts.
+  Decoders with threads then decode the parts in parallel, other decoders just read an ordinary PNG. The
+  parts cost some compression, so use a few hundred kilobytes of image data per part or more. Not used
+  for interlaced images or with custom_zlib or custom_deflate. The parts are also compressed on num_threads
+  threads of the zlib settings. Default: 0*/
+  unsigned restart_rows;
+  /*threads to choose the filters of the scanlines on with LFS_MINSUM, LFS_ENTROPY and LFS_BRUTE_FORCE, 0 for
+  one per processor core. The PNG is the same with any number of threads. Only used with
+  LODEPNG_COMPILE_THREADS. Default: 1*/
+  unsigned num_threads;
+  /*if not 0, images that would otherwise not get a palette of at most this many colors (up to 256) are
+  quantized to one: median cut chooses the colors and a few k-means iterations refine them. This is lossy.
+  Default: 0*/
+  unsigned quantize;
+  /*spread the difference between each pixel and its palette color over the next pixels (Floyd-Steinberg)
+  when quantizing. Hides banding in gradients but compresses less well. Default: 1*/
+  unsigned quantize_dither;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   /*add LodePNG identifier and version as a text chunk, for debugging*/
   unsigned add_id;
@@ -634,6 +759,12 @@ typedef struct LodePNGState
   LodePNGColorMode info_raw; /*specifies the format in which you would like to get the raw pixel buffer*/
   LodePNGInfo info_png; /*info of the PNG image obtained after decoding*/
   unsigned error;
+  /*
+  allocator for everything decoded or encoded with this state (default: null, for malloc): the output image,
+  the chunks in info_png and the memory used on the way. Memory that the state owns is freed with it by
+  lodepng_state_cleanup and lodepng_decode, so it must come from this allocator (an arena also takes malloc's).
+  */
+  const LodePNGAllocator* allocator;
 #ifdef LODEPNG_COMPILE_CPP
   /* For the lodepng::State subclass. */
   virtual ~LodePNGState(){}
@@ -655,6 +786,37 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize);
 
+/*
+Memory that lodepng_decode_into can reuse from one image to the next: the concatenated IDAT chunks and the
+decompressed scanlines. The buffers grow with lodepng_realloc when an image needs more and keep their size
+afterwards, so decoding images of similar size allocates nothing after the first one. They may be given in
+advance, as long as they're allocated with lodepng_malloc. They come from the allocator of the state, buffers
+of a different allocator are freed first.
+*/
+typedef struct LodePNGDecodeScratch
+{
+  unsigned char* idat;
+  size_t idatsize; /*allocated size of idat in bytes*/
+  unsigned char* scanlines;
+  size_t scanlinessize; /*allocated size of scanlines in bytes*/
+  const LodePNGAllocator* allocator; /*the allocator of the state the buffers were last decoded with*/
+} LodePNGDecodeScratch;
+
+void lodepng_decode_scratch_init(LodePNGDecodeScratch* scratch);
+void lodepng_decode_scratch_cleanup(LodePNGDecodeScratch* scratch);
+
+/*
+Same as lodepng_decode, but decodes into out, which the caller provides, e.g. mapped texture memory.
+Row y of the image starts at out + y * stride; stride must be at least the size of a row in the color
+type of info_raw (rows of less than 8 bit pixels start at a byte) and outsize at least
+stride * (h - 1) + that row size, otherwise it returns error 95. The bytes between rows are left alone.
+scratch holds the intermediate data, or use NULL to allocate and free it in this call.
+The width and height aren't known before decoding: use lodepng_inspect first to size out.
+*/
+unsigned lodepng_decode_into(unsigned char* out, size_t stride, size_t outsize, unsigned* w, unsigned* h,
+                             LodePNGState* state, const unsigned char* in, size_t insize,
+                             LodePNGDecodeScratch* scratch);
+
 /*
 Read the PNG header, but not the actual data. This returns only the information
 that is in the header chunk of the PNG, such as width, height and color type. The
@@ -663,6 +825,115 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Summary of the chunks of a PNG, e.g. to index many image files and plan their memory before decoding
+any of them. The pointers point into the PNG data given to lodepng_inspect_metadata, nothing is copied.
+*/
+typedef struct LodePNGMetadata
+{
+  unsigned width;
+  unsigned height;
+  LodePNGColorType colortype;
+  unsigned bitdepth;
+  unsigned interlace_method;
+  size_t raw_size; /*size in bytes of the decoded image in the color type of the PNG itself*/
+
+  const unsigned char* palette; /*contents of the PLTE chunk, palettesize RGB triplets. NULL if there's none*/
+  size_t palettesize; /*number of colors in the palette*/
+  const unsigned char* trns; /*contents of the tRNS chunk, NULL if there's none*/
+  size_t trnssize; /*size in bytes of the tRNS contents*/
+
+  unsigned phys_defined; /*if 0, there is no pHYs chunk and the values below are undefined*/
+  unsigned phys_x; /*pixels per unit in x direction*/
+  unsigned phys_y; /*pixels per unit in y direction*/
+  unsigned phys_unit; /*may be 0 (unknown unit) or 1 (metre)*/
+
+  size_t text_chunks; /*number of tEXt, zTXt and iTXt chunks, use lodepng_chunk_next_const to read them*/
+  size_t text_size; /*total size of their contents, compressed for zTXt and iTXt*/
+  size_t idat_chunks; /*number of IDAT chunks*/
+  size_t idat_size; /*total size of the compressed image data*/
+  size_t num_chunks; /*all chunks, including IHDR and IEND*/
+} LodePNGMetadata;
+
+/*
+Reads the header like lodepng_inspect, then walks the list of chunks up to IEND and fills in metadata,
+without decompressing anything and without allocating memory. The header and the chunks whose contents
+are read (PLTE, tRNS and pHYs) have their CRC checked unless state->decoder.ignore_crc is set, IDAT
+and the other chunks are skipped over. Uses state->decoder.ignore_end like decoding does.
+*/
+unsigned lodepng_inspect_metadata(LodePNGMetadata* metadata, LodePNGState* state,
+                                  const unsigned char* in, size_t insize);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Decodes a PNG that arrives in pieces, e.g. while it's read from a file or the network, and hands out
+each row of pixels as soon as it's decoded. Neither the PNG file nor the image has to be in memory as a
+whole: the decoder keeps a chunk (except IDAT chunks, which are passed through), the compressed data that
+isn't inflated yet, the last 32K of inflated data and two scanlines.
+
+LodePNGStreamDecoder decoder;
+lodepng_stream_decoder_init(&decoder);
+decoder.state.info_raw.colortype = LCT_RGBA; //the same settings as for lodepng_decode
+decoder.row = myRowFunction;
+decoder.user = &myData;
+while(!error && (size = readSomeBytes(buffer))) error = lodepng_stream_decoder_write(&decoder, buffer, size);
+if(!error) error = lodepng_stream_decoder_finish(&decoder);
+lodepng_stream_decoder_cleanup(&decoder);
+
+The custom_zlib and custom_inflate settings are not used, the decoder always uses its own inflater.
+
+With a preview function, an Adam7 interlaced image can be shown after a fraction of its data has arrived,
+e.g. from a decoding thread that hands each preview to the one that draws: after pass 3, which has 1/16th of
+the pixels, it's complete at a quarter of the width and height.
+*/
+typedef struct LodePNGStreamDecoder
+{
+  /*the settings like for lodepng_decode, info_png is filled in as the chunks arrive*/
+  LodePNGState state;
+  /*
+  called once before the first row, when info_png has everything before the image data, such as the
+  palette. Return an error code other than 0 to stop decoding with that error. May be NULL.
+  */
+  unsigned (*header)(void* user, unsigned w, unsigned h);
+  /*
+  called for each row with count pixels in the color type of info_raw, which go to image coordinates
+  (x, y), (x + dx, y), (x + 2 * dx, y), ... Without interlacing that's the whole row (x = 0, dx = 1),
+  from the top row to the bottom one. Adam7 interlaced images first give the rows of the 7 reduced images
+  in turn, so a row comes back several times with more of its pixels.
+  */
+  void (*row)(void* user, const unsigned char* pixels, unsigned count, unsigned x, unsigned dx, unsigned y);
+  /*
+  progressive display of Adam7 interlaced images. If set, the decoder keeps the whole image in the color
+  type of info_raw and after each pass from preview_pass on, calls this with all of it: each pixel that's
+  not decoded yet is a copy of the one at the top left of its block (8x8 after pass 1, 4x4 after pass 3,
+  2x2 after pass 5), so the image is complete but blocky and gets sharper with each pass. Passes without
+  pixels are skipped. Always called after the last pass that has pixels, also when that's before
+  preview_pass (e.g. pass 1 for a 1x1 image), and then it's the decoded image. Not called for images
+  without interlacing. May be NULL.
+  */
+  void (*preview)(void* user, const unsigned char* image, unsigned w, unsigned h, unsigned pass);
+  unsigned preview_pass; /*the first pass, 1 to 7, after which preview is called. Default: 3*/
+  void* user; /*passed to the header, row and preview functions*/
+  unsigned width, height; /*the image size, known once the IHDR chunk is read*/
+  void* internal; /*the decoding progress, private*/
+} LodePNGStreamDecoder;
+
+void lodepng_stream_decoder_init(LodePNGStreamDecoder* decoder);
+void lodepng_stream_decoder_cleanup(LodePNGStreamDecoder* decoder);
+
+/*
+Gives the next insize bytes of the PNG to the decoder, which calls the header and row functions for
+everything it can decode so far. Returns error code, after an error all calls return it.
+*/
+unsigned lodepng_stream_decoder_write(LodePNGStreamDecoder* decoder, const unsigned char* in, size_t insize);
+
+/*
+Tells the decoder the PNG has ended. Returns error code, e.g. if the image isn't complete. Not needed
+to get the rows if the IEND chunk was written, but it checks that nothing is missing.
+*/
+unsigned lodepng_stream_decoder_finish(LodePNGStreamDecoder* decoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -671,6 +942,61 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+/*
+Encodes a PNG whose rows arrive one after another, e.g. camera frames or GL readbacks, and hands out the
+file in pieces as soon as they're done. Neither the image nor the PNG has to be in memory as a whole: the
+encoder keeps two scanlines, up to 128K of filtered data with the 32K before it as dictionary, and the
+compressed data of those 128K, which goes out as one IDAT chunk. That's the same however high the image is.
+
+LodePNGStreamEncoder encoder;
+lodepng_stream_encoder_init(&encoder);
+encoder.state.info_raw.colortype = LCT_RGB; //the same settings as for lodepng_encode
+encoder.state.info_png.color.colortype = LCT_RGB;
+encoder.write = myWriteFunction;
+encoder.user = &myFile;
+error = lodepng_stream_encoder_start(&encoder, w, h);
+while(!error && (count = getSomeRows(&rows))) error = lodepng_stream_encoder_push(&encoder, rows, count, 0);
+if(!error) error = lodepng_stream_encoder_finish(&encoder);
+lodepng_stream_encoder_cleanup(&encoder);
+
+As the colors aren't known in advance, auto_convert and quantize aren't used: the PNG has the color type
+of info_png.color. Interlacing isn't possible (error 97) and restart_rows, custom_zlib and custom_deflate
+aren't used. The image data is deflated in the same parts as with zlibsettings.num_threads other than 1, so it
+compresses as well as lodepng_encode does with those.
+*/
+typedef struct LodePNGStreamEncoder
+{
+  /*the settings like for lodepng_encode*/
+  LodePNGState state;
+  /*
+  called with each next piece of the PNG file: the signature and the chunks before the image data, each
+  IDAT chunk, and the chunks after them up to IEND. Return an error code other than 0 to stop encoding with
+  that error. Required.
+  */
+  unsigned (*write)(void* user, const unsigned char* data, size_t size);
+  void* user; /*passed to the write function*/
+  void* internal; /*the encoding progress, private*/
+} LodePNGStreamEncoder;
+
+void lodepng_stream_encoder_init(LodePNGStreamEncoder* encoder);
+void lodepng_stream_encoder_cleanup(LodePNGStreamEncoder* encoder);
+
+/*Starts a PNG of w * h pixels and writes everything before the image data. Returns error code.*/
+unsigned lodepng_stream_encoder_start(LodePNGStreamEncoder* encoder, unsigned w, unsigned h);
+
+/*
+Gives the encoder the next count rows, in the color type of info_raw. Row i starts at rows + i * stride, or
+right after the previous one with stride 0; rows of less than 8 bit pixels start at a byte. Returns error
+code, e.g. 98 for more rows than the height. After an error all calls return it.
+*/
+unsigned lodepng_stream_encoder_push(LodePNGStreamEncoder* encoder, const unsigned char* rows, unsigned count,
+                                     size_t stride);
+
+/*Writes the rest of the PNG once all rows are pushed. Returns error code, 98 if rows are missing.*/
+unsigned lodepng_stream_encoder_finish(LodePNGStreamEncoder* encoder);
+#endif /*LODEPNG_COMPILE_ZLIB*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -805,6 +1131,25 @@ return value: error code (0 means ok)
 */
 unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* filename);
 
+/*the contents of a file opened with lodepng_map_file, read only*/
+typedef struct LodePNGMappedFile
+{
+  const unsigned char* data;
+  size_t size;
+  unsigned mapped; /*1 if data is a memory mapping of the file, 0 if it's an allocated buffer*/
+} LodePNGMappedFile;
+
+/*
+Makes the contents of a file available without copying them: maps the file into memory with mmap where
+LODEPNG_COMPILE_MMAP is available, advising the OS it's read sequentially. Otherwise, or if mapping it
+fails (e.g. for an empty file), it's loaded into a buffer like lodepng_load_file. The decode from file
+functions use this. The file must not be truncated while it's mapped.
+Release it with lodepng_unmap_file, also after an error.
+return value: error code (0 means ok)
+*/
+unsigned lodepng_map_file(LodePNGMappedFile* file, const char* filename);
+void lodepng_unmap_file(LodePNGMappedFile* file);
+
 /*
 Save a file from buffer to disk. Warning, if it exists, this function overwrites
 the file without warning!
@@ -816,6 +1161,30 @@ return value: error code (0 means ok)
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename);
 #endif /*LODEPNG_COMPILE_DISK*/
 
+#ifdef LODEPNG_COMPILE_SIMD
+/*Instruction set extensions LodePNG has SIMD code for, as bits in the value of lodepng_get_cpu_features*/
+typedef enum LodePNGCPUFeature
+{
+  LODEPNG_CPU_SSE2 = 1,
+  LODEPNG_CPU_SSSE3 = 2,
+  LODEPNG_CPU_AVX2 = 4,
+  LODEPNG_CPU_NEON = 8,
+  LODEPNG_CPU_PCLMUL = 16, /*carry-less multiplication, used for CRC32 on x86*/
+  LODEPNG_CPU_ARM_CRC32 = 32 /*the ARMv8 CRC32 instructions*/
+} LodePNGCPUFeature;
+
+/*returns the LodePNGCPUFeature bits of the features this CPU has and LodePNG will use. They're detected on
+the first call, which may come from several threads at once*/
+unsigned lodepng_get_cpu_features(void);
+
+/*
+Only lets LodePNG use the given LodePNGCPUFeature bits (of those the CPU has). Pass 0 to
+only run the portable C code, e.g. to compare against it in tests. This is a global
+setting, don't change it while other threads are encoding or decoding.
+*/
+void lodepng_set_cpu_features(unsigned features);
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 #ifdef LODEPNG_COMPILE_CPP
 /* The LodePNG C++ wrapper uses std::vectors instead of manually allocated memory buffers. */
 namespace lodepng
@@ -838,6 +1207,64 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
                 State& state,
                 const std::vector<unsigned char>& in);
+
+#ifdef LODEPNG_COMPILE_THREADS
+/*An image decoded by a BatchDecoder.*/
+struct BatchImage
+{
+  size_t index; /*which image of the batch it is: the number of images added before it*/
+  unsigned error; /*0 means ok*/
+  unsigned w, h;
+  std::vector<unsigned char> image; /*the pixels, in the color type of state.info_raw of the BatchDecoder*/
+};
+
+/*
+Decodes many PNGs at once, each on one of a pool of threads, with lodepng::decode. The images are handed to
+the threads in turn, and a thread that runs out of images takes the most recently added one of another thread,
+so small and big images even out. Each decode first reserves an estimate of the memory it needs, from the size
+in the PNG header: the image, the unfiltered scanlines and for files the file itself. Decodes only start while
+the reserved bytes of the running ones plus their own fit in the budget, in the order the threads took them;
+one that doesn't fit on its own still runs, but alone.
+The destructor waits for all added images to be decoded.
+*/
+class BatchDecoder
+{
+  public:
+    /*
+    state: the settings for all images, e.g. the output color type in info_raw. Its allocator, if any,
+      must be usable from several threads at once. decoder.num_threads is ignored, each image uses one thread.
+    num_threads: the size of the pool, 0 for one thread per processor core.
+    budget: how many bytes the running decodes may reserve together, 0 for no limit.
+    */
+    explicit BatchDecoder(const State& state = State(), unsigned num_threads = 0, size_t budget = 0);
+    ~BatchDecoder();
+
+    /*
+    Adds a PNG in memory to the batch. It isn't copied: keep it until the future is ready.
+    Returns the future of its decoded image. The future also becomes ready if decoding fails, with the error
+    code in BatchImage::error.
+    */
+    std::shared_future<BatchImage> add(const unsigned char* in, size_t insize);
+    std::shared_future<BatchImage> add(const std::vector<unsigned char>& in);
+#ifdef LODEPNG_COMPILE_DISK
+    /*Adds a PNG file to the batch. It's only opened once a thread gets to it.*/
+    std::shared_future<BatchImage> add(const std::string& filename);
+#endif /*LODEPNG_COMPILE_DISK*/
+
+    /*
+    Waits for the next decoded image in completion order: each image of the batch is returned once, as soon
+    as it's done, so the first images to use don't wait for slower ones added before them. Returns an invalid
+    future (valid() is false) once all images added so far have been returned.
+    */
+    std::shared_future<BatchImage> next();
+
+  private:
+    BatchDecoder(const BatchDecoder&); /*not copyable*/
+    BatchDecoder& operator=(const BatchDecoder&);
+    struct Impl;
+    Impl* impl;
+};
+#endif /*LODEPNG_COMPILE_THREADS*/
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -1074,6 +1501,26 @@ LodePNGState and lodepng_decode. For C++, all decoding can be done with the
 various lodepng::decode functions, and lodepng::State can be used for advanced
 features.
 
+To decode a PNG while it's still arriving, or without having the whole file and
+image in memory at once, use LodePNGStreamDecoder. It takes the PNG in pieces of
+any size and gives each row to a callback function as soon as it's decoded. It
+has a LodePNGState with the same settings as lodepng_decode.
+
+To decode into memory you already have, such as a texture buffer with its own
+row pitch, use lodepng_decode_into. With a LodePNGDecodeScratch that's kept
+between calls, loading many images this way does no allocations after the first.
+
+For a thumbnail, a tile or a lower mip level, set crop_x, crop_y, crop_w and
+crop_h and/or downscale in the decoder settings: lodepng_decode then returns
+just that region, made 2, 4 or 8 times smaller, and skips the work for the rows
+after it. For Adam7 images, downscaling stops after the pass that has a pixel of
+every square.
+
+To load many images at once, such as the assets at the start of an application,
+add them to a lodepng::BatchDecoder (C++11 and newer). It decodes them on a
+pool of threads, within a budget of memory, and gives each a std::shared_future
+as well as returning them in the order they're done.
+
 When using the LodePNGState, it uses the following fields for decoding:
 *) LodePNGInfo info_png: it stores extra information about the PNG (the input) in here
 *) LodePNGColorMode info_raw: here you can say what color mode of the raw image (the output) you want to get
@@ -1125,6 +1572,10 @@ LodePNGState and lodepng_encode. For C++, all encoding can be done with the
 various lodepng::encode functions, and lodepng::State can be used for advanced
 features.
 
+To encode an image whose rows come in over time, without holding the image or
+the PNG in memory, use LodePNGStreamEncoder. It takes any number of rows at a
+time and gives the PNG file to a callback function in pieces.
+
 Like the decoder, the encoder can also give errors. However it gives less errors
 since the encoder input is trusted, the decoder input (a PNG image that could
 be forged by anyone) is not trusted.
@@ -1176,9 +1627,21 @@ can encode the colors of all pixels without information loss.
    true for proper compression.
 *) windowsize: the window size used by the LZ77 encoder (1 - 32768). Has value
    2048 by default, but can be set to 32768 for better, but slow, compression.
+*) num_threads: deflate the image data in parts of 128 KiB on this many threads,
+   0 for one per core. The parts keep referring back to the data before them, so
+   this costs very little compression. The default 1 deflates on the calling thread.
+*) optimal_iterations: if not 0, choose the LZ77 matches by the cheapest path through
+   each block instead, refining the costs of the symbols over at most this many
+   iterations. Gives the smallest output, but is many times slower than level 9.
 *) force_palette: if colortype is 2 or 6, you can make the encoder write a PLTE
    chunk if force_palette is true. This can used as suggested palette to convert
    to by viewers that don't support more than 256 colors (if those still exist)
+*) restart_rows: compress the image data in parts of this many rows and add a
+   private idRS chunk with where they start, so that decoders can inflate and
+   unfilter the parts on different threads. The PNG stays readable by any decoder.
+*) quantize: lossily reduce the image to a palette of at most this many colors
+   if it has more, with median cut and k-means. With quantize_dither, the error
+   of each pixel is spread over its neighbours, which looks better in gradients.
 *) add_id: add text chunk "Encoder: LodePNG <version>" to the image.
 *) text_compression: default 1. If 1, it'll store texts as zTXt instead of tEXt chunks.
   zTXt chunks use zlib compression on the text. This gives a smaller result on
@@ -1464,6 +1927,13 @@ It is compatible with C90 and up, and C++03 and up.
 If performance is important, use optimization when compiling! For both the
 encoder and decoder, this makes a large difference.
 
+With gcc and clang on x86, SIMD code for SSE2, SSSE3 and AVX2 is compiled in
+regardless of the target flags, and only used if the CPU supports it. On ARM,
+NEON code is compiled in if the target has NEON (-mfpu=neon on 32-bit ARM, always
+on arm64). Define LODEPNG_NO_COMPILE_SIMD to only use the portable C code.
+The chunk CRCs likewise use PCLMULQDQ on x86 and the CRC32 instructions on arm64
+when the CPU has them, and otherwise an 8 bytes at a time table method.
+
 Make sure that LodePNG is compiled with the same compiler of the same version
 and with the same settings as the rest of the program, or the interfaces with
 std::vectors and std::strings in C++ can be incompatible.
@@ -1574,6 +2044,10 @@ state.decoder.ignore_crc: ignore CRC checksums
 state.decoder.ignore_critical: ignore unknown critical chunks
 state.decoder.ignore_end: ignore missing IEND chunk. May fail if this corruption causes other errors
 state.decoder.color_convert: convert internal PNG color to chosen one
+state.decoder.num_threads: threads for PNGs with a restart index, 0 for all cores
+state.decoder.crop_x, crop_y, crop_w, crop_h: decode only this rectangle of the image
+state.decoder.downscale: decode 2, 4 or 8 times smaller, averaging squares of pixels
+state.allocator: allocate from e.g. a LodePNGArena instead of malloc, also when encoding
 state.decoder.read_text_chunks: whether to read in text metadata chunks
 state.decoder.remember_unknown_chunks: whether to read in unknown chunks
 state.info_raw.colortype: desired color type for decoded image
@@ -1589,11 +2063,18 @@ state.encoder.zlibsettings.windowsize: tweak LZ77 windowsize
 state.encoder.zlibsettings.minmatch: tweak min LZ77 length to match
 state.encoder.zlibsettings.nicematch: tweak LZ77 match where to stop searching
 state.encoder.zlibsettings.lazymatching: try one more LZ77 matching
+state.encoder.zlibsettings.level: compression level 1-9 instead of the four settings above, 1 is fastest
+state.encoder.zlibsettings.num_threads: deflate in parts on several threads, 0 for all cores
+state.encoder.zlibsettings.optimal_iterations: optimal LZ77 parsing with this many iterations, e.g. 15
 state.encoder.zlibsettings.custom_...: use custom deflate function
 state.encoder.auto_convert: choose optimal PNG color type, if 0 uses info_png
 state.encoder.filter_palette_zero: PNG filter strategy for palette
 state.encoder.filter_strategy: PNG filter strategy to encode with
 state.encoder.force_palette: add palette even if not encoding to one
+state.encoder.restart_rows: compress in parts of this many rows for multithreaded decoding
+state.encoder.num_threads: threads to choose the filters on, 0 for all cores
+state.encoder.quantize: lossy palette of at most this many colors, e.g. 256
+state.encoder.quantize_dither: dither when quantizing
 state.encoder.add_id: add LodePNG identifier and version as a text chunk
 state.encoder.text_compression: use compressed text chunks for metadata
 state.info_raw.colortype: color type of raw input image you provide
@@ -43,10 +43,20 @@ freely, subject to the following restrictions:
 
 double total_dec_time = 0;
 double total_enc_time = 0;
+double total_inflate_time = 0; // Time spent in zlib decompression alone, to compare Huffman decoder changes
+double total_arena_dec_time = 0; // Decoding with a LodePNGArena that is reset between images
+size_t total_allocs = 0; // Allocations and reallocations of one decode of each image
+size_t total_heap_allocs = 0; // How many of those didn't fit in the arena
+size_t num_images = 0;
 size_t total_enc_size = 0;
 size_t total_in_size = 0; // This is the uncompressed data in the raw color format
+double total_level_time[10] = {0}; // Encoding with each compression level, with -l
+size_t total_level_size[10] = {0};
+double total_threads_enc_time = 0; // Encoding with num_threads 0, deflating on all cores
+size_t total_threads_enc_size = 0;
 
 bool verbose = false;
+bool levels = false;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -143,9 +153,92 @@ void doCodecTest(Image& image)
   assertEquals(image.width, decoded_w);
   assertEquals(image.height, decoded_h);
 
+  //The same with an arena that has room for the compressed data, the scanlines and the output
+  size_t raw_size = image.data.size();
+  LodePNGArena arena;
+  assertEquals(0, lodepng_arena_init(&arena, encoded_size + 2 * raw_size + 65536), "arena init");
+  size_t allocs = 0, heap_allocs = 0;
+  double t_arena0 = getTime();
+  for(int i = 0; i < NUM_DECODE; i++)
+  {
+    LodePNGState state;
+    lodepng_state_init(&state);
+    state.allocator = &arena.allocator;
+    state.info_raw.colortype = image.colorType;
+    state.info_raw.bitdepth = image.bitDepth;
+    unsigned char* arena_decoded = 0;
+    unsigned error_dec = lodepng_decode(&arena_decoded, &decoded_w, &decoded_h, &state, encoded, encoded_size);
+    assertEquals(0, error_dec, "decoder error arena");
+    allocs = arena.numallocs;
+    heap_allocs = arena.numheap;
+    lodepng_state_cleanup(&state);
+    lodepng_arena_reset(&arena);
+  }
+  double t_arena1 = getTime();
+  lodepng_arena_cleanup(&arena);
+
+  //Inflate throughput on its own: zlib data of the raw pixels, without PNG filtering and color conversion
+  unsigned char* zlibdata = 0;
+  size_t zlibdata_size = 0;
+  unsigned error_zlib = lodepng_zlib_compress(&zlibdata, &zlibdata_size, &image.data[0], image.data.size(),
+                                              &lodepng_default_compress_settings);
+  assertEquals(0, error_zlib, "zlib compress error");
+
+  double t_inf0 = getTime();
+  for(int i = 0; i < NUM_DECODE; i++)
+  {
+    unsigned char* inflated = 0;
+    size_t inflated_size = 0;
+    error_zlib = lodepng_zlib_decompress(&inflated, &inflated_size, zlibdata, zlibdata_size,
+                                         &lodepng_default_decompress_settings);
+    assertEquals(0, error_zlib, "zlib decompress error");
+    assertEquals(image.data.size(), inflated_size, "zlib decompress size");
+    free(inflated);
+  }
+  double t_inf1 = getTime();
+  free(zlibdata);
+
   total_enc_size += encoded_size;
   total_enc_time += (t_enc1 - t_enc0);
   total_dec_time += (t_dec1 - t_dec0);
+  total_inflate_time += (t_inf1 - t_inf0);
+  {
+    lodepng::State state;
+    state.info_raw.colortype = image.colorType;
+    state.info_raw.bitdepth = image.bitDepth;
+    state.encoder.zlibsettings.num_threads = 0;
+    state.encoder.num_threads = 0;
+    std::vector<unsigned char> png;
+    double t0 = getTime();
+    unsigned error = lodepng::encode(png, image.data, image.width, image.height, state);
+    double t1 = getTime();
+    assertEquals(0, error, "encoder error threads");
+    total_threads_enc_time += t1 - t0;
+    total_threads_enc_size += png.size();
+  }
+  if(levels)
+  {
+    for(unsigned level = 1; level <= 9; level++)
+    {
+      lodepng::State state;
+      state.info_raw.colortype = image.colorType;
+      state.info_raw.bitdepth = image.bitDepth;
+      state.encoder.zlibsettings.level = level;
+      std::vector<unsigned char> png;
+      double t0 = getTime();
+      unsigned error = lodepng::encode(png, image.data, image.width, image.height, state);
+      double t1 = getTime();
+      assertEquals(0, error, "encoder error level");
+      total_level_time[level] += t1 - t0;
+      total_level_size[level] += png.size();
+      if(verbose) std::cout << "level " << level << ": " << (t1 - t0) << "s size: " << png.size() << std::endl;
+    }
+  }
+
+  total_arena_dec_time += (t_arena1 - t_arena0);
+  total_allocs += allocs;
+  total_heap_allocs += heap_allocs;
+  num_images++;
   LodePNGColorMode colormode;
   colormode.colortype = image.colorType;
   colormode.bitdepth = image.bitDepth;
@@ -158,6 +251,9 @@ void doCodecTest(Image& image)
               << " ratio: " << ((double)(image.data.size()) / (double)(encoded_size))
               << " size: " << encoded_size << std::endl;
     if(NUM_DECODE> 0) printValue("decoding time", t_dec1 - t_dec0, "/", NUM_DECODE, " s");
+    if(NUM_DECODE> 0) printValue("inflate time", t_inf1 - t_inf0, "/", NUM_DECODE, " s");
+    if(NUM_DECODE> 0) printValue("arena decoding time", t_arena1 - t_arena0, "/", NUM_DECODE, " s");
+    if(NUM_DECODE> 0) printValue("allocations per decode", allocs, ", from the heap: ", heap_allocs);
     std::cout << std::endl;
   }
 
@@ -439,6 +535,35 @@ void testPatternY()
   doCodecTest(image);
 }
 
+//CRC32 throughput on its own, with the portable code and with the instructions of this CPU
+void testCRC32()
+{
+  std::vector<unsigned char> data(64 * 1024 * 1024);
+  for(size_t i = 0; i < data.size(); i++) data[i] = (unsigned char)(getRandomUint() >> 7);
+
+  const int num_cases = 2;
+  for(int c = 0; c < num_cases; c++)
+  {
+#ifdef LODEPNG_COMPILE_SIMD
+    unsigned original = lodepng_get_cpu_features();
+    if(c == 0) lodepng_set_cpu_features(0);
+#else
+    if(c == 1) break;
+#endif
+    unsigned crc = 0;
+    double t0 = getTime();
+    for(int i = 0; i < NUM_DECODE; i++) crc ^= lodepng_crc32(&data[0], data.size());
+    double t1 = getTime();
+#ifdef LODEPNG_COMPILE_SIMD
+    lodepng_set_cpu_features(original);
+#endif
+
+    double mb = (double)data.size() * NUM_DECODE / 1024.0 / 1024.0;
+    std::cout << "CRC32 " << (c == 0 ? "portable" : "cpu") << ": " << (t1 - t0) << "s (" << (mb / (t1 - t0))
+              << " MB/s) " << crc << std::endl;
+  }
+}
+
 void testPatternDisk(const std::string& filename)
 {
   if(verbose) std::cout << "file " << filename << std::endl;
@@ -461,6 +586,7 @@ int main(int argc, char *argv[])
   {
     std::string arg = argv[i];
     if(arg == "-v") verbose = true;
+    else if(arg == "-l") levels = true;
     else files.push_back(arg);
   }
 
@@ -499,8 +625,20 @@ int main(int argc, char *argv[])
     }
   }
 
+  if(NUM_DECODE > 0) testCRC32();
+
   std::cout << "Total decoding time: " << total_dec_time/NUM_DECODE << "s (" << ((total_in_size/1024.0/1024.0)/(total_dec_time/NUM_DECODE)) << " MB/s)" << std::endl;
+  std::cout << "Total inflate time: " << total_inflate_time/NUM_DECODE << "s (" << ((total_in_size/1024.0/1024.0)/(total_inflate_time/NUM_DECODE)) << " MB/s)" << std::endl;
+  std::cout << "Total arena decoding time: " << total_arena_dec_time/NUM_DECODE << "s (" << ((total_in_size/1024.0/1024.0)/(total_arena_dec_time/NUM_DECODE)) << " MB/s)" << std::endl;
+  if(num_images > 0) std::cout << "Allocations per decode: " << (double)total_allocs / num_images << " (from the heap with an arena: " << (double)total_heap_allocs / num_images << ")" << std::endl;
   std::cout << "Total encoding time: " << total_enc_time << "s (" << ((total_in_size/1024.0/1024.0)/(total_enc_time)) << " MB/s)" << std::endl;
+  std::cout << "Total encoding time on all cores: " << total_threads_enc_time << "s (" << ((total_in_size/1024.0/1024.0)/(total_threads_enc_time)) << " MB/s)"
+            << " size: " << total_threads_enc_size << std::endl;
+  for(unsigned level = 1; levels && level <= 9; level++)
+  {
+    std::cout << "Level " << level << " encoding time: " << total_level_time[level] << "s (" << ((total_in_size/1024.0/1024.0)/total_level_time[level]) << " MB/s)"
+              << " size: " << total_level_size[level] << " (" << (100.0 * total_level_size[level] / total_in_size) << "%)" << std::endl;
+  }
   std::cout << "Total uncompressed size  : " << total_in_size << std::endl;
   std::cout << "Total encoded size: " << total_enc_size << " (" << (100.0 * total_enc_size / total_in_size) << "%)" << std::endl;
 
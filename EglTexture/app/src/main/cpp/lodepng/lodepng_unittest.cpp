@@ -102,6 +102,10 @@ git difftool -y
 #include "lodepng.h"
 #include "lodepng_util.h"
 
+#include <algorithm>
+#ifdef LODEPNG_COMPILE_THREADS
+#include <atomic>
+#endif // LODEPNG_COMPILE_THREADS
 #include <cmath>
 #include <map>
 #include <iomanip>
@@ -861,6 +865,109 @@ void testColorConvert2()
   }
 }
 
+// Compares the conversions that lodepng_convert does on whole images at once, with and without SIMD, against
+// the colors of each pixel computed here, for lengths around the SIMD blocks.
+void testColorConvertFast() {
+  std::cout << "testColorConvertFast" << std::endl;
+  struct Pair {
+    LodePNGColorType type_in;
+    unsigned depth_in;
+    LodePNGColorType type_out;
+    bool key;
+  };
+  const Pair pairs[] = {
+    {LCT_RGB, 8, LCT_RGBA, false}, {LCT_RGBA, 8, LCT_RGB, false}, {LCT_GREY, 8, LCT_RGBA, false},
+    {LCT_GREY_ALPHA, 8, LCT_RGBA, false}, {LCT_PALETTE, 1, LCT_RGBA, false}, {LCT_PALETTE, 2, LCT_RGBA, false},
+    {LCT_PALETTE, 4, LCT_RGBA, false}, {LCT_PALETTE, 8, LCT_RGBA, false}, {LCT_GREY, 16, LCT_GREY, false},
+    {LCT_GREY_ALPHA, 16, LCT_GREY_ALPHA, false}, {LCT_RGB, 16, LCT_RGB, false}, {LCT_RGBA, 16, LCT_RGBA, false},
+    {LCT_RGB, 16, LCT_RGB, true}, {LCT_RGB, 8, LCT_RGBA, true}, {LCT_GREY, 8, LCT_RGBA, true}
+  };
+  const size_t numpairs = sizeof(pairs) / sizeof(*pairs);
+  unsigned seed = 5;
+#ifdef LODEPNG_COMPILE_SIMD
+  const unsigned features[] = {0, LODEPNG_CPU_SSE2, ~0u};
+  unsigned original = lodepng_get_cpu_features();
+#endif // LODEPNG_COMPILE_SIMD
+  for(size_t p = 0; p < numpairs; p++)
+  for(size_t n = 1; n <= 1000; n = n < 70 ? n + 1 : n * 3 + 1) {
+    const Pair& pair = pairs[p];
+    LodePNGColorMode mode_in, mode_out;
+    lodepng_color_mode_init(&mode_in);
+    lodepng_color_mode_init(&mode_out);
+    mode_in.colortype = pair.type_in;
+    mode_in.bitdepth = pair.depth_in;
+    mode_out.colortype = pair.type_out;
+    mode_out.bitdepth = 8;
+    unsigned bits = pair.depth_in, channels = lodepng_get_channels(&mode_in), mask = (1u << (bits & 15)) - 1u;
+    if(pair.type_in == LCT_PALETTE) {
+      // indices past the palette are black
+      size_t palettesize = bits == 8 ? 200 : 3;
+      for(size_t i = 0; i < palettesize; i++) {
+        seed = seed * 1103515245u + 12345u;
+        lodepng_palette_add(&mode_in, seed >> 24, seed >> 16, seed >> 8, seed);
+      }
+    }
+    std::vector<unsigned char> in(lodepng_get_raw_size(n, 1, &mode_in));
+    for(size_t i = 0; i < in.size(); i++) {
+      seed = seed * 1103515245u + 12345u;
+      in[i] = (unsigned char)(seed >> 16);
+    }
+    if(pair.key) {
+      // a key with pixels that match it, every third pixel, makes those transparent
+      mode_in.key_defined = 1;
+      mode_in.key_r = mode_in.key_g = mode_in.key_b = bits == 16 ? 0x1234 : 0x56;
+      size_t bytes = channels * bits / 8;
+      for(size_t i = 0; i < n; i += 3) {
+        for(size_t c = 0; c < bytes; c++) in[i * bytes + c] = bits == 16 ? 0x12 + (c & 1) * 0x22 : 0x56;
+      }
+    }
+
+    std::vector<unsigned char> expected;
+    if(pair.depth_in == 16) {
+      for(size_t i = 0; i < in.size(); i += 2) expected.push_back(in[i]);
+    } else {
+      for(size_t i = 0; i < n; i++) {
+        unsigned char rgba[4];
+        unsigned v[4];
+        for(size_t c = 0; c < channels; c++) {
+          size_t bit = (i * channels + c) * bits;
+          v[c] = (in[bit / 8] >> (8 - bits - bit % 8)) & mask;
+        }
+        if(pair.type_in == LCT_PALETTE) {
+          if(v[0] < mode_in.palettesize) for(size_t c = 0; c < 4; c++) rgba[c] = mode_in.palette[v[0] * 4 + c];
+          else {
+            rgba[0] = rgba[1] = rgba[2] = 0;
+            rgba[3] = 255;
+          }
+        } else if(channels <= 2) {
+          rgba[0] = rgba[1] = rgba[2] = v[0];
+          rgba[3] = channels == 2 ? v[1] : 255;
+        } else {
+          for(size_t c = 0; c < 4; c++) rgba[c] = c < channels ? v[c] : 255;
+        }
+        if(pair.key && v[0] == 0x56 && (channels == 1 || (v[1] == 0x56 && v[2] == 0x56))) rgba[3] = 0;
+        expected.insert(expected.end(), rgba, rgba + (pair.type_out == LCT_RGB ? 3 : 4));
+      }
+    }
+
+#ifdef LODEPNG_COMPILE_SIMD
+    for(size_t f = 0; f < 3; f++) {
+      lodepng_set_cpu_features(features[f]);
+#endif // LODEPNG_COMPILE_SIMD
+      std::vector<unsigned char> out(expected.size() + 1, 99);
+      unsigned error = lodepng_convert(&out[0], &in[0], &mode_out, &mode_in, n, 1);
+      assertNoPNGError(error);
+      ASSERT_EQUALS(99, out.back());
+      out.pop_back();
+      assertTrue(out == expected, "fast conversion");
+#ifdef LODEPNG_COMPILE_SIMD
+    }
+    lodepng_set_cpu_features(original);
+#endif // LODEPNG_COMPILE_SIMD
+    lodepng_color_mode_cleanup(&mode_in);
+  }
+}
+
 //if compressible is true, the test will also assert that the compressed string is smaller
 void testCompressStringZlib(const std::string& text, bool compressible)
 {
@@ -909,6 +1016,213 @@ void testCompressZlib()
   testCompressStringZlib("lodepng_zlib_decompress(&out2, &outsize2, out, outsize, &lodepng_default_decompress_settings);", true);
 }
 
+//Symbols with geometric frequencies, so that the huffman codes get longer than
+//the first level of the decoder's lookup table and need its subtables.
+void testCompressZlibLongCodes()
+{
+  std::cout << "testCompressZlibLongCodes" << std::endl;
+  std::string text;
+  unsigned random = 1;
+  for(size_t i = 0; i < 200000; i++)
+  {
+    random = random * 1103515245u + 12345u;
+    unsigned bits = random >> 8, symbol = 0;
+    while(symbol < 20 && (bits & 1)) { bits >>= 1; symbol++; }
+    text += (char)('a' + symbol + (random >> 30) * 21);
+  }
+  testCompressStringZlib(text, true);
+}
+
+//Roundtrip with each deflate block type, stored blocks make the decoder realign to whole bytes
+void testCompressZlibBlockTypes()
+{
+  std::cout << "testCompressZlibBlockTypes" << std::endl;
+  std::vector<unsigned char> in(200000);
+  for(size_t i = 0; i < in.size(); i++) in[i] = (unsigned char)((i * i) >> 7);
+  for(unsigned btype = 0; btype < 3; btype++)
+  {
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    settings.btype = btype;
+    std::vector<unsigned char> compressed, out;
+    assertNoPNGError(lodepng::compress(compressed, in, settings));
+    assertNoPNGError(lodepng::decompress(out, compressed));
+    ASSERT_EQUALS(in.size(), out.size());
+    for(size_t i = 0; i < in.size(); i++) ASSERT_EQUALS(in[i], out[i]);
+  }
+}
+
+//Roundtrip with each compression level, on data with long and short repetitions
+void testCompressZlibLevels()
+{
+  std::cout << "testCompressZlibLevels" << std::endl;
+  std::vector<unsigned char> in(300000);
+  unsigned random = 1;
+  for(size_t i = 0; i < in.size(); i++)
+  {
+    random = random * 1103515245u + 12345u;
+    if(i % 5000 < 1000) in[i] = 0; // runs of zeros, like filtered PNG rows
+    else if(i % 5000 < 3000) in[i] = (unsigned char)((i * i) >> 7);
+    else in[i] = "abcdefgh"[(random >> 16) & 7] + (unsigned char)(i % 3); // short random repetitions
+  }
+  size_t sizes[10];
+  for(unsigned level = 0; level < 10; level++)
+  {
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    settings.level = level;
+    std::vector<unsigned char> compressed, out;
+    assertNoPNGError(lodepng::compress(compressed, in, settings));
+    assertNoPNGError(lodepng::decompress(out, compressed));
+    ASSERT_EQUALS(in.size(), out.size());
+    assertTrue(in == out, "level roundtrip");
+    sizes[level] = compressed.size();
+  }
+  assertTrue(sizes[9] < sizes[1], "level 9 compresses more than level 1");
+  assertTrue(sizes[6] <= sizes[4], "level 6 compresses at least as much as level 4");
+
+  LodePNGCompressSettings settings;
+  lodepng_compress_settings_init(&settings);
+  settings.level = 10;
+  std::vector<unsigned char> compressed;
+  ASSERT_EQUALS(96, lodepng::compress(compressed, in, settings));
+
+  // a PNG with the fastest level
+  Image image;
+  generateTestImage(image, 71, 53, LCT_RGBA, 8);
+  lodepng::State state;
+  state.encoder.zlibsettings.level = 1;
+  std::vector<unsigned char> png, decoded;
+  assertNoPNGError(lodepng::encode(png, &image.data[0], image.width, image.height, state));
+  unsigned w, h;
+  assertNoPNGError(lodepng::decode(decoded, w, h, png));
+  assertTrue(image.data == decoded, "level 1 PNG");
+}
+
+void testCompressZlibThreads()
+{
+  std::cout << "testCompressZlibThreads" << std::endl;
+  std::vector<unsigned char> in(1000000);
+  unsigned random = 1;
+  for(size_t i = 0; i < in.size(); i++)
+  {
+    random = random * 1103515245u + 12345u;
+    if(i % 50000 < 10000) in[i] = 0;
+    else if(i >= 100000 && i % 100000 < 20000) in[i] = in[i - 20000]; // repeats across the parts
+    else in[i] = "abcdefgh"[(random >> 16) & 7] + (unsigned char)(i % 3);
+  }
+  // the default, a large window, the fast and the chained match finder, fixed and stored blocks
+  const unsigned windowsizes[] = {2048, 32768, 2048, 2048, 2048, 2048};
+  const unsigned levels[] = {0, 0, 1, 6, 0, 0};
+  const unsigned btypes[] = {2, 2, 2, 2, 1, 0};
+  for(size_t s = 0; s < 6; s++)
+  {
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    settings.windowsize = windowsizes[s];
+    settings.level = levels[s];
+    settings.btype = btypes[s];
+    std::vector<unsigned char> single, parallel;
+    assertNoPNGError(lodepng::compress(single, in, settings));
+    for(unsigned threads = 0; threads < 4; threads++)
+    {
+      if(threads == 1) continue;
+      settings.num_threads = threads;
+      std::vector<unsigned char> compressed, out;
+      assertNoPNGError(lodepng::compress(compressed, in, settings));
+      // the output doesn't depend on the number of threads
+      if(threads == 0) parallel = compressed;
+      else assertTrue(compressed == parallel, "same output on any number of threads");
+      assertNoPNGError(lodepng::decompress(out, compressed));
+      assertTrue(in == out, "threads roundtrip");
+    }
+    // the parts refer back to the data before them, so little compression is lost
+    assertTrue(parallel.size() < single.size() + single.size() / 50 + 200, "compression with threads");
+  }
+
+  // small data isn't split, and a PNG can use threads as well, also with an arena
+  LodePNGCompressSettings settings;
+  lodepng_compress_settings_init(&settings);
+  std::vector<unsigned char> small(in.begin(), in.begin() + 1000), single, parallel;
+  assertNoPNGError(lodepng::compress(single, small, settings));
+  settings.num_threads = 0;
+  assertNoPNGError(lodepng::compress(parallel, small, settings));
+  assertTrue(single == parallel, "small data on one thread");
+
+  Image image;
+  generateTestImage(image, 400, 300, LCT_RGBA, 8);
+  LodePNGArena arena;
+  assertNoPNGError(lodepng_arena_init(&arena, 1 << 16));
+  {
+    lodepng::State state;
+    state.allocator = &arena.allocator;
+    state.encoder.zlibsettings.num_threads = 0;
+    std::vector<unsigned char> png, decoded;
+    assertNoPNGError(lodepng::encode(png, &image.data[0], image.width, image.height, state));
+    unsigned w, h;
+    assertNoPNGError(lodepng::decode(decoded, w, h, png));
+    assertTrue(image.data == decoded, "PNG with threads");
+  }
+  lodepng_arena_cleanup(&arena);
+}
+
+void testCompressZlibOptimal()
+{
+  std::cout << "testCompressZlibOptimal" << std::endl;
+  std::vector<unsigned char> in(150000);
+  unsigned random = 1;
+  for(size_t i = 0; i < in.size(); i++)
+  {
+    random = random * 1103515245u + 12345u;
+    if(i % 5000 < 1000) in[i] = 0;
+    else if(i % 5000 < 3000) in[i] = (unsigned char)((i * i) >> 7);
+    else in[i] = "abcdefgh"[(random >> 16) & 7] + (unsigned char)(i % 3);
+  }
+  LodePNGCompressSettings settings;
+  lodepng_compress_settings_init(&settings);
+  settings.level = 9;
+  std::vector<unsigned char> level9;
+  assertNoPNGError(lodepng::compress(level9, in, settings));
+
+  // one iteration, several, and fixed and parallel blocks as well
+  const unsigned iterations[] = {1, 10, 10, 10};
+  const unsigned btypes[] = {2, 2, 1, 2};
+  const unsigned threads[] = {1, 1, 1, 0};
+  size_t sizes[4];
+  for(size_t s = 0; s < 4; s++)
+  {
+    settings.optimal_iterations = iterations[s];
+    settings.btype = btypes[s];
+    settings.num_threads = threads[s];
+    std::vector<unsigned char> compressed, out;
+    assertNoPNGError(lodepng::compress(compressed, in, settings));
+    assertNoPNGError(lodepng::decompress(out, compressed));
+    assertTrue(in == out, "optimal roundtrip");
+    sizes[s] = compressed.size();
+  }
+  assertTrue(sizes[1] < level9.size(), "optimal parsing compresses more than level 9");
+  assertTrue(sizes[1] <= sizes[0], "more iterations compress at least as much");
+
+  // tiny and empty data, and a PNG
+  for(size_t size = 0; size < 5; size++)
+  {
+    std::vector<unsigned char> tiny(in.begin() + 2000, in.begin() + 2000 + size), compressed, out;
+    assertNoPNGError(lodepng::compress(compressed, tiny, settings));
+    assertNoPNGError(lodepng::decompress(out, compressed));
+    assertTrue(tiny == out, "optimal roundtrip of tiny data");
+  }
+  Image image;
+  generateTestImage(image, 71, 53, LCT_RGBA, 8);
+  lodepng::State state;
+  state.encoder.zlibsettings.optimal_iterations = 5;
+  state.encoder.filter_strategy = LFS_BRUTE_FORCE;
+  std::vector<unsigned char> png, decoded;
+  assertNoPNGError(lodepng::encode(png, &image.data[0], image.width, image.height, state));
+  unsigned w, h;
+  assertNoPNGError(lodepng::decode(decoded, w, h, png));
+  assertTrue(image.data == decoded, "optimal PNG");
+}
+
 void testDiskCompressZlib(const std::string& filename)
 {
   std::cout << "testDiskCompressZlib: File " << filename << std::endl;
@@ -1196,6 +1510,17 @@ void testRGBToPaletteConvert()
   palette.push_back(7);
   palette.push_back(8);
   doRGBAToPaletteTest(&palette[0], 257, LCT_RGBA);
+
+  //colors scattered over all channels, the second half only differing from the first in alpha
+  palette.clear();
+  for(int i = 0; i < 256; i++)
+  {
+    palette.push_back(((i & 127) * 37) & 255);
+    palette.push_back(((i & 127) * 101) & 255);
+    palette.push_back(((i & 127) * 203) & 127);
+    palette.push_back(i < 128 ? 255 : i - 128);
+  }
+  doRGBAToPaletteTest(&palette[0], 256);
 }
 
 void testColorKeyConvert()
@@ -1715,6 +2040,1173 @@ void testPredefinedFilters() {
   for(size_t i = 0; i < h; i++) ASSERT_EQUALS(3, outfilters[i]);
 }
 
+// Encodes images with the minimum sum strategy with each set of SIMD instructions the CPU has, which must
+// choose the same filters and give the same PNG as the portable code.
+void testFilterSIMD() {
+#ifdef LODEPNG_COMPILE_SIMD
+  std::cout << "testFilterSIMD" << std::endl;
+  const LodePNGColorType types[] = {LCT_GREY, LCT_RGB, LCT_RGBA, LCT_RGB, LCT_RGBA};
+  const unsigned depths[] = {8, 8, 8, 16, 16};
+  const unsigned widths[] = {1, 5, 11, 16, 33, 100};
+  const unsigned features[] = {LODEPNG_CPU_SSE2, ~0u};
+  unsigned h = 13;
+  unsigned seed = 1;
+  unsigned original = lodepng_get_cpu_features();
+  for(size_t t = 0; t < 5; t++)
+  for(size_t w = 0; w < 6; w++) {
+    Image image;
+    generateTestImage(image, widths[w], h, types[t], depths[t]);
+    // smooth rows, noisy rows and rows with large differences, so that each filter type wins somewhere
+    for(size_t i = 0; i < image.data.size(); i++) {
+      seed = seed * 1103515245u + 12345u;
+      size_t y = i / (image.data.size() / h);
+      if(y % 3 == 1) image.data[i] = (unsigned char)(seed >> 16);
+      else if(y % 3 == 2) image.data[i] = (unsigned char)(image.data[i] * 7 + (seed >> 28));
+    }
+    lodepng::State state;
+    state.info_raw.colortype = state.info_png.color.colortype = image.colorType;
+    state.info_raw.bitdepth = state.info_png.color.bitdepth = image.bitDepth;
+    state.encoder.auto_convert = 0;
+    state.encoder.filter_strategy = LFS_MINSUM;
+    std::vector<unsigned char> expected;
+    for(size_t f = 0; f < 3; f++) {
+      lodepng_set_cpu_features(f == 0 ? 0 : features[f - 1]);
+      std::vector<unsigned char> png;
+      unsigned error = lodepng::encode(png, &image.data[0], image.width, image.height, state);
+      lodepng_set_cpu_features(original);
+      assertNoPNGError(error);
+      if(f == 0) expected = png;
+      else assertTrue(png == expected, "same PNG with SIMD");
+    }
+  }
+#endif // LODEPNG_COMPILE_SIMD
+}
+
+// The filter strategies that try all filter types choose the same ones on any number of threads,
+// and with or without SIMD.
+void testFilterStrategies() {
+  std::cout << "testFilterStrategies" << std::endl;
+  const LodePNGFilterStrategy strategies[] = {LFS_MINSUM, LFS_ENTROPY, LFS_BRUTE_FORCE};
+  unsigned w = 300, h = 250; // bands of 54 rows
+  Image image;
+  generateTestImage(image, w, h, LCT_RGBA, 8);
+  unsigned seed = 1;
+  for(size_t i = 0; i < image.data.size(); i++) {
+    seed = seed * 1103515245u + 12345u;
+    if(((i / 4 / w) / 10) % 2) image.data[i] = (unsigned char)(image.data[i] + ((seed >> 16) & 31));
+  }
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned original = lodepng_get_cpu_features();
+#endif // LODEPNG_COMPILE_SIMD
+  for(size_t s = 0; s < 3; s++) {
+    std::vector<unsigned char> expected;
+    for(unsigned threads = 1; threads < 5; threads++) {
+      lodepng::State state;
+      state.encoder.filter_strategy = strategies[s];
+      state.encoder.num_threads = threads % 4; // 1, 2, 3 and all cores
+      std::vector<unsigned char> png;
+#ifdef LODEPNG_COMPILE_SIMD
+      // the first time without SIMD
+      lodepng_set_cpu_features(threads == 1 ? 0u : ~0u);
+#endif // LODEPNG_COMPILE_SIMD
+      unsigned error = lodepng::encode(png, &image.data[0], w, h, state);
+#ifdef LODEPNG_COMPILE_SIMD
+      lodepng_set_cpu_features(original);
+#endif // LODEPNG_COMPILE_SIMD
+      assertNoPNGError(error);
+      if(threads == 1) expected = png;
+      else assertTrue(png == expected, "same filters on any number of threads");
+    }
+    std::vector<unsigned char> filters;
+    assertNoPNGError(lodepng::getFilterTypes(filters, expected));
+    ASSERT_EQUALS(h, filters.size());
+  }
+}
+
+// Decodes images with all filter types and with each set of SIMD instructions the CPU has,
+// which must all give the same pixels as the portable code.
+void testUnfilterSIMD() {
+#ifdef LODEPNG_COMPILE_SIMD
+  std::cout << "testUnfilterSIMD" << std::endl;
+  const LodePNGColorType types[] = {LCT_GREY, LCT_RGB, LCT_RGBA, LCT_RGB, LCT_RGBA};
+  const unsigned depths[] = {8, 8, 8, 16, 16};
+  const unsigned widths[] = {1, 2, 3, 7, 16, 33};
+  const unsigned features[] = {LODEPNG_CPU_SSE2, LODEPNG_CPU_SSE2 | LODEPNG_CPU_SSSE3, ~0u};
+  unsigned h = 11;
+  unsigned seed = 1;
+  unsigned original = lodepng_get_cpu_features();
+  for(size_t t = 0; t < 5; t++)
+  for(size_t w = 0; w < 6; w++)
+  for(unsigned interlace = 0; interlace < 2; interlace++) {
+    Image image;
+    generateTestImage(image, widths[w], h, types[t], depths[t]);
+    for(size_t i = 0; i < image.data.size(); i++) {
+      seed = seed * 1103515245u + 12345u;
+      image.data[i] = (unsigned char)(seed >> 16);
+    }
+
+    // cycle through all filter types, including Paeth on the first row
+    std::vector<unsigned char> predefined(h);
+    for(size_t y = 0; y < h; y++) predefined[y] = (unsigned char)((y + w) % 5);
+    lodepng::State state;
+    state.info_raw.colortype = image.colorType;
+    state.info_raw.bitdepth = image.bitDepth;
+    state.info_png.color.colortype = image.colorType;
+    state.info_png.color.bitdepth = image.bitDepth;
+    state.info_png.interlace_method = interlace;
+    state.encoder.auto_convert = 0;
+    state.encoder.filter_strategy = LFS_PREDEFINED;
+    state.encoder.predefined_filters = &predefined[0];
+    std::vector<unsigned char> png;
+    assertNoPNGError(lodepng::encode(png, &image.data[0], image.width, image.height, state));
+
+    for(size_t f = 0; f < 4; f++) {
+      lodepng_set_cpu_features(f == 0 ? 0 : features[f - 1]);
+      std::vector<unsigned char> decoded;
+      unsigned w2, h2;
+      unsigned error = lodepng::decode(decoded, w2, h2, png, image.colorType, image.bitDepth);
+      lodepng_set_cpu_features(original);
+      assertNoPNGError(error);
+      ASSERT_EQUALS(image.data.size(), decoded.size());
+      for(size_t i = 0; i < decoded.size(); i++) {
+        if(image.data[i] != decoded[i]) {
+          std::cout << "features " << f << " type " << t << " width " << widths[w] << " interlace " << interlace
+                    << " byte " << i << std::endl;
+        }
+        ASSERT_EQUALS((int)image.data[i], (int)decoded[i]);
+      }
+    }
+  }
+#endif // LODEPNG_COMPILE_SIMD
+}
+
+struct StreamImage {
+  std::vector<unsigned char> pixels;
+  unsigned w, h, bytes; // bytes per pixel
+  size_t rows;
+};
+
+unsigned streamHeader(void* user, unsigned w, unsigned h) {
+  StreamImage* image = (StreamImage*)user;
+  image->w = w;
+  image->h = h;
+  image->pixels.resize(w * h * image->bytes);
+  return 0;
+}
+
+void streamRow(void* user, const unsigned char* pixels, unsigned count, unsigned x, unsigned dx, unsigned y) {
+  StreamImage* image = (StreamImage*)user;
+  for(unsigned i = 0; i < count; i++) {
+    for(unsigned c = 0; c < image->bytes; c++) {
+      image->pixels[(y * image->w + x + i * dx) * image->bytes + c] = pixels[i * image->bytes + c];
+    }
+  }
+  image->rows++;
+}
+
+// Decodes png in pieces of the given size with the stream decoder
+unsigned streamDecode(StreamImage& image, const std::vector<unsigned char>& png, size_t piece,
+                      LodePNGColorType colortype, unsigned bitdepth) {
+  LodePNGStreamDecoder decoder;
+  lodepng_stream_decoder_init(&decoder);
+  decoder.state.info_raw.colortype = colortype;
+  decoder.state.info_raw.bitdepth = bitdepth;
+  decoder.header = streamHeader;
+  decoder.row = streamRow;
+  decoder.user = &image;
+  image.bytes = lodepng_get_bpp(&decoder.state.info_raw) / 8;
+  image.rows = 0;
+  unsigned error = 0;
+  for(size_t i = 0; i < png.size() && !error; i += piece) {
+    error = lodepng_stream_decoder_write(&decoder, &png[i], std::min(piece, png.size() - i));
+  }
+  if(!error) error = lodepng_stream_decoder_finish(&decoder);
+  lodepng_stream_decoder_cleanup(&decoder);
+  return error;
+}
+
+// bit by bit reference CRC, independent of the tables and instructions lodepng uses
+static unsigned referenceCRC32(const unsigned char* data, size_t length) {
+  unsigned r = 0xffffffffu;
+  for(size_t i = 0; i < length; i++) {
+    r ^= data[i];
+    for(int b = 0; b < 8; b++) r = (r >> 1) ^ (0xedb88320u & (0u - (r & 1u)));
+  }
+  return r ^ 0xffffffffu;
+}
+
+void testCRC32() {
+  std::cout << "testCRC32" << std::endl;
+  ASSERT_EQUALS(0xcbf43926u, lodepng_crc32((const unsigned char*)"123456789", 9));
+  ASSERT_EQUALS(0u, lodepng_crc32(0, 0));
+
+  std::vector<unsigned char> data(1200);
+  unsigned seed = 7;
+  for(size_t i = 0; i < data.size(); i++) {
+    seed = seed * 1103515245u + 12345u;
+    data[i] = (unsigned char)(seed >> 16);
+  }
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned original = lodepng_get_cpu_features();
+  for(int simd = 0; simd < 2; simd++) {
+    lodepng_set_cpu_features(simd ? ~0u : 0u);
+#endif // LODEPNG_COMPILE_SIMD
+    // all alignments, and lengths around the 8 and 16 byte blocks and the 64 bytes needed for folding
+    for(size_t offset = 0; offset < 16; offset++)
+    for(size_t length = 0; length + offset <= 300; length++) {
+      ASSERT_EQUALS(referenceCRC32(&data[offset], length), lodepng_crc32(&data[offset], length));
+    }
+    for(size_t length = 300; length <= data.size(); length += 61) {
+      ASSERT_EQUALS(referenceCRC32(&data[0], length), lodepng_crc32(&data[0], length));
+    }
+#ifdef LODEPNG_COMPILE_SIMD
+  }
+  lodepng_set_cpu_features(original);
+#endif // LODEPNG_COMPILE_SIMD
+}
+
+// the adler32 is the last 4 bytes of the zlib data, compare it with a direct computation of the definition
+static void checkAdler32(const unsigned char* data, size_t length) {
+  unsigned s1 = 1, s2 = 0;
+  for(size_t i = 0; i < length; i++) {
+    s1 = (s1 + data[i]) % 65521;
+    s2 = (s2 + s1) % 65521;
+  }
+  LodePNGCompressSettings settings;
+  lodepng_compress_settings_init(&settings);
+  settings.btype = 0; // only the checksum matters, keep it fast
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  assertNoPNGError(lodepng_zlib_compress(&out, &outsize, data, length, &settings));
+  unsigned adler = (out[outsize - 4] << 24u) | (out[outsize - 3] << 16u) | (out[outsize - 2] << 8u) | out[outsize - 1];
+  ASSERT_EQUALS((s2 << 16u) | s1, adler);
+
+  unsigned char* decompressed = 0;
+  size_t decompressedsize = 0;
+  assertNoPNGError(lodepng_zlib_decompress(&decompressed, &decompressedsize, out, outsize,
+                                           &lodepng_default_decompress_settings));
+  ASSERT_EQUALS(length, decompressedsize);
+  free(out);
+  free(decompressed);
+}
+
+void testAdler32() {
+  std::cout << "testAdler32" << std::endl;
+  std::vector<unsigned char> data(40000);
+  unsigned seed = 3;
+  for(size_t i = 0; i < data.size(); i++) {
+    seed = seed * 1103515245u + 12345u;
+    data[i] = (unsigned char)(seed >> 16);
+  }
+  // all 255 gives the largest sums, the blocks must be reduced in time to not overflow
+  std::vector<unsigned char> ones(40000, 255);
+#ifdef LODEPNG_COMPILE_SIMD
+  const unsigned features[] = {0, LODEPNG_CPU_SSSE3 | LODEPNG_CPU_NEON, ~0u};
+  unsigned original = lodepng_get_cpu_features();
+  for(size_t f = 0; f < 3; f++) {
+    lodepng_set_cpu_features(features[f]);
+#endif // LODEPNG_COMPILE_SIMD
+    for(size_t offset = 0; offset < 4; offset++)
+    for(size_t length = 0; length <= 200; length++) checkAdler32(&data[offset], length);
+    for(size_t length = 5000; length <= data.size(); length += 4999) {
+      checkAdler32(&data[1], length - 1);
+      checkAdler32(&ones[0], length);
+    }
+#ifdef LODEPNG_COMPILE_SIMD
+  }
+  lodepng_set_cpu_features(original);
+#endif // LODEPNG_COMPILE_SIMD
+}
+
+// Encodes the image to a PNG of its own color type, a palette image with a palette of 16 colors
+void encodeTestImage(std::vector<unsigned char>& png, const Image& image, unsigned interlace, unsigned btype = 2) {
+  lodepng::State state;
+  state.info_raw.colortype = image.colorType;
+  state.info_raw.bitdepth = image.bitDepth;
+  if(image.colorType == LCT_PALETTE) {
+    for(unsigned i = 0; i < 16; i++) lodepng_palette_add(&state.info_raw, i * 16, 255 - i * 8, i, 128 + i);
+  }
+  state.info_png.interlace_method = interlace;
+  state.encoder.zlibsettings.btype = btype;
+  state.encoder.auto_convert = 0;
+  lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+  png.clear();
+  assertNoPNGError(lodepng::encode(png, &image.data[0], image.width, image.height, state));
+}
+
+// The stream decoder must give the same pixels as lodepng::decode, however the PNG is cut in pieces
+void testStreamDecoder() {
+  std::cout << "testStreamDecoder" << std::endl;
+  const LodePNGColorType types[] = {LCT_RGBA, LCT_RGB, LCT_GREY, LCT_GREY, LCT_PALETTE};
+  const unsigned depths[] = {8, 16, 8, 1, 4};
+  const size_t pieces[] = {1, 7, 1000, 1000000};
+  unsigned seed = 3;
+  for(size_t t = 0; t < 5; t++)
+  for(unsigned btype = 0; btype < 3; btype++)
+  for(unsigned interlace = 0; interlace < 2; interlace++) {
+    unsigned w = 67, h = 45 + btype;
+    Image image;
+    generateTestImage(image, w, h, types[t], depths[t]);
+    // a mix of noise and runs, to get literals as well as back references
+    for(size_t i = 0; i < image.data.size(); i++) {
+      seed = seed * 1103515245u + 12345u;
+      if((i / 64) % 2) image.data[i] = (unsigned char)(seed >> 16);
+    }
+    std::vector<unsigned char> png;
+    encodeTestImage(png, image, interlace, btype);
+
+    std::vector<unsigned char> expected;
+    unsigned w2, h2;
+    assertNoPNGError(lodepng::decode(expected, w2, h2, png));
+    for(size_t p = 0; p < 4; p++) {
+      StreamImage streamed;
+      assertNoPNGError(streamDecode(streamed, png, pieces[p], LCT_RGBA, 8));
+      ASSERT_EQUALS(w, streamed.w);
+      ASSERT_EQUALS(h, streamed.h);
+      ASSERT_EQUALS(expected.size(), streamed.pixels.size());
+      for(size_t i = 0; i < expected.size(); i++) ASSERT_EQUALS((int)expected[i], (int)streamed.pixels[i]);
+    }
+  }
+
+  // without color conversion the rows keep the color type of the PNG
+  Image image;
+  generateTestImage(image, 20, 15, LCT_RGBA, 16);
+  std::vector<unsigned char> png;
+  assertNoPNGError(lodepng::encode(png, image.data, 20, 15, LCT_RGBA, 16));
+  StreamImage streamed;
+  assertNoPNGError(streamDecode(streamed, png, 100, LCT_RGBA, 16));
+  ASSERT_EQUALS(15u, streamed.rows);
+  for(size_t i = 0; i < image.data.size(); i++) ASSERT_EQUALS((int)image.data[i], (int)streamed.pixels[i]);
+
+  // a PNG that ends in the middle of a chunk, or has corrupted data, must give an error
+  ASSERT_EQUALS(64u, streamDecode(streamed, std::vector<unsigned char>(png.begin(), png.end() - 20), 100, LCT_RGBA, 16));
+  // an IEND right after the IHDR ends the image before any row, without zlib data
+  std::vector<unsigned char> noidat(png.begin(), png.begin() + 33);
+  noidat.insert(noidat.end(), png.end() - 12, png.end());
+  ASSERT_EQUALS(53u, streamDecode(streamed, noidat, 100, LCT_RGBA, 16));
+  png[png.size() / 2] ^= 1;
+  ASSERT_EQUALS(57u, streamDecode(streamed, png, 100, LCT_RGBA, 16));
+}
+
+struct StreamPreviews {
+  std::vector<std::vector<unsigned char> > images;
+  std::vector<unsigned> passes;
+  size_t size; // bytes of an image
+};
+
+void streamPreview(void* user, const unsigned char* image, unsigned, unsigned, unsigned pass) {
+  StreamPreviews* previews = (StreamPreviews*)user;
+  previews->images.push_back(std::vector<unsigned char>(image, image + previews->size));
+  previews->passes.push_back(pass);
+}
+
+// Decodes png with the stream decoder in pieces of 100 bytes and collects its previews
+unsigned streamDecodePreviews(StreamPreviews& previews, const std::vector<unsigned char>& png,
+                              unsigned color_convert, unsigned preview_pass) {
+  LodePNGStreamDecoder decoder;
+  lodepng_stream_decoder_init(&decoder);
+  decoder.state.decoder.color_convert = color_convert;
+  decoder.preview = streamPreview;
+  if(preview_pass) decoder.preview_pass = preview_pass;
+  decoder.user = &previews;
+  unsigned error = 0;
+  for(size_t i = 0; i < png.size() && !error; i += 100) {
+    error = lodepng_stream_decoder_write(&decoder, &png[i], std::min<size_t>(100, png.size() - i));
+    if(!previews.size && decoder.width) {
+      LodePNGColorMode mode = color_convert ? decoder.state.info_raw : decoder.state.info_png.color;
+      previews.size = lodepng_get_raw_size(decoder.width, decoder.height, &mode);
+    }
+  }
+  if(!error) error = lodepng_stream_decoder_finish(&decoder);
+  lodepng_stream_decoder_cleanup(&decoder);
+  return error;
+}
+
+// Each preview of an Adam7 image has the pixels of the passes so far, blown up to blocks
+void testStreamDecoderPreview() {
+  std::cout << "testStreamDecoderPreview" << std::endl;
+  const unsigned blockw[7] = {8, 4, 4, 2, 2, 1, 1}, blockh[7] = {8, 8, 4, 4, 2, 2, 1};
+  for(unsigned grey = 0; grey < 2; grey++) {
+    unsigned w = 67, h = 45;
+    Image image;
+    generateTestImage(image, w, h, grey ? LCT_GREY : LCT_RGBA, grey ? 1 : 8);
+    std::vector<unsigned char> png;
+    encodeTestImage(png, image, 1);
+    // the 1-bit image without conversion checks the previews bit by bit
+    unsigned bpp = grey ? 1 : 32;
+    std::vector<unsigned char> full;
+    unsigned w2, h2;
+    lodepng::State decodestate;
+    decodestate.decoder.color_convert = !grey;
+    assertNoPNGError(lodepng::decode(full, w2, h2, decodestate, png));
+
+    StreamPreviews previews;
+    previews.size = 0;
+    assertNoPNGError(streamDecodePreviews(previews, png, !grey, 1));
+    ASSERT_EQUALS(7u, previews.images.size());
+    for(unsigned p = 0; p < 7; p++) {
+      ASSERT_EQUALS(p + 1, previews.passes[p]);
+      const std::vector<unsigned char>& preview = previews.images[p];
+      for(unsigned y = 0; y < h; y++)
+      for(unsigned x = 0; x < w; x++)
+      for(unsigned b = 0; b < bpp; b++) {
+        size_t i = ((size_t)y * w + x) * bpp + b;
+        size_t j = ((size_t)(y - y % blockh[p]) * w + x - x % blockw[p]) * bpp + b;
+        ASSERT_EQUALS((full[j / 8] >> (7 - j % 8)) & 1, (preview[i / 8] >> (7 - i % 8)) & 1);
+      }
+    }
+    assertTrue(previews.images.back() == full, "last preview is the image");
+
+    // by default from pass 3 on, and not for images without interlacing
+    StreamPreviews later;
+    later.size = 0;
+    assertNoPNGError(streamDecodePreviews(later, png, !grey, 0));
+    ASSERT_EQUALS(5u, later.passes.size());
+    ASSERT_EQUALS(3u, later.passes[0]);
+    std::vector<unsigned char> plain;
+    assertNoPNGError(lodepng::encode(plain, full, w, h, grey ? LCT_GREY : LCT_RGBA, grey ? 1 : 8));
+    StreamPreviews none;
+    none.size = 0;
+    assertNoPNGError(streamDecodePreviews(none, plain, !grey, 1));
+    ASSERT_EQUALS(0u, none.passes.size());
+  }
+
+  // the last pass with pixels always gives a preview, also before preview_pass: a 1x1 image only has
+  // pass 1, and an image of 1 row has none in pass 7
+  const unsigned sizes[2][3] = {{1, 1, 1}, {67, 1, 6}}; // w, h, last pass with pixels
+  for(unsigned k = 0; k < 2; k++) {
+    Image image;
+    generateTestImage(image, sizes[k][0], sizes[k][1], LCT_RGBA, 8);
+    std::vector<unsigned char> png;
+    encodeTestImage(png, image, 1);
+    StreamPreviews previews;
+    previews.size = image.data.size(); // the whole PNG is in the first piece, before the size is known
+    assertNoPNGError(streamDecodePreviews(previews, png, 1, 7));
+    ASSERT_EQUALS(1u, previews.passes.size());
+    ASSERT_EQUALS(sizes[k][2], previews.passes[0]);
+    assertTrue(previews.images[0] == image.data, "preview of the last pass is the image");
+  }
+}
+
+unsigned streamWrite(void* user, const unsigned char* data, size_t size) {
+  std::vector<unsigned char>* png = (std::vector<unsigned char>*)user;
+  png->insert(png->end(), data, data + size);
+  return 0;
+}
+
+unsigned streamWriteFail(void*, const unsigned char*, size_t) {
+  return 1234;
+}
+
+// the contents of the IDAT chunks of a PNG, one after another
+std::vector<unsigned char> getImageData(const std::vector<unsigned char>& png, size_t* numidat) {
+  std::vector<unsigned char> data;
+  *numidat = 0;
+  const unsigned char* chunk = &png[8];
+  while(chunk < &png[0] + png.size()) {
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) {
+      data.insert(data.end(), lodepng_chunk_data_const(chunk), lodepng_chunk_data_const(chunk) + lodepng_chunk_length(chunk));
+      (*numidat)++;
+    }
+    chunk = lodepng_chunk_next_const(chunk);
+  }
+  return data;
+}
+
+// Encodes h rows of stride bytes with the stream encoder, count rows at a time
+unsigned streamEncode(std::vector<unsigned char>& png, const unsigned char* rows, unsigned w, unsigned h,
+                      size_t stride, unsigned count, const lodepng::State& state) {
+  LodePNGStreamEncoder encoder;
+  lodepng_stream_encoder_init(&encoder);
+  lodepng_state_copy(&encoder.state, &state);
+  encoder.state.error = 0;
+  encoder.write = streamWrite;
+  encoder.user = &png;
+  png.clear();
+  unsigned error = lodepng_stream_encoder_start(&encoder, w, h);
+  for(unsigned y = 0; y < h && !error; y += count) {
+    error = lodepng_stream_encoder_push(&encoder, &rows[y * stride], std::min(count, h - y), stride);
+  }
+  if(!error) error = lodepng_stream_encoder_finish(&encoder);
+  lodepng_stream_encoder_cleanup(&encoder);
+  return error;
+}
+
+void testStreamEncoder() {
+  std::cout << "testStreamEncoder" << std::endl;
+  // large enough for several parts of deflate data, with several filter strategies
+  unsigned w = 300, h = 600;
+  Image image;
+  generateTestImage(image, w, h, LCT_RGBA, 8);
+  std::vector<unsigned char> filters(h);
+  for(unsigned y = 0; y < h; y++) filters[y] = (unsigned char)(y % 5);
+  const LodePNGFilterStrategy strategies[] = {LFS_MINSUM, LFS_PREDEFINED, LFS_BRUTE_FORCE};
+  const unsigned counts[] = {1, 7, 600};
+  for(size_t s = 0; s < 3; s++) {
+    lodepng::State state;
+    state.encoder.auto_convert = 0;
+    state.encoder.filter_strategy = strategies[s];
+    state.encoder.predefined_filters = &filters[0];
+    state.encoder.zlibsettings.num_threads = 0;
+    std::vector<unsigned char> expected;
+    assertNoPNGError(lodepng::encode(expected, &image.data[0], w, h, state));
+    size_t numexpected, numstreamed;
+    std::vector<unsigned char> expecteddata = getImageData(expected, &numexpected);
+    for(size_t c = 0; c < 3; c++) {
+      std::vector<unsigned char> png;
+      assertNoPNGError(streamEncode(png, &image.data[0], w, h, w * 4, counts[c], state));
+      // the same image data, in an IDAT chunk per part
+      assertTrue(getImageData(png, &numstreamed) == expecteddata, "stream encoder image data");
+      ASSERT_EQUALS(expected.size() + (numstreamed - numexpected) * 12, png.size());
+      ASSERT_EQUALS((h * (w * 4 + 1) + 131071) / 131072, numstreamed); // parts of 128K filtered bytes
+      std::vector<unsigned char> decoded;
+      unsigned w2, h2;
+      assertNoPNGError(lodepng::decode(decoded, w2, h2, png));
+      assertTrue(decoded == image.data, "stream encoder roundtrip");
+    }
+  }
+
+  // rows with padding after them, converted to another color type, and rows of less than 8 bit pixels
+  const LodePNGColorType rawtypes[] = {LCT_RGB, LCT_GREY};
+  const LodePNGColorType pngtypes[] = {LCT_RGBA, LCT_GREY};
+  const unsigned depths[] = {8, 2};
+  for(size_t t = 0; t < 2; t++) {
+    unsigned w = 13, h = 20;
+    lodepng::State state;
+    state.info_raw.colortype = rawtypes[t];
+    state.info_raw.bitdepth = depths[t];
+    state.info_png.color.colortype = pngtypes[t];
+    state.info_png.color.bitdepth = depths[t];
+    size_t linebytes = (w * lodepng_get_bpp(&state.info_raw) + 7) / 8, stride = linebytes + 3;
+    std::vector<unsigned char> rows(stride * h);
+    unsigned seed = 5;
+    for(size_t i = 0; i < rows.size(); i++) {
+      seed = seed * 1103515245u + 12345u;
+      rows[i] = (unsigned char)(seed >> 16);
+    }
+    std::vector<unsigned char> png, decoded(stride * h);
+    assertNoPNGError(streamEncode(png, &rows[0], w, h, stride, 3, state));
+    unsigned w2, h2;
+    assertNoPNGError(lodepng_decode_into(&decoded[0], stride, decoded.size(), &w2, &h2, &state,
+                                         &png[0], png.size(), 0));
+    ASSERT_EQUALS(pngtypes[t], state.info_png.color.colortype);
+    // 13 pixels of 2 bits leave 6 bits of padding in the last byte of a row
+    unsigned char mask = depths[t] == 2 ? 0xc0 : 0xff;
+    for(unsigned y = 0; y < h; y++)
+    for(size_t i = 0; i < linebytes; i++) {
+      unsigned char m = i + 1 == linebytes ? mask : 0xff;
+      ASSERT_EQUALS((int)(rows[y * stride + i] & m), (int)(decoded[y * stride + i] & m));
+    }
+  }
+
+  // errors: interlacing, too many or too few rows, a stride too small, and one from the write function
+  lodepng::State state;
+  std::vector<unsigned char> png;
+  state.info_png.interlace_method = 1;
+  ASSERT_EQUALS(97u, streamEncode(png, &image.data[0], 10, 10, 40, 10, state));
+  state.info_png.interlace_method = 0;
+  LodePNGStreamEncoder encoder;
+  lodepng_stream_encoder_init(&encoder);
+  encoder.write = streamWrite;
+  encoder.user = &png;
+  ASSERT_EQUALS(98u, lodepng_stream_encoder_push(&encoder, &image.data[0], 1, 0));
+  lodepng_stream_encoder_cleanup(&encoder);
+  const unsigned pushed[] = {11, 9, 10};
+  const size_t strides[] = {0, 0, 39};
+  const unsigned errors[] = {98, 98, 95};
+  for(size_t i = 0; i < 3; i++) {
+    lodepng_stream_encoder_init(&encoder);
+    encoder.write = streamWrite;
+    encoder.user = &png;
+    assertNoPNGError(lodepng_stream_encoder_start(&encoder, 10, 10));
+    unsigned error = lodepng_stream_encoder_push(&encoder, &image.data[0], pushed[i], strides[i]);
+    if(!error) error = lodepng_stream_encoder_finish(&encoder);
+    ASSERT_EQUALS(errors[i], error);
+    ASSERT_EQUALS(errors[i], lodepng_stream_encoder_finish(&encoder)); // the error sticks
+    lodepng_stream_encoder_cleanup(&encoder);
+  }
+  lodepng_stream_encoder_init(&encoder);
+  encoder.write = streamWriteFail;
+  ASSERT_EQUALS(1234u, lodepng_stream_encoder_start(&encoder, 10, 10));
+  ASSERT_EQUALS(1234u, lodepng_stream_encoder_push(&encoder, &image.data[0], 10, 0));
+  lodepng_stream_encoder_cleanup(&encoder);
+}
+
+// decodes into a buffer with padding after each row and compares the pixels with lodepng::decode
+void checkDecodeInto(const std::vector<unsigned char>& png, LodePNGColorType colortype, unsigned bitdepth,
+                     unsigned color_convert, LodePNGDecodeScratch* scratch) {
+  lodepng::State state;
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = bitdepth;
+  state.decoder.color_convert = color_convert;
+  std::vector<unsigned char> expected;
+  unsigned w, h;
+  assertNoPNGError(lodepng::decode(expected, w, h, state, png));
+  unsigned bpp = lodepng_get_bpp(&state.info_raw);
+  size_t linebytes = (w * bpp + 7) / 8;
+  size_t stride = linebytes + 5;
+  std::vector<unsigned char> out(stride * h, 0xcd);
+
+  unsigned w2, h2;
+  lodepng::State state2;
+  state2.info_raw.colortype = colortype;
+  state2.info_raw.bitdepth = bitdepth;
+  state2.decoder.color_convert = color_convert;
+  assertNoPNGError(lodepng_decode_into(&out[0], stride, out.size() - 5, &w2, &h2, &state2, &png[0], png.size(), scratch));
+  ASSERT_EQUALS(w, w2);
+  ASSERT_EQUALS(h, h2);
+  ASSERT_EQUALS(bpp, lodepng_get_bpp(&state2.info_raw));
+  for(unsigned y = 0; y < h; y++) {
+    for(size_t i = 0; i < (size_t)w * bpp; i++) {
+      size_t a = y * w * bpp + i, b = y * stride * 8 + i;
+      ASSERT_EQUALS((expected[a / 8] >> (7 - a % 8)) & 1, (out[b / 8] >> (7 - b % 8)) & 1);
+    }
+    for(size_t i = linebytes; i < stride && y * stride + i < out.size() - 5; i++) {
+      ASSERT_EQUALS(0xcd, (int)out[y * stride + i]);
+    }
+  }
+
+  // the last row doesn't need the padding, but a byte less is too small, as is a smaller stride
+  ASSERT_EQUALS(95u, lodepng_decode_into(&out[0], stride, out.size() - 6, &w2, &h2, &state2, &png[0], png.size(), scratch));
+  ASSERT_EQUALS(95u, lodepng_decode_into(&out[0], linebytes - 1, out.size(), &w2, &h2, &state2, &png[0], png.size(), scratch));
+}
+
+void testDecodeInto() {
+  std::cout << "testDecodeInto" << std::endl;
+  const LodePNGColorType types[] = {LCT_RGBA, LCT_RGB, LCT_GREY_ALPHA, LCT_GREY, LCT_PALETTE};
+  const unsigned depths[] = {8, 16, 8, 1, 4};
+  LodePNGDecodeScratch scratch;
+  lodepng_decode_scratch_init(&scratch);
+  for(size_t t = 0; t < 5; t++)
+  for(unsigned interlace = 0; interlace < 2; interlace++) {
+    Image image;
+    generateTestImage(image, 67, 45, types[t], depths[t]);
+    std::vector<unsigned char> png;
+    encodeTestImage(png, image, interlace);
+
+    // the scratch memory is reused by every call, one call allocates its own
+    checkDecodeInto(png, LCT_RGBA, 8, 1, &scratch);
+    checkDecodeInto(png, LCT_RGB, 8, 1, &scratch);
+    checkDecodeInto(png, LCT_RGBA, 8, 0, &scratch);
+    checkDecodeInto(png, LCT_RGBA, 16, 1, 0);
+  }
+  assertTrue(scratch.scanlinessize != 0);
+  lodepng_decode_scratch_cleanup(&scratch);
+  ASSERT_EQUALS(0u, scratch.scanlinessize);
+}
+
+// the pixels of a rectangle of a raw image with bpp bits per pixel, every step-th pixel in both directions
+static std::vector<unsigned char> cropImage(const std::vector<unsigned char>& image, unsigned w, unsigned bpp,
+                                            unsigned x0, unsigned y0, unsigned cw, unsigned ch, unsigned step) {
+  unsigned rw = (cw + step - 1) / step, rh = (ch + step - 1) / step;
+  std::vector<unsigned char> result(((size_t)rw * rh * bpp + 7) / 8, 0);
+  size_t obp = 0;
+  for(unsigned y = 0; y < rh; y++)
+  for(unsigned x = 0; x < rw; x++)
+  for(unsigned b = 0; b < bpp; b++, obp++) {
+    size_t ibp = ((size_t)(y0 + y * step) * w + x0 + x * step) * bpp + b;
+    if((image[ibp / 8] >> (7 - ibp % 8)) & 1) result[obp / 8] |= 1 << (7 - obp % 8);
+  }
+  return result;
+}
+
+// the average of each square of factor * factor pixels of an image with 8-bit channels
+static std::vector<unsigned char> boxImage(const std::vector<unsigned char>& image, unsigned w, unsigned h,
+                                           unsigned channels, unsigned factor) {
+  std::vector<unsigned char> result;
+  for(unsigned oy = 0; oy < h; oy += factor)
+  for(unsigned ox = 0; ox < w; ox += factor)
+  for(unsigned c = 0; c < channels; c++) {
+    unsigned sum = 0, count = 0;
+    for(unsigned y = oy; y < oy + factor && y < h; y++)
+    for(unsigned x = ox; x < ox + factor && x < w; x++, count++) sum += image[(y * w + x) * channels + c];
+    result.push_back((unsigned char)((sum + count / 2) / count));
+  }
+  return result;
+}
+
+void testDecodeRegion() {
+  std::cout << "testDecodeRegion" << std::endl;
+  const LodePNGColorType types[] = {LCT_RGBA, LCT_RGB, LCT_GREY_ALPHA, LCT_GREY, LCT_PALETTE};
+  const unsigned depths[] = {8, 16, 8, 1, 4};
+  // x, y, width, height, downscale. A width of 0 is the whole image, the last ones are clipped
+  const unsigned regions[][5] = {{0, 0, 0, 0, 1}, {0, 0, 0, 0, 2}, {8, 16, 30, 20, 4}, {3, 5, 40, 30, 1},
+                                 {3, 5, 40, 30, 2}, {3, 5, 40, 30, 8}, {0, 0, 67, 45, 8}, {16, 8, 1, 1, 1},
+                                 {56, 40, 20, 20, 8}, {0, 20, 500, 1, 1}};
+  for(size_t t = 0; t < 5; t++)
+  for(unsigned interlace = 0; interlace < 2; interlace++) {
+    unsigned w = 67, h = 45;
+    Image image;
+    generateTestImage(image, w, h, types[t], depths[t]);
+    std::vector<unsigned char> png;
+    encodeTestImage(png, image, interlace);
+
+    std::vector<unsigned char> full, raw;
+    unsigned w2, h2;
+    assertNoPNGError(lodepng::decode(full, w2, h2, png));
+    lodepng::State rawstate;
+    rawstate.decoder.color_convert = 0;
+    assertNoPNGError(lodepng::decode(raw, w2, h2, rawstate, png));
+    unsigned bpp = lodepng_get_bpp(&rawstate.info_png.color);
+
+    for(size_t r = 0; r < sizeof(regions) / sizeof(*regions); r++) {
+      const unsigned* region = regions[r];
+      unsigned x0 = region[2] ? region[0] : 0, y0 = region[2] ? region[1] : 0, factor = region[4];
+      unsigned cw = region[2] ? std::min(region[2], w - x0) : w, ch = region[3] ? std::min(region[3], h - y0) : h;
+      // Adam7 images aligned to the squares give their top left pixels
+      unsigned step = interlace && x0 % factor == 0 && y0 % factor == 0 ? factor : 1;
+      std::vector<unsigned char> expected = cropImage(full, w, 32, x0, y0, cw, ch, step);
+      if(factor != step) expected = boxImage(expected, cw, ch, 4, factor);
+
+      lodepng::State regionstate;
+      regionstate.decoder.crop_x = region[0];
+      regionstate.decoder.crop_y = region[1];
+      regionstate.decoder.crop_w = region[2];
+      regionstate.decoder.crop_h = region[3];
+      regionstate.decoder.downscale = factor;
+      std::vector<unsigned char> decoded;
+      assertNoPNGError(lodepng::decode(decoded, w2, h2, regionstate, png));
+      ASSERT_EQUALS((cw + factor - 1) / factor, w2);
+      ASSERT_EQUALS((ch + factor - 1) / factor, h2);
+      assertTrue(decoded == expected, "region pixels");
+
+      // without color conversion, in the bits of the PNG
+      if(factor == 1) {
+        regionstate.decoder.color_convert = 0;
+        decoded.clear();
+        assertNoPNGError(lodepng::decode(decoded, w2, h2, regionstate, png));
+        assertTrue(decoded == cropImage(raw, w, bpp, x0, y0, cw, ch, 1), "region of raw pixels");
+      }
+    }
+
+    // 16-bit output averages 16-bit values
+    lodepng::State state16;
+    state16.info_raw.bitdepth = 16;
+    state16.decoder.downscale = 2;
+    std::vector<unsigned char> decoded16;
+    assertNoPNGError(lodepng::decode(decoded16, w2, h2, state16, png));
+    ASSERT_EQUALS(34u, w2);
+    ASSERT_EQUALS(23u, h2);
+    if(!interlace && depths[t] == 16) {
+      unsigned sum = 0;
+      for(unsigned i = 0; i < 4; i++) {
+        const unsigned char* red = &image.data[(i / 2 * w + i % 2) * 6];
+        sum += 256u * red[0] + red[1];
+      }
+      ASSERT_EQUALS((sum + 2) / 4, 256u * decoded16[0] + decoded16[1]);
+    }
+  }
+
+  Image image;
+  generateTestImage(image, 67, 45, LCT_RGBA, 8);
+  std::vector<unsigned char> png, decoded;
+  assertNoPNGError(lodepng::encode(png, image.data, 67, 45));
+  unsigned w, h;
+  lodepng::State state;
+  state.decoder.downscale = 3;
+  ASSERT_EQUALS(99u, lodepng::decode(decoded, w, h, state, png));
+  state.decoder.downscale = 1;
+  state.decoder.crop_x = 67;
+  state.decoder.crop_w = state.decoder.crop_h = 1;
+  ASSERT_EQUALS(99u, lodepng::decode(decoded, w, h, state, png));
+  state.decoder.crop_x = 0;
+  std::vector<unsigned char> out(4);
+  ASSERT_EQUALS(101u, lodepng_decode_into(&out[0], 4, 4, &w, &h, &state, &png[0], png.size(), 0));
+  state.decoder.downscale = 2;
+  state.info_raw.colortype = LCT_PALETTE;
+  ASSERT_EQUALS(100u, lodepng::decode(decoded, w, h, state, png));
+
+  // a crop at the top doesn't inflate up to the checksum at the end
+  size_t idat = std::search(png.begin(), png.end(), "IDAT", "IDAT" + 4) - png.begin();
+  png[idat + 4 + lodepng_chunk_length(&png[idat - 4]) - 1] ^= 1;
+  lodepng::State corrupt;
+  corrupt.decoder.ignore_crc = 1;
+  ASSERT_EQUALS(58u, lodepng::decode(decoded, w, h, corrupt, png));
+  corrupt.decoder.crop_w = 67;
+  corrupt.decoder.crop_h = 10;
+  assertNoPNGError(lodepng::decode(decoded, w, h, corrupt, png));
+  ASSERT_EQUALS(10u, h);
+}
+
+void testInspectMetadata() {
+  std::cout << "testInspectMetadata" << std::endl;
+  unsigned w = 37, h = 13;
+  Image image;
+  generateTestImage(image, w, h, LCT_PALETTE, 4);
+  lodepng::State state;
+  state.info_raw.colortype = LCT_PALETTE;
+  state.info_raw.bitdepth = 4;
+  for(unsigned i = 0; i < 16; i++) lodepng_palette_add(&state.info_raw, i * 16, 255 - i * 8, i, i < 3 ? i : 255);
+  lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+  state.info_png.interlace_method = 1;
+  state.info_png.phys_defined = 1;
+  state.info_png.phys_x = 2835;
+  state.info_png.phys_y = 2836;
+  state.info_png.phys_unit = 1;
+  lodepng_add_text(&state.info_png, "key0", "string0");
+  lodepng_add_itext(&state.info_png, "key1", "en", "key1", "string1");
+  state.encoder.auto_convert = 0;
+  state.encoder.zlibsettings.btype = 0;
+  std::vector<unsigned char> png;
+  assertNoPNGError(lodepng::encode(png, &image.data[0], w, h, state));
+
+  LodePNGMetadata metadata;
+  lodepng::State state2;
+  assertNoPNGError(lodepng_inspect_metadata(&metadata, &state2, &png[0], png.size()));
+  ASSERT_EQUALS(w, metadata.width);
+  ASSERT_EQUALS(h, metadata.height);
+  ASSERT_EQUALS(LCT_PALETTE, metadata.colortype);
+  ASSERT_EQUALS(4, metadata.bitdepth);
+  ASSERT_EQUALS(1, metadata.interlace_method);
+  ASSERT_EQUALS(lodepng_get_raw_size(w, h, &state.info_png.color), metadata.raw_size);
+  ASSERT_EQUALS(16, metadata.palettesize);
+  ASSERT_EQUALS(state.info_png.color.palette[4 * 5 + 1], metadata.palette[3 * 5 + 1]);
+  ASSERT_EQUALS(3, metadata.trnssize);
+  ASSERT_EQUALS(2, metadata.trns[2]);
+  ASSERT_EQUALS(1, metadata.phys_defined);
+  ASSERT_EQUALS(2835, metadata.phys_x);
+  ASSERT_EQUALS(2836, metadata.phys_y);
+  ASSERT_EQUALS(1, metadata.phys_unit);
+  ASSERT_EQUALS(2, metadata.text_chunks);
+  ASSERT_EQUALS(1, metadata.idat_chunks);
+  ASSERT_EQUALS(8, metadata.num_chunks); // IHDR, PLTE, tRNS, pHYs, tEXt, iTXt, IDAT, IEND
+  // the pointers are into the PNG itself
+  assertTrue(metadata.palette > &png[0] && metadata.palette < &png[0] + png.size());
+
+  // a broken CRC in a chunk that is read is an error unless CRCs are ignored, IDAT isn't checked at all
+  std::vector<unsigned char> png2 = png;
+  for(unsigned char* chunk = &png2[8]; !lodepng_chunk_type_equals(chunk, "IEND"); chunk = lodepng_chunk_next(chunk)) {
+    if(lodepng_chunk_type_equals(chunk, "PLTE") || lodepng_chunk_type_equals(chunk, "IDAT")) chunk[10] ^= 1;
+  }
+  ASSERT_EQUALS(57, lodepng_inspect_metadata(&metadata, &state2, &png2[0], png2.size()));
+  state2.decoder.ignore_crc = 1;
+  assertNoPNGError(lodepng_inspect_metadata(&metadata, &state2, &png2[0], png2.size()));
+
+  // a truncated PNG fails like decoding does
+  ASSERT_EQUALS(30, lodepng_inspect_metadata(&metadata, &state2, &png[0], png.size() - 12));
+  state2.decoder.ignore_end = 1;
+  assertNoPNGError(lodepng_inspect_metadata(&metadata, &state2, &png[0], png.size() - 12));
+  ASSERT_EQUALS(16, metadata.palettesize);
+
+  ASSERT_EQUALS(27, lodepng_inspect_metadata(&metadata, &state2, &png[0], 20));
+}
+
+void testMapFile() {
+  std::cout << "testMapFile" << std::endl;
+  const char* filename = "lodepng_unittest_mapfile.png";
+  Image image;
+  generateTestImage(image, 41, 17, LCT_RGBA, 8);
+  std::vector<unsigned char> png;
+  assertNoPNGError(lodepng::encode(png, image.data, image.width, image.height));
+  assertNoPNGError(lodepng::save_file(png, filename));
+
+  LodePNGMappedFile file;
+  assertNoPNGError(lodepng_map_file(&file, filename));
+#ifdef LODEPNG_COMPILE_MMAP
+  ASSERT_EQUALS(1, file.mapped);
+#endif // LODEPNG_COMPILE_MMAP
+  ASSERT_EQUALS(png.size(), file.size);
+  assertTrue(std::equal(png.begin(), png.end(), file.data));
+  lodepng_unmap_file(&file);
+  ASSERT_EQUALS(0, file.size);
+
+  std::vector<unsigned char> decoded;
+  unsigned w, h;
+  assertNoPNGError(lodepng::decode(decoded, w, h, std::string(filename)));
+  ASSERT_EQUALS(image.width, w);
+  assertTrue(decoded == image.data);
+  unsigned char* decoded2 = 0;
+  assertNoPNGError(lodepng_decode32_file(&decoded2, &w, &h, filename));
+  assertTrue(std::equal(image.data.begin(), image.data.end(), decoded2));
+  free(decoded2);
+
+  // an empty file can't be mapped, it's loaded instead
+  assertNoPNGError(lodepng::save_file(std::vector<unsigned char>(), filename));
+  assertNoPNGError(lodepng_map_file(&file, filename));
+  ASSERT_EQUALS(0, file.mapped);
+  ASSERT_EQUALS(0, file.size);
+  lodepng_unmap_file(&file);
+  remove(filename);
+
+  ASSERT_EQUALS(78, lodepng_map_file(&file, filename));
+  lodepng_unmap_file(&file);
+}
+
+struct AllocationCount {
+  size_t allocs;
+  size_t frees;
+};
+
+static void* countAllocate(void* user, size_t size) {
+  ((AllocationCount*)user)->allocs++;
+  return malloc(size);
+}
+
+static void* countReallocate(void* user, void* ptr, size_t size) {
+  if(!ptr) ((AllocationCount*)user)->allocs++;
+  return realloc(ptr, size);
+}
+
+static void countDeallocate(void* user, void* ptr) {
+  if(ptr) ((AllocationCount*)user)->frees++;
+  free(ptr);
+}
+
+void testAllocators() {
+  std::cout << "testAllocators" << std::endl;
+  unsigned w = 67, h = 45, w2, h2;
+  Image image;
+  generateTestImage(image, w, h, LCT_RGBA, 8);
+  lodepng::State encoder;
+  encoder.info_png.interlace_method = 1;
+  lodepng_add_text(&encoder.info_png, "key", "value");
+  std::vector<unsigned char> png, expected;
+  assertNoPNGError(lodepng::encode(png, &image.data[0], w, h, encoder));
+  assertNoPNGError(lodepng::decode(expected, w2, h2, png));
+
+  // a big arena has room for everything, a tiny one leaves most to the heap; both are reset between images
+  const size_t sizes[] = {1 << 20, 64};
+  for(size_t s = 0; s < 2; s++) {
+    LodePNGArena arena;
+    assertNoPNGError(lodepng_arena_init(&arena, sizes[s]));
+    for(int i = 0; i < 3; i++) {
+      LodePNGState state;
+      lodepng_state_init(&state);
+      state.allocator = &arena.allocator;
+      unsigned char* out = 0;
+      assertNoPNGError(lodepng_decode(&out, &w2, &h2, &state, &png[0], png.size()));
+      ASSERT_EQUALS(w, w2);
+      ASSERT_EQUALS(h, h2);
+      assertTrue(std::equal(expected.begin(), expected.end(), out), "arena decode");
+      ASSERT_EQUALS(1u, state.info_png.text_num);
+      assertTrue(arena.numallocs != 0);
+      assertEquals(s == 0, arena.numheap == 0, "arena heap use");
+      lodepng_state_cleanup(&state);
+      lodepng_arena_reset(&arena);
+      ASSERT_EQUALS(0u, arena.used);
+      ASSERT_EQUALS(0u, arena.numallocs);
+    }
+
+    // encoding with an arena gives the same PNG, the text given with malloc is freed by the state
+    {
+      lodepng::State state;
+      state.allocator = &arena.allocator;
+      state.info_png.interlace_method = 1;
+      lodepng_add_text(&state.info_png, "key", "value");
+      std::vector<unsigned char> png2;
+      assertNoPNGError(lodepng::encode(png2, &image.data[0], w, h, state));
+      assertTrue(png == png2, "arena encode");
+    }
+    lodepng_arena_cleanup(&arena);
+  }
+
+  // the allocator of the zlib settings is used for all memory of a zlib call
+  AllocationCount count = {0, 0};
+  LodePNGAllocator allocator = {countAllocate, countReallocate, countDeallocate, &count};
+  LodePNGCompressSettings compress;
+  lodepng_compress_settings_init(&compress);
+  compress.allocator = &allocator;
+  std::vector<unsigned char> zlib;
+  assertNoPNGError(lodepng::compress(zlib, image.data, compress));
+  assertTrue(count.allocs != 0);
+  ASSERT_EQUALS(count.allocs, count.frees);
+
+  LodePNGDecompressSettings decompress;
+  lodepng_decompress_settings_init(&decompress);
+  decompress.allocator = &allocator;
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  count.allocs = count.frees = 0;
+  assertNoPNGError(lodepng_zlib_decompress(&out, &outsize, &zlib[0], zlib.size(), &decompress));
+  ASSERT_EQUALS(image.data.size(), outsize);
+  ASSERT_EQUALS(count.allocs, count.frees + 1); // the output
+  free(out);
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+// the heap use of the decodes, from several threads
+struct HeapUse {
+  std::atomic<size_t> current;
+  std::atomic<size_t> peak;
+};
+
+static const size_t HEAP_HEADER = 16; // the size of each allocation is kept in front of it
+
+static void* heapAllocate(void* user, size_t size) {
+  HeapUse* use = (HeapUse*)user;
+  unsigned char* p = (unsigned char*)malloc(size + HEAP_HEADER);
+  if(!p) return 0;
+  *(size_t*)p = size;
+  size_t current = use->current += size;
+  size_t peak = use->peak;
+  while(current > peak && !use->peak.compare_exchange_weak(peak, current)) {}
+  return p + HEAP_HEADER;
+}
+
+static void heapDeallocate(void* user, void* ptr) {
+  if(!ptr) return;
+  unsigned char* p = (unsigned char*)ptr - HEAP_HEADER;
+  ((HeapUse*)user)->current -= *(size_t*)p;
+  free(p);
+}
+
+static void* heapReallocate(void* user, void* ptr, size_t size) {
+  void* result = heapAllocate(user, size);
+  if(result && ptr) {
+    memcpy(result, ptr, std::min(size, *(size_t*)((unsigned char*)ptr - HEAP_HEADER)));
+    heapDeallocate(user, ptr);
+  }
+  return result;
+}
+
+void testBatchDecoder() {
+  std::cout << "testBatchDecoder" << std::endl;
+  const char* filename = "lodepng_unittest_batch.png";
+  // images of different sizes, some interlaced, the last one is also decoded from a file
+  std::vector<std::vector<unsigned char> > pngs, expected;
+  for(unsigned i = 0; i < 12; i++) {
+    Image image;
+    generateTestImage(image, 13 + 37 * i, 200 - 15 * i, i % 3 ? LCT_RGBA : LCT_RGB, 8);
+    lodepng::State state;
+    state.info_raw.colortype = image.colorType;
+    state.info_png.interlace_method = i % 4 == 1;
+    std::vector<unsigned char> png, decoded;
+    assertNoPNGError(lodepng::encode(png, &image.data[0], image.width, image.height, state));
+    unsigned w, h;
+    assertNoPNGError(lodepng::decode(decoded, w, h, png));
+    pngs.push_back(png);
+    expected.push_back(decoded);
+  }
+  assertNoPNGError(lodepng::save_file(pngs.back(), filename));
+  std::vector<unsigned char> corrupt(pngs[0]);
+  corrupt[20] ^= 1;
+  expected.push_back(expected.back());
+
+  // the heap use of the images decoded one at a time
+  HeapUse use;
+  use.current = 0;
+  use.peak = 0;
+  LodePNGAllocator allocator = {heapAllocate, heapReallocate, heapDeallocate, &use};
+  lodepng::State state;
+  state.allocator = &allocator;
+  size_t singlepeak = 0;
+  for(size_t i = 0; i < pngs.size(); i++) {
+    lodepng::State single(state); // a state keeps some memory of the last decode until it is destroyed
+    std::vector<unsigned char> decoded;
+    unsigned w, h;
+    use.peak = 0;
+    assertNoPNGError(lodepng::decode(decoded, w, h, single, pngs[i]));
+    singlepeak = std::max<size_t>(singlepeak, use.peak);
+  }
+  ASSERT_EQUALS(0, use.current);
+
+  // a budget of 1 byte runs one decode at a time, the default budget all at once
+  const unsigned threads[] = {0, 1, 4, 4};
+  const size_t budgets[] = {0, 0, 1, 300000};
+  for(size_t b = 0; b < 4; b++) {
+    use.peak = 0;
+    std::vector<std::shared_future<lodepng::BatchImage> > futures;
+    std::vector<size_t> order;
+    {
+      lodepng::BatchDecoder batch(state, threads[b], budgets[b]);
+      for(size_t i = 0; i < pngs.size(); i++) futures.push_back(batch.add(pngs[i]));
+      futures.push_back(batch.add(std::string(filename)));
+      futures.push_back(batch.add(corrupt));
+      futures.push_back(batch.add(std::vector<unsigned char>()));
+      futures.push_back(batch.add(std::string("lodepng_unittest_nonexistent.png")));
+      for(;;) {
+        std::shared_future<lodepng::BatchImage> future = batch.next();
+        if(!future.valid()) break;
+        const lodepng::BatchImage& result = future.get();
+        order.push_back(result.index);
+        assertTrue(&result == &futures[result.index].get(), "the same image as the future of add");
+      }
+      assertTrue(!batch.next().valid(), "all images returned");
+      // images added later are returned by next as well
+      futures.push_back(batch.add(pngs[0]));
+      ASSERT_EQUALS(futures.size() - 1, batch.next().get().index);
+    }
+    ASSERT_EQUALS(futures.size() - 1, order.size());
+    std::vector<size_t> sorted(order);
+    std::sort(sorted.begin(), sorted.end());
+    for(size_t i = 0; i < sorted.size(); i++) ASSERT_EQUALS(i, sorted[i]);
+    if(threads[b] == 1) {
+      for(size_t i = 0; i < order.size(); i++) ASSERT_EQUALS(i, order[i]);
+    }
+
+    for(size_t i = 0; i < expected.size(); i++) {
+      const lodepng::BatchImage& result = futures[i].get();
+      ASSERT_EQUALS(i, result.index);
+      assertNoPNGError(result.error);
+      ASSERT_EQUALS(expected[i].size(), (size_t)result.w * result.h * 4);
+      assertTrue(result.image == expected[i], "batch decode");
+    }
+    const lodepng::BatchImage& failed = futures[expected.size()].get();
+    ASSERT_EQUALS(57, failed.error); // the CRC of the IHDR chunk
+    assertTrue(failed.image.empty());
+    assertTrue(futures[expected.size() + 1].get().error != 0);
+    ASSERT_EQUALS(78, futures[expected.size() + 2].get().error);
+    ASSERT_EQUALS(0, use.current);
+    if(budgets[b] == 1) assertTrue(use.peak <= singlepeak, "one decode at a time");
+  }
+  remove(filename);
+}
+#endif // LODEPNG_COMPILE_THREADS
+
+void testRestartIndex() {
+  std::cout << "testRestartIndex" << std::endl;
+  const LodePNGColorType types[] = {LCT_RGBA, LCT_RGB, LCT_GREY};
+  const unsigned depths[] = {8, 16, 1};
+  const unsigned restarts[] = {1, 7, 45};
+  for(size_t t = 0; t < 3; t++)
+  for(unsigned btype = 0; btype < 3; btype++)
+  for(size_t r = 0; r < 3; r++) {
+    unsigned w = 67, h = 45;
+    Image image;
+    generateTestImage(image, w, h, types[t], depths[t]);
+    lodepng::State state;
+    state.info_raw.colortype = state.info_png.color.colortype = image.colorType;
+    state.info_raw.bitdepth = state.info_png.color.bitdepth = image.bitDepth;
+    state.encoder.auto_convert = 0;
+    state.encoder.filter_palette_zero = 0;
+    state.encoder.zlibsettings.btype = btype;
+    state.encoder.restart_rows = restarts[r];
+    state.encoder.zlibsettings.num_threads = (unsigned)r; // all cores, one thread, two threads
+    std::vector<unsigned char> png;
+    assertNoPNGError(lodepng::encode(png, &image.data[0], w, h, state));
+
+    // a single part needs no index
+    ASSERT_EQUALS(std::string(h <= restarts[r] ? " IHDR IDAT IEND" : " IHDR IDAT idRS IEND"), extractChunkNames(png));
+    if(h > restarts[r]) {
+      const unsigned char* idat = lodepng_chunk_next_const(&png[8]);
+      const unsigned char* index = lodepng_chunk_data_const(lodepng_chunk_next_const(idat));
+      ASSERT_EQUALS(restarts[r], (unsigned)(index[0] << 24 | index[1] << 16 | index[2] << 8 | index[3]));
+      ASSERT_EQUALS(2u, (unsigned)(index[4] << 24 | index[5] << 16 | index[6] << 8 | index[7]));
+      // each part starts with a scanline that doesn't use the one above
+      std::vector<unsigned char> scanlines;
+      assertNoPNGError(lodepng::decompress(scanlines, lodepng_chunk_data_const(idat), lodepng_chunk_length(idat)));
+      size_t linebytes = (w * lodepng_get_bpp(&state.info_png.color) + 7) / 8;
+      for(unsigned y = restarts[r]; y < h; y += restarts[r]) {
+        assertTrue(scanlines[y * (linebytes + 1)] <= 1, "filter type of the first row of a part");
+      }
+    }
+
+    // on any number of threads, also when the index is wrong and the PNG is decoded as usual
+    for(unsigned threads = 0; threads < 4; threads++) {
+      lodepng::State decoder;
+      decoder.decoder.color_convert = 0;
+      decoder.decoder.num_threads = threads;
+      decoder.decoder.ignore_crc = threads == 3;
+      if(threads == 3 && h > restarts[r]) png[png.size() - 12 - 4 - 1]++;
+      std::vector<unsigned char> decoded;
+      unsigned w2, h2;
+      assertNoPNGError(lodepng::decode(decoded, w2, h2, decoder, png));
+      ASSERT_EQUALS(image.data.size(), decoded.size());
+      for(size_t i = 0; i < decoded.size(); i++) ASSERT_EQUALS((int)image.data[i], (int)decoded[i]);
+    }
+  }
+}
+
 void testEncoderErrors() {
   std::cout << "testEncoderErrors" << std::endl;
 
@@ -1966,6 +3458,171 @@ void testAutoColorModels()
   testAutoColorModel(grey1k, 8, LCT_PALETTE, 2, false);
 }
 
+// Profiles an RGBA image with one pixel changed and checks the properties that pixel alone decides, with and
+// without SIMD. Images of 90000 pixels get the sampling pass first, images of 1600 don't.
+static void testColorProfileCase(unsigned w, unsigned h, bool many, size_t pos, const unsigned char* pixel,
+                                 unsigned colored, unsigned alpha, unsigned key, unsigned bits) {
+  std::vector<unsigned char> image(w * h * 4);
+  unsigned seed = 3;
+  for(size_t i = 0; i < w * h; i++) {
+    seed = seed * 1103515245u + 12345u;
+    // either photo-like colors or 16 greys that fit in 4 bits
+    for(size_t c = 0; c < 3; c++) image[i * 4 + c] = many ? (unsigned char)(seed >> (8 + c * 8)) : (i % 16) * 17;
+    image[i * 4 + 3] = 255;
+  }
+  for(size_t c = 0; c < 4; c++) image[pos * 4 + c] = pixel[c];
+  LodePNGColorMode mode;
+  lodepng_color_mode_init(&mode);
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned original = lodepng_get_cpu_features();
+  for(int simd = 0; simd < 2; simd++) {
+    lodepng_set_cpu_features(simd ? ~0u : 0u);
+#endif // LODEPNG_COMPILE_SIMD
+    LodePNGColorProfile profile;
+    lodepng_color_profile_init(&profile);
+    assertNoPNGError(lodepng_get_color_profile(&profile, &image[0], w, h, &mode));
+    ASSERT_EQUALS(colored, profile.colored);
+    ASSERT_EQUALS(alpha, profile.alpha);
+    ASSERT_EQUALS(key, profile.key);
+    ASSERT_EQUALS(bits, profile.bits);
+    if(key) {
+      ASSERT_EQUALS(pixel[0] * 257u, profile.key_r);
+    }
+    // the changed pixel is a 17th color unless it's one of the 16 greys
+    bool known = pixel[0] % 17 == 0 && pixel[0] == pixel[1] && pixel[0] == pixel[2] && pixel[3] == 255;
+    ASSERT_EQUALS(many ? 257 : known ? 16 : 17, profile.numcolors);
+#ifdef LODEPNG_COMPILE_SIMD
+  }
+  lodepng_set_cpu_features(original);
+#endif // LODEPNG_COMPILE_SIMD
+}
+
+void testColorProfile() {
+  std::cout << "testColorProfile" << std::endl;
+  const unsigned sizes[] = {40, 300};
+  const unsigned char grey[4] = {51, 51, 51, 255}, grey8[4] = {50, 50, 50, 255}, colored[4] = {85, 85, 86, 255};
+  const unsigned char translucent[4] = {0, 0, 0, 128}, transparent[4] = {7, 7, 7, 0}, hidden[4] = {0, 0, 0, 0};
+  for(size_t s = 0; s < 2; s++) {
+    unsigned w = sizes[s], h = sizes[s];
+    size_t n = w * h;
+    // the pixel at the start, inside the first SIMD block, in the middle and at the end of the last blocks
+    const size_t positions[] = {0, 5, n / 2 + 3, n - 17, n - 1};
+    for(size_t p = 0; p < 5; p++) {
+      size_t pos = positions[p];
+      testColorProfileCase(w, h, false, pos, grey, 0, 0, 0, 4);
+      testColorProfileCase(w, h, false, pos, grey8, 0, 0, 0, 8);
+      testColorProfileCase(w, h, false, pos, colored, 1, 0, 0, 8);
+      testColorProfileCase(w, h, false, pos, translucent, 0, 1, 0, 8);
+      testColorProfileCase(w, h, false, pos, transparent, 0, 0, 1, 8);
+      // the key can't be used, (0, 0, 0) is also opaque
+      testColorProfileCase(w, h, false, pos, hidden, 0, 1, 0, 8);
+      testColorProfileCase(w, h, true, pos, translucent, 1, 1, 0, 8);
+      testColorProfileCase(w, h, true, pos, transparent, 1, 0, 1, 8);
+    }
+  }
+}
+
+// Quantizes gradients to palettes of several sizes, with and without dithering and SIMD, and checks that the
+// decoded image stays near the original.
+void testQuantize() {
+  std::cout << "testQuantize" << std::endl;
+  unsigned w = 97, h = 61;
+  std::vector<unsigned char> image(w * h * 4), rgb;
+  for(unsigned y = 0; y < h; y++)
+  for(unsigned x = 0; x < w; x++) {
+    unsigned char* p = &image[(y * w + x) * 4];
+    p[0] = x * 255 / (w - 1);
+    p[1] = y * 255 / (h - 1);
+    p[2] = (x + y) * 2;
+    p[3] = x < 10 ? 255 : 255 - y;
+    rgb.insert(rgb.end(), p, p + 3);
+  }
+  const unsigned sizes[] = {256, 64, 4};
+  for(size_t s = 0; s < 3; s++)
+  for(unsigned dither = 0; dither < 2; dither++)
+  for(int input = 0; input < 2; input++) {
+    lodepng::State state;
+    state.encoder.quantize = sizes[s];
+    state.encoder.quantize_dither = dither;
+    if(input == 1) state.info_raw.colortype = LCT_RGB;
+    const std::vector<unsigned char>& raw = input == 0 ? image : rgb;
+    std::vector<unsigned char> expected;
+#ifdef LODEPNG_COMPILE_SIMD
+    unsigned original = lodepng_get_cpu_features();
+    for(int simd = 0; simd < 2; simd++) {
+      lodepng_set_cpu_features(simd ? ~0u : 0u);
+#endif // LODEPNG_COMPILE_SIMD
+      std::vector<unsigned char> png;
+      assertNoPNGError(lodepng::encode(png, raw, w, h, state));
+      if(expected.empty()) expected = png;
+      else assertTrue(png == expected, "same PNG with SIMD");
+#ifdef LODEPNG_COMPILE_SIMD
+    }
+    lodepng_set_cpu_features(original);
+#endif // LODEPNG_COMPILE_SIMD
+
+    lodepng::State decodestate;
+    std::vector<unsigned char> decoded;
+    unsigned w2, h2;
+    assertNoPNGError(lodepng::decode(decoded, w2, h2, decodestate, expected));
+    ASSERT_EQUALS(LCT_PALETTE, decodestate.info_png.color.colortype);
+    ASSERT_EQUALS(sizes[s] == 4 ? 2 : 8, decodestate.info_png.color.bitdepth);
+    assertTrue(decodestate.info_png.color.palettesize <= sizes[s], "palette size");
+    // the average difference per channel, dithering adds noise but keeps the average color of areas
+    double difference = 0;
+    for(size_t i = 0; i < w * h; i++) {
+      for(size_t c = 0; c < 4; c++) {
+        int original = c < 3 || input == 0 ? image[i * 4 + c] : 255;
+        difference += std::abs(original - (int)decoded[i * 4 + c]);
+      }
+    }
+    difference /= w * h * 4;
+    assertTrue(difference < (sizes[s] == 256 ? 5 : sizes[s] == 64 ? 10 : 40), "quantized colors near the original");
+  }
+
+  // an image with fewer colors than the palette keeps them exactly, with the bits they need
+  std::vector<unsigned char> few(w * h * 4);
+  for(size_t i = 0; i < w * h; i++) {
+    for(size_t c = 0; c < 4; c++) few[i * 4 + c] = (unsigned char)((i % 10) * 25 + c);
+  }
+  lodepng::State state;
+  state.encoder.quantize = 16;
+  std::vector<unsigned char> png, decoded;
+  assertNoPNGError(lodepng::encode(png, few, w, h, state));
+  lodepng::State decodestate;
+  unsigned w2, h2;
+  assertNoPNGError(lodepng::decode(decoded, w2, h2, decodestate, png));
+  ASSERT_EQUALS(LCT_PALETTE, decodestate.info_png.color.colortype);
+  ASSERT_EQUALS(4, decodestate.info_png.color.bitdepth);
+  assertTrue(decoded == few, "few colors are kept");
+
+  // the samples must not all fall in the black columns, or all miss them, when the width is a multiple of their
+  // period. The 2048x512 images are sampled every 4 pixels, which a regular grid would keep at the same columns
+  const unsigned stripecases[3][4] = {{1024, 512, 8, 0}, {2048, 512, 4, 0}, {2048, 512, 4, 2}}; // w, h, period, x
+  state.encoder.quantize_dither = 0;
+  for(size_t k = 0; k < 3; k++) {
+    unsigned sw = stripecases[k][0], sh = stripecases[k][1], period = stripecases[k][2], line = stripecases[k][3];
+    std::vector<unsigned char> stripes((size_t)sw * sh * 4, 255);
+    for(size_t y = 0; y < sh; y++) {
+      for(size_t x = 0; x < sw; x++) {
+        unsigned char* p = &stripes[(y * sw + x) * 4];
+        bool black = x % period == line;
+        p[0] = black ? 0 : (unsigned char)(200 + x % 7);
+        p[1] = black ? 0 : (unsigned char)y;
+        p[2] = black ? 0 : 100;
+      }
+    }
+    png.clear();
+    decoded.clear();
+    assertNoPNGError(lodepng::encode(png, stripes, sw, sh, state));
+    assertNoPNGError(lodepng::decode(decoded, w2, h2, png));
+    double difference = 0;
+    for(size_t i = 0; i < stripes.size(); i++) difference += std::abs((int)stripes[i] - (int)decoded[i]);
+    difference /= stripes.size();
+    assertTrue(difference < 10, "colors between the sampled columns");
+  }
+}
+
 void testPaletteToPaletteDecode() {
   std::cout << "testPaletteToPaletteDecode" << std::endl;
   // It's a bit big for a 2x2 image... but this tests needs one with 256 palette entries in it.
@@ -2045,6 +3702,22 @@ void doMain()
   testPaletteFilterTypesZero();
   testComplexPNG();
   testPredefinedFilters();
+  testUnfilterSIMD();
+  testFilterSIMD();
+  testFilterStrategies();
+  testCRC32();
+  testStreamDecoder();
+  testStreamDecoderPreview();
+  testStreamEncoder();
+  testDecodeInto();
+  testDecodeRegion();
+  testRestartIndex();
+  testInspectMetadata();
+  testMapFile();
+  testAllocators();
+#ifdef LODEPNG_COMPILE_THREADS
+  testBatchDecoder();
+#endif // LODEPNG_COMPILE_THREADS
   testFuzzing();
   testEncoderErrors();
   testPaletteToPaletteDecode();
@@ -2055,14 +3728,23 @@ void doMain()
   testColorKeyConvert();
   testColorConvert();
   testColorConvert2();
+  testColorConvertFast();
   testPaletteToPaletteConvert();
   testRGBToPaletteConvert();
   test16bitColorEndianness();
   testAutoColorModels();
+  testColorProfile();
+  testQuantize();
   testNoAutoConvert();
 
   //Zlib
   testCompressZlib();
+  testCompressZlibLongCodes();
+  testCompressZlibBlockTypes();
+  testCompressZlibLevels();
+  testCompressZlibThreads();
+  testCompressZlibOptimal();
+  testAdler32();
   testHuffmanCodeLengths();
   testCustomZlibCompress();
   testCustomZlibCompress2();
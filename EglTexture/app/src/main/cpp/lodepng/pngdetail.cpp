@@ -42,6 +42,9 @@ everything, 16-bit:
 
 everything except huge output:
 ./pngdetail -sPlAcfzB image.png
+
+totals of all PNGs in a directory, without decoding them:
+./pngdetail -i directory
 */
 
 #include "lodepng.h"
@@ -52,6 +55,14 @@ everything except huge output:
 #include <sstream>
 #include <algorithm>
 
+#ifdef LODEPNG_COMPILE_THREADS
+#include <atomic>
+#include <thread>
+#endif
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
 struct Options
 {
   bool show_png_summary; //show filesize, pixels and color type on single line
@@ -71,12 +82,14 @@ struct Options
   bool zlib_counts; //in addition to the zlib_blocks info, show counts of occurrences all symbols
   bool zlib_full; //in addition to the zlib_blocks info, show all symbols, one per line (huge output)
   bool use_hex; //show some sizes or positions in hexadecimal
+  bool index; //only read the chunks of all files and directories given, in parallel, and show totals
 
   Options() : show_png_summary(false), show_png_info(false), show_extra_png_info(false),
               show_palette(false), show_palette_pixels(false),
               show_ascii_art(false), ascii_art_size(40), show_colors_hex(false), show_colors_hex_16(false),
               show_chunks(false), show_chunks2(false), show_filters(false),
-              zlib_info(false), zlib_blocks(false), zlib_counts(false), zlib_full(false), use_hex(false)
+              zlib_info(false), zlib_blocks(false), zlib_counts(false), zlib_full(false), use_hex(false),
+              index(false)
   {
   }
 };
@@ -718,6 +731,7 @@ void showHelp()
                "-B: show Zlib block symbol counts\n"
                "-7: show all lz77 values (huge output)\n"
                "-x: print most integer numbers in hexadecimal (includes e.g. year, num unique colors, ...)\n"
+               "-i: index: show totals of all given files and PNG files in given directories, without decoding them\n"
             << std::endl;
 }
 
@@ -942,6 +956,124 @@ unsigned showFileInfo(const std::string& filename, const Options& options)
   return 0;
 }
 
+// adds the .png files in the directory to files, or the path itself if it isn't a directory
+void listPNGFiles(std::vector<std::string>& files, const std::string& path)
+{
+#ifndef _WIN32
+  DIR* dir = opendir(path.c_str());
+  if(dir)
+  {
+    std::vector<std::string> names;
+    while(dirent* entry = readdir(dir))
+    {
+      std::string name = entry->d_name;
+      std::string ext = name.size() > 4 ? name.substr(name.size() - 4) : "";
+      std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+      if(ext == ".png") names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    std::string prefix = (path.empty() || path[path.size() - 1] == '/') ? path : path + "/";
+    for(size_t i = 0; i < names.size(); i++) files.push_back(prefix + names[i]);
+    return;
+  }
+#endif
+  files.push_back(path);
+}
+
+struct IndexResult
+{
+  unsigned error;
+  size_t filesize;
+  LodePNGMetadata metadata; // the pointers in it aren't valid anymore, the file is only mapped while reading it
+};
+
+void indexFile(const std::string& filename, IndexResult& result)
+{
+  LodePNGMappedFile file;
+  result.error = lodepng_map_file(&file, filename.c_str());
+  result.filesize = file.size;
+  if(!result.error)
+  {
+    lodepng::State state;
+    result.error = lodepng_inspect_metadata(&result.metadata, &state, file.data, file.size);
+  }
+  lodepng_unmap_file(&file);
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+void indexFiles(const std::vector<std::string>& files, std::vector<IndexResult>& results)
+{
+  std::atomic<size_t> next(0);
+  auto worker = [&]()
+  {
+    for(;;)
+    {
+      size_t i = next++;
+      if(i >= files.size()) return;
+      indexFile(files[i], results[i]);
+    }
+  };
+  std::vector<std::thread> threads;
+  unsigned numthreads = std::max(1u, std::thread::hardware_concurrency());
+  for(unsigned i = 1; i < numthreads && i < files.size(); i++) threads.push_back(std::thread(worker));
+  worker();
+  for(size_t i = 0; i < threads.size(); i++) threads[i].join();
+}
+#else
+void indexFiles(const std::vector<std::string>& files, std::vector<IndexResult>& results)
+{
+  for(size_t i = 0; i < files.size(); i++) indexFile(files[i], results[i]);
+}
+#endif
+
+/*
+Show totals of the metadata of many PNG files, e.g. to plan the memory for all textures of an app. The
+files are read in parallel (when compiled with C++11) and none of them is decoded.
+*/
+void showIndex(const std::vector<std::string>& paths)
+{
+  std::vector<std::string> files;
+  for(size_t i = 0; i < paths.size(); i++) listPNGFiles(files, paths[i]);
+  std::vector<IndexResult> results(files.size());
+  indexFiles(files, results);
+
+  size_t num_errors = 0, filesize = 0, idat_size = 0, raw_size = 0, rgba_size = 0, text_chunks = 0;
+  size_t num_palette = 0, num_trns = 0, num_interlaced = 0, num_16bit = 0;
+  double pixels = 0;
+  for(size_t i = 0; i < results.size(); i++)
+  {
+    const IndexResult& result = results[i];
+    filesize += result.filesize;
+    if(result.error)
+    {
+      std::cout << files[i] << ": error " << result.error << ": " << lodepng_error_text(result.error) << std::endl;
+      num_errors++;
+      continue;
+    }
+    const LodePNGMetadata& metadata = result.metadata;
+    pixels += (double)metadata.width * metadata.height;
+    idat_size += metadata.idat_size;
+    raw_size += metadata.raw_size;
+    rgba_size += (size_t)metadata.width * metadata.height * 4;
+    text_chunks += metadata.text_chunks;
+    if(metadata.palette) num_palette++;
+    if(metadata.trns) num_trns++;
+    if(metadata.interlace_method) num_interlaced++;
+    if(metadata.bitdepth == 16) num_16bit++;
+  }
+
+  std::cout << "Files: " << files.size() << " (" << num_errors << " with errors)" << std::endl;
+  std::cout << "Total filesize: " << filesize << " (" << filesize / 1024 << "K)" << std::endl;
+  std::cout << "Total image data: " << idat_size << " (" << idat_size / 1024 << "K)" << std::endl;
+  std::cout << "Total pixels: " << std::fixed << std::setprecision(0) << pixels << std::endl;
+  std::cout << "Total decoded size, own color types: " << raw_size << " (" << raw_size / 1024 << "K)" << std::endl;
+  std::cout << "Total decoded size, RGBA 8-bit: " << rgba_size << " (" << rgba_size / 1024 << "K)" << std::endl;
+  std::cout << "With palette: " << num_palette << ", with tRNS: " << num_trns
+            << ", interlaced: " << num_interlaced << ", 16-bit: " << num_16bit << std::endl;
+  std::cout << "Text chunks: " << text_chunks << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
   Options options;
@@ -994,6 +1126,7 @@ int main(int argc, char *argv[])
           options.zlib_blocks = true;
           options.zlib_full = true;
         }
+        else if(c == 'i') options.index = true;
         else if(c == 'x')
         {
           options.use_hex = true;
@@ -1017,6 +1150,12 @@ int main(int argc, char *argv[])
     return 0;
   }
 
+  if(options.index)
+  {
+    showIndex(filenames);
+    return 0;
+  }
+
   if(!options_chosen)
   {
     //fill in defaults